@@ -0,0 +1,719 @@
+#include "apu.h"
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define PI 3.14159265358979323846
+
+#define HIGH_PASS 0.996f  // per-sample integrator leak; removes the DAC's DC offset
+
+// Output units per digital level per master volume step. Four channels at
+// level 15 with master volume 8 stay inside the int16 range.
+#define LEVEL_SCALE (32000.0f / (4 * 15 * 8))
+
+// Waveform step periods below these are pitched above ~20 kHz. Stepping them
+// costs the most and is filtered out anyway, so the channel holds a level.
+#define ULTRASONIC_PULSE_PERIOD 26
+#define ULTRASONIC_WAVE_PERIOD  6
+
+
+// Band-limited step kernel, one windowed sinc per sub-sample phase. Each tap is
+// stored twice so a left/right pair can be scaled and added in one step.
+struct StepKernel {
+	alignas(16) float taps[BandLimitedBuffer::kernel_phases][2 * BandLimitedBuffer::kernel_taps];
+
+	StepKernel()
+	{
+		const int width = BandLimitedBuffer::kernel_taps;
+		const double cutoff = 0.45;  // fraction of the output sample rate
+
+		for (int phase = 0; phase < BandLimitedBuffer::kernel_phases; phase++) {
+			double kernel[width];
+			double sum = 0;
+
+			for (int i = 0; i < width; i++) {
+				double x = i - (width / 2 - 1) - (double)phase / BandLimitedBuffer::kernel_phases;
+				double sinc = (x == 0) ? 1.0 : sin(2 * PI * cutoff * x) / (2 * PI * cutoff * x);
+				double window = 0.5 + 0.5 * cos(PI * x / (width / 2));
+
+				kernel[i] = sinc * window;
+				sum += kernel[i];
+			}
+
+			// normalize so every phase produces a step of exactly the delta
+			for (int i = 0; i < width; i++) {
+				taps[phase][2 * i] = (float)(kernel[i] / sum);
+				taps[phase][2 * i + 1] = (float)(kernel[i] / sum);
+			}
+		}
+	}
+};
+
+static const StepKernel step_kernel;
+
+static const uint8_t duty_table[4] = { 0x80, 0x81, 0xE1, 0x7E };  // bit n = step n
+static const int wave_shift_table[4] = { 4, 0, 1, 2 };  // NR32 output level
+
+
+BandLimitedBuffer::BandLimitedBuffer()
+{
+	cycles_to_samples = ((uint64_t)APU_SAMPLE_RATE << 32) / APU_CLOCK_RATE;
+	clear(0);
+}
+
+
+// Input: time - cpu cycle that the start of the buffer corresponds to
+// Return: None
+// Function: Drop all pending deltas and samples
+void BandLimitedBuffer::clear(const uint64_t time)
+{
+	origin_position = 0;
+	time_origin = time;
+	write_end = 0;
+	dropped_count = 0;
+	integrator[0] = 0;
+	integrator[1] = 0;
+	memset(buffer, 0, sizeof(buffer));
+}
+
+
+// Input: time - cpu cycle of the level change
+//        delta_left, delta_right - change of the output level on each side
+// Return: None
+// Function: Add a band-limited step at the output position of time
+void BandLimitedBuffer::add_delta(const uint64_t time, const float delta_left,
+                                  const float delta_right)
+{
+	if (time < time_origin)
+		return;
+
+	uint64_t position = origin_position + (time - time_origin) * cycles_to_samples;
+	int index = (int)(position >> 32);
+	int phase = (int)(position >> (32 - kernel_phase_bits)) & (kernel_phases - 1);
+
+	// nobody is reading samples out; drop rather than overrun
+	if (index >= buffer_size) {
+		dropped_count++;
+		return;
+	}
+	if (index + kernel_taps > write_end)
+		write_end = index + kernel_taps;
+
+	float* out = &buffer[2 * index];
+	const float* kernel = step_kernel.taps[phase];
+
+#ifdef __SSE2__
+	const __m128 delta = _mm_set_ps(delta_right, delta_left, delta_right, delta_left);
+	for (int i = 0; i < 2 * kernel_taps; i += 4) {
+		__m128 sum = _mm_loadu_ps(out + i);
+		sum = _mm_add_ps(sum, _mm_mul_ps(delta, _mm_load_ps(kernel + i)));
+		_mm_storeu_ps(out + i, sum);
+	}
+#else
+	for (int i = 0; i < kernel_taps; i++) {
+		out[2 * i] += delta_left * kernel[2 * i];
+		out[2 * i + 1] += delta_right * kernel[2 * i + 1];
+	}
+#endif
+}
+
+
+// Input: time - cpu cycle that ends the frame
+// Return: None
+// Function: Make all samples up to time available for reading
+void BandLimitedBuffer::end_frame(const uint64_t time)
+{
+	if (time < time_origin)
+		return;
+
+	origin_position += (time - time_origin) * cycles_to_samples;
+	time_origin = time;
+
+	if ((origin_position >> 32) > (uint64_t)buffer_size)
+		origin_position = (uint64_t)buffer_size << 32;
+}
+
+
+#ifdef __SSE2__
+// Integrate two interleaved stereo frames with a leaky integrator.
+// sum holds the previous left/right levels in both halves.
+static inline __m128 integrate_pair(const float* in, __m128& sum)
+{
+	const __m128 leak = _mm_set1_ps(HIGH_PASS);
+	const __m128 carry_leak = _mm_set_ps(HIGH_PASS * HIGH_PASS, HIGH_PASS * HIGH_PASS,
+	                                     HIGH_PASS, HIGH_PASS);
+
+	__m128 x = _mm_loadu_ps(in);  // l0 r0 l1 r1
+	x = _mm_add_ps(x, _mm_mul_ps(_mm_movelh_ps(_mm_setzero_ps(), x), leak));
+	x = _mm_add_ps(x, _mm_mul_ps(sum, carry_leak));
+	sum = _mm_movehl_ps(x, x);  // l1 r1 l1 r1
+
+	return x;
+}
+#endif
+
+
+// Input: out - destination for interleaved left/right samples
+//        max_frames - capacity of out in stereo frames
+// Return: Number of stereo frames written
+// Function: Integrate finished deltas into 16-bit samples and remove them
+int BandLimitedBuffer::read_samples(int16_t* out, int max_frames)
+{
+	const int available = samples_available();
+	const int count = (max_frames < available) ? max_frames : available;
+	float left = integrator[0];
+	float right = integrator[1];
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128 sum = _mm_set_ps(right, left, right, left);
+	for (; i + 4 <= count; i += 4) {
+		__m128i low = _mm_cvtps_epi32(integrate_pair(&buffer[2 * i], sum));
+		__m128i high = _mm_cvtps_epi32(integrate_pair(&buffer[2 * i + 4], sum));
+		_mm_storeu_si128((__m128i*)(out + 2 * i), _mm_packs_epi32(low, high));
+	}
+	left = _mm_cvtss_f32(sum);
+	right = _mm_cvtss_f32(_mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+#endif
+
+	for (; i < count; i++) {
+		left = left * HIGH_PASS + buffer[2 * i];
+		right = right * HIGH_PASS + buffer[2 * i + 1];
+
+		long l = lrintf(left);
+		long r = lrintf(right);
+		out[2 * i] = (int16_t)((l > 32767) ? 32767 : (l < -32768) ? -32768 : l);
+		out[2 * i + 1] = (int16_t)((r > 32767) ? 32767 : (r < -32768) ? -32768 : r);
+	}
+
+	integrator[0] = left;
+	integrator[1] = right;
+
+	// shift everything written after the samples read to the front,
+	// including deltas of a frame still in progress
+	const int used = (write_end > count) ? write_end : count;
+	const int remaining = used - count;
+	memmove(buffer, &buffer[2 * count], remaining * 2 * sizeof(float));
+	memset(&buffer[2 * remaining], 0, count * 2 * sizeof(float));
+	origin_position -= (uint64_t)count << 32;
+	write_end = remaining;
+
+	return count;
+}
+
+
+APU::APU()
+{
+	uint8_t io_registers[0x30];
+
+	memset(io_registers, 0, sizeof(io_registers));
+	reset(0, io_registers);
+}
+
+
+// Input: time - current cpu cycle
+//        io_registers - current contents of 0xFF10 - 0xFF3F
+// Return: None
+// Function: Restart synthesis at time from the given register state. Channels
+//           stay silent until the game triggers them again.
+void APU::reset(const uint64_t time, const uint8_t* io_registers)
+{
+	buffer.clear(time);
+
+	memset(&pulse1, 0, sizeof(pulse1));
+	memset(&pulse2, 0, sizeof(pulse2));
+	memset(&wave, 0, sizeof(wave));
+	memset(&noise, 0, sizeof(noise));
+	noise.lfsr = 0x7FFF;
+
+	last_time = time;
+	next_sequencer_time = time + APU_FRAME_SEQUENCER_PERIOD;
+	sequencer_step = 0;
+
+	powered = (io_registers[0x16] & 0x80) != 0;
+	for (int i = 0; i < 0x30; i++)
+		load_register(0xFF10 + i, io_registers[i]);
+}
+
+
+// Input: time - cpu cycle of the write
+//        addr - sound register address (0xFF10 - 0xFF3F)
+//        value - 8-bit value written
+// Return: None
+// Function: Synthesize up to time, then apply the register write
+void APU::write_register(const uint64_t time, const uint16_t addr, const uint8_t value)
+{
+	const int reg = addr - 0xFF10;
+
+	run_until(time);
+
+	if (reg == 0x16) {  // NR52
+		if (!(value & 0x80) && powered) {
+			power_off(time);
+		} else if ((value & 0x80) && !powered) {
+			powered = true;
+			sequencer_step = 0;
+		}
+		regs[reg] = value & 0x80;
+		return;
+	}
+
+	// only wave RAM is writable while the APU is powered off
+	if (!powered && reg < 0x20)
+		return;
+
+	load_register(addr, value);
+
+	if (value & 0x80) {
+		if (reg == 0x04)       // NR14
+			trigger(0);
+		else if (reg == 0x09)  // NR24
+			trigger(1);
+		else if (reg == 0x0E)  // NR34
+			trigger(2);
+		else if (reg == 0x13)  // NR44
+			trigger(3);
+	}
+
+	refresh_outputs(time);
+}
+
+
+// Input: time - cpu cycle that ends the frame
+// Return: None
+// Function: Synthesize up to time and make the samples available
+void APU::end_frame(const uint64_t time)
+{
+	run_until(time);
+	buffer.end_frame(time);
+}
+
+
+// Input: out - destination for interleaved left/right samples
+//        max_frames - capacity of out in stereo frames
+// Return: Number of stereo frames written
+int APU::read_samples(int16_t* out, int max_frames)
+{
+	return buffer.read_samples(out, max_frames);
+}
+
+
+// Input: addr - sound register address
+//        value - 8-bit register value
+// Return: None
+// Function: Store the register and update the channel parameters derived
+//           from it, without any of the side effects of a trigger
+void APU::load_register(const uint16_t addr, const uint8_t value)
+{
+	const int reg = addr - 0xFF10;
+
+	regs[reg] = value;
+
+	switch(reg) {
+	case 0x01:  // NR11
+		pulse1.duty = value >> 6;
+		pulse1.length_counter = 64 - (value & 0x3F);
+		break;
+	case 0x02:  // NR12
+		pulse1.dac_enabled = (value & 0xF8) != 0;
+		if (!pulse1.dac_enabled)
+			pulse1.enabled = false;
+		break;
+	case 0x03:  // NR13
+		pulse1.frequency = (pulse1.frequency & 0x700) | value;
+		break;
+	case 0x04:  // NR14
+		pulse1.frequency = (pulse1.frequency & 0xFF) | ((value & 0x07) << 8);
+		pulse1.length_enabled = (value & 0x40) != 0;
+		break;
+	case 0x06:  // NR21
+		pulse2.duty = value >> 6;
+		pulse2.length_counter = 64 - (value & 0x3F);
+		break;
+	case 0x07:  // NR22
+		pulse2.dac_enabled = (value & 0xF8) != 0;
+		if (!pulse2.dac_enabled)
+			pulse2.enabled = false;
+		break;
+	case 0x08:  // NR23
+		pulse2.frequency = (pulse2.frequency & 0x700) | value;
+		break;
+	case 0x09:  // NR24
+		pulse2.frequency = (pulse2.frequency & 0xFF) | ((value & 0x07) << 8);
+		pulse2.length_enabled = (value & 0x40) != 0;
+		break;
+	case 0x0A:  // NR30
+		wave.dac_enabled = (value & 0x80) != 0;
+		if (!wave.dac_enabled)
+			wave.enabled = false;
+		break;
+	case 0x0B:  // NR31
+		wave.length_counter = 256 - value;
+		break;
+	case 0x0C:  // NR32
+		wave.volume_shift = wave_shift_table[(value >> 5) & 0x03];
+		break;
+	case 0x0D:  // NR33
+		wave.frequency = (wave.frequency & 0x700) | value;
+		break;
+	case 0x0E:  // NR34
+		wave.frequency = (wave.frequency & 0xFF) | ((value & 0x07) << 8);
+		wave.length_enabled = (value & 0x40) != 0;
+		break;
+	case 0x10:  // NR41
+		noise.length_counter = 64 - (value & 0x3F);
+		break;
+	case 0x11:  // NR42
+		noise.dac_enabled = (value & 0xF8) != 0;
+		if (!noise.dac_enabled)
+			noise.enabled = false;
+		break;
+	case 0x13:  // NR44
+		noise.length_enabled = (value & 0x40) != 0;
+		break;
+	case 0x14:  // NR50
+		left_volume = (((value >> 4) & 0x07) + 1) * LEVEL_SCALE;
+		right_volume = ((value & 0x07) + 1) * LEVEL_SCALE;
+		break;
+	}
+}
+
+
+// Input: index - channel number, 0-3
+// Return: None
+// Function: Restart the channel as on a write with bit 7 of NRx4 set
+void APU::trigger(const int index)
+{
+	if (index < 2) {
+		PulseChannel& ch = (index == 0) ? pulse1 : pulse2;
+		const uint8_t* nr = &regs[index * 5];
+
+		ch.enabled = ch.dac_enabled;
+		if (ch.length_counter == 0)
+			ch.length_counter = 64;
+		start_envelope(ch.envelope, nr[2]);
+		ch.delay = (2048 - ch.frequency) * 4;
+
+		if (index == 0) {
+			const int period = (regs[0x00] >> 4) & 0x07;
+			const int shift = regs[0x00] & 0x07;
+
+			pulse1.sweep_shadow = pulse1.frequency;
+			pulse1.sweep_timer = period ? period : 8;
+			pulse1.sweep_enabled = period || shift;
+			if (shift && sweep_target() > 2047)
+				pulse1.enabled = false;
+		}
+	} else if (index == 2) {
+		wave.enabled = wave.dac_enabled;
+		if (wave.length_counter == 0)
+			wave.length_counter = 256;
+		wave.position = 0;
+		wave.delay = (2048 - wave.frequency) * 2;
+	} else {
+		noise.enabled = noise.dac_enabled;
+		if (noise.length_counter == 0)
+			noise.length_counter = 64;
+		start_envelope(noise.envelope, regs[0x11]);
+		noise.lfsr = 0x7FFF;
+		noise.delay = 0;
+	}
+}
+
+
+// Input: time - cpu cycle of the NR52 write
+// Return: None
+// Function: Power the APU down, clearing every sound register but wave RAM
+void APU::power_off(const uint64_t time)
+{
+	for (int reg = 0; reg < 0x16; reg++)
+		load_register(0xFF10 + reg, 0);
+
+	pulse1.enabled = false;
+	pulse2.enabled = false;
+	wave.enabled = false;
+	noise.enabled = false;
+	powered = false;
+
+	refresh_outputs(time);
+}
+
+
+// Input: time - cpu cycle to synthesize up to
+// Return: None
+// Function: Advance every channel to time, stopping at each frame sequencer
+//           tick so length, sweep and envelope changes land on the right cycle
+void APU::run_until(const uint64_t time)
+{
+	if (time <= last_time)
+		return;
+
+	while (next_sequencer_time <= time) {
+		run_channels(next_sequencer_time);
+		if (powered)
+			clock_sequencer(next_sequencer_time);
+		next_sequencer_time += APU_FRAME_SEQUENCER_PERIOD;
+	}
+
+	run_channels(time);
+}
+
+
+void APU::run_channels(const uint64_t end)
+{
+	if (end <= last_time)
+		return;
+
+	run_pulse(pulse1, 0, end);
+	run_pulse(pulse2, 1, end);
+	run_wave(end);
+	run_noise(end);
+
+	last_time = end;
+}
+
+
+// Input: ch - pulse channel to run
+//        index - channel number for NR51 routing
+//        end - cpu cycle to stop at
+// Return: None
+// Function: Emit a level change for every duty step between last_time and end
+void APU::run_pulse(PulseChannel& ch, const int index, const uint64_t end)
+{
+	if (!ch.enabled || !powered) {
+		set_level(ch, index, last_time, 0);
+		return;
+	}
+
+	const int period = (2048 - ch.frequency) * 4;
+	if (period < ULTRASONIC_PULSE_PERIOD) {
+		set_level(ch, index, last_time, ch.envelope.volume / 2);
+		return;
+	}
+
+	uint64_t time = last_time + ch.delay;
+	while (time < end) {
+		ch.phase = (ch.phase + 1) & 0x07;
+		set_level(ch, index, time, pulse_level(ch));
+		time += period;
+	}
+	ch.delay = (int)(time - end);
+}
+
+
+// Input: end - cpu cycle to stop at
+// Return: None
+// Function: Emit a level change for every wave RAM step between last_time and end
+void APU::run_wave(const uint64_t end)
+{
+	if (!wave.enabled || !powered) {
+		set_level(wave, 2, last_time, 0);
+		return;
+	}
+
+	const int period = (2048 - wave.frequency) * 2;
+	if (period < ULTRASONIC_WAVE_PERIOD) {
+		set_level(wave, 2, last_time, wave_level());
+		return;
+	}
+
+	uint64_t time = last_time + wave.delay;
+	while (time < end) {
+		wave.position = (wave.position + 1) & 0x1F;
+		set_level(wave, 2, time, wave_level());
+		time += period;
+	}
+	wave.delay = (int)(time - end);
+}
+
+
+// Input: end - cpu cycle to stop at
+// Return: None
+// Function: Clock the LFSR between last_time and end, emitting level changes
+void APU::run_noise(const uint64_t end)
+{
+	if (!noise.enabled || !powered) {
+		set_level(noise, 3, last_time, 0);
+		return;
+	}
+
+	const uint8_t nr43 = regs[0x12];
+	const int shift = nr43 >> 4;
+	const int divisor = (nr43 & 0x07) ? (nr43 & 0x07) * 16 : 8;
+
+	// shifts of 14 and 15 stop the LFSR
+	if (shift >= 14) {
+		set_level(noise, 3, last_time, noise_level());
+		return;
+	}
+
+	const int period = divisor << shift;
+	uint64_t time = last_time + noise.delay;
+	while (time < end) {
+		const int bit = (noise.lfsr ^ (noise.lfsr >> 1)) & 0x01;
+		noise.lfsr = (noise.lfsr >> 1) | (bit << 14);
+		if (nr43 & 0x08)  // 7-bit mode
+			noise.lfsr = (noise.lfsr & ~0x40) | (bit << 6);
+
+		set_level(noise, 3, time, noise_level());
+		time += period;
+	}
+	noise.delay = (int)(time - end);
+}
+
+
+// Input: time - cpu cycle of the 512 Hz tick
+// Return: None
+// Function: Clock length counters, the sweep and the envelopes
+void APU::clock_sequencer(const uint64_t time)
+{
+	if ((sequencer_step & 0x01) == 0) {
+		clock_length(pulse1);
+		clock_length(pulse2);
+		clock_length(wave);
+		clock_length(noise);
+	}
+	if (sequencer_step == 2 || sequencer_step == 6)
+		clock_sweep();
+	if (sequencer_step == 7) {
+		clock_envelope(pulse1.envelope);
+		clock_envelope(pulse2.envelope);
+		clock_envelope(noise.envelope);
+	}
+
+	sequencer_step = (sequencer_step + 1) & 0x07;
+	refresh_outputs(time);
+}
+
+
+// Input: ch - channel whose output changed
+//        index - channel number for NR51 routing
+//        time - cpu cycle of the change
+//        level - new digital output, 0-15
+// Return: None
+// Function: Route and scale the level, and add a step for any change
+void APU::set_level(Channel& ch, const int index, const uint64_t time, const int level)
+{
+	const uint8_t routing = regs[0x15];  // NR51
+	const float left = (routing & (0x10 << index)) ? level * left_volume : 0.0f;
+	const float right = (routing & (0x01 << index)) ? level * right_volume : 0.0f;
+
+	if (left != ch.out_left || right != ch.out_right) {
+		buffer.add_delta(time, left - ch.out_left, right - ch.out_right);
+		ch.out_left = left;
+		ch.out_right = right;
+	}
+}
+
+
+// Input: time - cpu cycle of a volume, routing or enable change
+// Return: None
+// Function: Re-emit every channel's level with the current mixer settings
+void APU::refresh_outputs(const uint64_t time)
+{
+	const bool on = powered;
+
+	set_level(pulse1, 0, time, (on && pulse1.enabled) ? pulse_level(pulse1) : 0);
+	set_level(pulse2, 1, time, (on && pulse2.enabled) ? pulse_level(pulse2) : 0);
+	set_level(wave, 2, time, (on && wave.enabled) ? wave_level() : 0);
+	set_level(noise, 3, time, (on && noise.enabled) ? noise_level() : 0);
+}
+
+
+int APU::pulse_level(const PulseChannel& ch) const
+{
+	return ((duty_table[ch.duty] >> ch.phase) & 0x01) ? ch.envelope.volume : 0;
+}
+
+
+int APU::wave_level() const
+{
+	const uint8_t sample = regs[0x20 + (wave.position >> 1)];
+	const int nibble = (wave.position & 0x01) ? (sample & 0x0F) : (sample >> 4);
+
+	return nibble >> wave.volume_shift;
+}
+
+
+int APU::noise_level() const
+{
+	return (noise.lfsr & 0x01) ? 0 : noise.envelope.volume;
+}
+
+
+// Return: Next sweep frequency computed from the shadow register
+int APU::sweep_target()
+{
+	const int delta = pulse1.sweep_shadow >> (regs[0x00] & 0x07);
+
+	if (regs[0x00] & 0x08)
+		return pulse1.sweep_shadow - delta;
+	return pulse1.sweep_shadow + delta;
+}
+
+
+void APU::clock_length(Channel& ch)
+{
+	if (ch.length_enabled && ch.length_counter > 0) {
+		ch.length_counter--;
+		if (ch.length_counter == 0)
+			ch.enabled = false;
+	}
+}
+
+
+// Input: env - envelope to restart
+//        value - NRx2 register value
+// Return: None
+void APU::start_envelope(Envelope& env, const uint8_t value)
+{
+	env.volume = value >> 4;
+	env.increase = (value & 0x08) != 0;
+	env.period = value & 0x07;
+	env.timer = env.period ? env.period : 8;
+}
+
+
+void APU::clock_envelope(Envelope& env)
+{
+	if (env.period == 0)
+		return;
+	if (--env.timer > 0)
+		return;
+
+	env.timer = env.period;
+	if (env.increase && env.volume < 15)
+		env.volume++;
+	else if (!env.increase && env.volume > 0)
+		env.volume--;
+}
+
+
+void APU::clock_sweep()
+{
+	if (--pulse1.sweep_timer > 0)
+		return;
+
+	const int period = (regs[0x00] >> 4) & 0x07;
+	pulse1.sweep_timer = period ? period : 8;
+	if (!pulse1.sweep_enabled || period == 0)
+		return;
+
+	const int target = sweep_target();
+	if (target > 2047) {
+		pulse1.enabled = false;
+		return;
+	}
+
+	if (regs[0x00] & 0x07) {
+		pulse1.sweep_shadow = target;
+		pulse1.frequency = target;
+		regs[0x03] = target & 0xFF;
+		regs[0x04] = (regs[0x04] & 0xF8) | (target >> 8);
+
+		if (sweep_target() > 2047)
+			pulse1.enabled = false;
+	}
+}
@@ -0,0 +1,165 @@
+#ifndef APU_H_
+#define APU_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define APU_CLOCK_RATE  4194304  // cpu clock cycles per second
+#define APU_SAMPLE_RATE 48000    // output frames per second
+#define APU_FRAME_SEQUENCER_PERIOD 8192  // 512 Hz length/envelope/sweep clock
+
+
+// Stereo band-limited step synthesizer. Channels report each change of their
+// output level as a delta at the cpu cycle it happened; the delta is spread over
+// a few output samples with a band-limited step kernel, so the buffer only does
+// work when a waveform actually changes instead of once per cpu cycle. Reading
+// integrates the deltas back into samples at APU_SAMPLE_RATE.
+class BandLimitedBuffer {
+public:
+	static const int kernel_taps = 16;
+	static const int kernel_phase_bits = 5;  // of the sample position's fraction
+	static const int kernel_phases = 1 << kernel_phase_bits;
+	static const int buffer_size = 4096;  // stereo frames, ~85 ms at 48 kHz
+
+	BandLimitedBuffer();
+	void clear(const uint64_t time);
+
+	void add_delta(const uint64_t time, const float delta_left, const float delta_right);
+	void end_frame(const uint64_t time);
+
+	int samples_available() const;
+	int read_samples(int16_t* out, int max_frames);
+	uint64_t dropped_deltas() const;
+private:
+	// Output position of cycle time_origin, in 32.32 fixed point sample units.
+	// The integer part is also the number of finished samples.
+	uint64_t origin_position;
+	uint64_t time_origin;
+	uint64_t cycles_to_samples;  // 32.32 fixed point conversion factor
+
+	int write_end;  // stereo frames from the front that deltas have touched
+	uint64_t dropped_count;  // deltas past the end of a full buffer
+	float integrator[2];  // running left/right levels
+	float buffer[2 * (buffer_size + kernel_taps)];  // interleaved left/right deltas
+};
+
+
+class APU {
+public:
+	APU();
+	void reset(const uint64_t time, const uint8_t* io_registers);
+
+	void write_register(const uint64_t time, const uint16_t addr, const uint8_t value);
+	void end_frame(const uint64_t time);
+
+	int samples_available() const;
+	int read_samples(int16_t* out, int max_frames);
+	uint64_t dropped_deltas() const;
+private:
+	struct Channel {
+		bool enabled;
+		bool dac_enabled;
+		bool length_enabled;
+		int length_counter;
+		int frequency;  // 11-bit period value from NRx3/NRx4
+		int delay;      // cycles until the next waveform step
+		float out_left;
+		float out_right;
+	};
+
+	struct Envelope {
+		int volume;
+		int period;
+		int timer;
+		bool increase;
+	};
+
+	struct PulseChannel : Channel {
+		Envelope envelope;
+		int duty;
+		int phase;
+		// frequency sweep, channel 1 only
+		bool sweep_enabled;
+		int sweep_timer;
+		int sweep_shadow;
+	};
+
+	struct WaveChannel : Channel {
+		int position;
+		int volume_shift;
+	};
+
+	struct NoiseChannel : Channel {
+		Envelope envelope;
+		uint16_t lfsr;
+	};
+
+	BandLimitedBuffer buffer;
+
+	PulseChannel pulse1;
+	PulseChannel pulse2;
+	WaveChannel wave;
+	NoiseChannel noise;
+
+	uint8_t regs[0x30];  // shadow of 0xFF10 - 0xFF3F
+	bool powered;
+	float left_volume;   // NR50 master volume scaled to output units
+	float right_volume;
+
+	uint64_t last_time;
+	uint64_t next_sequencer_time;
+	int sequencer_step;
+
+	void run_until(const uint64_t time);
+	void run_channels(const uint64_t end);
+	void run_pulse(PulseChannel& ch, const int index, const uint64_t end);
+	void run_wave(const uint64_t end);
+	void run_noise(const uint64_t end);
+	void clock_sequencer(const uint64_t time);
+
+	void set_level(Channel& ch, const int index, const uint64_t time, const int level);
+	void refresh_outputs(const uint64_t time);
+
+	void load_register(const uint16_t addr, const uint8_t value);
+	void trigger(const int index);
+	void power_off(const uint64_t time);
+
+	int pulse_level(const PulseChannel& ch) const;
+	int wave_level() const;
+	int noise_level() const;
+	int sweep_target();
+	void clock_length(Channel& ch);
+	void start_envelope(Envelope& env, const uint8_t value);
+	void clock_envelope(Envelope& env);
+	void clock_sweep();
+};
+
+
+// Input: None
+// Return: Number of finished stereo frames ready to be read
+inline int BandLimitedBuffer::samples_available() const
+{
+	return (int)(origin_position >> 32);
+}
+
+
+// Return: Number of level changes dropped because samples weren't read
+//         out in time
+inline uint64_t BandLimitedBuffer::dropped_deltas() const
+{
+	return dropped_count;
+}
+
+
+inline int APU::samples_available() const
+{
+	return buffer.samples_available();
+}
+
+
+inline uint64_t APU::dropped_deltas() const
+{
+	return buffer.dropped_deltas();
+}
+
+#endif  // APU_H_
@@ -0,0 +1,623 @@
+#include "capture.h"
+#include "compress.h"
+#include <string.h>
+#include <chrono>
+
+#define PACKED_FRAME_SIZE (SCREEN_WIDTH * SCREEN_HEIGHT / 4)  // four 2-bit shades per byte
+
+#define FILE_HEADER_SIZE   16
+#define RECORD_HEADER_SIZE 24
+#define FOOTER_SIZE        24
+
+#define RECORD_KEYFRAME 0x01
+
+static const char file_magic[8] = { 'G', 'B', 'C', 'A', 'P', 0x01, 0, 0 };
+static const char index_magic[8] = { 'G', 'B', 'C', 'A', 'P', 'I', 'D', 'X' };
+
+static const uint8_t shade_to_gray[4] = { 0xFF, 0xAA, 0x55, 0x00 };
+
+
+// Capture files are little-endian regardless of the host.
+static void put_u16(uint8_t* p, const uint16_t value)
+{
+	p[0] = value & 0xFF;
+	p[1] = value >> 8;
+}
+
+
+static void put_u32(uint8_t* p, const uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = (value >> (8 * i)) & 0xFF;
+}
+
+
+static void put_u64(uint8_t* p, const uint64_t value)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = (value >> (8 * i)) & 0xFF;
+}
+
+
+static uint32_t get_u32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static uint64_t get_u64(const uint8_t* p)
+{
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+
+FrameCapture::FrameCapture()
+	: queue(CAPTURE_QUEUE_FRAMES, BACKPRESSURE), running(false), written_count(0),
+	  stall_count(0), file(NULL), interval(60), failed(false)
+{
+}
+
+
+FrameCapture::~FrameCapture()
+{
+	close();
+}
+
+
+// Input: file_name - capture file to create
+//        keyframe_interval - frames between frames stored without a delta
+// Return: Return 0 on success;
+//         return -1 on failure
+// Function: Create the capture file and start the writer thread
+int FrameCapture::open(const char* file_name, const int keyframe_interval)
+{
+	uint8_t header[FILE_HEADER_SIZE];
+
+	close();
+
+	file = fopen(file_name, "wb");
+	if (!file)
+		return -1;
+
+	memcpy(header, file_magic, sizeof(file_magic));
+	put_u16(header + 8, SCREEN_WIDTH);
+	put_u16(header + 10, SCREEN_HEIGHT);
+	interval = (keyframe_interval > 0) ? keyframe_interval : 1;
+	put_u32(header + 12, interval);
+
+	if (fwrite(header, sizeof(header), 1, file) != 1) {
+		fclose(file);
+		file = NULL;
+		return -1;
+	}
+
+	index.clear();
+	failed = false;
+	written_count.store(0, std::memory_order_relaxed);
+	stall_count = 0;
+
+	running.store(true, std::memory_order_release);
+	worker = std::thread(&FrameCapture::worker_loop, this);
+
+	return 0;
+}
+
+
+// Input: None
+// Return: Return 0 on success;
+//         return -1 if any frame or the index could not be written
+// Function: Wait for queued frames to be written, then write the frame index
+int FrameCapture::close()
+{
+	if (!file)
+		return 0;
+
+	running.store(false, std::memory_order_release);
+	worker.join();
+
+	const uint64_t index_offset = ftello(file);
+	std::vector<uint8_t> tail(index.size() * 8 + FOOTER_SIZE);
+
+	for (size_t i = 0; i < index.size(); i++)
+		put_u64(&tail[i * 8], index[i]);
+	put_u64(&tail[index.size() * 8], index_offset);
+	put_u64(&tail[index.size() * 8 + 8], index.size());
+	memcpy(&tail[index.size() * 8 + 16], index_magic, sizeof(index_magic));
+
+	if (fwrite(&tail[0], tail.size(), 1, file) != 1)
+		failed = true;
+	if (fclose(file) != 0)
+		failed = true;
+	file = NULL;
+
+	return failed ? -1 : 0;
+}
+
+
+// Input: None
+// Return: Queue slot to render the next frame into, or NULL if no capture is open
+// Function: Lend the caller a frame slot, waiting only if the writer has fallen
+//           a whole queue behind. Hand it back with end_frame().
+VideoFrame* FrameCapture::begin_frame()
+{
+	VideoFrame* slot;
+
+	if (!file)
+		return NULL;
+
+	while (!(slot = queue.begin_write())) {
+		stall_count++;
+		std::this_thread::yield();
+	}
+
+	return slot;
+}
+
+
+void FrameCapture::end_frame()
+{
+	queue.end_write();
+}
+
+
+// Input: frame - finished frame to record
+// Return: None
+void FrameCapture::submit(const VideoFrame& frame)
+{
+	VideoFrame* slot = begin_frame();
+
+	if (!slot)
+		return;
+
+	*slot = frame;
+	end_frame();
+}
+
+
+// Return: Number of frames the writer has finished
+uint64_t FrameCapture::frames_written() const
+{
+	return written_count.load(std::memory_order_relaxed);
+}
+
+
+// Return: Number of times the emulation thread waited for a free slot
+uint64_t FrameCapture::stalls() const
+{
+	return stall_count;
+}
+
+
+// Function: Encode and write queued frames until the capture is closed
+void FrameCapture::worker_loop()
+{
+	VideoFrame* previous = new VideoFrame();
+	uint8_t packed[PACKED_FRAME_SIZE];
+	std::vector<uint8_t> compressed(lz_compress_bound(PACKED_FRAME_SIZE));
+
+	for (;;) {
+		const VideoFrame* frame = queue.begin_read();
+
+		if (!frame) {
+			if (running.load(std::memory_order_acquire)) {
+				std::this_thread::sleep_for(std::chrono::microseconds(500));
+				continue;
+			}
+			// closing; anything submitted before close() is visible now
+			frame = queue.begin_read();
+			if (!frame)
+				break;
+		}
+
+		write_frame(*frame, *previous, packed, &compressed[0]);
+		*previous = *frame;
+		queue.end_read();
+		written_count.store(written_count.load(std::memory_order_relaxed) + 1,
+		                    std::memory_order_relaxed);
+	}
+
+	delete previous;
+}
+
+
+// Input: frame - frame to write
+//        previous - last frame written
+//        packed, compressed - scratch buffers
+// Return: None
+// Function: Delta-encode, pack, compress and append one frame record
+void FrameCapture::write_frame(const VideoFrame& frame, const VideoFrame& previous,
+                               uint8_t* packed, uint8_t* compressed)
+{
+	const bool keyframe = (index.size() % interval) == 0;
+	const uint8_t* base = previous.pixels;
+	uint8_t header[RECORD_HEADER_SIZE];
+
+	if (failed)
+		return;
+
+	for (int i = 0; i < PACKED_FRAME_SIZE; i++) {
+		const uint8_t* p = &frame.pixels[4 * i];
+		uint8_t value = (p[0] & 0x03) | ((p[1] & 0x03) << 2) |
+		                ((p[2] & 0x03) << 4) | ((p[3] & 0x03) << 6);
+
+		if (!keyframe) {
+			const uint8_t* q = &base[4 * i];
+			value ^= (q[0] & 0x03) | ((q[1] & 0x03) << 2) |
+			         ((q[2] & 0x03) << 4) | ((q[3] & 0x03) << 6);
+		}
+		packed[i] = value;
+	}
+
+	const int size = lz_compress(packed, PACKED_FRAME_SIZE, compressed,
+	                             lz_compress_bound(PACKED_FRAME_SIZE));
+
+	put_u64(header, frame.frame_number);
+	put_u64(header + 8, frame.clock_cycles);
+	put_u32(header + 16, size);
+	put_u32(header + 20, keyframe ? RECORD_KEYFRAME : 0);
+
+	index.push_back(ftello(file));
+	if (size < 0 || fwrite(header, sizeof(header), 1, file) != 1 ||
+	    fwrite(compressed, size, 1, file) != 1)
+		failed = true;
+}
+
+
+CaptureReader::CaptureReader() : file(NULL), interval(1), current_index(-1)
+{
+}
+
+
+CaptureReader::~CaptureReader()
+{
+	close();
+}
+
+
+// Input: file_name - capture file to read
+// Return: Return 0 on success;
+//         return -1 on failure
+// Function: Open a capture and load its frame index. A capture that was never
+//           closed has no index; it is rebuilt by scanning the records.
+int CaptureReader::open(const char* file_name)
+{
+	uint8_t header[FILE_HEADER_SIZE];
+	uint8_t footer[FOOTER_SIZE];
+
+	close();
+
+	file = fopen(file_name, "rb");
+	if (!file)
+		return -1;
+
+	if (fread(header, sizeof(header), 1, file) != 1 ||
+	    memcmp(header, file_magic, sizeof(file_magic)) != 0 ||
+	    (header[8] | (header[9] << 8)) != SCREEN_WIDTH ||
+	    (header[10] | (header[11] << 8)) != SCREEN_HEIGHT) {
+		close();
+		return -1;
+	}
+	interval = get_u32(header + 12);
+	if (interval <= 0)
+		interval = 1;
+
+	if (fseeko(file, -FOOTER_SIZE, SEEK_END) == 0 &&
+	    fread(footer, sizeof(footer), 1, file) == 1 &&
+	    memcmp(footer + 16, index_magic, sizeof(index_magic)) == 0) {
+		const uint64_t index_offset = get_u64(footer);
+		const uint64_t count = get_u64(footer + 8);
+		std::vector<uint8_t> raw(count * 8);
+
+		if (count == 0 ||
+		    (fseeko(file, index_offset, SEEK_SET) == 0 && fread(&raw[0], raw.size(), 1, file) == 1)) {
+			index.resize(count);
+			for (uint64_t i = 0; i < count; i++)
+				index[i] = get_u64(&raw[i * 8]);
+			return 0;
+		}
+	}
+
+	if (rebuild_index() != 0) {
+		close();
+		return -1;
+	}
+
+	return 0;
+}
+
+
+void CaptureReader::close()
+{
+	if (file)
+		fclose(file);
+
+	file = NULL;
+	index.clear();
+	current_index = -1;
+}
+
+
+uint64_t CaptureReader::frame_count() const
+{
+	return index.size();
+}
+
+
+// Input: number - position of the frame in the capture, from 0
+//        frame - destination for the decoded frame
+// Return: Return 0 on success;
+//         return -1 on failure
+// Function: Decode a frame, starting from the closest keyframe at or before it
+//           unless the last decoded frame is closer
+int CaptureReader::read_frame(const uint64_t number, VideoFrame& frame)
+{
+	if (number >= index.size())
+		return -1;
+
+	const uint64_t keyframe = number - (number % interval);
+	uint64_t next = keyframe;
+
+	if (current_index >= (int64_t)keyframe && current_index <= (int64_t)number)
+		next = current_index + 1;
+
+	for (; next <= number; next++) {
+		if (decode_record(next, current) != 0) {
+			current_index = -1;
+			return -1;
+		}
+		current_index = next;
+	}
+
+	frame = current;
+	return 0;
+}
+
+
+// Function: Find every complete record of a capture that has no index
+int CaptureReader::rebuild_index()
+{
+	uint8_t header[RECORD_HEADER_SIZE];
+	uint64_t offset = FILE_HEADER_SIZE;
+
+	index.clear();
+
+	while (fseeko(file, offset, SEEK_SET) == 0 && fread(header, sizeof(header), 1, file) == 1) {
+		const uint32_t size = get_u32(header + 16);
+
+		if (size > (uint32_t)lz_compress_bound(PACKED_FRAME_SIZE))
+			break;
+		if (fseeko(file, offset + RECORD_HEADER_SIZE + size, SEEK_SET) != 0)
+			break;
+
+		index.push_back(offset);
+		offset += RECORD_HEADER_SIZE + size;
+	}
+
+	// a crash can leave a partly written last record
+	if (!index.empty()) {
+		fseeko(file, 0, SEEK_END);
+		if ((uint64_t)ftello(file) < offset)
+			index.pop_back();
+	}
+
+	return 0;
+}
+
+
+// Input: number - position of the record
+//        frame - previous frame, replaced by the decoded frame
+// Return: Return 0 on success;
+//         return -1 on failure
+int CaptureReader::decode_record(const uint64_t number, VideoFrame& frame)
+{
+	uint8_t header[RECORD_HEADER_SIZE];
+	uint8_t packed[PACKED_FRAME_SIZE];
+	std::vector<uint8_t> compressed;
+
+	if (fseeko(file, index[number], SEEK_SET) != 0 ||
+	    fread(header, sizeof(header), 1, file) != 1)
+		return -1;
+
+	const uint32_t size = get_u32(header + 16);
+	const bool keyframe = (get_u32(header + 20) & RECORD_KEYFRAME) != 0;
+
+	if (size > (uint32_t)lz_compress_bound(PACKED_FRAME_SIZE))
+		return -1;
+
+	compressed.resize(size ? size : 1);
+	if (size && fread(&compressed[0], size, 1, file) != 1)
+		return -1;
+	if (lz_decompress(&compressed[0], size, packed, sizeof(packed)) != PACKED_FRAME_SIZE)
+		return -1;
+
+	frame.frame_number = get_u64(header);
+	frame.clock_cycles = get_u64(header + 8);
+
+	for (int i = 0; i < PACKED_FRAME_SIZE; i++) {
+		uint8_t* p = &frame.pixels[4 * i];
+
+		for (int k = 0; k < 4; k++) {
+			const uint8_t shade = (packed[i] >> (2 * k)) & 0x03;
+			p[k] = keyframe ? shade : (p[k] ^ shade);
+		}
+	}
+
+	return 0;
+}
+
+
+// ****** Offline export ******
+
+static uint32_t crc32(const uint8_t* data, const size_t size, uint32_t crc)
+{
+	static uint32_t table[256];
+	static bool table_ready = false;
+
+	if (!table_ready) {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+			table[n] = c;
+		}
+		table_ready = true;
+	}
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+
+static void put_u32_be(uint8_t* p, const uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = (value >> (24 - 8 * i)) & 0xFF;
+}
+
+
+static bool write_png_chunk(FILE* out, const char* type, const std::vector<uint8_t>& data)
+{
+	uint8_t header[8];
+	uint8_t crc_bytes[4];
+
+	put_u32_be(header, data.size());
+	memcpy(header + 4, type, 4);
+
+	uint32_t crc = crc32(header + 4, 4, 0);
+	if (!data.empty())
+		crc = crc32(&data[0], data.size(), crc);
+	put_u32_be(crc_bytes, crc);
+
+	return fwrite(header, sizeof(header), 1, out) == 1 &&
+	       (data.empty() || fwrite(&data[0], data.size(), 1, out) == 1) &&
+	       fwrite(crc_bytes, sizeof(crc_bytes), 1, out) == 1;
+}
+
+
+// Input: file_name - PNG file to create
+//        frame - frame to write as 8-bit grayscale
+// Return: Return 0 on success;
+//         return -1 on failure
+// Function: The image data goes into stored (uncompressed) deflate blocks,
+//           which any PNG reader accepts and needs no zlib here.
+static int write_png(const char* file_name, const VideoFrame& frame)
+{
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	const size_t raw_size = SCREEN_HEIGHT * (SCREEN_WIDTH + 1);
+	std::vector<uint8_t> raw(raw_size);
+	std::vector<uint8_t> ihdr(13, 0);
+	std::vector<uint8_t> idat;
+	uint32_t adler_a = 1;
+	uint32_t adler_b = 0;
+
+	for (int y = 0; y < SCREEN_HEIGHT; y++) {
+		raw[y * (SCREEN_WIDTH + 1)] = 0;  // filter: none
+		for (int x = 0; x < SCREEN_WIDTH; x++)
+			raw[y * (SCREEN_WIDTH + 1) + 1 + x] = shade_to_gray[frame.pixels[y * SCREEN_WIDTH + x] & 0x03];
+	}
+
+	put_u32_be(&ihdr[0], SCREEN_WIDTH);
+	put_u32_be(&ihdr[4], SCREEN_HEIGHT);
+	ihdr[8] = 8;  // bit depth
+	ihdr[9] = 0;  // grayscale
+
+	idat.push_back(0x78);
+	idat.push_back(0x01);
+	for (size_t pos = 0; pos < raw_size; ) {
+		const size_t length = (raw_size - pos < 0xFFFF) ? raw_size - pos : 0xFFFF;
+
+		idat.push_back((pos + length == raw_size) ? 1 : 0);
+		idat.push_back(length & 0xFF);
+		idat.push_back(length >> 8);
+		idat.push_back(~length & 0xFF);
+		idat.push_back((~length >> 8) & 0xFF);
+		idat.insert(idat.end(), raw.begin() + pos, raw.begin() + pos + length);
+		pos += length;
+	}
+	for (size_t i = 0; i < raw_size; i++) {
+		adler_a = (adler_a + raw[i]) % 65521;
+		adler_b = (adler_b + adler_a) % 65521;
+	}
+	idat.resize(idat.size() + 4);
+	put_u32_be(&idat[idat.size() - 4], (adler_b << 16) | adler_a);
+
+	FILE* out = fopen(file_name, "wb");
+	if (!out)
+		return -1;
+
+	bool ok = fwrite(signature, sizeof(signature), 1, out) == 1 &&
+	          write_png_chunk(out, "IHDR", ihdr) &&
+	          write_png_chunk(out, "IDAT", idat) &&
+	          write_png_chunk(out, "IEND", std::vector<uint8_t>());
+
+	if (fclose(out) != 0)
+		ok = false;
+
+	return ok ? 0 : -1;
+}
+
+
+// Input: reader - open capture
+//        file_prefix - path prefix; frames are written to <prefix>000000.png, ...
+// Return: Return 0 on success;
+//         return -1 on failure
+int export_png_sequence(CaptureReader& reader, const char* file_prefix)
+{
+	VideoFrame* frame = new VideoFrame();
+	char file_name[4096];
+	int result = 0;
+
+	for (uint64_t i = 0; i < reader.frame_count() && result == 0; i++) {
+		snprintf(file_name, sizeof(file_name), "%s%06llu.png", file_prefix, (unsigned long long)i);
+		if (reader.read_frame(i, *frame) != 0 || write_png(file_name, *frame) != 0)
+			result = -1;
+	}
+
+	delete frame;
+	return result;
+}
+
+
+// Input: reader - open capture
+//        file_name - y4m file to create
+// Return: Return 0 on success;
+//         return -1 on failure
+// Function: Write the capture as a monochrome YUV4MPEG2 stream at the
+//           GameBoy's native ~59.73 Hz frame rate
+int export_y4m(CaptureReader& reader, const char* file_name)
+{
+	VideoFrame* frame = new VideoFrame();
+	uint8_t luma[SCREEN_WIDTH * SCREEN_HEIGHT];
+	bool ok = true;
+
+	FILE* out = fopen(file_name, "wb");
+	if (!out) {
+		delete frame;
+		return -1;
+	}
+
+	if (fprintf(out, "YUV4MPEG2 W%d H%d F4194304:70224 Ip A1:1 Cmono\n",
+	            SCREEN_WIDTH, SCREEN_HEIGHT) < 0)
+		ok = false;
+
+	for (uint64_t i = 0; i < reader.frame_count() && ok; i++) {
+		if (reader.read_frame(i, *frame) != 0) {
+			ok = false;
+			break;
+		}
+		for (int p = 0; p < SCREEN_WIDTH * SCREEN_HEIGHT; p++)
+			luma[p] = shade_to_gray[frame->pixels[p] & 0x03];
+
+		if (fputs("FRAME\n", out) < 0 || fwrite(luma, sizeof(luma), 1, out) != 1)
+			ok = false;
+	}
+
+	if (fclose(out) != 0)
+		ok = false;
+
+	delete frame;
+	return ok ? 0 : -1;
+}
@@ -0,0 +1,82 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include "frame.h"
+#include "ring_buffer.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define CAPTURE_QUEUE_FRAMES 64  // ~1 s of frames buffered ahead of the writer
+
+
+// Records every frame of a run into a seekable capture file.
+//
+// The emulation thread only fills a preallocated queue slot per frame; a worker
+// thread XORs each frame against the previous one (most of the screen doesn't
+// change), packs the 2-bit shades, compresses the result and appends it. Every
+// keyframe_interval frames are stored against a blank frame instead so a reader
+// can seek without decoding the whole run. The frame index is written when the
+// capture is closed.
+class FrameCapture {
+public:
+	FrameCapture();
+	~FrameCapture();
+
+	int open(const char* file_name, const int keyframe_interval = 60);
+	int close();
+
+	VideoFrame* begin_frame();
+	void end_frame();
+	void submit(const VideoFrame& frame);
+
+	uint64_t frames_written() const;
+	uint64_t stalls() const;
+private:
+	FrameRing queue;
+	std::thread worker;
+	std::atomic<bool> running;
+	std::atomic<uint64_t> written_count;
+	uint64_t stall_count;
+
+	FILE* file;
+	int interval;
+	bool failed;  // a write failed; set by the worker, read after it exits
+	std::vector<uint64_t> index;  // record offset of every frame, owned by the worker
+
+	void worker_loop();
+	void write_frame(const VideoFrame& frame, const VideoFrame& previous, uint8_t* packed,
+	                 uint8_t* compressed);
+};
+
+
+// Random access to the frames of a capture file.
+class CaptureReader {
+public:
+	CaptureReader();
+	~CaptureReader();
+
+	int open(const char* file_name);
+	void close();
+
+	uint64_t frame_count() const;
+	int read_frame(const uint64_t number, VideoFrame& frame);
+private:
+	FILE* file;
+	int interval;
+	std::vector<uint64_t> index;
+
+	VideoFrame current;    // last decoded frame, so sequential reads decode one record
+	int64_t current_index;
+
+	int rebuild_index();
+	int decode_record(const uint64_t number, VideoFrame& frame);
+};
+
+
+int export_png_sequence(CaptureReader& reader, const char* file_prefix);
+int export_y4m(CaptureReader& reader, const char* file_name);
+
+#endif  // CAPTURE_H_
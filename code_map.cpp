@@ -0,0 +1,304 @@
+#include "code_map.h"
+#include "cpu.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define FNV_OFFSET 0xCBF29CE484222325ull
+#define FNV_PRIME  0x100000001B3ull
+
+static const char map_magic[8] = { 'G', 'B', 'C', 'O', 'D', 'E', 'S', 0 };
+
+// entry point, then the interrupt vectors
+static const uint16_t entry_points[] = { 0x0100, 0x0040, 0x0048, 0x0050, 0x0058, 0x0060 };
+
+struct CodeMapHeader {
+	char magic[8];      // "GBCODES\0"
+	uint32_t version;   // CODE_MAP_VERSION
+	uint32_t size;      // CODE_MAP_SIZE
+	uint64_t checksum;  // CodeMap::checksum() of the ROM
+};
+
+static std::mutex cache_mutex;
+static std::string cache_dir;  // empty when maps aren't cached
+
+
+// Return: Whether opcode is one of the undefined opcodes that lock the cpu
+static bool is_undefined(const uint8_t opcode)
+{
+	switch(opcode) {
+	case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4:
+	case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+CodeMap::CodeMap()
+{
+	memset(flags, 0, sizeof(flags));
+}
+
+
+// Input: rom - ROM image
+//        size - bytes in rom; only the first CODE_MAP_SIZE are analyzed
+// Return: None
+// Function: Mark every instruction reachable from the entry point and the
+//           interrupt vectors, following both sides of conditional branches
+//           and the targets of calls and RSTs
+void CodeMap::analyze(const uint8_t* rom, const size_t size)
+{
+	const uint32_t end = (size < CODE_MAP_SIZE) ? size : CODE_MAP_SIZE;
+	std::vector<uint16_t> pending;
+
+	memset(flags, 0, sizeof(flags));
+
+	for (size_t i = 0; i < sizeof(entry_points) / sizeof(entry_points[0]); i++) {
+		if (entry_points[i] < end) {
+			flags[entry_points[i]] |= CODE_BLOCK_START | CODE_CALL_TARGET;
+			pending.push_back(entry_points[i]);
+		}
+	}
+
+	while (!pending.empty()) {
+		uint32_t addr = pending.back();
+
+		pending.pop_back();
+
+		// follow the block until it ends or runs into code already mapped
+		while (addr < end && !(flags[addr] & (CODE_OPCODE | CODE_OPERAND)) &&
+		       addr + opcode_length[rom[addr]] <= end) {
+			int target;
+			const int next = decode(addr, rom, target);
+
+			if (target >= 0 && (uint32_t)target < end)
+				pending.push_back(target);
+			if (next < 0)
+				break;
+			addr = next;
+		}
+	}
+}
+
+
+// Input: addr - address of an instruction not yet mapped
+//        rom - ROM image
+//        target - receives the address the instruction may jump or call
+//                 to, or -1
+// Return: Address of the next instruction, or -1 if control never falls
+//         through to it
+// Function: Mark the instruction and the blocks it starts
+int CodeMap::decode(const uint16_t addr, const uint8_t* rom, int& target)
+{
+	const uint8_t opcode = rom[addr];
+	const int length = opcode_length[opcode];
+	const int next = addr + length;
+	bool branch = true;      // the next instruction starts a block
+	bool falls_through = true;
+	bool call = false;
+
+	target = -1;
+	if (is_undefined(opcode))
+		return -1;
+
+	flags[addr] |= CODE_OPCODE;
+	for (int i = 1; i < length; i++)
+		flags[addr + i] |= CODE_OPERAND;
+
+	switch(opcode) {
+	case 0x18:  // JR n
+		falls_through = false;
+		target = (next + (int8_t)rom[addr + 1]) & 0xFFFF;
+		break;
+	case 0x20: case 0x28: case 0x30: case 0x38:  // JR cc, n
+		target = (next + (int8_t)rom[addr + 1]) & 0xFFFF;
+		break;
+	case 0xC3:  // JP nn
+		falls_through = false;
+		target = (rom[addr + 2] << 8) | rom[addr + 1];
+		break;
+	case 0xC2: case 0xCA: case 0xD2: case 0xDA:  // JP cc, nn
+		target = (rom[addr + 2] << 8) | rom[addr + 1];
+		break;
+	case 0xCD:  // CALL nn
+	case 0xC4: case 0xCC: case 0xD4: case 0xDC:  // CALL cc, nn
+		call = true;
+		target = (rom[addr + 2] << 8) | rom[addr + 1];
+		break;
+	case 0xC9:  // RET
+	case 0xD9:  // RETI
+	case 0xE9:  // JP (HL), target unknown
+		falls_through = false;
+		break;
+	case 0xC0: case 0xC8: case 0xD0: case 0xD8:  // RET cc
+		break;
+	default:
+		if ((opcode & 0xC7) == 0xC7) {  // RST
+			call = true;
+			target = opcode & 0x38;
+		} else {
+			branch = false;
+		}
+	}
+
+	if (target >= CODE_MAP_SIZE)
+		target = -1;  // code in RAM isn't known until it runs
+	else if (target >= 0)
+		flags[target] |= CODE_BLOCK_START | (call ? CODE_CALL_TARGET : 0);
+
+	if (!falls_through)
+		return -1;
+
+	if (branch && next < CODE_MAP_SIZE)
+		flags[next] |= CODE_BLOCK_START;
+
+	return next;
+}
+
+
+// Input: bank - 16 KiB ROM bank, 0 to CODE_MAP_BANKS - 1
+//        flag - one of the CODE_* flags
+// Return: Number of bytes in the bank with the flag set, or -1 for a bank
+//         outside the map
+int CodeMap::count(const int bank, const uint8_t flag) const
+{
+	if (bank < 0 || bank >= CODE_MAP_BANKS)
+		return -1;
+
+	int total = 0;
+	for (int addr = bank * 0x4000; addr < (bank + 1) * 0x4000; addr++)
+		if (flags[addr] & flag)
+			total++;
+
+	return total;
+}
+
+
+// Input: file_name - map saved by save()
+//        checksum - checksum() of the ROM the map is wanted for
+// Return Value: Return 0 on success;
+//               return -1 if the file can't be read or is for another ROM or
+//               version, leaving the map unchanged
+int CodeMap::load(const char* file_name, const uint64_t checksum)
+{
+	FILE* file = fopen(file_name, "rb");
+	CodeMapHeader header;
+	std::vector<uint8_t> data(CODE_MAP_SIZE);
+
+	if (!file)
+		return -1;
+
+	const bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+	                memcmp(header.magic, map_magic, sizeof(map_magic)) == 0 &&
+	                header.version == CODE_MAP_VERSION && header.size == CODE_MAP_SIZE &&
+	                header.checksum == checksum &&
+	                fread(&data[0], CODE_MAP_SIZE, 1, file) == 1;
+
+	fclose(file);
+	if (!ok)
+		return -1;
+
+	memcpy(flags, &data[0], CODE_MAP_SIZE);
+	return 0;
+}
+
+
+// Input: file_name - file to create or replace
+//        checksum - checksum() of the ROM the map was built from
+// Return Value: Return 0 on success;
+//               return -1 on failure
+// Function: Write to a temporary file and rename it into place, so other
+//           processes loading the same ROM never see a partial map
+int CodeMap::save(const char* file_name, const uint64_t checksum) const
+{
+	const std::string temp_name = std::string(file_name) + "." + std::to_string(getpid()) + "." +
+	                              std::to_string((uintptr_t)this);
+	FILE* file = fopen(temp_name.c_str(), "wb");
+	CodeMapHeader header;
+
+	if (!file)
+		return -1;
+
+	memcpy(header.magic, map_magic, sizeof(map_magic));
+	header.version = CODE_MAP_VERSION;
+	header.size = CODE_MAP_SIZE;
+	header.checksum = checksum;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+	          fwrite(flags, sizeof(flags), 1, file) == 1;
+
+	if (fclose(file) != 0)
+		ok = false;
+
+	if (!ok || rename(temp_name.c_str(), file_name) != 0) {
+		remove(temp_name.c_str());
+		return -1;
+	}
+
+	return 0;
+}
+
+
+// Input: rom - ROM image
+//        size - bytes in rom
+// Return: 64-bit FNV-1a hash of the image, which names its cache file
+uint64_t CodeMap::checksum(const uint8_t* rom, const size_t size)
+{
+	uint64_t hash = FNV_OFFSET;
+
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ rom[i]) * FNV_PRIME;
+
+	return hash;
+}
+
+
+// Input: rom - ROM image
+//        size - bytes in rom
+// Return: Map of the ROM, read from the cache directory if one is set and
+//         holds it, otherwise analyzed and then saved there
+std::shared_ptr<const CodeMap> CodeMap::build(const uint8_t* rom, const size_t size)
+{
+	std::shared_ptr<CodeMap> map = std::make_shared<CodeMap>();
+	std::string dir;
+
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		dir = cache_dir;
+	}
+
+	if (dir.empty()) {
+		map->analyze(rom, size);
+		return map;
+	}
+
+	const uint64_t sum = checksum(rom, size);
+	char name[32];
+
+	snprintf(name, sizeof(name), "/%016llx.codemap", (unsigned long long)sum);
+	const std::string file_name = dir + name;
+
+	if (map->load(file_name.c_str(), sum) != 0) {
+		map->analyze(rom, size);
+		map->save(file_name.c_str(), sum);  // a failed save only costs the next load
+	}
+
+	return map;
+}
+
+
+// Input: dir - existing directory for cached maps, or NULL to analyze every
+//              ROM on load
+// Return: None
+// Function: Applies to every later ROM load, on any thread
+void CodeMap::set_cache_dir(const char* dir)
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	cache_dir = dir ? dir : "";
+}
@@ -0,0 +1,59 @@
+#ifndef CODE_MAP_H_
+#define CODE_MAP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+
+#define CODE_MAP_SIZE  0x8000  // the ROM the MMU maps, banks 0 and 1
+#define CODE_MAP_BANKS (CODE_MAP_SIZE / 0x4000)
+
+// Flags per ROM byte; a byte with none of them is data or unreached
+#define CODE_OPCODE      0x01  // first byte of an instruction
+#define CODE_OPERAND     0x02  // later byte of an instruction
+#define CODE_BLOCK_START 0x04  // entry point, branch target or the fall-through of one
+#define CODE_CALL_TARGET 0x08  // subroutine entry, including vectors and RST targets
+
+#define CODE_MAP_VERSION 1
+
+
+// Code/data map of a ROM found by following control flow from the entry
+// point and the interrupt vectors, without running anything. Every
+// instruction reachable through direct jumps, calls, returns and RSTs is
+// marked, and the start of every basic block is flagged, so work that
+// depends on where instructions begin can be done once per ROM instead of
+// once per instance. Code only reached through JP (HL), or copied to RAM,
+// isn't found.
+//
+// A map depends only on the ROM, so an MMU builds it when the ROM is loaded
+// and its forks share it. With a cache directory set, maps are saved there
+// keyed by ROM checksum and later loads read them back instead.
+class CodeMap {
+public:
+	CodeMap();
+
+	void analyze(const uint8_t* rom, const size_t size);
+	int load(const char* file_name, const uint64_t checksum);
+	int save(const char* file_name, const uint64_t checksum) const;
+
+	uint8_t get_flags(const uint16_t addr) const;
+	int count(const int bank, const uint8_t flag) const;
+
+	static uint64_t checksum(const uint8_t* rom, const size_t size);
+	static std::shared_ptr<const CodeMap> build(const uint8_t* rom, const size_t size);
+	static void set_cache_dir(const char* dir);
+private:
+	uint8_t flags[CODE_MAP_SIZE];
+
+	int decode(const uint16_t addr, const uint8_t* rom, int& target);
+};
+
+
+// Input: addr - ROM address
+// Return: CODE_* flags of the byte, or 0 outside the ROM
+inline uint8_t CodeMap::get_flags(const uint16_t addr) const
+{
+	return (addr < CODE_MAP_SIZE) ? flags[addr] : 0;
+}
+
+#endif  // CODE_MAP_H_
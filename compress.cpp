@@ -0,0 +1,187 @@
+#include "compress.h"
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+#define HASH_BITS 12
+
+
+static inline uint32_t read32(const uint8_t* p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+
+static inline int hash32(const uint32_t value)
+{
+	return (int)((value * 2654435761u) >> (32 - HASH_BITS));
+}
+
+
+// Input: dst - output position, advanced past the written bytes
+//        end - end of the output buffer
+//        length - length beyond the 15 that fit in the token nibble
+// Return: false if the output buffer is full
+static bool write_length(uint8_t*& dst, const uint8_t* end, int length)
+{
+	while (length >= 255) {
+		if (dst >= end)
+			return false;
+		*dst++ = 255;
+		length -= 255;
+	}
+	if (dst >= end)
+		return false;
+	*dst++ = (uint8_t)length;
+
+	return true;
+}
+
+
+// Input: dst - output position, advanced past the sequence
+//        end - end of the output buffer
+//        literals, literal_length - bytes to copy verbatim
+//        match_length - length of the following match, 0 for the last sequence
+//        offset - distance back to the match
+// Return: false if the output buffer is full
+static bool write_sequence(uint8_t*& dst, const uint8_t* end, const uint8_t* literals,
+                           const int literal_length, const int match_length, const int offset)
+{
+	const int match_code = match_length ? match_length - MIN_MATCH : 0;
+
+	if (dst >= end)
+		return false;
+	*dst++ = (uint8_t)(((literal_length < 15 ? literal_length : 15) << 4) |
+	                   (match_code < 15 ? match_code : 15));
+
+	if (literal_length >= 15 && !write_length(dst, end, literal_length - 15))
+		return false;
+	if (end - dst < literal_length)
+		return false;
+	memcpy(dst, literals, literal_length);
+	dst += literal_length;
+
+	if (match_length == 0)
+		return true;
+
+	if (end - dst < 2)
+		return false;
+	*dst++ = offset & 0xFF;
+	*dst++ = offset >> 8;
+
+	if (match_code >= 15 && !write_length(dst, end, match_code - 15))
+		return false;
+
+	return true;
+}
+
+
+// Input: src, size - bytes to compress
+//        dst, capacity - output buffer; lz_compress_bound(size) always suffices
+// Return: Compressed size, or -1 if dst is too small
+int lz_compress(const uint8_t* src, const int size, uint8_t* dst, const int capacity)
+{
+	int table[1 << HASH_BITS];
+	uint8_t* out = dst;
+	const uint8_t* end = dst + capacity;
+	int anchor = 0;
+	int pos = 0;
+
+	memset(table, 0xFF, sizeof(table));
+
+	while (pos + MIN_MATCH <= size) {
+		const uint32_t sequence = read32(src + pos);
+		const int h = hash32(sequence);
+		const int candidate = table[h];
+
+		table[h] = pos;
+
+		if (candidate < 0 || pos - candidate > MAX_OFFSET || read32(src + candidate) != sequence) {
+			pos++;
+			continue;
+		}
+
+		int length = MIN_MATCH;
+		while (pos + length < size && src[candidate + length] == src[pos + length])
+			length++;
+
+		if (!write_sequence(out, end, src + anchor, pos - anchor, length, pos - candidate))
+			return -1;
+
+		pos += length;
+		anchor = pos;
+	}
+
+	if (!write_sequence(out, end, src + anchor, size - anchor, 0, 0))
+		return -1;
+
+	return (int)(out - dst);
+}
+
+
+// Input: src, size - compressed bytes
+//        dst, capacity - output buffer
+// Return: Decompressed size, or -1 if the input is corrupt or dst is too small
+int lz_decompress(const uint8_t* src, const int size, uint8_t* dst, const int capacity)
+{
+	const uint8_t* in = src;
+	const uint8_t* in_end = src + size;
+	uint8_t* out = dst;
+	uint8_t* out_end = dst + capacity;
+
+	while (in < in_end) {
+		const int token = *in++;
+		int literal_length = token >> 4;
+		int match_length = token & 0x0F;
+
+		if (literal_length == 15) {
+			int extra;
+			do {
+				if (in >= in_end)
+					return -1;
+				extra = *in++;
+				literal_length += extra;
+			} while (extra == 255);
+		}
+
+		if (in_end - in < literal_length || out_end - out < literal_length)
+			return -1;
+		memcpy(out, in, literal_length);
+		in += literal_length;
+		out += literal_length;
+
+		// the last sequence carries no match
+		if (in == in_end)
+			break;
+
+		if (in_end - in < 2)
+			return -1;
+		const int offset = in[0] | (in[1] << 8);
+		in += 2;
+
+		if (match_length == 15) {
+			int extra;
+			do {
+				if (in >= in_end)
+					return -1;
+				extra = *in++;
+				match_length += extra;
+			} while (extra == 255);
+		}
+		match_length += MIN_MATCH;
+
+		if (offset == 0 || offset > out - dst || out_end - out < match_length)
+			return -1;
+
+		// byte by byte, since a match may overlap the bytes it produces
+		const uint8_t* match = out - offset;
+		for (int i = 0; i < match_length; i++)
+			out[i] = match[i];
+		out += match_length;
+	}
+
+	return (int)(out - dst);
+}
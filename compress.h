@@ -0,0 +1,21 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stdint.h>
+
+
+// Fast byte-oriented LZ77 codec (LZ4-style sequences of literals followed by
+// a match of at least four bytes at a 16-bit offset). It trades ratio for
+// speed, and does very well on the long runs of zeros in delta-encoded frames
+// and states.
+
+// Return: Worst-case compressed size for size input bytes
+inline int lz_compress_bound(const int size)
+{
+	return size + size / 255 + 16;
+}
+
+int lz_compress(const uint8_t* src, const int size, uint8_t* dst, const int capacity);
+int lz_decompress(const uint8_t* src, const int size, uint8_t* dst, const int capacity);
+
+#endif  // COMPRESS_H_
@@ -0,0 +1,507 @@
+#include "control_server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <new>
+
+#define POLL_INTERVAL_MS 100   // how soon serve() notices stop()
+#define SEND_TIMEOUT_MS  1000  // a client that stops reading replies is dropped
+#define SHARED_ALIGN     4096
+#define STATE_ALIGN      64
+
+static_assert(SERVER_SCREEN_WIDTH == SCREEN_WIDTH && SERVER_SCREEN_HEIGHT == SCREEN_HEIGHT,
+              "server_protocol.h screen size is out of date");
+
+static const char shared_magic[8] = { 'G', 'B', 'S', 'H', 'A', 'R', 'E', 'D' };
+
+
+static size_t round_up(const size_t size, const size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+
+// Input: fd - connected socket
+//        buffer, size - bytes to send
+// Return: 0 once size bytes have been sent, -1 if the client has gone or
+//         hasn't taken them within SEND_TIMEOUT_MS
+static int write_all(const int fd, const void* buffer, size_t size)
+{
+	const uint8_t* p = (const uint8_t*)buffer;
+
+	while (size > 0) {
+		const ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return -1;
+		p += sent;
+		size -= sent;
+	}
+
+	return 0;
+}
+
+
+// Input: count - number of emulator instances, at least 1
+//        threads - threads to run batches on, including the serving thread
+ControlServer::ControlServer(const int count, const int threads)
+	: listen_fd(-1), shared(NULL), shared_size(0), slot_offset(0), slot_size(0),
+	  state_offset(0), stopping(false), next_instance(0), generation(0), pending(0),
+	  exiting(false)
+{
+	const int n = count < 1 ? 1 : (count >= SERVER_ALL_INSTANCES ? SERVER_ALL_INSTANCES - 1 : count);
+	const int slices = threads < 1 ? 1 : (threads > n ? n : threads);
+
+	for (int i = 0; i < n; i++)
+		instances.push_back(new GameBoy());
+	loaded_states.resize(n);
+	queues.resize(n);
+
+	for (int i = 1; i < slices; i++)
+		workers.push_back(std::thread(&ControlServer::worker_loop, this));
+}
+
+
+ControlServer::~ControlServer()
+{
+	close();
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		exiting = true;
+	}
+	start.notify_all();
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	for (size_t i = 0; i < instances.size(); i++)
+		delete instances[i];
+}
+
+
+// Input: socket_path - Unix domain socket to listen on; a stale one is
+//                      replaced
+//        shared_name - POSIX shared memory name, "/" and a name, for the
+//                      published frames, RAM and states; replaced if it exists
+// Return Value: Return 0 on success;
+//               return -1 if either can't be created
+int ControlServer::open(const char* socket_path, const char* shared_name)
+{
+	sockaddr_un address;
+
+	close();
+
+	if (strlen(socket_path) >= sizeof(address.sun_path))
+		return -1;
+
+	state_offset = round_up(sizeof(SharedSlot), STATE_ALIGN);
+	slot_offset = round_up(sizeof(SharedHeader), SHARED_ALIGN);
+	slot_size = round_up(state_offset + sizeof(GameBoyState), SHARED_ALIGN);
+	shared_size = slot_offset + slot_size * instances.size();
+
+	const int shm = shm_open(shared_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+	if (shm < 0)
+		return -1;
+	this->shared_name = shared_name;
+
+	if (ftruncate(shm, shared_size) != 0) {
+		::close(shm);
+		close();
+		return -1;
+	}
+
+	void* mapped = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+	::close(shm);
+	if (mapped == MAP_FAILED) {
+		close();
+		return -1;
+	}
+	shared = (uint8_t*)mapped;
+
+	SharedHeader* header = (SharedHeader*)shared;
+	memcpy(header->magic, shared_magic, sizeof(shared_magic));
+	header->version = SERVER_PROTOCOL_VERSION;
+	header->instance_count = instances.size();
+	header->slot_offset = slot_offset;
+	header->slot_size = slot_size;
+	header->state_offset = state_offset;
+	header->state_size = sizeof(GameBoyState);
+
+	for (size_t i = 0; i < instances.size(); i++)
+		publish(i);
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		close();
+		return -1;
+	}
+
+	unlink(socket_path);
+	if (bind(listen_fd, (const sockaddr*)&address, sizeof(address)) != 0 ||
+	    listen(listen_fd, SERVER_MAX_CLIENTS) != 0) {
+		close();
+		return -1;
+	}
+	this->socket_path = socket_path;
+
+	stopping.store(false, std::memory_order_relaxed);
+	return 0;
+}
+
+
+// Input: None
+// Return: None
+// Function: Disconnect every client and remove the socket and the shared
+//           memory name. Instances keep their state.
+void ControlServer::close()
+{
+	for (size_t i = 0; i < clients.size(); i++)
+		::close(clients[i].fd);
+	clients.clear();
+
+	if (listen_fd >= 0)
+		::close(listen_fd);
+	listen_fd = -1;
+
+	if (!socket_path.empty())
+		unlink(socket_path.c_str());
+	socket_path.clear();
+
+	if (shared)
+		munmap(shared, shared_size);
+	shared = NULL;
+
+	if (!shared_name.empty())
+		shm_unlink(shared_name.c_str());
+	shared_name.clear();
+}
+
+
+// Input: None
+// Return Value: Return 0 after stop();
+//               return -1 if the server isn't open or polling fails
+// Function: Accept clients and run their batches until stopped
+int ControlServer::serve()
+{
+	std::vector<pollfd> fds;
+
+	if (listen_fd < 0)
+		return -1;
+
+	while (!stopping.load(std::memory_order_relaxed)) {
+		fds.clear();
+		for (size_t i = 0; i < clients.size(); i++) {
+			const pollfd client = { clients[i].fd, POLLIN, 0 };
+			fds.push_back(client);
+		}
+		const pollfd listener = { listen_fd, POLLIN, 0 };
+		fds.push_back(listener);
+
+		if (poll(&fds[0], fds.size(), POLL_INTERVAL_MS) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		// backwards, so dropping a client doesn't shift the ones left to check
+		for (int i = (int)clients.size() - 1; i >= 0; i--) {
+			if (fds[i].revents && serve_client(clients[i]) != 0) {
+				::close(clients[i].fd);
+				clients.erase(clients.begin() + i);
+			}
+		}
+
+		if (fds.back().revents & POLLIN) {
+			const int fd = accept(listen_fd, NULL, NULL);
+			const ServerHello hello = { SERVER_MAGIC, SERVER_PROTOCOL_VERSION,
+			                            (uint32_t)instances.size(), (uint32_t)shared_size };
+			const timeval timeout = { SEND_TIMEOUT_MS / 1000, SEND_TIMEOUT_MS % 1000 * 1000 };
+
+			if (fd < 0)
+				continue;
+			if (clients.size() >= SERVER_MAX_CLIENTS ||
+			    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0 ||
+			    write_all(fd, &hello, sizeof(hello)) != 0) {
+				::close(fd);
+			} else {
+				const Client client = { fd, std::vector<uint8_t>() };
+				clients.push_back(client);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+// Input: client - client with data waiting
+// Return Value: Return 0 on success, including when the batch isn't
+//               complete yet;
+//               return -1 if the client hung up or broke the protocol, and
+//               should be dropped
+// Function: Take what has arrived without blocking. Once a whole batch is
+//           in, run it and send the results.
+int ControlServer::serve_client(Client& client)
+{
+	ServerBatch header;
+	size_t want = sizeof(header);
+
+	for (;;) {
+		const size_t have = client.input.size();
+
+		if (have >= sizeof(header)) {
+			memcpy(&header, &client.input[0], sizeof(header));
+			if (header.magic != SERVER_MAGIC || header.size > SERVER_MAX_BATCH ||
+			    header.count > header.size / sizeof(ServerCommand))
+				return -1;
+			want = sizeof(header) + header.size;
+		}
+		if (have == want)
+			break;
+
+		client.input.resize(want);
+		const ssize_t got = recv(client.fd, &client.input[have], want - have, MSG_DONTWAIT);
+		client.input.resize(have + (got > 0 ? got : 0));
+
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (got <= 0)
+			return -1;
+	}
+
+	std::vector<ServerResult> results(header.count);
+
+	if (run_batch(header.size ? &client.input[sizeof(header)] : NULL, header.size, header.count,
+	              header.count ? &results[0] : NULL) != 0)
+		return -1;
+	client.input.clear();
+
+	header.size = header.count * sizeof(ServerResult);
+	if (write_all(client.fd, &header, sizeof(header)) != 0 ||
+	    (header.count && write_all(client.fd, &results[0], header.size) != 0))
+		return -1;
+
+	return 0;
+}
+
+
+// Input: commands, size - count ServerCommands, each followed by its data
+//        count - number of commands
+//        results - receives count results
+// Return Value: Return 0 on success, whether or not the commands succeeded;
+//               return -1 if the commands don't fit in size bytes
+// Function: Run each instance's commands in order, different instances in
+//           parallel, and publish the instances they change
+int ControlServer::run_batch(const uint8_t* commands, const uint32_t size, const uint32_t count,
+                             ServerResult* results)
+{
+	const int n = instances.size();
+	uint32_t offset = 0;
+	int busy = 0;  // instances with commands
+
+	batch.clear();
+	for (int i = 0; i < n; i++)
+		queues[i].clear();
+
+	for (uint32_t c = 0; c < count; c++) {
+		ServerCommand header;
+		Command command;
+
+		if (size - offset < sizeof(header))
+			return -1;
+		memcpy(&header, commands + offset, sizeof(header));
+		offset += sizeof(header);
+		if (size - offset < header.data_size)
+			return -1;
+
+		command.op = header.op;
+		command.instance = header.instance;
+		command.arg = header.arg;
+		command.data = commands + offset;
+		command.data_size = header.data_size;
+		command.rom = NULL;
+		offset += header.data_size;
+		batch.push_back(command);
+	}
+
+	statuses.reset(new std::atomic<int32_t>[count]);
+	roms.clear();
+
+	for (uint32_t c = 0; c < count; c++) {
+		const uint16_t instance = batch[c].instance;
+
+		statuses[c].store(0, std::memory_order_relaxed);
+		if (instance == SERVER_ALL_INSTANCES) {
+			// load the ROM once here; every instance then shares it
+			if (batch[c].op == SERVER_LOAD_ROM) {
+				roms.push_back(std::unique_ptr<MMU>(new MMU()));
+				if (roms.back()->load_ROM_data(batch[c].data, batch[c].data_size) == 0)
+					batch[c].rom = roms.back().get();
+			}
+			for (int i = 0; i < n; i++)
+				queues[i].push_back(c);
+		} else if (instance < n) {
+			queues[instance].push_back(c);
+		} else {
+			statuses[c].store(-1, std::memory_order_relaxed);
+		}
+	}
+
+	for (int i = 0; i < n; i++)
+		busy += !queues[i].empty();
+
+	next_instance.store(0, std::memory_order_relaxed);
+	if (busy <= 1 || workers.empty()) {
+		run_queues();
+	} else {
+		std::unique_lock<std::mutex> guard(lock);
+
+		generation++;
+		pending = workers.size();
+		start.notify_all();
+		guard.unlock();
+
+		run_queues();
+
+		guard.lock();
+		finished.wait(guard, [this] { return pending == 0; });
+	}
+
+	for (uint32_t c = 0; c < count; c++) {
+		results[c].status = statuses[c].load(std::memory_order_relaxed);
+		results[c].reserved = 0;
+	}
+
+	return 0;
+}
+
+
+// Function: Run batches on this thread's share of the instances until the
+//           server is destroyed
+void ControlServer::worker_loop()
+{
+	uint64_t seen = 0;
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			start.wait(guard, [this, seen] { return exiting || generation != seen; });
+			if (exiting)
+				return;
+			seen = generation;
+		}
+
+		run_queues();
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (--pending == 0)
+			finished.notify_one();
+	}
+}
+
+
+// Function: Take instances with queued commands until none are left, and
+//           run their commands
+void ControlServer::run_queues()
+{
+	const int n = instances.size();
+
+	for (int i = next_instance++; i < n; i = next_instance++) {
+		for (size_t k = 0; k < queues[i].size(); k++) {
+			const int c = queues[i][k];
+
+			if (run_command(i, batch[c]) != 0)
+				statuses[c].store(-1, std::memory_order_relaxed);
+		}
+	}
+}
+
+
+// Input: index - instance to run the command on
+//        command - command to run
+// Return Value: Return 0 on success;
+//               return -1 on an unknown op or bad data, or if the ROM or
+//               state can't be loaded
+int ControlServer::run_command(const int index, const Command& command)
+{
+	GameBoy& gb = *instances[index];
+	SharedSlot* s = slot(index);
+
+	switch(command.op) {
+	case SERVER_LOAD_ROM:
+		if (command.rom)
+			gb.get_mmu().share_ROM(*command.rom);
+		else if (gb.get_mmu().load_ROM_data(command.data, command.data_size) != 0)
+			return -1;
+		gb.reset();
+		break;
+	case SERVER_RESET:
+		gb.reset();
+		break;
+	case SERVER_SET_INPUT:
+		gb.set_joypad(command.arg);
+		return 0;
+	case SERVER_STEP:
+		for (uint32_t i = 0; i < command.arg && gb.get_cpu().get_fault() == FAULT_NONE; i++)
+			gb.run_frame();
+		break;
+	case SERVER_SAVE_STATE:
+		gb.save_state(*state_area(index));
+		return 0;
+	case SERVER_LOAD_STATE:
+		if (!loaded_states[index])
+			loaded_states[index].reset(new (std::nothrow) GameBoyState);
+		if (!loaded_states[index])
+			return -1;
+		memcpy(loaded_states[index].get(), state_area(index), sizeof(GameBoyState));
+		if (gb.load_state(*loaded_states[index]) != 0)
+			return -1;
+		break;
+	case SERVER_WATCH_RAM:
+		if (command.data_size % 2 != 0 || command.data_size / 2 > SERVER_MAX_WATCH)
+			return -1;
+		memcpy(s->watch_addresses, command.data, command.data_size);
+		s->watch_count = command.data_size / 2;
+		break;
+	default:
+		return -1;
+	}
+
+	publish(index);
+	return 0;
+}
+
+
+// Input: index - instance
+// Return: None
+// Function: Copy the instance's frame, watched RAM, frame count and fault
+//           into its shared slot
+void ControlServer::publish(const int index)
+{
+	GameBoy& gb = *instances[index];
+	SharedSlot* s = slot(index);
+	const uint32_t watched = s->watch_count < SERVER_MAX_WATCH ? s->watch_count : SERVER_MAX_WATCH;
+
+	s->frame_number = gb.get_ppu().get_frame_count();
+	s->clock_cycles = gb.get_cpu().get_clock_cycles();
+	s->fault = gb.get_cpu().get_fault();
+	for (uint32_t i = 0; i < watched; i++)
+		s->ram[i] = gb.get_mmu().read(s->watch_addresses[i]);
+	memcpy(s->pixels, gb.get_ppu().get_frame().pixels, sizeof(s->pixels));
+}
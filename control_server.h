@@ -0,0 +1,125 @@
+#ifndef CONTROL_SERVER_H_
+#define CONTROL_SERVER_H_
+
+#include "gameboy.h"
+#include "server_protocol.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SERVER_MAX_CLIENTS 16
+
+
+// Hosts emulator instances for an orchestrator in another process. Batches
+// of commands come in over a Unix domain socket in the format of
+// server_protocol.h. Results go out through a POSIX shared memory region
+// that the orchestrator maps, so frames, RAM and states are never copied
+// through the socket.
+//
+// Batches from all clients are run one at a time on the serving thread and
+// a fixed pool of workers, each instance's commands on one thread. Clients
+// are read without blocking and a batch only runs once all of it has
+// arrived, so a client that stalls mid-batch holds up nobody else. A ROM
+// loaded into every instance is loaded once and its pages shared.
+class ControlServer {
+public:
+	ControlServer(const int count, const int threads);
+	~ControlServer();
+
+	int open(const char* socket_path, const char* shared_name);
+	void close();
+	int serve();
+	void stop();
+
+	int run_batch(const uint8_t* commands, const uint32_t size, const uint32_t count,
+	              ServerResult* results);
+private:
+	struct Command {
+		uint8_t op;
+		uint16_t instance;
+		uint32_t arg;
+		const uint8_t* data;
+		uint32_t data_size;
+		const MMU* rom;  // ROM already loaded for LOAD_ROM, or NULL
+	};
+
+	struct Client {
+		int fd;
+		std::vector<uint8_t> input;  // the part of a batch received so far
+	};
+
+	std::vector<GameBoy*> instances;
+	// private copy of each slot's state area for LOAD_STATE, allocated on
+	// first use, so a client writing the slot meanwhile can't change the
+	// state between load_state()'s checks and its use of it
+	std::vector<std::unique_ptr<GameBoyState> > loaded_states;
+
+	int listen_fd;  // -1 while closed
+	std::vector<Client> clients;
+	std::string socket_path;
+	std::string shared_name;
+	uint8_t* shared;  // mapped region, NULL while closed
+	size_t shared_size;
+	size_t slot_offset;
+	size_t slot_size;
+	size_t state_offset;  // within a slot
+	std::atomic<bool> stopping;
+
+	// batch in progress
+	std::vector<Command> batch;
+	std::vector<std::vector<int> > queues;  // batch commands per instance
+	std::vector<std::unique_ptr<MMU> > roms;  // loaded for LOAD_ROMs to every instance
+	std::unique_ptr<std::atomic<int32_t>[]> statuses;
+	std::atomic<int> next_instance;
+
+	// Workers wait for a new generation, then take instances until none are
+	// left, like the serving thread does.
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable start;
+	std::condition_variable finished;
+	uint64_t generation;
+	int pending;
+	bool exiting;
+
+	ControlServer(const ControlServer&) = delete;
+	ControlServer& operator=(const ControlServer&) = delete;
+
+	int serve_client(Client& client);
+	void worker_loop();
+	void run_queues();
+	int run_command(const int index, const Command& command);
+	void publish(const int index);
+	SharedSlot* slot(const int index);
+	GameBoyState* state_area(const int index);
+};
+
+
+// Input: None
+// Return: None
+// Function: Make serve() return within a poll interval; safe to call from
+//           a signal handler
+inline void ControlServer::stop()
+{
+	stopping.store(true, std::memory_order_relaxed);
+}
+
+
+inline SharedSlot* ControlServer::slot(const int index)
+{
+	return (SharedSlot*)(shared + slot_offset + index * slot_size);
+}
+
+
+inline GameBoyState* ControlServer::state_area(const int index)
+{
+	return (GameBoyState*)(shared + slot_offset + index * slot_size + state_offset);
+}
+
+#endif  // CONTROL_SERVER_H_
@@ -1,13 +1,219 @@
 #include "cpu.h"
+#include "profiler.h"
+#include "trace.h"
+#include "timer.h"
+#include "ppu.h"
+
+// Instruction length in bytes, including the opcode
+const uint8_t opcode_length[256] = {
+//  x0 x1 x2 x3 x4 x5 x6 x7 x8 x9 xA xB xC xD xE xF
+	1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,  // 0x
+	2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,  // 1x
+	2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,  // 2x
+	2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,  // 3x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 4x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 5x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 6x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 7x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 8x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 9x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // Ax
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // Bx
+	1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,  // Cx
+	1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,  // Dx
+	2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,  // Ex
+	2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1   // Fx
+};
+
+// Clock cycles per opcode. Conditional jumps, calls and returns are listed
+// with their not-taken cost. The undefined opcodes lock the cpu after the
+// fetch.
+static const uint8_t opcode_cycles[256] = {
+//  x0  x1  x2  x3  x4  x5  x6  x7  x8  x9  xA  xB  xC  xD  xE  xF
+	 4, 12,  8,  8,  4,  4,  8,  4, 20,  8,  8,  8,  4,  4,  8,  4,  // 0x
+	 4, 12,  8,  8,  4,  4,  8,  4, 12,  8,  8,  8,  4,  4,  8,  4,  // 1x
+	 8, 12,  8,  8,  4,  4,  8,  4,  8,  8,  8,  8,  4,  4,  8,  4,  // 2x
+	 8, 12,  8,  8, 12, 12, 12,  4,  8,  8,  8,  8,  4,  4,  8,  4,  // 3x
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,  // 4x
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,  // 5x
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,  // 6x
+	 8,  8,  8,  8,  8,  8,  4,  8,  4,  4,  4,  4,  4,  4,  8,  4,  // 7x
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,  // 8x
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,  // 9x
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,  // Ax
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,  // Bx
+	 8, 12, 12, 16, 12, 16,  8, 16,  8, 16, 12,  4, 12, 24,  8, 16,  // Cx
+	 8, 12, 12,  4, 12, 16,  8, 16,  8, 16, 12,  4, 12,  4,  8, 16,  // Dx
+	12, 12,  8,  4,  4, 16,  8, 16, 16,  4, 16,  4,  4,  4,  8, 16,  // Ex
+	12, 12,  8,  4,  4, 16,  8, 16, 12,  8, 16,  4,  4,  4,  8, 16   // Fx
+};
+
+
+// Input: None
+// Return: Flag and result tables for every input of the 8-bit ALU
+// Function: Evaluated by the compiler; see ALUTables in cpu.h
+static constexpr ALUTables make_alu_tables()
+{
+	ALUTables t = {};
+
+	for (int carry = 0; carry < 2; carry++) {
+		for (int a = 0; a < 256; a++) {
+			for (int val = 0; val < 256; val++) {
+				const int sum = a + val + carry;
+				const int diff = a - val - carry;
+				uint8_t flags = 0;
+
+				if ((sum & MAX_INT_8BIT) == 0)
+					flags |= Z_FLAG;
+				if ((a & 0xF) + (val & 0xF) + carry > MAX_INT_4BIT)
+					flags |= H_FLAG;
+				if (sum > MAX_INT_8BIT)
+					flags |= C_FLAG;
+				t.add_flags[carry][a][val] = flags;
+
+				flags = N_FLAG;
+				if ((diff & MAX_INT_8BIT) == 0)
+					flags |= Z_FLAG;
+				if ((a & 0xF) - (val & 0xF) - carry < 0)
+					flags |= H_FLAG;
+				if (diff < 0)
+					flags |= C_FLAG;
+				t.sub_flags[carry][a][val] = flags;
+			}
+		}
+	}
+
+	for (int val = 0; val < 256; val++) {
+		t.zero_flag[val] = (val == 0) ? Z_FLAG : 0;
+		t.inc_flags[val] = (((val + 1) & MAX_INT_8BIT) == 0 ? Z_FLAG : 0) |
+		                   ((val & 0xF) == 0xF ? H_FLAG : 0);
+		t.dec_flags[val] = N_FLAG | (val == 1 ? Z_FLAG : 0) | ((val & 0xF) == 0 ? H_FLAG : 0);
+	}
+
+	// index bits: 4 = N, 2 = H, 1 = C, as bits 6-4 of F
+	for (int nhc = 0; nhc < 8; nhc++) {
+		for (int a = 0; a < 256; a++) {
+			const bool subtract = nhc & 4;
+			const bool half_carry = nhc & 2;
+			bool carry = nhc & 1;
+			int result = a;
+
+			if (!subtract) {
+				if (carry || a > 0x99) {
+					result += 0x60;
+					carry = true;
+				}
+				if (half_carry || (a & 0xF) > 9)
+					result += 0x06;
+			} else {
+				if (carry)
+					result -= 0x60;
+				if (half_carry)
+					result -= 0x06;
+			}
+			result &= MAX_INT_8BIT;
+
+			const uint8_t flags = (result == 0 ? Z_FLAG : 0) | (subtract ? N_FLAG : 0) |
+			                      (carry ? C_FLAG : 0);
+			t.daa[nhc][a] = (result << 8) | flags;
+		}
+	}
+
+	for (int op = 0; op < 8; op++) {
+		for (int carry = 0; carry < 2; carry++) {
+			for (int val = 0; val < 256; val++) {
+				int result = 0;
+				int out = 0;  // bit shifted out
+
+				switch (op) {
+				case 0:  // RLC
+					out = val >> 7;
+					result = (val << 1) | out;
+					break;
+				case 1:  // RRC
+					out = val & 1;
+					result = (val >> 1) | (out << 7);
+					break;
+				case 2:  // RL
+					out = val >> 7;
+					result = (val << 1) | carry;
+					break;
+				case 3:  // RR
+					out = val & 1;
+					result = (val >> 1) | (carry << 7);
+					break;
+				case 4:  // SLA
+					out = val >> 7;
+					result = val << 1;
+					break;
+				case 5:  // SRA
+					out = val & 1;
+					result = (val >> 1) | (val & 0x80);
+					break;
+				case 6:  // SWAP
+					result = (val << 4) | (val >> 4);
+					break;
+				case 7:  // SRL
+					out = val & 1;
+					result = val >> 1;
+					break;
+				}
+				result &= MAX_INT_8BIT;
+
+				t.shift[op][carry][val] = (result << 8) | (result == 0 ? Z_FLAG : 0) |
+				                          (out ? C_FLAG : 0);
+			}
+		}
+	}
+
+	return t;
+}
+
+constexpr ALUTables alu_tables = make_alu_tables();
+
+// Cycles per iteration of the fused loops; the last iteration's JR isn't
+// taken and costs 4 less
+#define COPY_LOOP_CYCLES 52
+#define FILL_LOOP_CYCLES 24
+
+#define COPY_LOOP_BYTES 8
+#define FILL_LOOP_BYTES 4
+
+// LD A,(HLI); LD (DE),A; INC DE; DEC BC; LD A,B; OR C; JR NZ,-8. The test of
+// BC may also be LD A,C; OR B.
+static const uint8_t copy_loop[COPY_LOOP_BYTES] = { 0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1, 0x20, 0xF8 };
+
+
+// Return: Whether any of the size bytes from addr is in VRAM or OAM, which
+//         the LCD reads as it draws each line
+static bool in_video_memory(const int addr, const int size)
+{
+	return (addr < 0xA000 && addr + size > 0x8000) || (addr < 0xFEA0 && addr + size > 0xFE00);
+}
+
 
 #define debug_print(fmt, ...) \
         do { if (DEBUG) fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, \
                                 __LINE__, __func__, __VA_ARGS__); } while (0)
 
 
-CPU::CPU(MMU& mmu) : gb_mmu(mmu)
+template <class Timing>
+BasicCPU<Timing>::BasicCPU(MMU& mmu) : gb_mmu(mmu), tracer(NULL), timer(NULL), ppu(NULL)
 {
 	initialize();
+	gb_mmu.attach_clock(&clock_cycles);
+}
+
+
+// Input: mmu - fork of the parent's MMU
+//        parent - cpu to copy the state of
+// Function: Continue from the parent's state without initializing mmu
+template <class Timing>
+BasicCPU<Timing>::BasicCPU(MMU& mmu, const BasicCPU& parent)
+	: gb_mmu(mmu), tracer(NULL), timer(NULL), ppu(NULL)
+{
+	set_state(parent.get_state());
+	gb_mmu.attach_clock(&clock_cycles);
 }
 
 
@@ -15,7 +221,8 @@ CPU::CPU(MMU& mmu) : gb_mmu(mmu)
 // Function: Initialize all of the CPU general registers, set the PC
 //           and SP registers, clear the internal RAM, and initialize
 //           the special I/O registers in RAM
-void CPU::initialize()
+template <class Timing>
+void BasicCPU<Timing>::initialize()
 {
 	PC = 0x0100;
 	SP = 0xFFFE;
@@ -25,27 +232,81 @@ void CPU::initialize()
 	DE.highlow = 0x00D8;
 	HL.highlow = 0x014D;
 
+	clock_cycles = 0;
+
+	IME = false;
+	ime_scheduled = false;
+	halted = false;
+	stopped = false;
+	halt_bug = false;
+
+	fault = FAULT_NONE;
+	fault_address = 0;
+	fault_opcode = 0;
+
 	gb_mmu.initialize();
 }
 
 
 // Input: None
-// Return Value: 
-// Function: Execute the opcode and update the CPU state
-int CPU::execute_next_opcode()
+// Return Value: Number of clock cycles taken
+// Function: Service a pending interrupt, or execute the opcode and update
+//           the CPU state
+template <class Timing>
+int BasicCPU<Timing>::execute()
 {
-	uint8_t opcode = gb_mmu.read(PC);
+	const uint64_t start_cycles = clock_cycles;
+	const bool enable_interrupts = ime_scheduled;
+	const bool repeat_opcode = halt_bug;
+
+	// a faulted cpu stays locked up, as hardware does on an undefined opcode
+	if (fault != FAULT_NONE) {
+		clock_cycles += 4;
+		return 4;
+	}
+
+	if (handle_interrupts())
+		return (int)(clock_cycles - start_cycles);
+
+	// still asleep; GameBoy::step() normally skips ahead instead
+	if (halted || stopped) {
+		clock_cycles += 4;
+		return 4;
+	}
+
+	halt_bug = false;
+
+	const uint16_t opcode_pc = PC;
+	const uint8_t opcode = bus_read(PC);
+
+	// unusable memory and I/O registers
+	if (PC >= 0xFEA0 && PC < 0xFF80) {
+		raise_fault(FAULT_ILLEGAL_ADDRESS, opcode);
+		clock_cycles += 4;
+		return 4;
+	}
+
+	if (tracer)
+		trace(opcode);
+
+	// PC moves past the whole instruction before it executes, so jumps and
+	// calls simply overwrite it. The HALT bug fails to increment it once.
+	PC += opcode_length[opcode];
+	if (repeat_opcode)
+		PC--;
+
+	// Every opcode is charged its fixed cost here; conditional jumps, calls
+	// and returns add the extra cycles of a taken branch themselves.
+	clock_cycles += opcode_cycles[opcode];
 
 	uint8_t tmp_byte;
 	uint16_t tmp_word;
 
 	switch(opcode) {
 	case 0x00:  // NOP
-		clock_cycles += 4;
 		break;
 	case 0xC3:  // JP nn
-		JUMP((gb_mmu.read(PC + 2) << 8) | (gb_mmu.read(PC + 1)));
-		clock_cycles += 16;
+		JUMP(bus_read_word(opcode_pc + 1));
 		break;
 	case 0x87:  // ADD A, A
 		ADD_8BIT(AF.high);
@@ -69,14 +330,12 @@ int CPU::execute_next_opcode()
 		ADD_8BIT(HL.low);
 		break;
 	case 0x86:  // ADD A, (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		ADD_8BIT(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xC6:  // ADD A, #
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		ADD_8BIT(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x8F:  // ADC A, A
 		ADC_8BIT(AF.high);
@@ -100,14 +359,12 @@ int CPU::execute_next_opcode()
 		ADC_8BIT(HL.low);
 		break;
 	case 0x8E:  // ADC A, (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		ADC_8BIT(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xCE:  // ADC A, #
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		ADC_8BIT(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x97:  // SUB A
 		SUB(AF.high);
@@ -131,14 +388,12 @@ int CPU::execute_next_opcode()
 		SUB(HL.low);
 		break;
 	case 0x96:  // SUB (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		SUB(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xD6:  // SUB #
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		SUB(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x9F:  // SBC A, A
 		SBC(AF.high);
@@ -162,9 +417,8 @@ int CPU::execute_next_opcode()
 		SBC(HL.low);
 		break;
 	case 0x9E:  // SBC A, (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		SBC(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xA7:  // AND A
 		AND(AF.high);
@@ -188,14 +442,12 @@ int CPU::execute_next_opcode()
 		AND(HL.low);
 		break;
 	case 0xA6:  // AND (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		AND(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xE6:  // AND #
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		AND(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xB7:  // OR A
 		OR(AF.high);
@@ -219,14 +471,12 @@ int CPU::execute_next_opcode()
 		OR(HL.low);
 		break;
 	case 0xB6:  // OR (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		OR(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xF6:  // OR #
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		OR(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xAF:  // XOR A
 		XOR(AF.high);
@@ -250,14 +500,12 @@ int CPU::execute_next_opcode()
 		XOR(HL.low);
 		break;
 	case 0xAE:  // XOR (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		XOR(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xEE:  // XOR #
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		XOR(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xBF:  // CP A
 		CP(AF.high);
@@ -281,14 +529,12 @@ int CPU::execute_next_opcode()
 		CP(HL.low);
 		break;
 	case 0xBE:  // CP (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		CP(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xFE:  // CP #
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		CP(tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x3C:  // INC A
 		AF.high = INC_8BIT(AF.high);
@@ -312,10 +558,9 @@ int CPU::execute_next_opcode()
 		HL.low = INC_8BIT(HL.low);
 		break;
 	case 0x34:  // INC (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		tmp_byte = INC_8BIT(tmp_byte);
-		gb_mmu.write_byte(HL.highlow, tmp_byte);
-		clock_cycles += 8;
+		bus_write(HL.highlow, tmp_byte);
 		break;
 	case 0x3D:  // DEC A
 		AF.high = DEC_8BIT(AF.high);
@@ -339,40 +584,33 @@ int CPU::execute_next_opcode()
 		HL.low = DEC_8BIT(HL.low);
 		break;
 	case 0x35:  // DEC (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		tmp_byte = DEC_8BIT(tmp_byte);
-		gb_mmu.write_byte(HL.highlow, tmp_byte);
-		clock_cycles += 8;
+		bus_write(HL.highlow, tmp_byte);
 		break;
 	case 0x06:  // LD B, n
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		LD_reg_val_8BIT('B', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x0E:  // LD C, n
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		LD_reg_val_8BIT('C', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x16:  // LD D, n
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		LD_reg_val_8BIT('D', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x1E:  // LD E, n
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		LD_reg_val_8BIT('E', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x26:  // LD H, n
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		LD_reg_val_8BIT('H', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x2E:  // LD L, n
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		LD_reg_val_8BIT('L', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x7F:  // LD A, A
 		LD_reg_val_8BIT('A', AF.high);
@@ -396,9 +634,8 @@ int CPU::execute_next_opcode()
 		LD_reg_val_8BIT('A', HL.low);
 		break;
 	case 0x7E:  // LD A, (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		LD_reg_val_8BIT('A', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x40:  // LD B, B
 		LD_reg_val_8BIT('B', BC.high);
@@ -419,9 +656,8 @@ int CPU::execute_next_opcode()
 		LD_reg_val_8BIT('B', HL.low);
 		break;
 	case 0x46:  // LD B, (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		LD_reg_val_8BIT('B', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x48:  // LD C, B
 		LD_reg_val_8BIT('C', BC.high);
@@ -442,9 +678,8 @@ int CPU::execute_next_opcode()
 		LD_reg_val_8BIT('C', HL.low);
 		break;
 	case 0x4E:  // LD C, (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		LD_reg_val_8BIT('C', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x50:  // LD D, B
 		LD_reg_val_8BIT('D', BC.high);
@@ -465,9 +700,8 @@ int CPU::execute_next_opcode()
 		LD_reg_val_8BIT('D', HL.low);
 		break;
 	case 0x56:  // LD D, (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		LD_reg_val_8BIT('D', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x58:  // LD E, B
 		LD_reg_val_8BIT('E', BC.high);
@@ -488,9 +722,8 @@ int CPU::execute_next_opcode()
 		LD_reg_val_8BIT('E', HL.low);
 		break;
 	case 0x5E:  // LD E, (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		LD_reg_val_8BIT('E', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x60:  // LD H, B
 		LD_reg_val_8BIT('H', BC.high);
@@ -511,9 +744,8 @@ int CPU::execute_next_opcode()
 		LD_reg_val_8BIT('H', HL.low);
 		break;
 	case 0x66:  // LD H, (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		LD_reg_val_8BIT('H', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x68:  // LD L, B
 		LD_reg_val_8BIT('L', BC.high);
@@ -534,9 +766,8 @@ int CPU::execute_next_opcode()
 		LD_reg_val_8BIT('L', HL.low);
 		break;
 	case 0x6E:  // LD L, (HL)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		LD_reg_val_8BIT('L', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x70:  // LD (HL), B
 		LD_addr_val_8BIT(HL.highlow, BC.high);
@@ -557,30 +788,25 @@ int CPU::execute_next_opcode()
 		LD_addr_val_8BIT(HL.highlow, HL.low);
 		break;
 	case 0x36:  // LD (HL), n
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		LD_addr_val_8BIT(HL.highlow, tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x0A:  // LD A, (BC)
-		tmp_byte = gb_mmu.read(BC.highlow);
+		tmp_byte = bus_read(BC.highlow);
 		LD_reg_val_8BIT('A', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x1A:  // LD A, (DE)
-		tmp_byte = gb_mmu.read(DE.highlow);
+		tmp_byte = bus_read(DE.highlow);
 		LD_reg_val_8BIT('A', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xFA:  // LD A, nn
-		tmp_word = (gb_mmu.read(PC + 2) << 8) | gb_mmu.read(PC + 1);
-		tmp_byte = gb_mmu.read(tmp_word);
+		tmp_word = bus_read_word(opcode_pc + 1);
+		tmp_byte = bus_read(tmp_word);
 		LD_reg_val_8BIT('A', tmp_byte);
-		clock_cycles += 12;
 		break;
 	case 0x3E:  // LD A, #
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		LD_reg_val_8BIT('A', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0x47:  // LD B, A
 		LD_reg_val_8BIT('B', AF.high);
@@ -610,80 +836,69 @@ int CPU::execute_next_opcode()
 		LD_addr_val_8BIT(HL.highlow, AF.high);
 		break;
 	case 0xEA:  // LD (nn), A
-		tmp_word = (gb_mmu.read(PC + 2) << 8) | gb_mmu.read(PC + 1);
+		tmp_word = bus_read_word(opcode_pc + 1);
 		LD_addr_val_8BIT(tmp_word, AF.high);
-		clock_cycles += 8;
 		break;
 	case 0xF2:  // LD A, (C)
-		tmp_byte = gb_mmu.read(0xFF00 + BC.low);
+		tmp_byte = bus_read(0xFF00 + BC.low);
 		LD_reg_val_8BIT('A', tmp_byte);
-		clock_cycles += 4;
 		break;
 	case 0xE2:  // LD (C), A
 		tmp_word = 0xFF00 + BC.low;
 		LD_addr_val_8BIT(tmp_word, AF.high);
 		break;
 	case 0x3A:  // LD A, (HLD)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		LD_reg_val_8BIT('A', tmp_byte);
 		HL.highlow--;
-		clock_cycles += 4;
 		break;
 	case 0x32:  // LD (HLD), A
 		LD_addr_val_8BIT(HL.highlow, AF.high);
 		HL.highlow--;
 		break;
 	case 0x2A:  // LD A, (HLI)
-		tmp_byte = gb_mmu.read(HL.highlow);
+		tmp_byte = bus_read(HL.highlow);
 		LD_reg_val_8BIT('A', tmp_byte);
 		HL.highlow++;
-		clock_cycles += 4;
 		break;
 	case 0x22:  // LD (HLI), A
 		LD_addr_val_8BIT(HL.highlow, AF.high);
 		HL.highlow++;
 		break;
 	case 0xE0:  // LDH (n), A
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		LD_addr_val_8BIT(0xFF00 + tmp_byte, AF.high);
-		clock_cycles += 4;
 		break;
 	case 0xF0:  // LDH A, (n)
-		tmp_byte = gb_mmu.read(PC + 1);
-		LD_reg_val_8BIT('A', 0xFF00 + tmp_byte);
-		clock_cycles += 8;
+		tmp_byte = bus_read(0xFF00 + bus_read(opcode_pc + 1));
+		LD_reg_val_8BIT('A', tmp_byte);
 		break;
 	case 0x01:  // LD BC, nn
-		tmp_word = (gb_mmu.read(PC + 2) << 8) | gb_mmu.read(PC + 1);
+		tmp_word = bus_read_word(opcode_pc + 1);
 		LD_reg_val_16BIT("BC", tmp_word);
-		clock_cycles += 4;
 		break;
 	case 0x11:  // LD DE, nn
-		tmp_word = (gb_mmu.read(PC + 2) << 8) | gb_mmu.read(PC + 1);
+		tmp_word = bus_read_word(opcode_pc + 1);
 		LD_reg_val_16BIT("DE", tmp_word);
-		clock_cycles += 4;
 		break;
 	case 0x21:  // LD HL, nn
-		tmp_word = (gb_mmu.read(PC + 2) << 8) | gb_mmu.read(PC + 1);
+		tmp_word = bus_read_word(opcode_pc + 1);
 		LD_reg_val_16BIT("HL", tmp_word);
-		clock_cycles += 4;
 		break;
 	case 0x31:  // LD SP, nn
-		tmp_word = (gb_mmu.read(PC + 2) << 8) | gb_mmu.read(PC + 1);
+		tmp_word = bus_read_word(opcode_pc + 1);
 		LD_reg_val_16BIT("SP", tmp_word);
-		clock_cycles += 4;
 		break;
 	case 0xF9:  // LD SP, HL
 		LD_reg_val_16BIT("SP", HL.highlow);
 		break;
 	case 0xF8:  // LD HL, SP+n
-		tmp_byte = gb_mmu.read(PC + 1);
+		tmp_byte = bus_read(opcode_pc + 1);
 		LDHL_SP_n(tmp_byte);
 		break;
 	case 0x08:  // LD (nn), SP
-		tmp_word = (gb_mmu.read(PC + 2) << 8) | gb_mmu.read(PC + 1);
+		tmp_word = bus_read_word(opcode_pc + 1);
 		LD_addr_val_16BIT(tmp_word, SP);
-		clock_cycles += 8;
 		break;
 	case 0xF5:  // PUSH AF
 		PUSH_nn("AF");
@@ -709,59 +924,687 @@ int CPU::execute_next_opcode()
 	case 0xE1:  // POP HL
 		POP_nn("HL");
 		break;
+	case 0x76:  // HALT
+		// With IME off and an interrupt already pending the cpu doesn't halt,
+		// and fails to advance PC past the next opcode.
+		if (!IME && (gb_mmu.read(0xFFFF) & gb_mmu.read(0xFF0F) & 0x1F))
+			halt_bug = true;
+		else
+			halted = true;
+		break;
+	case 0x10:  // STOP
+		stopped = true;
+		gb_mmu.write_byte(0xFF04, 0);  // DIV is reset
+		break;
+	case 0xF3:  // DI
+		IME = false;
+		ime_scheduled = false;
+		break;
+	case 0xFB:  // EI
+		ime_scheduled = true;
+		break;
+	case 0xD9:  // RETI
+		PC = pop_word();
+		IME = true;
+		break;
+	case 0x18:  // JR n
+		JUMP(PC + (int8_t)bus_read(opcode_pc + 1));
+		break;
+	case 0x20:  // JR NZ, n
+	case 0x28:  // JR Z, n
+	case 0x30:  // JR NC, n
+	case 0x38:  // JR C, n
+		tmp_byte = bus_read(opcode_pc + 1);
+		if (condition(opcode)) {
+			JUMP(PC + (int8_t)tmp_byte);
+			clock_cycles += 4;
+		}
+		break;
+	case 0xC2:  // JP NZ, nn
+	case 0xCA:  // JP Z, nn
+	case 0xD2:  // JP NC, nn
+	case 0xDA:  // JP C, nn
+		tmp_word = bus_read_word(opcode_pc + 1);
+		if (condition(opcode)) {
+			JUMP(tmp_word);
+			clock_cycles += 4;
+		}
+		break;
+	case 0xE9:  // JP (HL)
+		JUMP(HL.highlow);
+		break;
+	case 0xCD:  // CALL nn
+		tmp_word = bus_read_word(opcode_pc + 1);
+		CALL(tmp_word);
+		break;
+	case 0xC4:  // CALL NZ, nn
+	case 0xCC:  // CALL Z, nn
+	case 0xD4:  // CALL NC, nn
+	case 0xDC:  // CALL C, nn
+		tmp_word = bus_read_word(opcode_pc + 1);
+		if (condition(opcode)) {
+			CALL(tmp_word);
+			clock_cycles += 12;
+		}
+		break;
+	case 0xC9:  // RET
+		PC = pop_word();
+		break;
+	case 0xC0:  // RET NZ
+	case 0xC8:  // RET Z
+	case 0xD0:  // RET NC
+	case 0xD8:  // RET C
+		bus_idle();  // the condition is checked
+		if (condition(opcode)) {
+			PC = pop_word();
+			clock_cycles += 12;
+		}
+		break;
+	case 0xC7:  // RST 00H
+	case 0xCF:  // RST 08H
+	case 0xD7:  // RST 10H
+	case 0xDF:  // RST 18H
+	case 0xE7:  // RST 20H
+	case 0xEF:  // RST 28H
+	case 0xF7:  // RST 30H
+	case 0xFF:  // RST 38H
+		CALL(opcode & 0x38);
+		break;
+	case 0x03:  // INC BC
+		BC.highlow++;
+		break;
+	case 0x13:  // INC DE
+		DE.highlow++;
+		break;
+	case 0x23:  // INC HL
+		HL.highlow++;
+		break;
+	case 0x33:  // INC SP
+		SP++;
+		break;
+	case 0x0B:  // DEC BC
+		BC.highlow--;
+		break;
+	case 0x1B:  // DEC DE
+		DE.highlow--;
+		break;
+	case 0x2B:  // DEC HL
+		HL.highlow--;
+		break;
+	case 0x3B:  // DEC SP
+		SP--;
+		break;
+	case 0x09:  // ADD HL, BC
+		ADD_HL(BC.highlow);
+		break;
+	case 0x19:  // ADD HL, DE
+		ADD_HL(DE.highlow);
+		break;
+	case 0x29:  // ADD HL, HL
+		ADD_HL(HL.highlow);
+		break;
+	case 0x39:  // ADD HL, SP
+		ADD_HL(SP);
+		break;
+	case 0xE8:  // ADD SP, n
+		tmp_byte = bus_read(opcode_pc + 1);
+		SP = SP_plus_n(tmp_byte);
+		break;
+	case 0xDE:  // SBC A, #
+		tmp_byte = bus_read(opcode_pc + 1);
+		SBC(tmp_byte);
+		break;
+	case 0x07:  // RLCA
+	case 0x0F:  // RRCA
+	case 0x17:  // RLA
+	case 0x1F:  // RRA
+		AF.high = SHIFT(opcode >> 3, AF.high);
+		AF.low &= C_FLAG;  // unlike the CB rotates, Z is always cleared
+		break;
+	case 0x27:  // DAA
+		DAA();
+		break;
+	case 0x2F:  // CPL
+		AF.high = ~AF.high;
+		AF.low |= N_FLAG | H_FLAG;
+		break;
+	case 0x37:  // SCF
+		AF.low = (AF.low & Z_FLAG) | C_FLAG;
+		break;
+	case 0x3F:  // CCF
+		AF.low = (AF.low & (Z_FLAG | C_FLAG)) ^ C_FLAG;
+		break;
+	case 0xCB:  // prefix
+		execute_CB(bus_read(opcode_pc + 1));
+		break;
 	default:
-		printf("Unknown opcode: 0x%02X\n", opcode);
-		cpu_dump();
+		PC = opcode_pc;
+		raise_fault(FAULT_UNKNOWN_OPCODE, opcode);
+	}
+
+	if (enable_interrupts && ime_scheduled) {
+		IME = true;
+		ime_scheduled = false;
+	}
+
+	const int cycles = (int)(clock_cycles - start_cycles);
+
+	if (Profiler::is_enabled())
+		Profiler::record(opcode_pc, (opcode == 0xCB) ? 0x100 | gb_mmu.read(opcode_pc + 1) : opcode,
+		                 cycles);
+
+	return cycles;
+}
+
+
+// Input: max_cycles - cycles that may pass before an interrupt could be
+//                     raised
+//        render_cycles - cycles before the LCD next reads VRAM and OAM;
+//                        loops writing to them stop by then
+// Return: Clock cycles taken, or 0 if nothing was run
+// Function: Run whole iterations of the copy or fill loop at PC as a single
+//           bulk operation, leaving the registers, flags, memory and clock
+//           exactly as executing them one by one would. Loops that would
+//           touch I/O, ROM or their own code are left to execute().
+template <class Timing>
+int BasicCPU<Timing>::execute_fused(const int max_cycles, const int render_cycles)
+{
+	switch(match_fused_loop()) {
+	case FUSED_COPY:
+		return run_copy_loop(max_cycles, render_cycles);
+	case FUSED_FILL:
+		return run_fill_loop(max_cycles, render_cycles);
+	default:
+		return 0;
+	}
+}
+
+
+// Return: Kind of loop at PC, or FUSED_NONE if there is none or the next
+//         instruction has to run on its own: while tracing or profiling,
+//         around interrupts and HALT, and when devices are clocked per access
+template <class Timing>
+FusedLoop BasicCPU<Timing>::match_fused_loop() const
+{
+	if (Timing::per_access || tracer || Profiler::is_enabled() || fault != FAULT_NONE ||
+	    halted || stopped || halt_bug || ime_scheduled)
+		return FUSED_NONE;
+
+	FusedLoop loop = FUSED_NONE;
+	const uint8_t opcode = gb_mmu.read(PC);
+
+	if (opcode == copy_loop[0]) {
+		const bool swapped = gb_mmu.read(PC + 4) == 0x79 && gb_mmu.read(PC + 5) == 0xB0;
+
+		for (int i = 1; i < COPY_LOOP_BYTES; i++)
+			if (gb_mmu.read(PC + i) != copy_loop[i] && !(swapped && (i == 4 || i == 5)))
+				return FUSED_NONE;
+		loop = FUSED_COPY;
+	} else if (opcode == 0x22 || opcode == 0x32) {
+		const uint8_t dec = gb_mmu.read(PC + 1);
+
+		// DEC B, C, D or E
+		if ((dec & 0xC7) != 0x05 || dec > 0x1D || gb_mmu.read(PC + 2) != 0x20 ||
+		    gb_mmu.read(PC + 3) != (uint8_t)-FILL_LOOP_BYTES)
+			return FUSED_NONE;
+		loop = FUSED_FILL;
+	}
+
+	// an interrupt is dispatched before the next instruction
+	if (loop != FUSED_NONE && interrupt_due())
+		return FUSED_NONE;
+
+	return loop;
+}
+
+
+// Input: max_cycles - cycles the iterations may take
+//        render_cycles - cycles they may take if they write VRAM or OAM
+// Return: Clock cycles taken, or 0 if fewer than two iterations could run
+// Function: Copy the bytes of as many iterations of the copy loop at PC as
+//           fit, then update HL, DE, BC, A and F to match
+template <class Timing>
+int BasicCPU<Timing>::run_copy_loop(const int max_cycles, const int render_cycles)
+{
+	const uint16_t src = HL.highlow;
+	const uint16_t dst = DE.highlow;
+	const int remaining = BC.highlow ? BC.highlow : 0x10000;
+	int count = max_cycles / COPY_LOOP_CYCLES;
+
+	if (remaining < count)
+		count = remaining;
+
+	// only RAM and VRAM below the I/O registers are written
+	if (dst < 0x8000)
+		return 0;
+	if (0xFF00 - dst < count)
+		count = 0xFF00 - dst;
+	if (0xFF00 - src < count)
+		count = 0xFF00 - src;
+
+	// stop before the copy reads its own output or overwrites the loop
+	if (src < dst && dst - src < count)
+		count = dst - src;
+	if (dst <= PC && PC - dst < count)
+		count = PC - dst;
+	else if (dst > PC && dst < PC + COPY_LOOP_BYTES)
+		return 0;
+
+	if (in_video_memory(dst, count) && render_cycles / COPY_LOOP_CYCLES < count)
+		count = render_cycles / COPY_LOOP_CYCLES;
+
+	if (count < 2)
+		return 0;
+
+	gb_mmu.copy(dst, src, count);
+	HL.highlow += count;
+	DE.highlow += count;
+	BC.highlow -= count;
+	AF.high = BC.high | BC.low;
+	AF.low = alu_tables.zero_flag[AF.high];
+
+	int cycles = count * COPY_LOOP_CYCLES;
+	if (count == remaining) {
+		PC += COPY_LOOP_BYTES;
+		cycles -= 4;
+	}
+
+	clock_cycles += cycles;
+	return cycles;
+}
+
+
+// Input: max_cycles - cycles the iterations may take
+//        render_cycles - cycles they may take if they write VRAM or OAM
+// Return: Clock cycles taken, or 0 if fewer than two iterations could run
+// Function: Store A in the bytes of as many iterations of the fill loop at
+//           PC as fit, then update HL, the counter and F to match
+template <class Timing>
+int BasicCPU<Timing>::run_fill_loop(const int max_cycles, const int render_cycles)
+{
+	const bool down = gb_mmu.read(PC) == 0x32;  // LD (HLD),A
+	const int counter = gb_mmu.read(PC + 1) >> 3;
+	const uint8_t value = read_register(counter);
+	const int remaining = value ? value : 0x100;
+	const uint16_t addr = HL.highlow;
+	int count = max_cycles / FILL_LOOP_CYCLES;
+
+	if (remaining < count)
+		count = remaining;
+
+	// only RAM and VRAM below the I/O registers are written, and not the loop
+	if (addr < 0x8000 || addr >= 0xFF00)
+		return 0;
+
+	if (!down) {
+		if (0xFF00 - addr < count)
+			count = 0xFF00 - addr;
+		if (addr <= PC && PC - addr < count)
+			count = PC - addr;
+		else if (addr > PC && addr < PC + FILL_LOOP_BYTES)
+			return 0;
+	} else {
+		if (addr - 0x7FFF < count)
+			count = addr - 0x7FFF;
+		if (addr >= PC + FILL_LOOP_BYTES && addr - (PC + FILL_LOOP_BYTES - 1) < count)
+			count = addr - (PC + FILL_LOOP_BYTES - 1);
+		else if (addr >= PC && addr < PC + FILL_LOOP_BYTES)
+			return 0;
+	}
+
+	if (in_video_memory(down ? addr - count + 1 : addr, count) &&
+	    render_cycles / FILL_LOOP_CYCLES < count)
+		count = render_cycles / FILL_LOOP_CYCLES;
+
+	if (count < 2)
+		return 0;
+
+	if (!down) {
+		gb_mmu.fill(addr, AF.high, count);
+		HL.highlow += count;
+	} else {
+		gb_mmu.fill(addr - count + 1, AF.high, count);
+		HL.highlow -= count;
+	}
+
+	// flags of the last DEC
+	write_register(counter, value - count);
+	AF.low = (AF.low & C_FLAG) | alu_tables.dec_flags[(uint8_t)(value - count + 1)];
+
+	int cycles = count * FILL_LOOP_CYCLES;
+	if (count == remaining) {
+		PC += FILL_LOOP_BYTES;
+		cycles -= 4;
+	}
+
+	clock_cycles += cycles;
+	return cycles;
+}
+
+
+// Input: tracer - recorder for every executed instruction, or NULL
+// Return: None
+template <class Timing>
+void BasicCPU<Timing>::attach_tracer(TraceRecorder* tracer)
+{
+	this->tracer = tracer;
+}
+
+
+// Input: timer, ppu - devices to clock on every memory access under
+//                     AccurateTiming, or NULL; FastTiming leaves them to
+//                     the caller
+// Return: None
+template <class Timing>
+void BasicCPU<Timing>::attach_devices(Timer* timer, PPU* ppu)
+{
+	this->timer = timer;
+	this->ppu = ppu;
+}
+
+
+// Input: cycles - clock cycles of the current instruction that have passed
+// Return: None
+template <class Timing>
+void BasicCPU<Timing>::tick_devices(const int cycles)
+{
+	if (timer)
+		timer->tick(cycles);
+	if (ppu)
+		ppu->tick(cycles);
+}
+
+
+// Input: code - kind of fault
+//        opcode - opcode at PC
+// Return: None
+// Function: Lock the cpu up at the current instruction. The fault is
+//           reported through get_fault()/get_state() so callers on any
+//           thread can inspect it without the emulator blocking.
+template <class Timing>
+void BasicCPU<Timing>::raise_fault(const CPUFault code, const uint8_t opcode)
+{
+	fault = code;
+	fault_address = PC;
+	fault_opcode = opcode;
+}
+
+
+// Return: Registers, flags, interrupt and fault state, and clock
+template <class Timing>
+CPUState BasicCPU<Timing>::get_state() const
+{
+	CPUState state;
+
+	state.regs = get_registers();
+	state.zero = (AF.low & Z_FLAG) != 0;
+	state.subtract = (AF.low & N_FLAG) != 0;
+	state.half_carry = (AF.low & H_FLAG) != 0;
+	state.carry = (AF.low & C_FLAG) != 0;
+	state.IME = IME;
+	state.ime_scheduled = ime_scheduled;
+	state.halted = halted;
+	state.stopped = stopped;
+	state.halt_bug = halt_bug;
+	state.fault = fault;
+	state.fault_address = fault_address;
+	state.fault_opcode = fault_opcode;
+	state.clock = clock_cycles;
+	return state;
+}
+
+
+// Input: state - state saved by get_state()
+// Return: None
+// Function: Restore the registers, interrupt, sleep and fault state and the
+//           clock. The flag fields are ignored; they are part of AF.
+template <class Timing>
+void BasicCPU<Timing>::set_state(const CPUState& state)
+{
+	set_registers(state.regs);
+	IME = state.IME;
+	ime_scheduled = state.ime_scheduled;
+	halted = state.halted;
+	stopped = state.stopped;
+	halt_bug = state.halt_bug;
+	fault = state.fault;
+	fault_address = state.fault_address;
+	fault_opcode = state.fault_opcode;
+	clock_cycles = state.clock;
+}
+
+
+// Input: state - state from a file or another process, not yet loaded
+// Return: Whether set_state() can take it: flags are 0 or 1, and the fault
+//         is a CPUFault with no address or opcode unless one was raised
+template <class Timing>
+bool BasicCPU<Timing>::is_valid_state(const CPUState& state)
+{
+	const bool* flags[] = { &state.zero, &state.subtract, &state.half_carry, &state.carry,
+	                        &state.IME, &state.ime_scheduled, &state.halted, &state.stopped,
+	                        &state.halt_bug };
+	int fault;
+
+	for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		uint8_t byte;
+		memcpy(&byte, flags[i], 1);
+		if (byte > 1)
+			return false;
 	}
 
-	PC++;
-	return 0;
+	memcpy(&fault, &state.fault, sizeof(fault));
+	if (fault < FAULT_NONE || fault > FAULT_ILLEGAL_ADDRESS)
+		return false;
+
+	return fault != FAULT_NONE || (state.fault_address == 0 && state.fault_opcode == 0);
+}
+
+
+// Record the state before executing opcode
+template <class Timing>
+void BasicCPU<Timing>::trace(const uint8_t opcode)
+{
+	TraceEntry entry;
+
+	entry.clock = clock_cycles;
+	entry.PC = PC;
+	entry.AF = AF.highlow;
+	entry.BC = BC.highlow;
+	entry.DE = DE.highlow;
+	entry.HL = HL.highlow;
+	entry.SP = SP;
+	entry.opcode = opcode;
+	entry.operand = gb_mmu.read(PC + 1);
+	tracer->record(entry);
+}
+
+
+// Input: None
+// Return Value: true if an interrupt was dispatched
+// Function: Wake the cpu from HALT/STOP when an interrupt is pending and, if
+//           IME is set, jump to the vector of the highest priority one
+template <class Timing>
+bool BasicCPU<Timing>::handle_interrupts()
+{
+	const uint8_t requested = gb_mmu.read(0xFF0F);
+	const uint8_t pending = gb_mmu.read(0xFFFF) & requested & 0x1F;
+
+	if (stopped) {
+		if (!(requested & INT_JOYPAD))
+			return false;
+		stopped = false;
+	}
+
+	if (!pending)
+		return false;
+
+	// any enabled interrupt ends HALT, even with IME off
+	halted = false;
+
+	if (!IME)
+		return false;
+
+	int bit = 0;
+	while (!(pending & (1 << bit)))
+		bit++;
+
+	IME = false;
+	gb_mmu.write_byte(0xFF0F, requested & ~(1 << bit));
+	bus_idle();  // two wait states, the second in push_word()
+	push_word(PC);
+	PC = 0x0040 + bit * 8;
+	clock_cycles += 20;
+
+	return true;
 }
 
 
 // Input: None
 // Return Value: None
 // Function: Dump the state of all the cpu registers
-void CPU::cpu_dump()
+template <class Timing>
+void BasicCPU<Timing>::cpu_dump()
 {
+	static const char* fault_names[] = { "none", "unknown opcode", "illegal address" };
+
 	printf("PC: 0x%04X\n", PC);
 	printf("SP: 0x%04X\n", SP);
 	printf("AF: 0x%04X\n", AF.highlow);
 	printf("BC: 0x%04X\n", BC.highlow);
 	printf("DE: 0x%04X\n", DE.highlow);
 	printf("HL: 0x%04X\n", HL.highlow);
-	getchar();
+	if (fault != FAULT_NONE)
+		printf("fault: %s, opcode 0x%02X at 0x%04X\n", fault_names[fault], fault_opcode,
+		       fault_address);
 }
 
 
 // ****** GameBoy Opcode Instructions ******
 
+// Return: Register r in the order of the opcode encodings
+//         (B, C, D, E, H, L, (HL), A)
+template <class Timing>
+uint8_t BasicCPU<Timing>::read_register(const int r)
+{
+	switch(r) {
+	case 0:
+		return BC.high;
+	case 1:
+		return BC.low;
+	case 2:
+		return DE.high;
+	case 3:
+		return DE.low;
+	case 4:
+		return HL.high;
+	case 5:
+		return HL.low;
+	case 6:
+		return bus_read(HL.highlow);
+	default:
+		return AF.high;
+	}
+}
+
+
+// Store val in register r, numbered as for read_register()
+template <class Timing>
+void BasicCPU<Timing>::write_register(const int r, const uint8_t val)
+{
+	switch(r) {
+	case 0:
+		BC.high = val;
+		break;
+	case 1:
+		BC.low = val;
+		break;
+	case 2:
+		DE.high = val;
+		break;
+	case 3:
+		DE.low = val;
+		break;
+	case 4:
+		HL.high = val;
+		break;
+	case 5:
+		HL.low = val;
+		break;
+	case 6:
+		bus_write(HL.highlow, val);
+		break;
+	default:
+		AF.high = val;
+	}
+}
+
+
+// Input: op - opcode following the 0xCB prefix
+// Function: Rotate, shift, test, reset or set a bit of a register or (HL).
+//           The prefix was charged 4 cycles; the rest is added here.
+template <class Timing>
+void BasicCPU<Timing>::execute_CB(const uint8_t op)
+{
+	const int r = op & 7;
+	const int b = (op >> 3) & 7;
+	const uint8_t val = read_register(r);
+
+	switch(op >> 6) {
+	case 0:  // RLC RRC RL RR SLA SRA SWAP SRL
+		write_register(r, SHIFT(b, val));
+		break;
+	case 1:  // BIT b, r
+		BIT(b, val);
+		break;
+	case 2:  // RES b, r
+		write_register(r, val & ~(1 << b));
+		break;
+	case 3:  // SET b, r
+		write_register(r, val | (1 << b));
+		break;
+	}
+
+	if (r != 6)
+		clock_cycles += 4;
+	else if ((op >> 6) == 1)
+		clock_cycles += 8;
+	else
+		clock_cycles += 12;
+}
+
 // Load 8-bit val into the specified register
-void CPU::LD_reg_val_8BIT(const char reg, const uint8_t val)
+template <class Timing>
+void BasicCPU<Timing>::LD_reg_val_8BIT(const char reg, const uint8_t val)
 {
 	switch(reg) {
 	case 'A':
 		AF.high = val;
+		break;
 	case 'B':
 		BC.high = val;
+		break;
 	case 'C':
 		BC.low = val;
+		break;
 	case 'D':
 		DE.high = val;
+		break;
 	case 'E':
 		DE.low = val;
+		break;
 	case 'H':
 		HL.high = val;
+		break;
 	case 'L':
 		HL.low = val;
+		break;
 	}
-
-	clock_cycles += 4;
 }
 
 
 // Load 16-bit val into the specified register
-void CPU::LD_reg_val_16BIT(const std::string reg, const uint16_t val)
+template <class Timing>
+void BasicCPU<Timing>::LD_reg_val_16BIT(const std::string reg, const uint16_t val)
 {
 	if (reg == "BC")
 		BC.highlow = val;
@@ -771,13 +1614,12 @@ void CPU::LD_reg_val_16BIT(const std::string reg, const uint16_t val)
 		HL.highlow = val;
 	else if (reg == "SP")
 		SP = val;
-
-	clock_cycles += 8;
 }
 
 
 // Push 16-bit register onto stack. Decrement SP twice
-void CPU::PUSH_nn(const std::string reg)
+template <class Timing>
+void BasicCPU<Timing>::PUSH_nn(const std::string reg)
 {
 	cpu_register val;
 
@@ -790,21 +1632,44 @@ void CPU::PUSH_nn(const std::string reg)
 	else
 		val = HL;
 
-	gb_mmu.write_byte((SP - 1), val.high);
-	gb_mmu.write_byte((SP - 2), val.low);
+	bus_idle();  // SP is decremented first
+	bus_write((SP - 1), val.high);
+	bus_write((SP - 2), val.low);
 
 	SP -= 2;
-	clock_cycles += 16;
+}
+
+
+// Push 16-bit val onto stack. Decrement SP twice
+template <class Timing>
+void BasicCPU<Timing>::push_word(const uint16_t val)
+{
+	bus_idle();  // SP is decremented first
+	bus_write((SP - 1), val >> 8);
+	bus_write((SP - 2), val & 0xFF);
+	SP -= 2;
+}
+
+
+// Pop 16-bit value off stack. Increment SP twice
+template <class Timing>
+uint16_t BasicCPU<Timing>::pop_word()
+{
+	uint16_t val = bus_read_word(SP);
+
+	SP += 2;
+	return val;
 }
 
 
 // Pop 16-bit value off stack into the specified 16-bit register
-void CPU::POP_nn(const std::string reg)
+template <class Timing>
+void BasicCPU<Timing>::POP_nn(const std::string reg)
 {
-	uint16_t tmp_word = (gb_mmu.read(SP + 1) << 8) | gb_mmu.read(SP);
+	uint16_t tmp_word = bus_read_word(SP);
 
 	if (reg == "AF")
-		AF.highlow = tmp_word;
+		AF.highlow = tmp_word & 0xFFF0;  // the low nibble of F is always 0
 	else if (reg == "BC")
 		BC.highlow = tmp_word;
 	else if (reg == "DE")
@@ -813,5 +1678,8 @@ void CPU::POP_nn(const std::string reg)
 		HL.highlow = tmp_word;
 
 	SP += 2;
-	clock_cycles += 12;
 }
+
+
+template class BasicCPU<FastTiming>;
+template class BasicCPU<AccurateTiming>;
@@ -16,12 +16,113 @@
 #define N_FLAG 0x40  // subtract flag
 #define Z_FLAG 0x80  // zero flag
 
+// Flags, and results where they take more than an add, for every input of
+// the 8-bit ALU, so an operation is a table load instead of flag branches.
+// Built at compile time by make_alu_tables() in cpu.cpp.
+struct ALUTables {
+	uint8_t add_flags[2][256][256];  // [carry][A][val] flags of A + val + carry
+	uint8_t sub_flags[2][256][256];  // [carry][A][val] flags of A - val - carry
+	uint8_t inc_flags[256];          // [val] Z and H of val + 1
+	uint8_t dec_flags[256];          // [val] Z, N and H of val - 1
+	uint8_t zero_flag[256];          // [val] Z_FLAG if val is 0
+	uint16_t daa[8][256];            // [N H C flags][A] result << 8 | flags
+	uint16_t shift[8][2][256];       // [CB op >> 3][carry][val] result << 8 | flags
+};
+
+extern const ALUTables alu_tables;
+
+extern const uint8_t opcode_length[256];  // bytes, including the opcode
+
+class TraceRecorder;
+class Timer;
+class PPU;
+
+
+struct CPURegisters {
+	uint16_t AF;
+	uint16_t BC;
+	uint16_t DE;
+	uint16_t HL;
+	uint16_t SP;
+	uint16_t PC;
+};
+
+enum CPUFault {
+	FAULT_NONE,
+	FAULT_UNKNOWN_OPCODE,   // undefined or unimplemented opcode
+	FAULT_ILLEGAL_ADDRESS   // execution reached memory that can't hold code
+};
+
+// Everything a debugger or batch runner needs to know about the cpu
+struct CPUState {
+	CPURegisters regs;
+	bool zero;
+	bool subtract;
+	bool half_carry;
+	bool carry;
+	bool IME;
+	bool ime_scheduled;  // EI is waiting for the next instruction
+	bool halted;
+	bool stopped;
+	bool halt_bug;
+	CPUFault fault;
+	uint16_t fault_address;  // PC of the faulting instruction
+	uint8_t fault_opcode;
+	uint64_t clock;
+};
+
+// Loops BasicCPU::execute_fused() runs as one bulk memory operation
+enum FusedLoop {
+	FUSED_NONE,
+	FUSED_COPY,  // LD A,(HLI); LD (DE),A; INC DE; DEC BC; LD A,B; OR C; JR NZ
+	FUSED_FILL   // LD (HLI),A or LD (HLD),A; DEC r; JR NZ
+};
+
 
-class CPU {
+// Accuracy policies for BasicCPU, picked when the emulator is built; CPU is
+// the one selected by ACCURATE_TIMING.
+//
+// FastTiming charges an instruction its whole cost at once and the timer
+// and LCD catch up after it, so a read of DIV, LY or STAT sees them as they
+// were when the instruction started. Frame-level results are unaffected.
+struct FastTiming {
+	static const bool per_access = false;
+};
+
+// AccurateTiming brings the timer and LCD up to the M-cycle of each memory
+// access before it is made, so reads and writes of their registers land on
+// the cycle they would on hardware.
+struct AccurateTiming {
+	static const bool per_access = true;
+};
+
+
+template <class Timing>
+class BasicCPU {
 public:
-	CPU(MMU& mmu);
+	// whether execute_next_opcode() clocks the timer and LCD itself
+	static const bool ticks_devices = Timing::per_access;
+
+	BasicCPU(MMU& mmu);
+	BasicCPU(MMU& mmu, const BasicCPU& parent);
 	void initialize();
 	int execute_next_opcode();
+	bool at_fused_loop() const;
+	int execute_fused(const int max_cycles, const int render_cycles);
+
+	bool is_sleeping() const;
+	bool interrupt_due() const;
+	void fast_forward(const int cycles);
+	uint64_t get_clock_cycles() const;
+	CPURegisters get_registers() const;
+	void set_registers(const CPURegisters& regs);
+	CPUState get_state() const;
+	void set_state(const CPUState& state);
+	static bool is_valid_state(const CPUState& state);
+	CPUFault get_fault() const;
+	void attach_tracer(TraceRecorder* tracer);
+	bool is_tracing() const;
+	void attach_devices(Timer* timer, PPU* ppu);
 
 	void cpu_dump();
 	
@@ -44,12 +145,47 @@ private:
 	uint16_t SP;
 	uint16_t PC;
 
-	int clock_cycles;  // 4 clock cycles = 1 machine cycle
+	uint64_t clock_cycles;  // 4 clock cycles = 1 machine cycle
+
+	bool IME;            // interrupt master enable
+	bool ime_scheduled;  // EI takes effect after the next instruction
+	bool halted;
+	bool stopped;
+	bool halt_bug;       // the next opcode byte is executed twice
+
+	CPUFault fault;      // set once the cpu has locked up
+	uint16_t fault_address;
+	uint8_t fault_opcode;
 
 	MMU& gb_mmu;
+	TraceRecorder* tracer;
+	Timer* timer;  // clocked per memory access under AccurateTiming
+	PPU* ppu;
+
+	int bus_cycles;     // cycles of the current instruction before its next access
+	int ticked_cycles;  // cycles of the current instruction the devices have seen
+
+	int execute();
+	bool handle_interrupts();
+	void raise_fault(const CPUFault code, const uint8_t opcode);
+	void trace(const uint8_t opcode);
+	void push_word(const uint16_t val);
+	uint16_t pop_word();
+
+	uint8_t bus_read(const uint16_t addr);
+	uint16_t bus_read_word(const uint16_t addr);
+	void bus_write(const uint16_t addr, const uint8_t value);
+	void bus_idle();
+	void tick_devices(const int cycles);
+
+	FusedLoop match_fused_loop() const;
+	int run_copy_loop(const int max_cycles, const int render_cycles);
+	int run_fill_loop(const int max_cycles, const int render_cycles);
 
 	// ****** GameBoy Opcode Instructions ******
 	void JUMP(const uint16_t addr);
+	uint8_t read_register(const int r);
+	void write_register(const int r, const uint8_t val);
 
 	// 8-Bit ALU
 	void ADD_8BIT(const uint8_t val);
@@ -62,6 +198,20 @@ private:
 	void CP(const uint8_t val);
 	uint8_t INC_8BIT(uint8_t val);
 	uint8_t DEC_8BIT(uint8_t val);
+	void DAA();
+
+	// Rotates, shifts and bit operations
+	uint8_t SHIFT(const int op, const uint8_t val);
+	void BIT(const int b, const uint8_t val);
+	void execute_CB(const uint8_t op);
+
+	// 16-Bit Arithmetic
+	void ADD_HL(const uint16_t val);
+	uint16_t SP_plus_n(const uint8_t val);
+
+	// Jumps, Calls and Returns
+	bool condition(const uint8_t opcode) const;
+	void CALL(const uint16_t addr);
 
 	// 8-Bit Loads
 	void LD_reg_val_8BIT(const char reg, const uint8_t val);
@@ -79,202 +229,387 @@ private:
 	// ********** End of Instructions **********
 };
 
+#ifdef ACCURATE_TIMING
+typedef BasicCPU<AccurateTiming> CPU;
+#else
+typedef BasicCPU<FastTiming> CPU;
+#endif
+
+
+// Input: None
+// Return Value: Number of clock cycles taken
+// Function: Service a pending interrupt, or execute the opcode and update
+//           the CPU state. Under AccurateTiming the timer and LCD have been
+//           clocked through the returned cycles as well.
+template <class Timing>
+inline int BasicCPU<Timing>::execute_next_opcode()
+{
+	bus_cycles = 0;
+	ticked_cycles = 0;
+
+	const int cycles = execute();
+
+	if (Timing::per_access && cycles > ticked_cycles)
+		tick_devices(cycles - ticked_cycles);
+
+	return cycles;
+}
+
+
+
+// Return: Whether the cpu is at the head of a loop execute_fused() can run
+template <class Timing>
+inline bool BasicCPU<Timing>::at_fused_loop() const
+{
+	// every fused loop starts with LD A,(HLI), LD (HLI),A or LD (HLD),A
+	const uint8_t opcode = gb_mmu.read(PC);
+
+	return !Timing::per_access && (opcode == 0x2A || opcode == 0x22 || opcode == 0x32) &&
+	       match_fused_loop() != FUSED_NONE;
+}
+
+
+// Input: None
+// Return: true while HALT or STOP is in effect and nothing would wake the
+//         cpu yet, so time can be skipped up to the next interrupt
+template <class Timing>
+inline bool BasicCPU<Timing>::is_sleeping() const
+{
+	if (stopped)
+		return !(gb_mmu.read(0xFF0F) & INT_JOYPAD);
+
+	return halted && !(gb_mmu.read(0xFFFF) & gb_mmu.read(0xFF0F) & 0x1F);
+}
+
+
+// Input: None
+// Return: true if an interrupt may be dispatched within the next two
+//         instructions: one is enabled and requested with IME set, or EI is
+//         about to set IME. Nothing may be skipped or fused past it.
+template <class Timing>
+inline bool BasicCPU<Timing>::interrupt_due() const
+{
+	return ime_scheduled || (IME && (gb_mmu.read(0xFFFF) & gb_mmu.read(0xFF0F) & 0x1F));
+}
+
+
+// Input: cycles - clock cycles to skip
+// Return: None
+// Function: Let a sleeping cpu's clock jump ahead in one step
+template <class Timing>
+inline void BasicCPU<Timing>::fast_forward(const int cycles)
+{
+	clock_cycles += cycles;
+}
+
+
+// Input: None
+// Return: Number of clock cycles executed since initialize()
+template <class Timing>
+inline uint64_t BasicCPU<Timing>::get_clock_cycles() const
+{
+	return clock_cycles;
+}
+
+
+// Return: Copy of the register file
+template <class Timing>
+inline CPURegisters BasicCPU<Timing>::get_registers() const
+{
+	CPURegisters regs;
+
+	regs.AF = AF.highlow;
+	regs.BC = BC.highlow;
+	regs.DE = DE.highlow;
+	regs.HL = HL.highlow;
+	regs.SP = SP;
+	regs.PC = PC;
+	return regs;
+}
+
+
+// Input: regs - new register file
+// Return: None
+template <class Timing>
+inline void BasicCPU<Timing>::set_registers(const CPURegisters& regs)
+{
+	AF.highlow = regs.AF & 0xFFF0;  // the low nibble of F is always 0
+	BC.highlow = regs.BC;
+	DE.highlow = regs.DE;
+	HL.highlow = regs.HL;
+	SP = regs.SP;
+	PC = regs.PC;
+}
+
+
+// Return: FAULT_NONE, or why the cpu stopped executing instructions
+template <class Timing>
+inline CPUFault BasicCPU<Timing>::get_fault() const
+{
+	return fault;
+}
+
+
+// Return: Whether a tracer is attached; every instruction must then be
+//         executed for it to be recorded
+template <class Timing>
+inline bool BasicCPU<Timing>::is_tracing() const
+{
+	return tracer != NULL;
+}
+
+
+// Input: addr - address the instruction reads
+// Return: Byte at addr
+// Function: Make the instruction's next memory access. Every access takes
+//           one M-cycle; the timer and LCD are brought up to its start
+//           under AccurateTiming.
+template <class Timing>
+inline uint8_t BasicCPU<Timing>::bus_read(const uint16_t addr)
+{
+	bus_idle();
+	return gb_mmu.read(addr);
+}
+
+
+// Input: addr - address of the low byte
+// Return: Little-endian word at addr
+// Function: Make two memory accesses, the low byte first as the hardware
+//           does, so each lands on its own M-cycle in a fixed order
+template <class Timing>
+inline uint16_t BasicCPU<Timing>::bus_read_word(const uint16_t addr)
+{
+	const uint8_t low = bus_read(addr);
+	const uint8_t high = bus_read(addr + 1);
+
+	return (high << 8) | low;
+}
+
+
+// Input: addr - address the instruction writes
+//        value - byte written
+// Return: None
+template <class Timing>
+inline void BasicCPU<Timing>::bus_write(const uint16_t addr, const uint8_t value)
+{
+	bus_idle();
+	gb_mmu.write_byte(addr, value);
+}
+
+
+// Inputs: None
+// Function: Pass one M-cycle of the instruction, for an access or an
+//           internal delay. Compiles to nothing under FastTiming.
+template <class Timing>
+inline void BasicCPU<Timing>::bus_idle()
+{
+	if (!Timing::per_access)
+		return;
+
+	if (bus_cycles > ticked_cycles) {
+		tick_devices(bus_cycles - ticked_cycles);
+		ticked_cycles = bus_cycles;
+	}
+	bus_cycles += 4;
+}
 
 
 // Jump to address designated by val.
-inline void CPU::JUMP(const uint16_t addr)
+template <class Timing>
+inline void BasicCPU<Timing>::JUMP(const uint16_t addr)
 {
 	PC = addr;
 }
 
 
 // Add val to register A.
-inline void CPU::ADD_8BIT(const uint8_t val)
+template <class Timing>
+inline void BasicCPU<Timing>::ADD_8BIT(const uint8_t val)
 {
-	// set flags
-	if (AF.high + val == 0)
-		AF.low |= Z_FLAG;
-	if ((AF.high & 0xF) > (MAX_INT_4BIT - (val & 0xF)))
-		AF.low |= H_FLAG;
-	if (AF.high > (MAX_INT_8BIT - val))
-		AF.low |= C_FLAG;
-	AF.low &= ~(N_FLAG);
-
+	AF.low = alu_tables.add_flags[0][AF.high][val];
 	AF.high += val;
-	clock_cycles += 4;
 }
 
 
 // Add val + Carry Flag to A.
-inline void CPU::ADC_8BIT(const uint8_t val)
+template <class Timing>
+inline void BasicCPU<Timing>::ADC_8BIT(const uint8_t val)
 {
-	// set flags
-	if (AF.high + val == 0)
-		AF.low |= Z_FLAG;
-	if ((AF.high & 0xF) > (MAX_INT_4BIT - (val & 0xF)))
-		AF.low |= H_FLAG;
-	if (AF.high > (MAX_INT_8BIT - val))
-		AF.low |= C_FLAG;
-	AF.low &= ~(N_FLAG);
+	const int carry = (AF.low >> 4) & 1;
 
-	AF.high = AF.high + val + ((AF.low & C_FLAG) >> 4);
-	clock_cycles += 4;
+	AF.low = alu_tables.add_flags[carry][AF.high][val];
+	AF.high += val + carry;
 }
 
 
 // Subtract val from A.
-inline void CPU::SUB(const uint8_t val)
+template <class Timing>
+inline void BasicCPU<Timing>::SUB(const uint8_t val)
 {
-	// set flags
-	if (AF.high - val == 0)
-		AF.low |= Z_FLAG;
-	if ((AF.high & 0xF) > (val & 0xF))  // Set if no borrow
-		AF.low |= H_FLAG;
-	if (AF.high > val)  // Set if no borrow
-		AF.low |= C_FLAG;
-	AF.low |= N_FLAG;
-
+	AF.low = alu_tables.sub_flags[0][AF.high][val];
 	AF.high -= val;
-	clock_cycles += 4;
 }
 
 
-// Subtract A + Carry Flag from A.
-inline void CPU::SBC(const uint8_t val)
+// Subtract val + Carry Flag from A.
+template <class Timing>
+inline void BasicCPU<Timing>::SBC(const uint8_t val)
 {
-	// set flags
-	if (AF.high - val == 0)
-		AF.low |= Z_FLAG;
-	if ((AF.high & 0xF) > (val & 0xF))  // Set if no borrow
-		AF.low |= H_FLAG;
-	if (AF.high > val)  // Set if no borrow
-		AF.low |= C_FLAG;
-	AF.low |= N_FLAG;
+	const int carry = (AF.low >> 4) & 1;
 
-	AF.high = AF.high - val - ((AF.low & C_FLAG) >> 4);
-	clock_cycles += 4;
+	AF.low = alu_tables.sub_flags[carry][AF.high][val];
+	AF.high -= val + carry;
 }
 
 
 // Logical exclusive OR register A with val.
-inline void CPU::XOR(const uint8_t val)
+template <class Timing>
+inline void BasicCPU<Timing>::XOR(const uint8_t val)
 {
-	// set flags
-	AF.low = 0;
-	if ((AF.high ^ val) == 0)
-		AF.low |= Z_FLAG;
-
 	AF.high ^= val;
-	clock_cycles += 4;
+	AF.low = alu_tables.zero_flag[AF.high];
 }
 
 
 // Logical AND register A with val.
-inline void CPU::AND(const uint8_t val)
+template <class Timing>
+inline void BasicCPU<Timing>::AND(const uint8_t val)
 {
-	// set flags
-	AF.low = 0;
-	AF.low |= H_FLAG;
-	if ((AF.high & val) == 0)
-		AF.low |= Z_FLAG;
-
 	AF.high &= val;
-	clock_cycles += 4;
+	AF.low = alu_tables.zero_flag[AF.high] | H_FLAG;
 }
 
 
 // Logical OR register A with val.
-inline void CPU::OR(const uint8_t val)
+template <class Timing>
+inline void BasicCPU<Timing>::OR(const uint8_t val)
 {
-	// set flags
-	AF.low = 0;
-	if ((AF.high | val) == 0)
-		AF.low |= Z_FLAG;
-
 	AF.high |= val;
-	clock_cycles += 4;
+	AF.low = alu_tables.zero_flag[AF.high];
 }
 
 
-// Compare register A with val.
-inline void CPU::CP(const uint8_t val)
+// Compare register A with val. Flags are set as for A - val.
+template <class Timing>
+inline void BasicCPU<Timing>::CP(const uint8_t val)
 {
-	// set flags
-	AF.low |= N_FLAG;
-	if (AF.high - val == 0)
-		AF.low |= Z_FLAG;
-	if ((AF.high & 0xF) > (val & 0xF))  // Set if no borrow
-		AF.low |= H_FLAG;
-	if (AF.high > val)  // Set if no borrow
-		AF.low |= C_FLAG;
+	AF.low = alu_tables.sub_flags[0][AF.high][val];
+}
+
 
-	clock_cycles += 4;
+// Increment val by 1. The carry flag is unaffected.
+template <class Timing>
+inline uint8_t BasicCPU<Timing>::INC_8BIT(uint8_t val)
+{
+	AF.low = (AF.low & C_FLAG) | alu_tables.inc_flags[val];
+	return val + 1;
 }
 
 
-// Increment val by 1.
-inline uint8_t CPU::INC_8BIT(uint8_t val)
+// Decrement val by 1. The carry flag is unaffected.
+template <class Timing>
+inline uint8_t BasicCPU<Timing>::DEC_8BIT(uint8_t val)
 {
-	// set flags
-	AF.low &= ~(N_FLAG);
-	if (val + 1 == 0)
-		AF.low |= Z_FLAG;
-	if (((val & 0xF) + 1) > MAX_INT_4BIT)
-		AF.low |= H_FLAG;
+	AF.low = (AF.low & C_FLAG) | alu_tables.dec_flags[val];
+	return val - 1;
+}
 
-	val++;
-	clock_cycles += 4;
 
-	return val;
+// Decimal adjust A after a BCD addition or subtraction.
+template <class Timing>
+inline void BasicCPU<Timing>::DAA()
+{
+	const uint16_t entry = alu_tables.daa[(AF.low >> 4) & 7][AF.high];
+
+	AF.high = entry >> 8;
+	AF.low = entry & 0xFF;
 }
 
 
-// Decrement val by 1.
-inline uint8_t CPU::DEC_8BIT(uint8_t val)
+// Rotate, shift or swap val with one of the CB 0x00 - 0x3F operations
+// (RLC RRC RL RR SLA SRA SWAP SRL), setting Z and C from the result.
+template <class Timing>
+inline uint8_t BasicCPU<Timing>::SHIFT(const int op, const uint8_t val)
 {
-	// set flags
-	AF.low |= N_FLAG;
-	if (val - 1 == 0)
-		AF.low |= Z_FLAG;
-	if ((val & 0xF) > 1)  // Set if no borrow
-		AF.low |= H_FLAG;
+	const uint16_t entry = alu_tables.shift[op][(AF.low >> 4) & 1][val];
+
+	AF.low = entry & 0xFF;
+	return entry >> 8;
+}
 
-	val--;
-	clock_cycles += 4;
 
-	return val;
+// Test bit b of val. The carry flag is unaffected.
+template <class Timing>
+inline void BasicCPU<Timing>::BIT(const int b, const uint8_t val)
+{
+	AF.low = (AF.low & C_FLAG) | H_FLAG | alu_tables.zero_flag[val & (1 << b)];
 }
 
 
-// Load 8-bit val into the specified 16-bit address
-inline void CPU::LD_addr_val_8BIT(const uint16_t addr, const uint8_t val)
+// Add val to HL. H and C come from bits 11 and 15; Z is unaffected.
+template <class Timing>
+inline void BasicCPU<Timing>::ADD_HL(const uint16_t val)
 {
-	gb_mmu.write_byte(addr, val);
-	clock_cycles += 8;
+	const int carry = (HL.low + (val & 0xFF)) >> 8;
+
+	AF.low = (AF.low & Z_FLAG) |
+	         (alu_tables.add_flags[carry][HL.high][val >> 8] & (H_FLAG | C_FLAG));
+	HL.highlow += val;
 }
 
 
-// Load 16-bit val into the specified 16-bit address
-inline void CPU::LD_addr_val_16BIT(const uint16_t addr, const uint16_t val)
+// Return: SP + n. n is signed; H and C come from the unsigned addition of
+//         n to the low byte of SP.
+template <class Timing>
+inline uint16_t BasicCPU<Timing>::SP_plus_n(const uint8_t val)
 {
-	gb_mmu.write_word(addr, val);
-	clock_cycles += 12;
+	AF.low = alu_tables.add_flags[0][SP & 0xFF][val] & (H_FLAG | C_FLAG);
+	return SP + (int8_t)val;
 }
 
 
-// Load (SP + n) effective address into HL
-inline void CPU::LDHL_SP_n(const uint8_t val)
+// Return: Whether the condition of a conditional jump, call or return
+//         opcode (NZ, Z, NC, C in bits 3-4) holds
+template <class Timing>
+inline bool BasicCPU<Timing>::condition(const uint8_t opcode) const
 {
-	// set flags
-	AF.low &= ~(Z_FLAG);
-	AF.low &= ~(N_FLAG);
-	if ((HL.low & 0x0F) > (MAX_INT_4BIT - (val & 0x0F)))
-		AF.low |= H_FLAG;
-	if (HL.low > (MAX_INT_8BIT - val))
-		AF.low |= C_FLAG;
+	const uint8_t flag = (opcode & 0x10) ? C_FLAG : Z_FLAG;
+
+	return ((AF.low & flag) != 0) == ((opcode & 0x08) != 0);
+}
+
 
-	HL.highlow = SP + val;
-	clock_cycles += 12;
+// Push the address of the next instruction and jump to addr.
+template <class Timing>
+inline void BasicCPU<Timing>::CALL(const uint16_t addr)
+{
+	push_word(PC);
+	PC = addr;
+}
+
+
+// Load 8-bit val into the specified 16-bit address
+template <class Timing>
+inline void BasicCPU<Timing>::LD_addr_val_8BIT(const uint16_t addr, const uint8_t val)
+{
+	bus_write(addr, val);
+}
+
+
+// Load 16-bit val into the specified 16-bit address, low byte first
+template <class Timing>
+inline void BasicCPU<Timing>::LD_addr_val_16BIT(const uint16_t addr, const uint16_t val)
+{
+	bus_write(addr, val & 0xFF);
+	bus_write(addr + 1, val >> 8);
+}
+
+
+// Load (SP + n) effective address into HL.
+template <class Timing>
+inline void BasicCPU<Timing>::LDHL_SP_n(const uint8_t val)
+{
+	HL.highlow = SP_plus_n(val);
 }
 
 #endif  // CPU_H_
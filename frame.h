@@ -0,0 +1,28 @@
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <stdint.h>
+
+#define SCREEN_WIDTH  160
+#define SCREEN_HEIGHT 144
+
+#define AUDIO_BLOCK_FRAMES 1024  // stereo frames per audio block, ~21 ms at 48 kHz
+
+
+// A finished screen. Each pixel is a 2-bit shade, 0 (white) to 3 (black),
+// after the palette has been applied.
+struct VideoFrame {
+	uint64_t frame_number;
+	uint64_t clock_cycles;  // cpu cycle the frame was finished on
+	uint8_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
+};
+
+
+// A block of interleaved left/right samples at APU_SAMPLE_RATE.
+struct AudioBlock {
+	uint64_t first_sample;  // index of the first stereo frame since reset
+	int frames;             // number of valid stereo frames in samples
+	int16_t samples[2 * AUDIO_BLOCK_FRAMES];
+};
+
+#endif  // FRAME_H_
@@ -0,0 +1,303 @@
+#include "frame_pacer.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_SECOND 1000000000LL
+#define AUDIO_FILL_SMOOTHING 0.1  // weight of each new queue fill reading
+
+static const char* const mode_names[] = { "clock", "audio" };
+
+
+// Return: CLOCK_MONOTONIC time in nanoseconds
+static int64_t now_ns()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+
+// Input: cycles - cpu clock cycles
+// Return: Their length in nanoseconds at APU_CLOCK_RATE, without overflow
+//         for any run length
+static int64_t cycles_to_ns(const uint64_t cycles)
+{
+	const uint64_t seconds = cycles / APU_CLOCK_RATE;
+	const uint64_t rest = cycles % APU_CLOCK_RATE;
+
+	return seconds * NS_PER_SECOND + rest * NS_PER_SECOND / APU_CLOCK_RATE;
+}
+
+
+// Hint to the core that it is spinning, so a sibling hyperthread gets the
+// execution units
+static inline void spin_pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+
+PacingHistogram::PacingHistogram()
+{
+	clear();
+}
+
+
+void PacingHistogram::clear()
+{
+	count = 0;
+	total_ns = 0;
+	max_ns = 0;
+	memset(buckets, 0, sizeof(buckets));
+}
+
+
+// Input: ns - duration; negative durations count as 0
+// Return: None
+void PacingHistogram::add(const int64_t ns)
+{
+	const int64_t value = ns < 0 ? 0 : ns;
+	const uint64_t us = value / 1000;
+	int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (bucket >= PACING_HISTOGRAM_BUCKETS)
+		bucket = PACING_HISTOGRAM_BUCKETS - 1;
+
+	buckets[bucket]++;
+	count++;
+	total_ns += value;
+	if (value > max_ns)
+		max_ns = value;
+}
+
+
+// Input: fraction - 0 to 1, e.g. 0.99
+// Return: Upper bound in nanoseconds of the bucket holding that fraction of
+//         the durations, no more than the longest one; 0 when empty
+int64_t PacingHistogram::percentile(const double fraction) const
+{
+	const double rank = fraction * count;
+	uint64_t seen = 0;
+
+	for (int i = 0; i < PACING_HISTOGRAM_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen && seen >= rank) {
+			const int64_t bound = (1LL << i) * 1000;
+			return bound < max_ns ? bound : max_ns;
+		}
+	}
+
+	return max_ns;
+}
+
+
+FramePacer::FramePacer()
+	: mode(PACE_CLOCK), audio_queue(NULL), audio_target(0), audio_fill(0),
+	  spin_ns(PACING_MIN_SPIN_NS)
+{
+	restart();
+	clear_stats();
+}
+
+
+// Input: queue - blocks waiting for the sound device, or NULL
+//        target_blocks - fill to hold it at in PACE_AUDIO mode; enough to
+//                        ride out the device's and the scheduler's delays
+// Return: None
+void FramePacer::set_audio_queue(const AudioRing* queue, const int target_blocks)
+{
+	audio_queue = queue;
+	audio_target = target_blocks;
+	audio_fill = target_blocks;
+}
+
+
+// Input: None
+// Return: None
+// Function: Start the schedule afresh at the next begin_frame(), after a
+//           pause, a state load or anything else that moves the clock
+void FramePacer::restart()
+{
+	started = false;
+	origin_ns = 0;
+	origin_clock = 0;
+	last_clock = 0;
+	frame_start_ns = 0;
+	last_late_ns = 0;
+}
+
+
+// Input: clock_cycles - cpu clock at the start of the frame
+// Return Value: Return 0 on success;
+//               return -1 if the loop had fallen so far behind that the
+//               schedule was restarted; the caller may want to skip drawing
+// Function: Wait until the wall clock catches up with the emulated clock.
+//           Read input after it returns.
+int FramePacer::begin_frame(const uint64_t clock_cycles)
+{
+	if (!started) {
+		started = true;
+		origin_ns = frame_start_ns = now_ns();
+		origin_clock = last_clock = clock_cycles;
+		return 0;
+	}
+
+	if (mode == PACE_AUDIO && audio_queue)
+		adjust_to_audio(cycles_to_ns(clock_cycles - last_clock));
+
+	const int64_t deadline = origin_ns + cycles_to_ns(clock_cycles - origin_clock);
+
+	wait_until(deadline);
+	frame_start_ns = now_ns();
+	last_clock = clock_cycles;
+
+	const int64_t late = frame_start_ns - deadline;
+
+	if (late > PACING_MAX_LAG_NS) {
+		origin_ns = frame_start_ns;
+		origin_clock = clock_cycles;
+		last_late_ns = 0;
+		resyncs++;
+		return -1;
+	}
+
+	jitter.add(late > last_late_ns ? late - last_late_ns : last_late_ns - late);
+	last_late_ns = late;
+	return 0;
+}
+
+
+// Input: None
+// Return: None
+// Function: Record the time from the start of the frame, when input was
+//           read, until now, when the frame has been shown
+void FramePacer::end_frame()
+{
+	if (started)
+		latency.add(now_ns() - frame_start_ns);
+}
+
+
+void FramePacer::clear_stats()
+{
+	latency.clear();
+	jitter.clear();
+	resyncs = 0;
+	total_spin_ns = 0;
+	total_wait_ns = 0;
+}
+
+
+// Input: deadline - CLOCK_MONOTONIC time in nanoseconds
+// Return: None
+// Function: Sleep until spin_ns before the deadline, then spin up to it.
+//           The margin grows at once to cover an oversleep and shrinks
+//           slowly while wake-ups are prompt.
+void FramePacer::wait_until(const int64_t deadline)
+{
+	const int64_t start = now_ns();
+	int64_t now = start;
+
+	if (deadline - now > spin_ns) {
+		const int64_t target = deadline - spin_ns;
+		timespec ts;
+
+		ts.tv_sec = target / NS_PER_SECOND;
+		ts.tv_nsec = target % NS_PER_SECOND;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+		}
+
+		now = now_ns();
+		const int64_t needed = now - target + PACING_SPIN_SLACK_NS;
+
+		if (needed > spin_ns)
+			spin_ns = needed;
+		else
+			spin_ns -= (spin_ns - needed) / 16;
+
+		if (spin_ns < PACING_MIN_SPIN_NS)
+			spin_ns = PACING_MIN_SPIN_NS;
+		if (spin_ns > PACING_MAX_SPIN_NS)
+			spin_ns = PACING_MAX_SPIN_NS;
+	}
+
+	const int64_t spin_start = now;
+
+	while (now < deadline) {
+		spin_pause();
+		now = now_ns();
+	}
+
+	total_spin_ns += now - spin_start;
+	total_wait_ns += now - start;
+}
+
+
+// Input: frame_ns - emulated length of the frame just run
+// Return: None
+// Function: Move the origin so the emulated clock runs up to
+//           PACING_MAX_SKEW slow while the audio queue is fuller than the
+//           target, and as much fast while it is emptier. The fill moves a
+//           whole block at a time, so it is smoothed first.
+void FramePacer::adjust_to_audio(const int64_t frame_ns)
+{
+	audio_fill += (audio_queue->size() - audio_fill) * AUDIO_FILL_SMOOTHING;
+
+	double deviation = (audio_fill - audio_target) / (audio_target > 0 ? audio_target : 1);
+
+	if (deviation > 1)
+		deviation = 1;
+	if (deviation < -1)
+		deviation = -1;
+
+	origin_ns += (int64_t)(frame_ns * PACING_MAX_SKEW * deviation);
+}
+
+
+// Input: file - open for writing
+//        name - heading of the histogram
+//        histogram - durations to print
+// Return: None
+static void write_histogram(FILE* file, const char* name, const PacingHistogram& histogram)
+{
+	fprintf(file, "\n%s: %llu frames, mean %.1f us, p50 < %.1f us, p99 < %.1f us, max %.1f us\n",
+	        name, (unsigned long long)histogram.get_count(), histogram.get_mean() / 1000.0,
+	        histogram.percentile(0.5) / 1000.0, histogram.percentile(0.99) / 1000.0,
+	        histogram.get_max() / 1000.0);
+
+	for (int i = 0; i < PACING_HISTOGRAM_BUCKETS; i++) {
+		if (histogram.get_bucket(i))
+			fprintf(file, "  < %8lld us %10llu\n", 1LL << i,
+			        (unsigned long long)histogram.get_bucket(i));
+	}
+}
+
+
+// Input: file_name - text file to create
+// Return Value: Return 0 on success;
+//               return -1 on failure
+// Function: Write the pacing mode, how much of the waiting was spent
+//           spinning, and the latency and jitter histograms
+int FramePacer::write_report(const char* file_name) const
+{
+	FILE* file = fopen(file_name, "w");
+
+	if (!file)
+		return -1;
+
+	fprintf(file, "mode %s, %llu resyncs, spin margin %.1f us, %.2f%% of waiting spent spinning\n",
+	        mode_names[mode], (unsigned long long)resyncs, spin_ns / 1000.0,
+	        total_wait_ns ? 100.0 * total_spin_ns / total_wait_ns : 0.0);
+
+	write_histogram(file, "latency (input to frame shown)", latency);
+	write_histogram(file, "jitter (frame start error)", jitter);
+
+	return fclose(file) == 0 ? 0 : -1;
+}
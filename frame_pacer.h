@@ -0,0 +1,173 @@
+#ifndef FRAME_PACER_H_
+#define FRAME_PACER_H_
+
+#include "apu.h"
+#include "ring_buffer.h"
+#include <stdint.h>
+
+#define PACING_HISTOGRAM_BUCKETS 24        // bucket i counts times below 2^i us
+#define PACING_MAX_LAG_NS        67000000  // ~4 frames; further behind, the schedule restarts
+
+#define PACING_MIN_SPIN_NS 20000    // busy-wait at least this long before a deadline
+#define PACING_MAX_SPIN_NS 2000000
+#define PACING_SPIN_SLACK_NS 10000  // added to the worst recent oversleep
+
+#define PACING_MAX_SKEW 0.005  // audio sync may run up to 0.5% fast or slow
+
+
+enum PacingMode {
+	PACE_CLOCK,  // frames at the emulated clock rate, 59.73 Hz
+	PACE_AUDIO   // the same, nudged to keep an audio queue at a target fill
+};
+
+
+// Distribution of durations on a log2 microsecond scale.
+class PacingHistogram {
+public:
+	PacingHistogram();
+
+	void clear();
+	void add(const int64_t ns);
+
+	uint64_t get_count() const;
+	uint64_t get_bucket(const int i) const;
+	int64_t get_max() const;
+	int64_t get_mean() const;
+	int64_t percentile(const double fraction) const;
+private:
+	uint64_t count;
+	int64_t total_ns;
+	int64_t max_ns;
+	uint64_t buckets[PACING_HISTOGRAM_BUCKETS];
+};
+
+
+// Paces a real-time loop to the emulated clock:
+//
+//	for (;;) {
+//		pacer.begin_frame(gb.get_cpu().get_clock_cycles());
+//		gb.set_joypad(poll_input());
+//		gb.run_frame();
+//		present(gb.get_ppu().get_frame());
+//		pacer.end_frame();
+//	}
+//
+// Each frame starts when the wall clock reaches the emulated time it begins
+// at, measured from the first frame, so the rate is exactly the cpu clock
+// over the cycles each frame takes and rounding never accumulates into
+// drift. Input is read right after the wait, which keeps the time from
+// input to display down to one frame's emulation.
+//
+// The wait sleeps with clock_nanosleep() until shortly before the deadline
+// and spins the rest of the way. The spin covers the worst recent oversleep
+// and shrinks again when the scheduler wakes the thread promptly, so only a
+// small fraction of a core is spent waiting.
+//
+// In PACE_AUDIO mode the emulated clock is stretched or shrunk by up to
+// PACING_MAX_SKEW to hold a queue of audio blocks, drained by the sound
+// device, at a target fill, so sound neither underruns nor lags behind when
+// the device's clock differs from the system clock.
+class FramePacer {
+public:
+	FramePacer();
+
+	void set_mode(const PacingMode mode);
+	void set_audio_queue(const AudioRing* queue, const int target_blocks);
+	void restart();
+
+	int begin_frame(const uint64_t clock_cycles);
+	void end_frame();
+
+	const PacingHistogram& get_latency() const;
+	const PacingHistogram& get_jitter() const;
+	uint64_t get_resyncs() const;
+	int64_t get_spin_ns() const;
+	void clear_stats();
+	int write_report(const char* file_name) const;
+private:
+	PacingMode mode;
+	const AudioRing* audio_queue;
+	int audio_target;  // blocks
+	double audio_fill;  // smoothed queue fill, blocks
+
+	bool started;
+	int64_t origin_ns;      // wall time of origin_clock
+	uint64_t origin_clock;
+	uint64_t last_clock;    // cpu clock at the start of the previous frame
+	int64_t frame_start_ns;
+	int64_t last_late_ns;   // how long after its deadline the previous frame began
+	int64_t spin_ns;        // current busy-wait margin
+
+	PacingHistogram latency;  // frame start to end_frame()
+	PacingHistogram jitter;   // frame interval minus its emulated length
+	uint64_t resyncs;
+	int64_t total_spin_ns;
+	int64_t total_wait_ns;
+
+	void wait_until(const int64_t deadline);
+	void adjust_to_audio(const int64_t frame_ns);
+};
+
+
+inline uint64_t PacingHistogram::get_count() const
+{
+	return count;
+}
+
+
+// Input: i - bucket, 0 to PACING_HISTOGRAM_BUCKETS - 1
+// Return: Number of durations below 2^i us and, but for bucket 0, at least
+//         2^(i - 1) us; the last bucket also holds everything longer
+inline uint64_t PacingHistogram::get_bucket(const int i) const
+{
+	return buckets[i];
+}
+
+
+inline int64_t PacingHistogram::get_max() const
+{
+	return max_ns;
+}
+
+
+inline int64_t PacingHistogram::get_mean() const
+{
+	return count ? total_ns / (int64_t)count : 0;
+}
+
+
+// Input: mode - PACE_AUDIO only takes effect once an audio queue is set
+// Return: None
+inline void FramePacer::set_mode(const PacingMode mode)
+{
+	this->mode = mode;
+}
+
+
+inline const PacingHistogram& FramePacer::get_latency() const
+{
+	return latency;
+}
+
+
+inline const PacingHistogram& FramePacer::get_jitter() const
+{
+	return jitter;
+}
+
+
+// Return: Number of times the loop fell more than PACING_MAX_LAG_NS
+//         behind and the schedule was restarted instead of catching up
+inline uint64_t FramePacer::get_resyncs() const
+{
+	return resyncs;
+}
+
+
+// Return: Busy-wait margin before each deadline, in nanoseconds
+inline int64_t FramePacer::get_spin_ns() const
+{
+	return spin_ns;
+}
+
+#endif  // FRAME_PACER_H_
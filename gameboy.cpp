@@ -0,0 +1,326 @@
+#include "gameboy.h"
+#include "apu.h"
+#include "profiler.h"
+#include <new>
+
+static const char state_magic[8] = { 'G', 'B', 'S', 'T', 'A', 'T', 'E', 0 };
+
+
+GameBoy::GameBoy() : cpu(mmu), timer(mmu), ppu(mmu), serial(mmu), apu(NULL),
+                     idle_loop(mmu), idle_skip(IDLE_SKIP_ON), fusion(true)
+{
+	mmu.attach_timer(&timer);
+	mmu.attach_ppu(&ppu);
+	mmu.attach_serial(&serial);
+	cpu.attach_devices(&timer, &ppu);
+}
+
+
+// Input: parent - instance to fork
+// Function: Continue from the parent's state, sharing its memory pages and
+//           ROM until either side writes to them. Sound and the link cable
+//           are not attached.
+GameBoy::GameBoy(const GameBoy& parent)
+	: mmu(parent.mmu), cpu(mmu, parent.cpu), timer(mmu, parent.timer), ppu(mmu, parent.ppu),
+	  serial(mmu, parent.serial), apu(NULL), idle_loop(mmu), idle_skip(parent.idle_skip),
+	  fusion(parent.fusion), hasher(parent.hasher)
+{
+	mmu.attach_timer(&timer);
+	mmu.attach_ppu(&ppu);
+	mmu.attach_serial(&serial);
+	cpu.attach_devices(&timer, &ppu);
+	publish_state();
+}
+
+
+// Inputs: None
+// Function: Put every component back in its power-on state, keeping the ROM
+void GameBoy::reset()
+{
+	cpu.initialize();
+	timer.reset();
+	ppu.reset();
+	serial.reset();
+	idle_loop.reset();
+	mmu.attach_apu(apu);  // restart sound from the fresh registers
+	publish_state();
+}
+
+
+// Input: rom_name - path of the ROM file
+// Return Value: Return 0 on success;
+//               return -1 on failure
+int GameBoy::load_ROM(const char* rom_name)
+{
+	if (mmu.load_ROM(rom_name) != 0)
+		return -1;
+
+	reset();
+	return 0;
+}
+
+
+// Input: None
+// Return: New instance in the same state, to be deleted by the caller, or
+//         NULL if out of memory
+// Function: Clone the instance for branching searches. The clone costs a
+//           few kilobytes until it, or this instance, writes to memory
+//           pages they still share; each such page is then copied once.
+//           This instance must not be running while it is forked.
+GameBoy* GameBoy::fork() const
+{
+	return new (std::nothrow) GameBoy(*this);
+}
+
+
+// Input: source - instance to continue from; it must not be running
+// Return: None
+// Function: Take over source's state the way a fork would, in place: memory
+//           pages and the ROM are shared rather than copied, so going back
+//           to a cached instance is cheaper than load_state(). Attached
+//           sound, link cable and renderer stay attached.
+void GameBoy::restore(const GameBoy& source)
+{
+	TimerState timer_state;
+	SerialState serial_state;
+	PPUState ppu_state;
+
+	mmu.share_memory(source.mmu);
+	cpu.set_state(source.cpu.get_state());
+	source.timer.get_state(timer_state);
+	timer.set_state(timer_state);
+	source.ppu.get_state(ppu_state);
+	ppu.set_state(ppu_state);
+	source.serial.get_state(serial_state);
+	serial.set_state(serial_state);
+
+	idle_loop.reset();
+	mmu.attach_apu(apu);
+	publish_state();
+}
+
+
+// Input: apu - audio unit fed from the sound register writes, or NULL
+// Return: None
+void GameBoy::attach_apu(APU* apu)
+{
+	this->apu = apu;
+	mmu.attach_apu(apu);
+}
+
+
+// Input: None
+// Return: Number of clock cycles that passed
+// Function: Execute one instruction, interrupt dispatch or run of a fused
+//           loop, or skip ahead to the next interrupt if the cpu is halted,
+//           and let the timer, LCD and serial port catch up
+int GameBoy::step()
+{
+	int cycles;
+	bool ticked = false;  // the cpu has clocked the timer and LCD itself
+
+	serial.sync(cpu.get_clock_cycles());
+
+	if (cpu.is_sleeping()) {
+		cycles = cycles_until_interrupt();
+		cpu.fast_forward(cycles);
+	} else if ((cycles = skip_idle_loop()) == 0 && (cycles = run_fused_loop()) == 0) {
+		cycles = cpu.execute_next_opcode();
+		ticked = CPU::ticks_devices;
+	}
+
+	if (!ticked) {
+		timer.tick(cycles);
+		ppu.tick(cycles);
+	}
+	serial.tick(cpu.get_clock_cycles());
+
+	return cycles;
+}
+
+
+// Input: None
+// Return: None
+// Function: Run until the LCD finishes the current frame
+void GameBoy::run_frame()
+{
+	const uint64_t frame = ppu.get_frame_count();
+
+	while (ppu.get_frame_count() == frame)
+		step();
+
+	if (apu)
+		apu->end_frame(cpu.get_clock_cycles());
+
+	publish_state();
+}
+
+
+// Input: state - receives the state of the cpu, memory and devices
+// Return: None
+void GameBoy::save_state(GameBoyState& state) const
+{
+	memcpy(state.magic, state_magic, sizeof(state_magic));
+	state.version = STATE_VERSION;
+	state.size = sizeof(GameBoyState);
+
+	state.cpu = cpu.get_state();
+	timer.get_state(state.timer);
+	ppu.get_state(state.ppu);
+	serial.get_state(state.serial);
+	mmu.get_state(state.mmu);
+}
+
+
+// Input: state - state saved by save_state() with the same ROM loaded
+// Return Value: Return 0 on success;
+//               return -1 if state was saved by another version or holds a
+//               value out of range, leaving the instance as it was
+// Function: Restore the cpu, memory and devices. Sound restarts from the
+//           restored registers.
+int GameBoy::load_state(const GameBoyState& state)
+{
+	if (memcmp(state.magic, state_magic, sizeof(state_magic)) != 0 ||
+	    state.version != STATE_VERSION || state.size != sizeof(GameBoyState))
+		return -1;
+
+	if (!CPU::is_valid_state(state.cpu) || !Timer::is_valid_state(state.timer) ||
+	    !PPU::is_valid_state(state.ppu) || !Serial::is_valid_state(state.serial, state.cpu.clock))
+		return -1;
+
+	mmu.set_state(state.mmu);
+	cpu.set_state(state.cpu);
+	timer.set_state(state.timer);
+	ppu.set_state(state.ppu);
+	serial.set_state(state.serial);
+
+	idle_loop.reset();
+	mmu.attach_apu(apu);
+	publish_state();
+	return 0;
+}
+
+
+// Input: None
+// Return: Clock cycles skipped, or 0 if the cpu isn't in an idle loop
+// Function: Skip as many whole iterations of an idle loop as fit before the
+//           next event that could change what the loop reads
+int GameBoy::skip_idle_loop()
+{
+	if (idle_skip == IDLE_SKIP_OFF)
+		return 0;
+
+	const uint64_t clock = cpu.get_clock_cycles();
+	const int iteration = idle_loop.observe(cpu.get_registers(), clock);
+
+	// skipped iterations would be missing from the trace or the per-PC counts
+	if (iteration <= 0 || cpu.is_tracing() || Profiler::is_enabled())
+		return 0;
+
+	// a skip that stopped just short of an interrupt mustn't run past it
+	if (cpu.interrupt_due())
+		return 0;
+
+	// The registers only show what the last iteration read. If something it
+	// polls could have changed since, after the read, wait for an iteration
+	// that has seen the new value.
+	const int change = cycles_until_change(idle_loop.get_reads());
+	const bool stable = idle_loop.get_stable_until() > clock;
+
+	idle_loop.set_stable_until(clock + change);
+	if (!stable)
+		return 0;
+
+	const int cycles = change / iteration * iteration;
+
+	if (cycles <= 0)
+		return 0;
+
+	if (idle_skip == IDLE_SKIP_VERIFY) {
+		idle_loop.expect(clock + cycles);
+		return 0;
+	}
+
+	cpu.fast_forward(cycles);
+	idle_loop.skipped(cycles);
+	return cycles;
+}
+
+
+// Input: None
+// Return: Clock cycles run, or 0 if the cpu isn't at a loop it can fuse
+// Function: Run as many iterations of a copy or fill loop at once as end
+//           before an interrupt could be raised and, if they write VRAM or
+//           OAM, before the LCD next draws a line, so no device sees the
+//           bulk writes at a different time than the loop's own
+int GameBoy::run_fused_loop()
+{
+	if (!fusion || !cpu.at_fused_loop())
+		return 0;
+
+	return cpu.execute_fused(cycles_until_interrupt(), ppu.cycles_until_render());
+}
+
+
+// Input: reads - IDLE_READS_* flags of what an idle loop polls
+// Return: Cycles until an interrupt could be dispatched or any of the polled
+//         values could change
+int GameBoy::cycles_until_change(const int reads) const
+{
+	int cycles = cycles_until_interrupt();
+
+	if (reads & (IDLE_READS_PPU | IDLE_READS_IF)) {
+		const int mode_change = ppu.cycles_until_mode_change();
+		if (mode_change < cycles)
+			cycles = mode_change;
+	}
+
+	if (reads & IDLE_READS_DIV) {
+		const int div = timer.cycles_until_change(0xFF04);
+		if (div < cycles)
+			cycles = div;
+	}
+
+	if (reads & IDLE_READS_TIMA) {
+		const int tima = timer.cycles_until_change(0xFF05);
+		if (tima > 0 && tima < cycles)
+			cycles = tima;
+	}
+
+	if (reads & IDLE_READS_IF) {
+		const int overflow = timer.cycles_until_interrupt();
+		if (overflow > 0 && overflow < cycles)
+			cycles = overflow;
+	}
+
+	return cycles;
+}
+
+
+// Return: Cycles until the next point an enabled interrupt could be raised.
+//         The end of the frame always counts so run_frame() returns on time.
+int GameBoy::cycles_until_interrupt() const
+{
+	const uint8_t enabled = mmu.read(0xFFFF);
+	int cycles = ppu.cycles_until_frame_end();
+
+	if (enabled & INT_STAT) {
+		const int mode_change = ppu.cycles_until_mode_change();
+		if (mode_change < cycles)
+			cycles = mode_change;
+	}
+
+	if (enabled & INT_TIMER) {
+		const int overflow = timer.cycles_until_interrupt();
+		if (overflow > 0 && overflow < cycles)
+			cycles = overflow;
+	}
+
+	// the peer may need us before then, so this counts even if disabled
+	const int serial_event = serial.cycles_until_event(cpu.get_clock_cycles());
+	if (serial_event < cycles)
+		cycles = serial_event;
+
+	// instructions take at least 4 cycles, so do jumps
+	return cycles < 4 ? 4 : cycles;
+}
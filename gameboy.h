@@ -0,0 +1,205 @@
+#ifndef GAMEBOY_H_
+#define GAMEBOY_H_
+
+#include "mmu.h"
+#include "cpu.h"
+#include "timer.h"
+#include "ppu.h"
+#include "serial.h"
+#include "idle_loop.h"
+#include "state_hash.h"
+#include "seqlock.h"
+#include <stdint.h>
+
+#define STATE_VERSION 2
+
+class APU;
+
+// Complete emulator state apart from the ROM, in host byte order
+struct GameBoyState {
+	char magic[8];     // "GBSTATE\0"
+	uint32_t version;  // STATE_VERSION
+	uint32_t size;     // sizeof(GameBoyState)
+	CPUState cpu;
+	TimerState timer;
+	PPUState ppu;
+	SerialState serial;
+	MMUState mmu;
+};
+
+
+// Owns the cpu, memory and the devices that raise interrupts, and advances
+// them together one instruction at a time. While the cpu is halted, or spins
+// in an idle loop, the clock jumps straight to the next event that could
+// wake it, and memory copy and fill loops run as one bulk operation.
+class GameBoy {
+public:
+	GameBoy();
+	void reset();
+	GameBoy* fork() const;
+	void restore(const GameBoy& source);
+	int load_ROM(const char* rom_name);
+	void attach_apu(APU* apu);
+	void attach_link(LinkPort* port);
+	void attach_renderer(RenderWorker* renderer);
+	void set_idle_skip(const IdleSkipMode mode);
+	void set_fusion(const bool enabled);
+	void set_joypad(const uint8_t buttons);
+
+	int step();
+	void run_frame();
+
+	void save_state(GameBoyState& state) const;
+	int load_state(const GameBoyState& state);
+
+	uint64_t state_hash();
+	void set_hash_mask(const uint8_t* mask);
+
+	MMU& get_mmu();
+	CPU& get_cpu();
+	PPU& get_ppu();
+	const IdleLoopDetector& get_idle_loop() const;
+
+	void publish_state();
+	void get_published_state(CPUState& state) const;
+private:
+	MMU mmu;
+	CPU cpu;
+	Timer timer;
+	PPU ppu;
+	Serial serial;
+	APU* apu;
+
+	IdleLoopDetector idle_loop;
+	IdleSkipMode idle_skip;
+	bool fusion;  // run copy and fill loops in bulk
+
+	SeqLock<CPUState> published_state;
+	StateHasher hasher;
+
+	GameBoy(const GameBoy& parent);
+	GameBoy& operator=(const GameBoy&) = delete;
+
+	int skip_idle_loop();
+	int run_fused_loop();
+	int cycles_until_interrupt() const;
+	int cycles_until_change(const int reads) const;
+};
+
+
+// Input: mode - IDLE_SKIP_OFF, IDLE_SKIP_ON, or IDLE_SKIP_VERIFY to check
+//               every skip against plain execution; nothing is skipped
+//               while the cpu is traced or the profiler is enabled
+// Return: None
+inline void GameBoy::set_idle_skip(const IdleSkipMode mode)
+{
+	idle_skip = mode;
+	idle_loop.reset();
+}
+
+
+// Input: enabled - run memory copy and fill loops as one bulk operation;
+//                  on by default, and never under ACCURATE_TIMING
+// Return: None
+inline void GameBoy::set_fusion(const bool enabled)
+{
+	fusion = enabled;
+}
+
+
+// Input: buttons - JOYPAD_* buttons held from now on
+// Return: None
+inline void GameBoy::set_joypad(const uint8_t buttons)
+{
+	mmu.set_joypad(buttons);
+	idle_loop.reset();  // a polling loop may now see something new
+}
+
+
+// Return: Fingerprint of memory and the cpu registers; see StateHasher
+inline uint64_t GameBoy::state_hash()
+{
+	return hasher.hash(mmu, cpu.get_state());
+}
+
+
+// Input: mask - MEMORY_SIZE bytes ANDed with memory before hashing, so only
+//               the bytes that matter to a search count; NULL for all
+// Return: None
+inline void GameBoy::set_hash_mask(const uint8_t* mask)
+{
+	hasher.set_mask(mask);
+}
+
+
+// Input: port - end of a LinkCable whose other end another instance, on
+//               another thread, is attached to; NULL to unplug
+// Return: None
+// Function: Connect the serial port. Linked instances wait for each other
+//           only when one gets more than LINK_WINDOW cycles ahead, or
+//           finishes a transfer the other hasn't reached yet. Unplugging, or
+//           deleting the instance, disconnects the other end for good.
+inline void GameBoy::attach_link(LinkPort* port)
+{
+	serial.attach_link(port, cpu.get_clock_cycles());
+}
+
+
+// Input: renderer - started worker to draw frames on, or NULL to draw them
+//                   in the PPU again
+// Return: None
+// Function: Draw frames in parallel with emulation. They are then read from
+//           the renderer, one frame behind, and get_ppu().get_frame() stops
+//           changing. Forks draw in their own PPU.
+inline void GameBoy::attach_renderer(RenderWorker* renderer)
+{
+	mmu.attach_renderer(renderer);
+	ppu.attach_renderer(renderer);
+}
+
+
+inline MMU& GameBoy::get_mmu()
+{
+	return mmu;
+}
+
+
+inline CPU& GameBoy::get_cpu()
+{
+	return cpu;
+}
+
+
+inline PPU& GameBoy::get_ppu()
+{
+	return ppu;
+}
+
+
+inline const IdleLoopDetector& GameBoy::get_idle_loop() const
+{
+	return idle_loop;
+}
+
+
+
+// Input: None
+// Return: None
+// Function: Make the current cpu state visible to get_published_state().
+//           run_frame() does this after every frame.
+inline void GameBoy::publish_state()
+{
+	published_state.write(cpu.get_state());
+}
+
+
+// Input: state - receives the last published cpu state
+// Return: None
+// Function: Safe to call from any thread while the emulator runs; never
+//           blocks the emulation thread
+inline void GameBoy::get_published_state(CPUState& state) const
+{
+	published_state.read(state);
+}
+
+#endif  // GAMEBOY_H_
@@ -0,0 +1,446 @@
+#include "gb_api.h"
+#include "gameboy.h"
+#include "vec_env.h"
+#include "run_ahead.h"
+#include <new>
+
+static_assert(GB_SCREEN_WIDTH == SCREEN_WIDTH && GB_SCREEN_HEIGHT == SCREEN_HEIGHT,
+              "gb_api.h screen size is out of date");
+static_assert(GB_BUTTON_START == JOYPAD_START && GB_BUTTON_RIGHT == JOYPAD_RIGHT,
+              "gb_api.h buttons are out of date");
+
+struct gb_instance {
+	GameBoy* gameboy;
+	GameBoyState* scratch;  // for state buffers that aren't suitably aligned
+	RunAhead* run_ahead;    // NULL until gb_set_run_ahead()
+	uint32_t viewed;        // bit per GB_REGION_* handed out by gb_memory_view()
+};
+
+struct gb_vec {
+	VecEnv env;
+
+	gb_vec(const int count, const int threads) : env(count, threads) {}
+};
+
+struct gb_link {
+	LinkCable cable;
+	bool attached[2];
+};
+
+struct Region {
+	uint16_t start;
+	uint16_t size;
+};
+
+// Each region lies within one memory page
+static const Region regions[] = {
+	{ 0x8000, 0x2000 },
+	{ 0xA000, 0x2000 },
+	{ 0xC000, 0x2000 },
+	{ 0xFE00, 0x00A0 },
+	{ 0xFF00, 0x0080 },
+	{ 0xFF80, 0x007F }
+};
+
+
+// Return: GB_API_VERSION of the library, to check against the header
+int gb_api_version(void)
+{
+	return GB_API_VERSION;
+}
+
+
+// Return: New instance without a ROM, or NULL if out of memory
+gb_instance* gb_create(void)
+{
+	gb_instance* gb = new (std::nothrow) gb_instance;
+
+	if (!gb)
+		return NULL;
+
+	if (!(gb->gameboy = new (std::nothrow) GameBoy())) {
+		delete gb;
+		return NULL;
+	}
+
+	gb->scratch = NULL;
+	gb->run_ahead = NULL;
+	gb->viewed = 0;
+	return gb;
+}
+
+
+void gb_destroy(gb_instance* gb)
+{
+	if (!gb)
+		return;
+
+	delete gb->run_ahead;
+	delete gb->scratch;
+	delete gb->gameboy;
+	delete gb;
+}
+
+
+// Return: Independent copy of gb that shares its memory until either one
+//         writes to it, or NULL if out of memory
+gb_instance* gb_fork(gb_instance* gb)
+{
+	gb_instance* child = new (std::nothrow) gb_instance;
+
+	if (!child)
+		return NULL;
+
+	if (!(child->gameboy = gb->gameboy->fork())) {
+		delete child;
+		return NULL;
+	}
+
+	child->scratch = NULL;
+	child->run_ahead = NULL;
+	child->viewed = 0;
+	return child;
+}
+
+
+// Input: data, size - ROM image; it is copied
+// Return Value: Return 0 on success;
+//               return -1 if the image is empty or larger than 2 MiB
+// Function: Load the ROM and power the instance on
+int gb_load_rom(gb_instance* gb, const uint8_t* data, size_t size)
+{
+	if (gb->gameboy->get_mmu().load_ROM_data(data, size) != 0)
+		return -1;
+
+	gb->gameboy->reset();
+	return 0;
+}
+
+
+// Input: dir - existing directory where the code maps of loaded ROMs are
+//              kept between processes, or NULL to map every ROM afresh
+// Return: None
+// Function: Applies to every later gb_load_rom() and gb_vec_load_rom()
+void gb_set_code_cache_dir(const char* dir)
+{
+	CodeMap::set_cache_dir(dir);
+}
+
+
+void gb_reset(gb_instance* gb)
+{
+	gb->gameboy->reset();
+}
+
+
+// Return Value: Return 0 on success;
+//               return -1 if the cpu has locked up on a bad opcode or address
+// Function: Run until the LCD finishes the current frame
+int gb_run_frame(gb_instance* gb)
+{
+	if (gb->run_ahead)
+		gb->run_ahead->run_frame();
+	else
+		gb->gameboy->run_frame();
+
+	return gb->gameboy->get_cpu().get_fault() == FAULT_NONE ? 0 : -1;
+}
+
+
+// Input: buttons - GB_BUTTON_* buttons held from now on
+void gb_set_input(gb_instance* gb, uint8_t buttons)
+{
+	gb->gameboy->set_joypad(buttons);
+}
+
+
+// Return: Bytes needed by gb_save_state()
+size_t gb_state_size(void)
+{
+	return sizeof(GameBoyState);
+}
+
+
+// Input: buffer, size - at least gb_state_size() bytes
+// Return Value: Return 0 on success;
+//               return -1 if the buffer is too small
+// Function: Save everything but the ROM. The state is written in place
+//           when buffer is 8-byte aligned.
+int gb_save_state(gb_instance* gb, void* buffer, size_t size)
+{
+	if (size < sizeof(GameBoyState))
+		return -1;
+
+	if ((uintptr_t)buffer % alignof(GameBoyState) == 0) {
+		gb->gameboy->save_state(*(GameBoyState*)buffer);
+		return 0;
+	}
+
+	if (!gb->scratch && !(gb->scratch = new (std::nothrow) GameBoyState))
+		return -1;
+
+	gb->gameboy->save_state(*gb->scratch);
+	memcpy(buffer, gb->scratch, sizeof(GameBoyState));
+	return 0;
+}
+
+
+// Input: buffer, size - state from gb_save_state() with the same ROM loaded
+// Return Value: Return 0 on success;
+//               return -1 if the state is truncated, from another version
+//               or holds a value out of range
+int gb_load_state(gb_instance* gb, const void* buffer, size_t size)
+{
+	if (size < sizeof(GameBoyState))
+		return -1;
+
+	if ((uintptr_t)buffer % alignof(GameBoyState) == 0)
+		return gb->gameboy->load_state(*(const GameBoyState*)buffer);
+
+	if (!gb->scratch && !(gb->scratch = new (std::nothrow) GameBoyState))
+		return -1;
+
+	memcpy(gb->scratch, buffer, sizeof(GameBoyState));
+	return gb->gameboy->load_state(*gb->scratch);
+}
+
+
+// Input: region - one of GB_REGION_*
+//        size - receives the size of the region in bytes, if not NULL
+// Return: Pointer into the emulated memory, or NULL for an unknown region.
+//         Writes through it skip the I/O side effects of the cpu's writes.
+//         gb_state_hash() rehashes the region from then on, so it sees
+//         writes made through the pointer at any time.
+uint8_t* gb_memory_view(gb_instance* gb, int region, size_t* size)
+{
+	if (region < 0 || region >= (int)(sizeof(regions) / sizeof(regions[0])))
+		return NULL;
+
+	const uint16_t start = regions[region].start;
+
+	if (size)
+		*size = regions[region].size;
+
+	gb->viewed |= 1u << region;
+
+	return gb->gameboy->get_mmu().get_page(start) + (start & (MEMORY_PAGE_SIZE - 1));
+}
+
+
+// Return: GB_SCREEN_WIDTH * GB_SCREEN_HEIGHT shades, 0 (white) to 3 (black),
+//         row by row. Complete after gb_run_frame() returns; with run-ahead
+//         on, it is the frame run ahead to.
+const uint8_t* gb_framebuffer(gb_instance* gb)
+{
+	if (gb->run_ahead)
+		return gb->run_ahead->get_frame().pixels;
+
+	return gb->gameboy->get_ppu().get_frame().pixels;
+}
+
+
+// Input: frames - frames to show ahead of the emulated state to hide the
+//                 game's input lag, up to 8; 0 turns run-ahead off
+// Return Value: Return 0 on success;
+//               return -1 if out of memory
+// Function: Each gb_run_frame() then also runs a throwaway fork that many
+//           frames ahead with the current input, for gb_framebuffer()
+int gb_set_run_ahead(gb_instance* gb, int frames)
+{
+	if (!gb->run_ahead && !(gb->run_ahead = new (std::nothrow) RunAhead(*gb->gameboy)))
+		return -1;
+
+	gb->run_ahead->set_frames(frames);
+	return 0;
+}
+
+
+void gb_get_registers(gb_instance* gb, gb_registers* regs)
+{
+	const CPURegisters r = gb->gameboy->get_cpu().get_registers();
+
+	regs->AF = r.AF;
+	regs->BC = r.BC;
+	regs->DE = r.DE;
+	regs->HL = r.HL;
+	regs->SP = r.SP;
+	regs->PC = r.PC;
+}
+
+
+// Return: Number of frames finished since the last reset
+uint64_t gb_frame_count(gb_instance* gb)
+{
+	return gb->gameboy->get_ppu().get_frame_count();
+}
+
+
+// Return: Clock cycles since the last reset
+uint64_t gb_clock_cycles(gb_instance* gb)
+{
+	return gb->gameboy->get_cpu().get_clock_cycles();
+}
+
+
+// Return: Fingerprint of memory and registers, for duplicate detection.
+//         Only the memory written since the last call is rehashed, along
+//         with the regions handed out by gb_memory_view().
+uint64_t gb_state_hash(gb_instance* gb)
+{
+	MMU& mmu = gb->gameboy->get_mmu();
+
+	for (int region = 0; gb->viewed >> region; region++) {
+		if (gb->viewed & (1u << region))
+			mmu.mark_written(regions[region].start, regions[region].size);
+	}
+
+	return gb->gameboy->state_hash();
+}
+
+
+// Input: mask - 65536 bytes ANDed with memory before hashing, or NULL to
+//               hash all of it; it is copied
+void gb_set_hash_mask(gb_instance* gb, const uint8_t* mask)
+{
+	gb->gameboy->set_hash_mask(mask);
+}
+
+
+// Return: New cable with nothing plugged in, or NULL if out of memory
+gb_link* gb_link_create(void)
+{
+	gb_link* link = new (std::nothrow) gb_link;
+
+	if (link)
+		link->attached[0] = link->attached[1] = false;
+
+	return link;
+}
+
+
+// Function: Free the cable; both instances must be destroyed or unplugged
+//           first
+void gb_link_destroy(gb_link* link)
+{
+	delete link;
+}
+
+
+// Input: link - cable to plug in, or NULL to unplug gb
+//        side - end of the cable, 0 or 1; each end can be used once
+// Return Value: Return 0 on success;
+//               return -1 if that end is already in use
+int gb_link_attach(gb_instance* gb, gb_link* link, int side)
+{
+	if (!link) {
+		gb->gameboy->attach_link(NULL);
+		return 0;
+	}
+
+	if (side < 0 || side > 1 || link->attached[side])
+		return -1;
+
+	link->attached[side] = true;
+	gb->gameboy->attach_link(&link->cable.port(side));
+	return 0;
+}
+
+
+// Input: count - number of instances
+//        threads - threads to step them on, including the calling thread
+// Return: New batch without a ROM, or NULL if out of memory
+gb_vec* gb_vec_create(int count, int threads)
+{
+	return new (std::nothrow) gb_vec(count, threads);
+}
+
+
+void gb_vec_destroy(gb_vec* vec)
+{
+	delete vec;
+}
+
+
+// Input: data, size - ROM image; it is copied into every instance
+//        warmup_frames - frames to run before taking the reset state
+// Return Value: Return 0 on success;
+//               return -1 if the image is empty or larger than 2 MiB
+int gb_vec_load_rom(gb_vec* vec, const uint8_t* data, size_t size, int warmup_frames)
+{
+	return vec->env.load_ROM(data, size, warmup_frames);
+}
+
+
+// Input: buffer, size - state from gb_save_state() episodes start from
+// Return Value: Return 0 on success;
+//               return -1 if the state is truncated, from another version
+//               or holds a value out of range
+int gb_vec_set_reset_state(gb_vec* vec, const void* buffer, size_t size)
+{
+	if (size < sizeof(GameBoyState))
+		return -1;
+
+	if ((uintptr_t)buffer % alignof(GameBoyState) == 0)
+		return vec->env.set_reset_state(*(const GameBoyState*)buffer);
+
+	GameBoyState* state = new (std::nothrow) GameBoyState;
+
+	if (!state)
+		return -1;
+
+	memcpy(state, buffer, sizeof(GameBoyState));
+	const int result = vec->env.set_reset_state(*state);
+	delete state;
+	return result;
+}
+
+
+// Input: frames - episode length, or 0 to end episodes only on a cpu lock up
+void gb_vec_set_episode_frames(gb_vec* vec, int frames)
+{
+	vec->env.set_episode_frames(frames);
+}
+
+
+// Input: type - GB_OBS_FRAMEBUFFER, or GB_OBS_RAM to observe the bytes at
+//               addresses[0 .. count - 1]
+// Return Value: Return 0 on success;
+//               return -1 on an unknown type or an empty address list
+int gb_vec_set_observation(gb_vec* vec, int type, const uint16_t* addresses, int count)
+{
+	if (type == GB_OBS_FRAMEBUFFER) {
+		vec->env.set_observation_framebuffer();
+		return 0;
+	}
+
+	if (type != GB_OBS_RAM || !addresses)
+		return -1;
+
+	return vec->env.set_observation_ram(addresses, count);
+}
+
+
+// Return: Bytes per instance in the observation buffer
+size_t gb_vec_observation_size(gb_vec* vec)
+{
+	return vec->env.observation_size();
+}
+
+
+// Input: observations - count * gb_vec_observation_size() bytes, or NULL
+void gb_vec_reset(gb_vec* vec, uint8_t* observations)
+{
+	vec->env.reset(observations);
+}
+
+
+// Input: actions - GB_BUTTON_* buttons for each instance
+//        frames - frames to run each instance
+//        observations - count * gb_vec_observation_size() bytes, or NULL
+//        done - count flags set for instances that ended an episode and were
+//               reset, or NULL
+void gb_vec_step(gb_vec* vec, const uint8_t* actions, int frames, uint8_t* observations,
+                 uint8_t* done)
+{
+	vec->env.step(actions, frames, observations, done);
+}
@@ -0,0 +1,113 @@
+#ifndef GB_API_H_
+#define GB_API_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C interface for embedding the emulator from other languages. Build the
+// sources with -fPIC -fvisibility=hidden into a shared library; only the
+// functions below are exported.
+//
+// The memory and framebuffer views point straight into the instance, so
+// callers can wrap them (a numpy array, a Rust slice) and read them after
+// every frame without copying. The framebuffer view stays valid until the
+// instance is destroyed; memory views until it is forked or loads a state.
+
+#if defined(_WIN32)
+#define GB_API __declspec(dllexport)
+#else
+#define GB_API __attribute__((visibility("default")))
+#endif
+
+#define GB_API_VERSION 5
+
+#define GB_SCREEN_WIDTH  160
+#define GB_SCREEN_HEIGHT 144
+
+// Buttons for gb_set_input(), set while held
+#define GB_BUTTON_RIGHT  0x01
+#define GB_BUTTON_LEFT   0x02
+#define GB_BUTTON_UP     0x04
+#define GB_BUTTON_DOWN   0x08
+#define GB_BUTTON_A      0x10
+#define GB_BUTTON_B      0x20
+#define GB_BUTTON_SELECT 0x40
+#define GB_BUTTON_START  0x80
+
+// Memory regions for gb_memory_view()
+#define GB_REGION_VRAM     0  // 0x8000 - 0x9FFF
+#define GB_REGION_CART_RAM 1  // 0xA000 - 0xBFFF
+#define GB_REGION_WRAM     2  // 0xC000 - 0xDFFF
+#define GB_REGION_OAM      3  // 0xFE00 - 0xFE9F
+#define GB_REGION_IO       4  // 0xFF00 - 0xFF7F
+#define GB_REGION_HRAM     5  // 0xFF80 - 0xFFFE
+
+// Observations for gb_vec_step()
+#define GB_OBS_FRAMEBUFFER 0
+#define GB_OBS_RAM         1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct gb_instance gb_instance;
+typedef struct gb_vec gb_vec;
+typedef struct gb_link gb_link;
+
+typedef struct gb_registers {
+	uint16_t AF;
+	uint16_t BC;
+	uint16_t DE;
+	uint16_t HL;
+	uint16_t SP;
+	uint16_t PC;
+} gb_registers;
+
+GB_API int gb_api_version(void);
+
+GB_API gb_instance* gb_create(void);
+GB_API void gb_destroy(gb_instance* gb);
+GB_API gb_instance* gb_fork(gb_instance* gb);
+
+GB_API int gb_load_rom(gb_instance* gb, const uint8_t* data, size_t size);
+GB_API void gb_set_code_cache_dir(const char* dir);
+GB_API void gb_reset(gb_instance* gb);
+GB_API int gb_run_frame(gb_instance* gb);
+GB_API void gb_set_input(gb_instance* gb, uint8_t buttons);
+
+GB_API size_t gb_state_size(void);
+GB_API int gb_save_state(gb_instance* gb, void* buffer, size_t size);
+GB_API int gb_load_state(gb_instance* gb, const void* buffer, size_t size);
+
+GB_API uint8_t* gb_memory_view(gb_instance* gb, int region, size_t* size);
+GB_API const uint8_t* gb_framebuffer(gb_instance* gb);
+GB_API int gb_set_run_ahead(gb_instance* gb, int frames);
+GB_API void gb_get_registers(gb_instance* gb, gb_registers* regs);
+GB_API uint64_t gb_frame_count(gb_instance* gb);
+GB_API uint64_t gb_clock_cycles(gb_instance* gb);
+GB_API uint64_t gb_state_hash(gb_instance* gb);
+GB_API void gb_set_hash_mask(gb_instance* gb, const uint8_t* mask);
+
+// Serial link cables between two instances run on different threads; see
+// link_cable.h
+GB_API gb_link* gb_link_create(void);
+GB_API void gb_link_destroy(gb_link* link);
+GB_API int gb_link_attach(gb_instance* gb, gb_link* link, int side);
+
+// Batches of instances stepped together; see vec_env.h
+GB_API gb_vec* gb_vec_create(int count, int threads);
+GB_API void gb_vec_destroy(gb_vec* vec);
+GB_API int gb_vec_load_rom(gb_vec* vec, const uint8_t* data, size_t size, int warmup_frames);
+GB_API int gb_vec_set_reset_state(gb_vec* vec, const void* buffer, size_t size);
+GB_API void gb_vec_set_episode_frames(gb_vec* vec, int frames);
+GB_API int gb_vec_set_observation(gb_vec* vec, int type, const uint16_t* addresses, int count);
+GB_API size_t gb_vec_observation_size(gb_vec* vec);
+GB_API void gb_vec_reset(gb_vec* vec, uint8_t* observations);
+GB_API void gb_vec_step(gb_vec* vec, const uint8_t* actions, int frames, uint8_t* observations,
+                        uint8_t* done);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // GB_API_H_
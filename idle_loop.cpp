@@ -0,0 +1,285 @@
+#include "idle_loop.h"
+#include "mmu.h"
+#include <stdio.h>
+
+// Masks of the registers an instruction writes or addresses memory through
+#define REG_BIT(r)   (1 << (r))        // r as encoded in opcodes: B, C, D, E, H, L, -, A
+#define PAIR_BITS(p) (3 << (2 * (p)))  // p as encoded in opcodes: BC, DE, HL
+
+
+static bool same_registers(const CPURegisters& a, const CPURegisters& b)
+{
+	return a.AF == b.AF && a.BC == b.BC && a.DE == b.DE &&
+	       a.HL == b.HL && a.SP == b.SP && a.PC == b.PC;
+}
+
+
+// Input: addr - address read by the loop
+// Return: IDLE_READS_* flags for the events that can change the value, or -1
+//         if it isn't known when the value changes
+static int read_flags(const uint16_t addr)
+{
+	// RAM and ROM only change when the cpu writes them, which the loop
+	// doesn't and interrupt handlers only do after an interrupt event.
+	if (addr < 0xFF00 || addr >= 0xFF80)
+		return 0;
+
+	switch(addr) {
+	case 0xFF00:  // joypad, only changes between frames
+	case 0xFF06:  // TMA
+	case 0xFF07:  // TAC
+		return 0;
+	case 0xFF04:
+		return IDLE_READS_DIV;
+	case 0xFF05:
+		return IDLE_READS_TIMA;
+	case 0xFF0F:
+		return IDLE_READS_IF;
+	}
+
+	if (addr >= 0xFF40 && addr <= 0xFF4B)
+		return IDLE_READS_PPU;
+
+	return -1;
+}
+
+
+// Input: mmu - memory holding the loop
+//        addr - address of the instruction
+//        regs - register values at the loop head, the same on every
+//               iteration
+//        reads - IDLE_READS_* flags, updated with what the instruction reads
+//        written - REG_BIT()s of the registers earlier instructions in the
+//                  loop wrote, updated with what this one writes
+//        branch - set if the instruction is a jump
+// Return: Length of the instruction, or 0 if it has side effects, isn't
+//         known to be safe to repeat, or reads through a register the loop
+//         has changed since the head, so regs don't tell what it reads
+static int decode(const MMU& mmu, const uint16_t addr, const CPURegisters& regs,
+                  int& reads, int& written, bool& branch)
+{
+	const uint8_t opcode = mmu.read(addr);
+	int length = 1;
+	int source = -1;  // address read, if any
+	int pointer = 0;  // registers source was formed from
+	int writes = 0;
+
+	branch = false;
+
+	switch(opcode) {
+	case 0x00:  // NOP
+	case 0x33: case 0x3B:  // INC/DEC SP
+		break;
+	case 0x03: case 0x0B: case 0x13: case 0x1B:  // INC/DEC rr
+	case 0x23: case 0x2B:
+		writes = PAIR_BITS(opcode >> 4);
+		break;
+	case 0x04: case 0x05: case 0x0C: case 0x0D:  // INC/DEC r
+	case 0x14: case 0x15: case 0x1C: case 0x1D:
+	case 0x24: case 0x25: case 0x2C: case 0x2D:
+	case 0x3C: case 0x3D:
+		writes = REG_BIT((opcode >> 3) & 0x07);
+		break;
+	case 0x06: case 0x0E: case 0x16: case 0x1E:  // LD r, n
+	case 0x26: case 0x2E: case 0x3E:
+		writes = REG_BIT((opcode >> 3) & 0x07);
+		length = 2;
+		break;
+	case 0xC6: case 0xCE: case 0xD6: case 0xDE:  // ALU A, n
+	case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+		length = 2;
+		break;
+	case 0x0A:  // LD A, (BC)
+		source = regs.BC;
+		pointer = PAIR_BITS(0);
+		break;
+	case 0x1A:  // LD A, (DE)
+		source = regs.DE;
+		pointer = PAIR_BITS(1);
+		break;
+	case 0xFA:  // LD A, (nn)
+		source = (mmu.read(addr + 2) << 8) | mmu.read(addr + 1);
+		length = 3;
+		break;
+	case 0xF0:  // LDH A, (n)
+		source = 0xFF00 + mmu.read(addr + 1);
+		length = 2;
+		break;
+	case 0xF2:  // LD A, (C)
+		source = 0xFF00 + (regs.BC & 0xFF);
+		pointer = REG_BIT(1);
+		break;
+	case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:  // JR (cc,) e
+		branch = true;
+		length = 2;
+		break;
+	case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:  // JP (cc,) nn
+		branch = true;
+		length = 3;
+		break;
+	case 0xCB: {
+		const uint8_t cb_opcode = mmu.read(addr + 1);
+		if (cb_opcode < 0x40 || cb_opcode > 0x7F)  // only BIT b, r
+			return 0;
+		if ((cb_opcode & 0x07) == 0x06) {
+			source = regs.HL;
+			pointer = PAIR_BITS(2);
+		}
+		length = 2;
+		break;
+	}
+	default:
+		// LD r, r' and ALU A, r, but not LD (HL), r or HALT
+		if (opcode < 0x40 || opcode > 0xBF || (opcode >= 0x70 && opcode <= 0x77))
+			return 0;
+		if ((opcode & 0x07) == 0x06) {
+			source = regs.HL;
+			pointer = PAIR_BITS(2);
+		}
+		if (opcode < 0x80)
+			writes = REG_BIT((opcode >> 3) & 0x07);
+	}
+
+	if (source >= 0) {
+		const int flags = read_flags(source);
+		if (flags < 0 || (pointer & written))
+			return 0;
+		reads |= flags;
+	}
+
+	written |= writes;
+	return length;
+}
+
+
+IdleLoopDetector::IdleLoopDetector(const MMU& mmu) : gb_mmu(mmu)
+{
+	reset();
+}
+
+
+// Inputs: None
+// Function: Forget the loop being tracked and any pending prediction
+void IdleLoopDetector::reset()
+{
+	prev_pc = 0;
+	resumed = false;
+	looping = false;
+	visited = false;
+	reads = 0;
+	stable_until = 0;
+
+	expecting = false;
+	mismatches = 0;
+}
+
+
+// Input: regs - cpu registers before the next instruction
+//        clock - cpu clock before the next instruction
+// Return: Clock cycles per iteration if the cpu is at the head of an idle
+//         loop, 0 otherwise
+// Function: Called before every instruction to follow backward branches
+int IdleLoopDetector::observe(const CPURegisters& regs, const uint64_t clock)
+{
+	const uint16_t pc = regs.PC;
+	int iteration = 0;
+
+	if (expecting)
+		check_expectation(regs, clock);
+
+	// back at the head right after a skip, no instruction ran since
+	if (resumed) {
+		resumed = false;
+		return 0;
+	}
+
+	// leaving the loop, by exiting it or for an interrupt, ends it
+	if (looping && (pc < head || pc > end))
+		looping = false;
+
+	if (pc <= prev_pc && prev_pc - pc <= MAX_IDLE_LOOP_BYTES) {
+		if (!looping || pc != head || prev_pc != end) {
+			looping = true;
+			head = pc;
+			end = prev_pc;
+			visited = false;
+			stable_until = 0;
+		} else if (visited && same_registers(regs, head_regs) && analyze(regs)) {
+			iteration = (int)(clock - head_clock);
+		}
+
+		visited = true;
+		head_regs = regs;
+		head_clock = clock;
+	}
+
+	prev_pc = pc;
+	return iteration;
+}
+
+
+// Input: cycles - whole iterations' worth of clock cycles skipped
+// Return: None
+// Function: Account for a skip taken at the loop head
+void IdleLoopDetector::skipped(const int cycles)
+{
+	head_clock += cycles;
+	resumed = true;
+}
+
+
+// Input: clock - cpu clock at which plain execution should be back at the
+//                loop head with the same registers
+// Return: None
+// Function: Record a skip prediction for IDLE_SKIP_VERIFY instead of taking
+//           it; observe() checks it when execution gets there
+void IdleLoopDetector::expect(const uint64_t clock)
+{
+	if (expecting)
+		return;
+
+	expecting = true;
+	expect_clock = clock;
+	expect_regs = head_regs;
+}
+
+
+void IdleLoopDetector::check_expectation(const CPURegisters& regs, const uint64_t clock)
+{
+	if (clock < expect_clock)
+		return;
+
+	if (clock > expect_clock || !same_registers(regs, expect_regs)) {
+		mismatches++;
+		fprintf(stderr, "idle loop at 0x%04X: expected back at cycle %llu, "
+		        "got PC 0x%04X at cycle %llu\n", expect_regs.PC,
+		        (unsigned long long)expect_clock, regs.PC, (unsigned long long)clock);
+	}
+
+	expecting = false;
+}
+
+
+// Input: regs - register values at the loop head
+// Return: true if every instruction from head to the closing branch can be
+//         repeated without side effects. Sets reads.
+bool IdleLoopDetector::analyze(const CPURegisters& regs)
+{
+	int addr = head;
+	int written = 0;
+	bool branch = false;
+
+	reads = 0;
+
+	while (addr <= end) {
+		const int length = decode(gb_mmu, addr, regs, reads, written, branch);
+		if (!length)
+			return false;
+		if (addr == end)
+			return branch;
+		addr += length;
+	}
+
+	// the closing branch isn't on an instruction boundary
+	return false;
+}
@@ -0,0 +1,100 @@
+#ifndef IDLE_LOOP_H_
+#define IDLE_LOOP_H_
+
+#include "cpu.h"
+#include <stdint.h>
+
+#define MAX_IDLE_LOOP_BYTES 32
+
+// What an idle loop polls, i.e. which device events can end it
+#define IDLE_READS_PPU  0x01  // LCD registers, change at mode changes
+#define IDLE_READS_DIV  0x02
+#define IDLE_READS_TIMA 0x04
+#define IDLE_READS_IF   0x08  // any interrupt request
+
+enum IdleSkipMode {
+	IDLE_SKIP_OFF,
+	IDLE_SKIP_ON,
+	IDLE_SKIP_VERIFY  // detect and predict, but execute normally and check
+};
+
+class MMU;
+
+
+// Spots busy-wait loops such as "LDH A,(44h); CP n; JR NZ" so the emulator
+// can skip whole iterations at once. A loop qualifies when it is a short
+// backward branch, its body only reads memory and registers, and the
+// register file is identical at two consecutive visits of the loop head.
+// Such a loop repeats exactly until a device changes one of the values it
+// reads, so iterations can be skipped up to the next such event without
+// changing timing. The event must also not have come during the last
+// iteration, after its reads, so a skip is only taken once a previous visit
+// has established that none was due before this one.
+class IdleLoopDetector {
+public:
+	IdleLoopDetector(const MMU& mmu);
+	void reset();
+
+	int observe(const CPURegisters& regs, const uint64_t clock);
+	int get_reads() const;
+	uint64_t get_stable_until() const;
+	void set_stable_until(const uint64_t clock);
+
+	void skipped(const int cycles);
+	void expect(const uint64_t clock);
+	uint64_t get_mismatches() const;
+private:
+	const MMU& gb_mmu;
+
+	uint16_t prev_pc;
+	bool resumed;          // a skip was just taken
+	bool looping;          // head/end describe the loop being executed
+	uint16_t head;         // loop start, the target of the backward branch
+	uint16_t end;          // address of the backward branch
+	bool visited;          // head_regs/head_clock are from the last visit
+	CPURegisters head_regs;
+	uint64_t head_clock;
+	int reads;
+	uint64_t stable_until; // nothing the loop reads changes before this clock
+
+	bool expecting;        // IDLE_SKIP_VERIFY prediction in flight
+	uint64_t expect_clock;
+	CPURegisters expect_regs;
+	uint64_t mismatches;
+
+	bool analyze(const CPURegisters& regs);
+	void check_expectation(const CPURegisters& regs, const uint64_t clock);
+};
+
+
+// Return: IDLE_READS_* flags of the loop last reported by observe()
+inline int IdleLoopDetector::get_reads() const
+{
+	return reads;
+}
+
+
+// Return: Clock before which nothing the tracked loop reads can change, as
+//         last set for it, or 0
+inline uint64_t IdleLoopDetector::get_stable_until() const
+{
+	return stable_until;
+}
+
+
+// Input: clock - clock before which nothing the tracked loop reads can
+//                change
+// Return: None
+inline void IdleLoopDetector::set_stable_until(const uint64_t clock)
+{
+	stable_until = clock;
+}
+
+
+// Return: Number of predictions that plain execution didn't match
+inline uint64_t IdleLoopDetector::get_mismatches() const
+{
+	return mismatches;
+}
+
+#endif  // IDLE_LOOP_H_
@@ -0,0 +1,41 @@
+#include "link_cable.h"
+#include <stddef.h>
+
+
+LinkPort::LinkPort() : outgoing(NULL), incoming(NULL), clock(NULL), other_clock(NULL)
+{
+}
+
+
+// Inputs: None
+// Function: Leave the cable. The peer stops waiting for us and every
+//           transfer it clocks from now on receives 0xFF. A closed port
+//           can't be used again.
+void LinkPort::close()
+{
+	clock->store(LINK_NO_PEER, std::memory_order_release);
+}
+
+
+LinkCable::LinkCable()
+	: to_side0(LINK_QUEUE_MESSAGES, BACKPRESSURE), to_side1(LINK_QUEUE_MESSAGES, BACKPRESSURE),
+	  clock0(0), clock1(0)
+{
+	ports[0].outgoing = &to_side1;
+	ports[0].incoming = &to_side0;
+	ports[0].clock = &clock0;
+	ports[0].other_clock = &clock1;
+
+	ports[1].outgoing = &to_side0;
+	ports[1].incoming = &to_side1;
+	ports[1].clock = &clock1;
+	ports[1].other_clock = &clock0;
+}
+
+
+// Input: side - 0 or 1
+// Return: End of the cable for one of the two instances
+LinkPort& LinkCable::port(const int side)
+{
+	return ports[side & 1];
+}
@@ -0,0 +1,122 @@
+#ifndef LINK_CABLE_H_
+#define LINK_CABLE_H_
+
+#include "ring_buffer.h"
+#include <stdint.h>
+#include <atomic>
+
+#define SERIAL_TRANSFER_CYCLES 4096  // 8 bits at 8192 Hz
+#define LINK_QUEUE_MESSAGES    16
+
+// How far an instance may run ahead of the clock its peer last published.
+// A transfer takes SERIAL_TRANSFER_CYCLES, so with this bound neither side
+// can pass the end of a transfer before it has seen the start, even with an
+// instruction's worth of overshoot.
+#define LINK_WINDOW (SERIAL_TRANSFER_CYCLES - 32)
+
+#define LINK_PUBLISH_INTERVAL 256  // cycles between clock updates to the peer
+
+#define LINK_NO_PEER UINT64_MAX
+
+enum LinkMessageType {
+	LINK_START,  // the clocking side started a transfer
+	LINK_REPLY   // the other side's byte, shifted out by the end of it
+};
+
+struct LinkMessage {
+	uint64_t time;  // cpu cycle the transfer ends on
+	LinkMessageType type;
+	uint8_t data;
+};
+
+
+// One end of a LinkCable, used by the Serial unit of one instance. Each
+// direction is a lock-free single-producer/single-consumer ring, and each
+// side publishes its cpu clock so the other can bound how far it runs ahead.
+class LinkPort {
+public:
+	LinkPort();
+
+	void send(const LinkMessage& message);
+	const LinkMessage* peek();
+	void pop();
+
+	void publish_clock(const uint64_t clock);
+	uint64_t peer_clock() const;
+	void close();
+private:
+	friend class LinkCable;
+
+	RingBuffer<LinkMessage>* outgoing;
+	RingBuffer<LinkMessage>* incoming;
+	std::atomic<uint64_t>* clock;       // ours; LINK_NO_PEER once closed
+	std::atomic<uint64_t>* other_clock;
+};
+
+
+// Serial link between two instances running on different threads. Plug
+// port(0) into one and port(1) into the other with GameBoy::attach_link().
+// The instances exchange each byte at the cycle its transfer completes in
+// both of them, and an instance only waits when it gets more than
+// LINK_WINDOW cycles ahead of the other, or when it finishes a transfer the
+// other hasn't reached yet.
+class LinkCable {
+public:
+	LinkCable();
+
+	LinkPort& port(const int side);
+private:
+	LinkCable(const LinkCable&) = delete;
+	LinkCable& operator=(const LinkCable&) = delete;
+
+	RingBuffer<LinkMessage> to_side0;
+	RingBuffer<LinkMessage> to_side1;
+	alignas(64) std::atomic<uint64_t> clock0;
+	alignas(64) std::atomic<uint64_t> clock1;
+	LinkPort ports[2];
+};
+
+
+// Input: message - message for the peer
+// Return: None
+// Function: Queue the message, waiting for room in the unlikely case the
+//           peer has fallen LINK_QUEUE_MESSAGES messages behind. Messages
+//           to a peer that has left are dropped.
+inline void LinkPort::send(const LinkMessage& message)
+{
+	while (!outgoing->push(message))
+		if (peer_clock() == LINK_NO_PEER)
+			return;
+}
+
+
+// Return: Oldest message from the peer, or NULL if there is none
+inline const LinkMessage* LinkPort::peek()
+{
+	return incoming->begin_read();
+}
+
+
+// Function: Drop the message returned by peek()
+inline void LinkPort::pop()
+{
+	incoming->end_read();
+}
+
+
+// Input: clock - our cpu clock; it must never go backwards
+// Return: None
+inline void LinkPort::publish_clock(const uint64_t clock)
+{
+	if (this->clock->load(std::memory_order_relaxed) != LINK_NO_PEER)
+		this->clock->store(clock, std::memory_order_release);
+}
+
+
+// Return: Last clock the peer published, or LINK_NO_PEER once it has left
+inline uint64_t LinkPort::peer_clock() const
+{
+	return other_clock->load(std::memory_order_acquire);
+}
+
+#endif  // LINK_CABLE_H_
@@ -1,14 +1,53 @@
 #include "mmu.h"
+#include "apu.h"
+#include "timer.h"
+#include "ppu.h"
+#include "serial.h"
+#include "render_worker.h"
+#include <vector>
 
 #define MIN(x,y) ((x < y) ? x : y)
 
+static const uint64_t stopped_clock = 0;
 
-MMU::MMU()
+
+MMU::MMU() : joypad(0), clock(&stopped_clock), apu(NULL), timer(NULL), ppu(NULL),
+             serial(NULL), renderer(NULL)
 {
+	for (int i = 0; i < MEMORY_PAGES; i++)
+		pages[i] = PagePool::allocate();
+
+	mark_all_dirty();
 	initialize();
 }
 
 
+// Input: parent - MMU to fork
+// Function: Share the parent's pages and ROM. Neither side copies a page
+//           until it writes to it. Peripherals and the clock are not
+//           attached. The parent must not run while it is being forked.
+MMU::MMU(const MMU& parent)
+	: cartridge(parent.cartridge), code_map(parent.code_map), cartridge_type(parent.cartridge_type),
+	  RAM_bank_size(parent.RAM_bank_size), ROM_bank_size(parent.ROM_bank_size),
+	  joypad(parent.joypad), clock(&stopped_clock), apu(NULL), timer(NULL), ppu(NULL),
+	  serial(NULL), renderer(NULL)
+{
+	for (int i = 0; i < MEMORY_PAGES; i++) {
+		pages[i] = parent.pages[i];
+		PagePool::retain(pages[i]);
+	}
+
+	memcpy(dirty_blocks, parent.dirty_blocks, sizeof(dirty_blocks));
+}
+
+
+MMU::~MMU()
+{
+	for (int i = 0; i < MEMORY_PAGES; i++)
+		PagePool::release(pages[i]);
+}
+
+
 // Inputs: None
 // Function: Clear the internal RAM and initialize the
 //           special I/O registers in RAM
@@ -16,40 +55,62 @@ void MMU::initialize()
 {
 	// The GameBoy RAM actually contains random values when it's loaded,
 	// but it's zero'd out for emulation.
-	memset(memory, 0, RAM_size);
+	// The first 32kB of any loaded ROM is mapped back in; a page that
+	// already holds it is kept, so ROM pages shared with other MMUs stay
+	// shared.
+	const int rom_pages = cartridge ? ROM_PAGES : 0;
+
+	mark_all_dirty();
+	for (int i = 0; i < MEMORY_PAGES; i++) {
+		const uint8_t* rom = (i < rom_pages) ? cartridge.get() + i * MEMORY_PAGE_SIZE : NULL;
+
+		if (rom && memcmp(pages[i]->data, rom, MEMORY_PAGE_SIZE) == 0)
+			continue;
+		if (pages[i]->references.load(std::memory_order_acquire) != 1)
+			unshare_page(i, false);
+		if (rom)
+			memcpy(pages[i]->data, rom, MEMORY_PAGE_SIZE);
+		else
+			memset(pages[i]->data, 0, MEMORY_PAGE_SIZE);
+	}
 
 	// Special I/O registers
-	memory[0xFF05] = 0x00;  // TIMA
-	memory[0xFF06] = 0x00;  // TMA
-	memory[0xFF07] = 0x00;  // TAC
-	memory[0xFF10] = 0x80;  // NR10
-	memory[0xFF11] = 0xBF;  // NR11
-	memory[0xFF12] = 0xF3;  // NR12
-	memory[0xFF14] = 0xBF;  // NR14
-	memory[0xFF16] = 0x3F;  // NR21
-	memory[0xFF17] = 0x00;  // NR22
-	memory[0xFF19] = 0xBF;  // NR24
-	memory[0xFF1A] = 0x7F;  // NR30
-	memory[0xFF1B] = 0xFF;  // NR31
-	memory[0xFF1C] = 0x9F;  // NR32
-	memory[0xFF1E] = 0xBF;  // NR33
-	memory[0xFF20] = 0xFF;  // NR41
-	memory[0xFF21] = 0x00;  // NR42
-	memory[0xFF22] = 0x00;  // NR43
-	memory[0xFF23] = 0xBF;  // NR30
-	memory[0xFF24] = 0x77;  // NR50
-	memory[0xFF25] = 0xF3;  // NR51
-	memory[0xFF26] = 0xF1;  // NR52
-	memory[0xFF40] = 0x91;  // LCDC
-	memory[0xFF42] = 0x00;  // SCY
-	memory[0xFF43] = 0x00;  // SCX
-	memory[0xFF45] = 0x00;  // LYC
-	memory[0xFF47] = 0xFC;  // BGP
-	memory[0xFF48] = 0xFF;  // OBP0
-	memory[0xFF49] = 0xFF;  // OBP1
-	memory[0xFF4A] = 0x00;  // WY
-	memory[0xFF4B] = 0x00;  // WX
-	memory[0xFFFF] = 0x00;  // IE
+	set_io_register(0xFF00, 0xCF);  // P1
+	set_io_register(0xFF05, 0x00);  // TIMA
+	set_io_register(0xFF06, 0x00);  // TMA
+	set_io_register(0xFF07, 0x00);  // TAC
+	set_io_register(0xFF10, 0x80);  // NR10
+	set_io_register(0xFF11, 0xBF);  // NR11
+	set_io_register(0xFF12, 0xF3);  // NR12
+	set_io_register(0xFF14, 0xBF);  // NR14
+	set_io_register(0xFF16, 0x3F);  // NR21
+	set_io_register(0xFF17, 0x00);  // NR22
+	set_io_register(0xFF19, 0xBF);  // NR24
+	set_io_register(0xFF1A, 0x7F);  // NR30
+	set_io_register(0xFF1B, 0xFF);  // NR31
+	set_io_register(0xFF1C, 0x9F);  // NR32
+	set_io_register(0xFF1E, 0xBF);  // NR33
+	set_io_register(0xFF20, 0xFF);  // NR41
+	set_io_register(0xFF21, 0x00);  // NR42
+	set_io_register(0xFF22, 0x00);  // NR43
+	set_io_register(0xFF23, 0xBF);  // NR30
+	set_io_register(0xFF24, 0x77);  // NR50
+	set_io_register(0xFF25, 0xF3);  // NR51
+	set_io_register(0xFF26, 0xF1);  // NR52
+	set_io_register(0xFF40, 0x91);  // LCDC
+	set_io_register(0xFF42, 0x00);  // SCY
+	set_io_register(0xFF43, 0x00);  // SCX
+	set_io_register(0xFF45, 0x00);  // LYC
+	set_io_register(0xFF47, 0xFC);  // BGP
+	set_io_register(0xFF48, 0xFF);  // OBP0
+	set_io_register(0xFF49, 0xFF);  // OBP1
+	set_io_register(0xFF4A, 0x00);  // WY
+	set_io_register(0xFF4B, 0x00);  // WX
+	set_io_register(0xFFFF, 0x00);  // IE
+
+	update_joypad();
+	if (renderer)
+		invalidate_video();
 }
 
 
@@ -64,20 +125,393 @@ int MMU::load_ROM(const char* file_name)
 	if (!File.is_open())
 		return -1;
 
-	memset(cartridge, 0, 0x200000);
-
 	// get file size and set get position to beginning of file
 	std::streampos size = File.tellg();
 	File.seekg(0, std::ios::beg);
 
-	File.read((char*)cartridge, size);
+	if (size <= 0 || size > cartridge_size)
+		return -1;
 
-	cartridge_type = cartridge[0x0147];
-	RAM_bank_size = cartridge[0x0148];
-	ROM_bank_size = cartridge[0x0149];
+	std::vector<uint8_t> data(size);
+
+	if (!File.read((char*)&data[0], size))
+		return -1;
+
+	return load_ROM_data(&data[0], size);
+}
+
+
+// Input: data - ROM image
+//        size - size of the image in bytes
+// Return Value: Return 0 on success;
+//               return -1 if the image is empty or too large
+// Function: Copy the ROM into cartridge memory, store ROM info and map
+//           its code
+int MMU::load_ROM_data(const uint8_t* data, const size_t size)
+{
+	if (size == 0 || size > (size_t)cartridge_size)
+		return -1;
+
+	uint8_t* image = new uint8_t[cartridge_size];
+
+	memset(image, 0, cartridge_size);
+	memcpy(image, data, size);
+	cartridge.reset(image, std::default_delete<uint8_t[]>());
+	code_map = CodeMap::build(image, size);
+
+	cartridge_type = image[0x0147];
+	RAM_bank_size = image[0x0148];
+	ROM_bank_size = image[0x0149];
 
 	// load first available 32kB into memory
-	memcpy(memory, cartridge, MIN((int)size, 0x8000));
+	mark_all_dirty();
+	for (int addr = 0; addr < MIN((int)size, 0x8000); addr += MEMORY_PAGE_SIZE)
+		memcpy(writable(addr), image + addr, MIN((int)size - addr, MEMORY_PAGE_SIZE));
 
 	return 0;
 }
+
+
+// Input: source - MMU with a ROM loaded
+// Return: None
+// Function: Use the ROM loaded in source instead of loading a copy of it.
+//           The image, its code map and the pages it is mapped into are
+//           shared rather than copied, so many instances of one game cost
+//           one ROM. Like load_ROM_data(), follow with initialize().
+void MMU::share_ROM(const MMU& source)
+{
+	cartridge = source.cartridge;
+	code_map = source.code_map;
+	cartridge_type = source.cartridge_type;
+	RAM_bank_size = source.RAM_bank_size;
+	ROM_bank_size = source.ROM_bank_size;
+
+	mark_all_dirty();
+	for (int i = 0; i < ROM_PAGES; i++)
+		adopt_page(i, source.pages[i]);
+}
+
+
+// Input: source - MMU to take the contents of; it must not be running
+// Return: None
+// Function: Continue from source's memory, ROM and held buttons, sharing
+//           every page like a fork does, without copying anything.
+//           Peripherals stay attached and are not told.
+void MMU::share_memory(const MMU& source)
+{
+	share_ROM(source);
+	for (int i = ROM_PAGES; i < MEMORY_PAGES; i++)
+		adopt_page(i, source.pages[i]);
+
+	joypad = source.joypad;
+	if (renderer)
+		invalidate_video();
+}
+
+
+// Input: dst - first address to write
+//        src - first address to read
+//        size - bytes to copy; neither range may wrap past 0xFFFF
+// Return: None
+// Function: Copy memory as a cpu loop would byte by byte in ascending order,
+//           a page-sized run at a time. Like get_page(), it skips the I/O
+//           side effects of write_byte(), so dst must not reach the I/O
+//           registers, and dst must not overlap src from above. Bytes for
+//           the ROM are dropped, as write_byte() drops them.
+void MMU::copy(uint16_t dst, uint16_t src, int size)
+{
+	if (dst < 0x8000) {
+		const int skip = MIN(size, 0x8000 - dst);
+		dst += skip;
+		src += skip;
+		size -= skip;
+	}
+
+	while (size > 0) {
+		const int dst_left = MEMORY_PAGE_SIZE - (dst & (MEMORY_PAGE_SIZE - 1));
+		const int src_left = MEMORY_PAGE_SIZE - (src & (MEMORY_PAGE_SIZE - 1));
+		const int run = MIN(size, MIN(dst_left, src_left));
+		uint8_t* to = writable_range(dst, run);  // may replace the src page
+
+		memmove(to, &pages[src >> MEMORY_PAGE_SHIFT]->data[src & (MEMORY_PAGE_SIZE - 1)], run);
+		if (renderer)
+			log_video_range(dst, run);
+		dst += run;
+		src += run;
+		size -= run;
+	}
+}
+
+
+// Input: dst - first address to write
+//        value - byte to store
+//        size - bytes to fill; the range may not wrap past 0xFFFF
+// Return: None
+// Function: Set a range of memory without the I/O side effects of
+//           write_byte(), so it must not reach the I/O registers. Bytes for
+//           the ROM are dropped, as write_byte() drops them.
+void MMU::fill(uint16_t dst, const uint8_t value, int size)
+{
+	if (dst < 0x8000) {
+		const int skip = MIN(size, 0x8000 - dst);
+		dst += skip;
+		size -= skip;
+	}
+
+	while (size > 0) {
+		const int run = MIN(size, MEMORY_PAGE_SIZE - (dst & (MEMORY_PAGE_SIZE - 1)));
+
+		memset(writable_range(dst, run), value, run);
+		if (renderer)
+			log_video_range(dst, run);
+		dst += run;
+		size -= run;
+	}
+}
+
+
+// Input: addr - first address
+//        size - bytes from addr, all within addr's page
+// Return: Pointer to the byte at addr, in a page no other MMU shares
+// Function: Every block in the range counts as written
+uint8_t* MMU::writable_range(const uint16_t addr, const int size)
+{
+	mark_written(addr, size);
+	return writable(addr);
+}
+
+
+// Function: Count every block as written
+void MMU::mark_all_dirty()
+{
+	memset(dirty_blocks, 0xFF, sizeof(dirty_blocks));
+}
+
+
+// Input: page - index of a page shared with another MMU
+//        keep_contents - copy the shared contents, or leave the new page
+//                        undefined because it is about to be overwritten
+// Return: None
+// Function: Give this MMU a page of its own in place of the shared one
+void MMU::unshare_page(const int page, const bool keep_contents)
+{
+	MemoryPage* shared = pages[page];
+	MemoryPage* copy = PagePool::allocate();
+
+	if (keep_contents)
+		memcpy(copy->data, shared->data, MEMORY_PAGE_SIZE);
+
+	pages[page] = copy;
+	PagePool::release(shared);
+}
+
+
+// Input: page - index of the page to replace
+//        shared - page of another MMU to share in its place
+// Return: None
+void MMU::adopt_page(const int page, MemoryPage* shared)
+{
+	if (pages[page] == shared)
+		return;
+
+	PagePool::retain(shared);
+	PagePool::release(pages[page]);
+	pages[page] = shared;
+}
+
+
+// Input: clock - cpu clock cycle counter
+// Return: None
+// Function: Use clock to timestamp writes forwarded to peripherals
+void MMU::attach_clock(const uint64_t* clock)
+{
+	this->clock = clock ? clock : &stopped_clock;
+}
+
+
+// Input: apu - sound unit to drive, or NULL to skip sound entirely
+// Return: None
+// Function: Forward sound register writes to apu. The apu is restarted from
+//           the current register contents so it can be attached at any time.
+void MMU::attach_apu(APU* apu)
+{
+	this->apu = apu;
+
+	if (apu)
+		apu->reset(*clock, writable(0xFF10));
+}
+
+
+// Input: timer - DIV/TIMA unit, or NULL
+// Return: None
+// Function: Forward writes to 0xFF04 - 0xFF07 to timer
+void MMU::attach_timer(Timer* timer)
+{
+	this->timer = timer;
+}
+
+
+// Input: ppu - LCD controller, or NULL
+// Return: None
+// Function: Forward writes to the LCD registers to ppu
+void MMU::attach_ppu(PPU* ppu)
+{
+	this->ppu = ppu;
+}
+
+
+// Input: serial - serial port, or NULL
+// Return: None
+// Function: Forward writes to SB and SC to serial
+void MMU::attach_serial(Serial* serial)
+{
+	this->serial = serial;
+}
+
+
+// Input: renderer - worker drawing the frames, or NULL
+// Return: None
+// Function: Log writes to VRAM, OAM and the LCD registers to renderer
+void MMU::attach_renderer(RenderWorker* renderer)
+{
+	this->renderer = renderer;
+
+	if (renderer)
+		invalidate_video();
+}
+
+
+// Input: addr - I/O register address (0xFF00 - 0xFF7F)
+//        value - 8-bit value written, already stored in memory
+// Return: None
+// Function: Apply the side effects of writing an I/O register
+void MMU::write_io(const uint16_t addr, const uint8_t value)
+{
+	if (addr == 0xFF00) {
+		update_joypad();
+	} else if ((addr == 0xFF01) || (addr == 0xFF02)) {
+		if (serial)
+			serial->write_register(*clock, addr, value);
+	} else if ((addr >= 0xFF04) && (addr <= 0xFF07)) {
+		if (timer)
+			timer->write_register(addr, value);
+	} else if ((addr >= 0xFF10) && (addr < 0xFF40)) {
+		// sound registers and wave RAM
+		if (apu)
+			apu->write_register(*clock, addr, value);
+	} else if (addr == 0xFF46) {
+		// OAM DMA, done at once
+		const uint16_t source = value << 8;
+		if (source < 0xE000) {
+			const int offset = source & (MEMORY_PAGE_SIZE - 1);
+			memcpy(writable(0xFE00), &pages[source >> MEMORY_PAGE_SHIFT]->data[offset], 0xA0);
+			if (renderer)
+				log_video_range(0xFE00, 0xA0);
+		}
+	} else if ((addr >= 0xFF40) && (addr <= 0xFF4B)) {
+		if (ppu)
+			ppu->write_register(addr, value);
+	}
+}
+
+
+// Input: buttons - JOYPAD_* buttons now held
+// Return: None
+// Function: Update P1 and request the joypad interrupt when a button in a
+//           selected group is pressed
+void MMU::set_joypad(const uint8_t buttons)
+{
+	const uint8_t before = read(0xFF00);
+
+	joypad = buttons;
+	update_joypad();
+
+	// P1 lines are active low; the interrupt fires on a falling edge
+	if (before & ~read(0xFF00) & 0x0F)
+		request_interrupt(INT_JOYPAD);
+}
+
+
+// Function: Recompute the P1 input lines from the held buttons and the
+//           groups selected by bits 4 (directions) and 5 (buttons)
+void MMU::update_joypad()
+{
+	const uint8_t select = read(0xFF00) & 0x30;
+	uint8_t lines = 0x0F;
+
+	if (!(select & 0x10))
+		lines &= ~(joypad & 0x0F);
+	if (!(select & 0x20))
+		lines &= ~(joypad >> 4);
+
+	set_io_register(0xFF00, 0xC0 | select | lines);
+}
+
+
+// Input: state - receives the address space and held buttons
+// Return: None
+void MMU::get_state(MMUState& state) const
+{
+	for (int i = 0; i < MEMORY_PAGES; i++)
+		memcpy(&state.memory[i * MEMORY_PAGE_SIZE], pages[i]->data, MEMORY_PAGE_SIZE);
+	state.joypad = joypad;
+}
+
+
+// Input: state - state saved by get_state()
+// Return: None
+// Function: Restore the address space and held buttons without the side
+//           effects of writing the I/O registers. Shared pages that already
+//           hold the saved contents, such as the ROM, stay shared.
+void MMU::set_state(const MMUState& state)
+{
+	mark_all_dirty();
+	for (int i = 0; i < MEMORY_PAGES; i++) {
+		const uint8_t* contents = &state.memory[i * MEMORY_PAGE_SIZE];
+
+		if (pages[i]->references.load(std::memory_order_acquire) != 1) {
+			if (memcmp(pages[i]->data, contents, MEMORY_PAGE_SIZE) == 0)
+				continue;
+			unshare_page(i, false);
+		}
+		memcpy(pages[i]->data, contents, MEMORY_PAGE_SIZE);
+	}
+	joypad = state.joypad;
+	if (renderer)
+		invalidate_video();
+}
+
+
+// Input: addr - address written, 0x8000 or above
+//        value - byte written
+// Return: None
+// Function: Pass the write on to the renderer if the LCD reads addr
+void MMU::log_video_write(const uint16_t addr, const uint8_t value)
+{
+	if (addr < 0xA000 || (addr >= 0xFE00 && addr < 0xFEA0) || (addr >= 0xFF40 && addr < 0xFF4C))
+		renderer->log_write(*clock, addr, value);
+}
+
+
+// Input: addr - first address written
+//        size - bytes written from addr, none of them I/O registers
+// Return: None
+// Function: Pass the bytes of a bulk write that the LCD reads on to the
+//           renderer, as if written one by one
+void MMU::log_video_range(const uint16_t addr, const int size)
+{
+	for (int i = 0; i < size; i++) {
+		const uint16_t a = addr + i;
+
+		if ((a >= 0x8000 && a < 0xA000) || (a >= 0xFE00 && a < 0xFEA0))
+			renderer->log_write(*clock, a, read(a));
+	}
+}
+
+
+// Function: Make the renderer take a fresh copy of video memory, after it
+//           changed without being logged
+void MMU::invalidate_video()
+{
+	renderer->invalidate();
+}
@@ -1,30 +1,125 @@
 #ifndef MMU_H_
 #define MMU_H_
 
+#include "page_pool.h"
+#include "code_map.h"
 #include <stdint.h>
+#include <memory>
 #include <iostream>
 #include <fstream>
 #include <string.h>
 
+// Interrupt flags in IF (0xFF0F) and IE (0xFFFF), highest priority first
+#define INT_VBLANK 0x01
+#define INT_STAT   0x02
+#define INT_TIMER  0x04
+#define INT_SERIAL 0x08
+#define INT_JOYPAD 0x10
 
+// Buttons for MMU::set_joypad(), set while held
+#define JOYPAD_RIGHT  0x01
+#define JOYPAD_LEFT   0x02
+#define JOYPAD_UP     0x04
+#define JOYPAD_DOWN   0x08
+#define JOYPAD_A      0x10
+#define JOYPAD_B      0x20
+#define JOYPAD_SELECT 0x40
+#define JOYPAD_START  0x80
+
+#define MEMORY_SIZE  0x10000
+#define MEMORY_PAGES (MEMORY_SIZE / MEMORY_PAGE_SIZE)
+#define ROM_PAGES    (0x8000 / MEMORY_PAGE_SIZE)  // the ROM mapped at 0x0000 - 0x7FFF
+
+// Writes are tracked in 256-byte blocks for incremental state hashing
+#define DIRTY_BLOCK_SIZE  256
+#define DIRTY_BLOCK_SHIFT 8
+#define DIRTY_BLOCKS      (MEMORY_SIZE / DIRTY_BLOCK_SIZE)
+#define DIRTY_WORDS       (DIRTY_BLOCKS / 64)
+
+class APU;
+class Timer;
+class PPU;
+class Serial;
+class RenderWorker;
+
+struct MMUState {
+	uint8_t memory[MEMORY_SIZE];
+	uint8_t joypad;
+};
+
+
+// The address space is held in reference-counted 8 KiB pages so an MMU can be
+// forked cheaply: the copy shares the parent's pages and the ROM image, and
+// whichever side writes to a shared page first gets its own copy of it.
 class MMU {
 public:
 	MMU();
+	MMU(const MMU& parent);
+	~MMU();
 	void initialize();
 	int load_ROM(const char* file_name);
-	
+	int load_ROM_data(const uint8_t* data, const size_t size);
+	void share_ROM(const MMU& source);
+	void share_memory(const MMU& source);
+
 	uint8_t read(const uint16_t addr) const;
 	void write_byte(const uint16_t addr, const uint8_t value);
 	void write_word(const uint16_t addr, const uint16_t value);
+	void copy(const uint16_t dst, const uint16_t src, const int size);
+	void fill(const uint16_t dst, const uint8_t value, const int size);
+
+	void request_interrupt(const uint8_t interrupt);
+	void set_io_register(const uint16_t addr, const uint8_t value);
+	void set_joypad(const uint8_t buttons);
+
+	uint8_t* get_page(const uint16_t addr);
+	void mark_written(const uint16_t addr, const int size);
+	const uint8_t* get_block(const uint16_t addr) const;
+	void take_dirty_blocks(uint64_t* blocks);
+	const CodeMap* get_code_map() const;
+	void get_state(MMUState& state) const;
+	void set_state(const MMUState& state);
+
+	void attach_clock(const uint64_t* clock);
+	void attach_apu(APU* apu);
+	void attach_timer(Timer* timer);
+	void attach_ppu(PPU* ppu);
+	void attach_serial(Serial* serial);
+	void attach_renderer(RenderWorker* renderer);
 private:
-	static const int RAM_size = 0x10000;
+	static const int RAM_size = MEMORY_SIZE;
 	static const int cartridge_size = 0x200000;
-	uint8_t memory[RAM_size];
-	uint8_t cartridge[cartridge_size];  // GameBoy ROMs are stored on cartridges
+	MemoryPage* pages[MEMORY_PAGES];
+	std::shared_ptr<const uint8_t> cartridge;  // GameBoy ROMs are stored on cartridges; NULL before a load
+	std::shared_ptr<const CodeMap> code_map;   // of the cartridge, NULL before a load
 
 	uint8_t cartridge_type;
 	uint8_t RAM_bank_size;
 	uint8_t ROM_bank_size;
+
+	uint8_t joypad;  // JOYPAD_* buttons held
+
+	uint64_t dirty_blocks[DIRTY_WORDS];  // bit per block written since take_dirty_blocks()
+
+	const uint64_t* clock;  // cpu clock, used to timestamp peripheral writes
+	APU* apu;  // NULL when nobody is listening; sound writes are then only stored
+	Timer* timer;
+	PPU* ppu;
+	Serial* serial;
+	RenderWorker* renderer;  // logged to when video memory changes, or NULL
+
+	MMU& operator=(const MMU&) = delete;
+
+	uint8_t* writable(const uint16_t addr);
+	uint8_t* writable_range(const uint16_t addr, const int size);
+	void mark_all_dirty();
+	void unshare_page(const int page, const bool keep_contents);
+	void adopt_page(const int page, MemoryPage* shared);
+	void write_io(const uint16_t addr, const uint8_t value);
+	void update_joypad();
+	void log_video_write(const uint16_t addr, const uint8_t value);
+	void log_video_range(const uint16_t addr, const int size);
+	void invalidate_video();
 };
 
 
@@ -32,20 +127,44 @@ private:
 // Return: 8-bit value stored at the provided address
 inline uint8_t MMU::read(const uint16_t addr) const
 {
-	return memory[addr];
+	return pages[addr >> MEMORY_PAGE_SHIFT]->data[addr & (MEMORY_PAGE_SIZE - 1)];
+}
+
+
+// Input: addr - 16-bit memory address
+// Return: Pointer to the byte at addr, in a page no other MMU shares
+inline uint8_t* MMU::writable(const uint16_t addr)
+{
+	const int page = addr >> MEMORY_PAGE_SHIFT;
+	const int block = addr >> DIRTY_BLOCK_SHIFT;
+
+	if (pages[page]->references.load(std::memory_order_acquire) != 1)
+		unshare_page(page, true);
+
+	dirty_blocks[block >> 6] |= (uint64_t)1 << (block & 63);
+	return &pages[page]->data[addr & (MEMORY_PAGE_SIZE - 1)];
 }
 
 
 // Input: addr - 16-bit memory address
 //        value - 8-bit value to be written at provided address
 // Return: None
+// Function: Store a cpu write. Writes to the ROM are dropped, so its pages
+//           stay shared and match the code map; they would only select
+//           banks, and no memory bank controller is emulated.
 inline void MMU::write_byte(const uint16_t addr, const uint8_t value)
 {
-	// write to I/O ports
-	// if ((addr >= 0xFF00) && (addr < 0xFF4C)) 
-	//	memory[addr] = value;
+	if (addr < 0x8000)
+		return;
 
-	memory[addr] = value;
+	*writable(addr) = value;
+
+	if (renderer && addr >= 0x8000)
+		log_video_write(addr, value);
+
+	// write to I/O ports
+	if ((addr >= 0xFF00) && (addr < 0xFF80))
+		write_io(addr, value);
 }
 
 
@@ -55,8 +174,85 @@ inline void MMU::write_byte(const uint16_t addr, const uint8_t value)
 // Return: None
 inline void MMU::write_word(const uint16_t addr, const uint16_t value)
 {
-	memory[addr] = value & 0x0F;
-	memory[addr + 1] = (value & 0xF0) >> 8;
+	write_byte(addr, value & 0xFF);
+	write_byte(addr + 1, value >> 8);
+}
+
+
+// Input: interrupt - one of the INT_* flags
+// Return: None
+// Function: Set the interrupt's bit in IF
+inline void MMU::request_interrupt(const uint8_t interrupt)
+{
+	*writable(0xFF0F) |= interrupt;
+}
+
+
+// Input: addr - I/O register address
+//        value - 8-bit value to store
+// Return: None
+// Function: Update a register from the hardware side, without the side
+//           effects of a cpu write
+inline void MMU::set_io_register(const uint16_t addr, const uint8_t value)
+{
+	*writable(addr) = value;
+}
+
+
+
+// Input: addr - any address in the page
+// Return: Start of the 8 KiB page holding addr. Writes through the pointer
+//         skip the I/O side effects of write_byte(). The pointer is
+//         invalidated when the MMU is forked or its state is loaded.
+// Function: The whole page counts as written
+inline uint8_t* MMU::get_page(const uint16_t addr)
+{
+	const int page = addr >> MEMORY_PAGE_SHIFT;
+	const int blocks = MEMORY_PAGE_SIZE / DIRTY_BLOCK_SIZE;
+
+	dirty_blocks[page * blocks / 64] |= (~(uint64_t)0 >> (64 - blocks)) << (page * blocks % 64);
+	if (renderer)
+		invalidate_video();
+	return writable(addr & ~(MEMORY_PAGE_SIZE - 1));
+}
+
+
+// Input: addr - first address
+//        size - bytes from addr; the range may not wrap past 0xFFFF
+// Return: None
+// Function: Count every block in the range as written, for memory changed
+//           through a get_page() pointer after it was handed out
+inline void MMU::mark_written(const uint16_t addr, const int size)
+{
+	for (int block = addr >> DIRTY_BLOCK_SHIFT; block <= (addr + size - 1) >> DIRTY_BLOCK_SHIFT;
+	     block++)
+		dirty_blocks[block >> 6] |= (uint64_t)1 << (block & 63);
+}
+
+
+// Input: addr - any address in the block
+// Return: Start of the DIRTY_BLOCK_SIZE bytes holding addr, read only
+inline const uint8_t* MMU::get_block(const uint16_t addr) const
+{
+	return &pages[addr >> MEMORY_PAGE_SHIFT]->data[addr & (MEMORY_PAGE_SIZE - DIRTY_BLOCK_SIZE)];
+}
+
+
+// Input: blocks - receives DIRTY_WORDS words, bit n set if block n was
+//                 written since the last call
+// Return: None
+inline void MMU::take_dirty_blocks(uint64_t* blocks)
+{
+	memcpy(blocks, dirty_blocks, sizeof(dirty_blocks));
+	memset(dirty_blocks, 0, sizeof(dirty_blocks));
+}
+
+
+// Return: Code/data map of the loaded ROM, built when it was loaded and
+//         shared with forks, or NULL before a ROM is loaded
+inline const CodeMap* MMU::get_code_map() const
+{
+	return code_map.get();
 }
 
 #endif  // MMU_H_
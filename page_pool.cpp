@@ -0,0 +1,74 @@
+#include "page_pool.h"
+#include <mutex>
+#include <vector>
+
+static std::mutex pool_lock;
+static std::vector<MemoryPage*> pool;
+
+
+// Return: Page with one reference and undefined contents
+MemoryPage* PagePool::allocate()
+{
+	MemoryPage* page = NULL;
+
+	{
+		std::lock_guard<std::mutex> lock(pool_lock);
+
+		if (!pool.empty()) {
+			page = pool.back();
+			pool.pop_back();
+		}
+	}
+
+	if (!page)
+		page = new MemoryPage;
+
+	page->references.store(1, std::memory_order_relaxed);
+	return page;
+}
+
+
+// Input: page - page the caller stops using
+// Return: None
+// Function: Drop a reference; the last one returns the page to the pool
+void PagePool::release(MemoryPage* page)
+{
+	if (page->references.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(pool_lock);
+
+		if (pool.size() < PAGE_POOL_LIMIT) {
+			pool.push_back(page);
+			return;
+		}
+	}
+
+	delete page;
+}
+
+
+// Return: Number of pages waiting to be reused
+size_t PagePool::free_pages()
+{
+	std::lock_guard<std::mutex> lock(pool_lock);
+
+	return pool.size();
+}
+
+
+// Inputs: None
+// Function: Give the pooled pages back to the allocator
+void PagePool::trim()
+{
+	std::vector<MemoryPage*> pages;
+
+	{
+		std::lock_guard<std::mutex> lock(pool_lock);
+		pages.swap(pool);
+	}
+
+	for (size_t i = 0; i < pages.size(); i++)
+		delete pages[i];
+}
@@ -0,0 +1,41 @@
+#ifndef PAGE_POOL_H_
+#define PAGE_POOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#define MEMORY_PAGE_SIZE  0x2000  // 8 KiB, one VRAM/cartridge RAM/WRAM region
+#define MEMORY_PAGE_SHIFT 13
+#define PAGE_POOL_LIMIT   16384   // free pages kept for reuse, 128 MiB
+
+
+// A page of the emulated address space. Forked MMUs share pages and count
+// their references; a page is only written while a single MMU holds it.
+struct MemoryPage {
+	std::atomic<int> references;
+	alignas(64) uint8_t data[MEMORY_PAGE_SIZE];
+};
+
+
+// Process-wide free list of memory pages, so forking and releasing emulator
+// instances recycles pages instead of going through the allocator.
+class PagePool {
+public:
+	static MemoryPage* allocate();
+	static void retain(MemoryPage* page);
+	static void release(MemoryPage* page);
+
+	static size_t free_pages();
+	static void trim();
+};
+
+
+// Input: page - page another MMU starts to share
+// Return: None
+inline void PagePool::retain(MemoryPage* page)
+{
+	page->references.fetch_add(1, std::memory_order_relaxed);
+}
+
+#endif  // PAGE_POOL_H_
@@ -0,0 +1,440 @@
+#include "ppu.h"
+#include "mmu.h"
+#include "render_worker.h"
+
+#define OAM_END      80   // line_clock at which mode 2 ends
+#define TRANSFER_END 252  // line_clock at which mode 3 ends
+
+
+PPU::PPU(MMU& mmu) : gb_mmu(mmu), rendering(true), renderer(NULL)
+{
+	reset();
+}
+
+
+// Input: mmu - fork of the parent's MMU
+//        parent - LCD controller to copy the state and frame of
+PPU::PPU(MMU& mmu, const PPU& parent)
+	: gb_mmu(mmu), lcd_enabled(parent.lcd_enabled), line_clock(parent.line_clock),
+	  ly(parent.ly), mode(parent.mode), window_line(parent.window_line),
+	  off_clock(parent.off_clock), stat_line(parent.stat_line), rendering(parent.rendering),
+	  renderer(NULL), clock(parent.clock), frames(parent.frames)
+{
+	memcpy(&frame, &parent.frame, sizeof(frame));
+}
+
+
+// Inputs: None
+// Function: Restart the LCD at the top of a frame
+void PPU::reset()
+{
+	lcd_enabled = (gb_mmu.read(0xFF40) & 0x80) != 0;
+	line_clock = 0;
+	ly = 0;
+	mode = MODE_OAM;
+	window_line = 0;
+	off_clock = 0;
+	stat_line = false;
+
+	clock = 0;
+	frames = 0;
+	memset(&frame, 0, sizeof(frame));
+	if (renderer)
+		renderer->log_blank(clock);
+
+	update_stat();
+}
+
+
+// Input: cycles - cpu clock cycles that have passed
+// Return: None
+// Function: Advance the LCD through every mode change in the interval
+void PPU::tick(int cycles)
+{
+	clock += cycles;
+
+	if (!lcd_enabled) {
+		// A disabled LCD still finishes a blank frame every 70224 cycles so
+		// frame pacing doesn't depend on the game leaving it on.
+		off_clock += cycles;
+		while (off_clock >= CYCLES_PER_FRAME) {
+			off_clock -= CYCLES_PER_FRAME;
+			if (renderer)
+				renderer->log_blank(clock);
+			else
+				memset(frame.pixels, 0, sizeof(frame.pixels));
+			finish_frame();
+		}
+		return;
+	}
+
+	while (cycles > 0) {
+		const int boundary = next_boundary();
+
+		if (cycles < boundary) {
+			line_clock += cycles;
+			return;
+		}
+
+		line_clock += boundary;
+		cycles -= boundary;
+		advance();
+	}
+}
+
+
+// Input: addr - LCD register address (0xFF40 - 0xFF4B)
+//        value - 8-bit value written
+// Return: None
+// Function: Apply side effects of LCD register writes and restore the bits
+//           of STAT and LY that the game can't write
+void PPU::write_register(const uint16_t addr, const uint8_t value)
+{
+	switch(addr) {
+	case 0xFF40:  // LCDC
+		if (lcd_enabled && !(value & 0x80)) {
+			// switching off stops the LCD at the top of the screen
+			line_clock = 0;
+			ly = 0;
+			mode = MODE_HBLANK;
+			off_clock = 0;
+		} else if (!lcd_enabled && (value & 0x80)) {
+			line_clock = 0;
+			ly = 0;
+			mode = MODE_OAM;
+			window_line = 0;
+		}
+		lcd_enabled = (value & 0x80) != 0;
+		break;
+	case 0xFF41:  // STAT
+	case 0xFF44:  // LY
+	case 0xFF45:  // LYC
+		break;
+	default:
+		return;
+	}
+
+	update_stat();
+}
+
+
+// Input: None
+// Return: Cycles until the current frame is finished
+int PPU::cycles_until_frame_end() const
+{
+	if (!lcd_enabled)
+		return CYCLES_PER_FRAME - off_clock;
+
+	if (ly < 144)
+		return (144 - ly) * CYCLES_PER_LINE - line_clock;
+	return (LINES_PER_FRAME - ly + 144) * CYCLES_PER_LINE - line_clock;
+}
+
+
+// Input: None
+// Return: Cycles until the next mode or line change, the earliest point a
+//         STAT interrupt could be raised
+int PPU::cycles_until_mode_change() const
+{
+	if (!lcd_enabled)
+		return cycles_until_frame_end();
+
+	return next_boundary();
+}
+
+
+// Input: None
+// Return: Cycles until the LCD next reads VRAM and OAM to draw a line
+int PPU::cycles_until_render() const
+{
+	if (!lcd_enabled)
+		return cycles_until_frame_end();
+
+	if (ly < 144 && line_clock < OAM_END)
+		return OAM_END - line_clock;
+
+	const int lines = (ly + 1 < 144) ? 1 : LINES_PER_FRAME - ly;
+	return lines * CYCLES_PER_LINE - line_clock + OAM_END;
+}
+
+
+// Input: state - receives the timing state and the current frame
+// Return: None
+void PPU::get_state(PPUState& state) const
+{
+	state.lcd_enabled = lcd_enabled;
+	state.stat_line = stat_line;
+	state.line_clock = line_clock;
+	state.ly = ly;
+	state.mode = mode;
+	state.window_line = window_line;
+	state.off_clock = off_clock;
+	state.clock = clock;
+	state.frames = frames;
+	memcpy(&state.frame, &frame, sizeof(frame));
+}
+
+
+// Input: state - state saved by get_state()
+// Return: None
+// Function: Restore the timing state and the frame. LY and STAT in memory
+//           are restored along with the rest of the MMU.
+void PPU::set_state(const PPUState& state)
+{
+	lcd_enabled = state.lcd_enabled;
+	stat_line = state.stat_line;
+	line_clock = state.line_clock;
+	ly = state.ly;
+	mode = state.mode;
+	window_line = state.window_line;
+	off_clock = state.off_clock;
+	clock = state.clock;
+	frames = state.frames;
+	memcpy(&frame, &state.frame, sizeof(frame));
+}
+
+
+// Input: state - state from a file or another process, not yet loaded
+// Return: Whether set_state() can take it: every counter is within the
+//         frame, so none of them can index past a line or the frame
+bool PPU::is_valid_state(const PPUState& state)
+{
+	uint8_t flags[2];
+
+	memcpy(&flags[0], &state.lcd_enabled, 1);
+	memcpy(&flags[1], &state.stat_line, 1);
+
+	return flags[0] <= 1 && flags[1] <= 1 &&
+	       state.line_clock >= 0 && state.line_clock < CYCLES_PER_LINE &&
+	       state.ly >= 0 && state.ly < LINES_PER_FRAME &&
+	       state.mode >= MODE_HBLANK && state.mode <= MODE_TRANSFER &&
+	       state.window_line >= 0 && state.window_line <= SCREEN_HEIGHT &&
+	       state.off_clock >= 0 && state.off_clock < CYCLES_PER_FRAME;
+}
+
+
+int PPU::next_boundary() const
+{
+	if (ly >= 144)
+		return CYCLES_PER_LINE - line_clock;
+	if (line_clock < OAM_END)
+		return OAM_END - line_clock;
+	if (line_clock < TRANSFER_END)
+		return TRANSFER_END - line_clock;
+	return CYCLES_PER_LINE - line_clock;
+}
+
+
+// Function: Perform the mode change due at the current line_clock
+void PPU::advance()
+{
+	if (line_clock == CYCLES_PER_LINE) {
+		line_clock = 0;
+		ly++;
+
+		if (ly == 144) {
+			mode = MODE_VBLANK;
+			gb_mmu.request_interrupt(INT_VBLANK);
+			finish_frame();
+		} else if (ly == LINES_PER_FRAME) {
+			ly = 0;
+			window_line = 0;
+			mode = MODE_OAM;
+		} else if (ly < 144) {
+			mode = MODE_OAM;
+		}
+	} else if (line_clock == OAM_END) {
+		mode = MODE_TRANSFER;
+		render_line();
+	} else if (line_clock == TRANSFER_END) {
+		mode = MODE_HBLANK;
+	}
+
+	update_stat();
+}
+
+
+void PPU::finish_frame()
+{
+	if (renderer)
+		renderer->end_frame(frames, clock);
+
+	frame.frame_number = frames;
+	frame.clock_cycles = clock;
+	frames++;
+}
+
+
+// Function: Refresh LY and the STAT mode/coincidence bits, and request the
+//           STAT interrupt when any enabled source becomes active
+void PPU::update_stat()
+{
+	const uint8_t stat = gb_mmu.read(0xFF41);
+	const bool coincidence = (ly == gb_mmu.read(0xFF45));
+	const bool line = ((mode == MODE_HBLANK) && (stat & 0x08)) ||
+	                  ((mode == MODE_VBLANK) && (stat & 0x10)) ||
+	                  ((mode == MODE_OAM) && (stat & 0x20)) ||
+	                  (coincidence && (stat & 0x40));
+
+	gb_mmu.set_io_register(0xFF44, ly);
+	gb_mmu.set_io_register(0xFF41, 0x80 | (stat & 0x78) | (coincidence ? 0x04 : 0x00) | mode);
+
+	if (line && !stat_line && lcd_enabled)
+		gb_mmu.request_interrupt(INT_STAT);
+	stat_line = line;
+}
+
+
+// Function: Draw line ly, or log it for the renderer, and count the window
+//           rows drawn
+void PPU::render_line()
+{
+	const bool window = line_has_window(gb_mmu, ly);
+
+	if (renderer) {
+		if (renderer->is_stale())
+			renderer->sync(gb_mmu, clock);
+		renderer->log_line(clock, ly, window_line);
+	} else if (rendering) {
+		draw_line(gb_mmu, ly, window_line, &frame.pixels[ly * SCREEN_WIDTH]);
+	}
+
+	// later lines depend on how many window rows were drawn
+	if (window)
+		window_line++;
+}
+
+
+// Input: memory - MMU or VideoMemory to read the LCD registers from
+//        ly - line being drawn
+// Return: Whether the window covers part of the line
+template <class Memory>
+bool line_has_window(const Memory& memory, const int ly)
+{
+	return (memory.read(0xFF40) & 0x21) == 0x21 && ly >= memory.read(0xFF4A) &&
+	       memory.read(0xFF4B) - 7 < SCREEN_WIDTH;
+}
+
+
+// Input: memory - MMU or VideoMemory to read VRAM, OAM and the LCD
+//                 registers from
+//        ly - line to draw
+//        window_line - window rows drawn before this line in the frame
+//        out - SCREEN_WIDTH shades
+// Return: None
+// Function: Draw the background, window and sprites of line ly
+template <class Memory>
+void draw_line(const Memory& memory, const int ly, const int window_line, uint8_t* out)
+{
+	const uint8_t lcdc = memory.read(0xFF40);
+	const uint8_t bgp = memory.read(0xFF47);
+	uint8_t color_index[SCREEN_WIDTH];  // raw bg/window colors, for sprite priority
+
+	memset(color_index, 0, sizeof(color_index));
+
+	if (lcdc & 0x01) {
+		const uint8_t scy = memory.read(0xFF42);
+		const uint8_t scx = memory.read(0xFF43);
+		const int wx = memory.read(0xFF4B) - 7;
+		const bool window = line_has_window(memory, ly);
+
+		for (int x = 0; x < SCREEN_WIDTH; x++) {
+			uint16_t map;
+			int px;
+			int py;
+
+			if (window && x >= wx) {
+				map = (lcdc & 0x40) ? 0x9C00 : 0x9800;
+				px = x - wx;
+				py = window_line;
+			} else {
+				map = (lcdc & 0x08) ? 0x9C00 : 0x9800;
+				px = (scx + x) & 0xFF;
+				py = (scy + ly) & 0xFF;
+			}
+
+			const uint8_t tile = memory.read(map + (py >> 3) * 32 + (px >> 3));
+			const uint16_t tile_addr = (lcdc & 0x10) ? 0x8000 + tile * 16
+			                                         : 0x9000 + (int8_t)tile * 16;
+			const uint8_t low = memory.read(tile_addr + (py & 0x07) * 2);
+			const uint8_t high = memory.read(tile_addr + (py & 0x07) * 2 + 1);
+			const int bit = 7 - (px & 0x07);
+
+			color_index[x] = (((high >> bit) & 0x01) << 1) | ((low >> bit) & 0x01);
+		}
+	}
+
+	for (int x = 0; x < SCREEN_WIDTH; x++)
+		out[x] = (bgp >> (color_index[x] * 2)) & 0x03;
+
+	if (!(lcdc & 0x02))
+		return;
+
+	// up to ten sprites per line, in OAM order
+	const int height = (lcdc & 0x04) ? 16 : 8;
+	int sprites[10];
+	int count = 0;
+
+	for (int i = 0; i < 40 && count < 10; i++) {
+		const int y = memory.read(0xFE00 + i * 4) - 16;
+		if (ly >= y && ly < y + height)
+			sprites[count++] = i;
+	}
+
+	// Lower X wins, then lower OAM index. Draw lowest priority first so
+	// higher priority sprites end up on top.
+	for (int i = 1; i < count; i++) {
+		const int s = sprites[i];
+		const int sx = memory.read(0xFE00 + s * 4 + 1);
+		int j = i - 1;
+
+		while (j >= 0 && memory.read(0xFE00 + sprites[j] * 4 + 1) > sx) {
+			sprites[j + 1] = sprites[j];
+			j--;
+		}
+		sprites[j + 1] = s;
+	}
+
+	for (int i = count - 1; i >= 0; i--) {
+		const uint16_t oam = 0xFE00 + sprites[i] * 4;
+		const int y = memory.read(oam) - 16;
+		const int x = memory.read(oam + 1) - 8;
+		const uint8_t attributes = memory.read(oam + 3);
+		const uint8_t palette = memory.read((attributes & 0x10) ? 0xFF49 : 0xFF48);
+		uint8_t tile = memory.read(oam + 2);
+		int row = ly - y;
+
+		if (attributes & 0x40)  // y flip
+			row = height - 1 - row;
+		if (height == 16)
+			tile &= 0xFE;
+
+		const uint16_t tile_addr = 0x8000 + tile * 16 + row * 2;
+		const uint8_t low = memory.read(tile_addr);
+		const uint8_t high = memory.read(tile_addr + 1);
+
+		for (int p = 0; p < 8; p++) {
+			const int sx = x + p;
+			if (sx < 0 || sx >= SCREEN_WIDTH)
+				continue;
+
+			const int bit = (attributes & 0x20) ? p : 7 - p;  // x flip
+			const int color = (((high >> bit) & 0x01) << 1) | ((low >> bit) & 0x01);
+
+			if (color == 0)
+				continue;
+			if ((attributes & 0x80) && color_index[sx] != 0)  // behind bg colors 1-3
+				continue;
+
+			out[sx] = (palette >> (color * 2)) & 0x03;
+		}
+	}
+}
+
+
+template bool line_has_window<MMU>(const MMU& memory, const int ly);
+template bool line_has_window<VideoMemory>(const VideoMemory& memory, const int ly);
+template void draw_line<MMU>(const MMU& memory, const int ly, const int window_line,
+                             uint8_t* out);
+template void draw_line<VideoMemory>(const VideoMemory& memory, const int ly,
+                                     const int window_line, uint8_t* out);
@@ -0,0 +1,157 @@
+#ifndef PPU_H_
+#define PPU_H_
+
+#include "frame.h"
+#include <stdint.h>
+
+#define CYCLES_PER_LINE   456
+#define LINES_PER_FRAME   154
+#define CYCLES_PER_FRAME  (CYCLES_PER_LINE * LINES_PER_FRAME)  // 70224
+
+#define MODE_HBLANK   0
+#define MODE_VBLANK   1
+#define MODE_OAM      2
+#define MODE_TRANSFER 3
+
+class MMU;
+class RenderWorker;
+
+struct PPUState {
+	bool lcd_enabled;
+	bool stat_line;
+	int line_clock;
+	int ly;
+	int mode;
+	int window_line;
+	int off_clock;
+	uint64_t clock;
+	uint64_t frames;
+	VideoFrame frame;
+};
+
+
+// Copy of everything the LCD reads, for drawing away from the MMU
+struct VideoMemory {
+	uint8_t vram[0x2000];     // 0x8000 - 0x9FFF
+	uint8_t oam[0xA0];        // 0xFE00 - 0xFE9F
+	uint8_t registers[0x0C];  // 0xFF40 - 0xFF4B
+
+	uint8_t read(const uint16_t addr) const;
+	void write(const uint16_t addr, const uint8_t value);
+};
+
+
+template <class Memory> bool line_has_window(const Memory& memory, const int ly);
+template <class Memory> void draw_line(const Memory& memory, const int ly, const int window_line,
+                                       uint8_t* out);
+
+
+// LCD controller. Mode and LY timing follow the hardware line by line, and
+// each line is rendered in one go when mode 3 starts, using the registers,
+// VRAM and OAM as they are at that moment.
+class PPU {
+public:
+	PPU(MMU& mmu);
+	PPU(MMU& mmu, const PPU& parent);
+	void reset();
+
+	void tick(int cycles);
+	void write_register(const uint16_t addr, const uint8_t value);
+	void set_rendering(const bool enabled);
+	void attach_renderer(RenderWorker* renderer);
+
+	int cycles_until_frame_end() const;
+	int cycles_until_mode_change() const;
+	int cycles_until_render() const;
+
+	void get_state(PPUState& state) const;
+	void set_state(const PPUState& state);
+	static bool is_valid_state(const PPUState& state);
+
+	uint64_t get_frame_count() const;
+	const VideoFrame& get_frame() const;
+private:
+	MMU& gb_mmu;
+
+	bool lcd_enabled;  // LCDC bit 7 as last seen
+	int line_clock;   // cycles into the current line
+	int ly;
+	int mode;
+	int window_line;  // window rows drawn so far this frame
+	int off_clock;    // cycles into the current frame while the LCD is off
+	bool stat_line;   // OR of the enabled STAT sources, interrupts on rising edge
+	bool rendering;   // draw lines into frame; timing and interrupts run regardless
+	RenderWorker* renderer;  // draws the lines instead when not NULL
+
+	uint64_t clock;
+	uint64_t frames;
+	VideoFrame frame;
+
+	int next_boundary() const;
+	void advance();
+	void finish_frame();
+	void update_stat();
+	void render_line();
+};
+
+
+// Input: enabled - draw the screen; with false, lines keep their timing,
+//                  interrupts and window position but frame isn't updated
+// Return: None
+inline void PPU::set_rendering(const bool enabled)
+{
+	rendering = enabled;
+}
+
+
+// Input: renderer - worker to log lines and frames to, or NULL to draw
+//                   them here again
+// Return: None
+// Function: While a renderer is attached, frame isn't updated
+inline void PPU::attach_renderer(RenderWorker* renderer)
+{
+	this->renderer = renderer;
+}
+
+
+// Return: Number of frames finished since reset
+inline uint64_t PPU::get_frame_count() const
+{
+	return frames;
+}
+
+
+// Return: The last finished frame; lines of the frame in progress are
+//         rendered over it as they are reached
+inline const VideoFrame& PPU::get_frame() const
+{
+	return frame;
+}
+
+
+// Input: addr - address in VRAM, OAM or 0xFF40 - 0xFF4B
+// Return: Byte at addr
+inline uint8_t VideoMemory::read(const uint16_t addr) const
+{
+	if (addr >= 0xFF00)
+		return registers[addr - 0xFF40];
+	if (addr >= 0xFE00)
+		return oam[addr - 0xFE00];
+	return vram[addr - 0x8000];
+}
+
+
+// Input: addr - address in VRAM, OAM or 0xFF40 - 0xFF4B
+//        value - byte to store
+// Return: None
+inline void VideoMemory::write(const uint16_t addr, const uint8_t value)
+{
+	if (addr >= 0xFF00)
+		registers[addr - 0xFF40] = value;
+	else if (addr >= 0xFE00)
+		oam[addr - 0xFE00] = value;
+	else
+		vram[addr - 0x8000] = value;
+}
+
+#endif  // PPU_H_
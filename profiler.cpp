@@ -0,0 +1,204 @@
+#include "profiler.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+static const char raw_magic[8] = { 'G', 'B', 'P', 'R', 'O', 'F', 1, 0 };
+
+std::atomic<bool> Profiler::enabled(false);
+thread_local ProfileCounters* Profiler::counters = NULL;
+
+static std::mutex registry_lock;
+static std::vector<ProfileCounters*> registry;  // counters of running threads
+static ProfileCounters retired;                 // sums of threads that exited
+
+
+// Owns a thread's counters and folds them into retired when the thread exits
+struct ThreadCounters {
+	ProfileCounters* counters;
+
+	~ThreadCounters()
+	{
+		if (!counters)
+			return;
+
+		std::lock_guard<std::mutex> lock(registry_lock);
+
+		for (int i = 0; i < PROFILE_OPCODES; i++) {
+			retired.count[i] += counters->count[i];
+			retired.cycles[i] += counters->cycles[i];
+		}
+		for (int i = 0; i < PROFILE_PCS; i++)
+			retired.pc_samples[i] += counters->pc_samples[i];
+
+		registry.erase(std::find(registry.begin(), registry.end(), counters));
+		delete counters;
+	}
+};
+
+static thread_local ThreadCounters thread_counters;
+
+
+// Input: enabled - whether CPU::execute_next_opcode() records instructions
+// Return: None
+void Profiler::set_enabled(const bool enabled)
+{
+	Profiler::enabled.store(enabled, std::memory_order_relaxed);
+}
+
+
+// Inputs: None
+// Function: Clear the counters of every thread
+void Profiler::reset()
+{
+	std::lock_guard<std::mutex> lock(registry_lock);
+
+	memset(&retired, 0, sizeof(retired));
+	for (size_t i = 0; i < registry.size(); i++)
+		memset(registry[i], 0, sizeof(ProfileCounters));
+}
+
+
+// Input: total - receives the sum of the counters of every thread
+// Return: None
+void Profiler::merge(ProfileCounters& total)
+{
+	std::lock_guard<std::mutex> lock(registry_lock);
+
+	memcpy(&total, &retired, sizeof(total));
+
+	for (size_t t = 0; t < registry.size(); t++) {
+		const ProfileCounters* c = registry[t];
+
+		for (int i = 0; i < PROFILE_OPCODES; i++) {
+			total.count[i] += c->count[i];
+			total.cycles[i] += c->cycles[i];
+		}
+		for (int i = 0; i < PROFILE_PCS; i++)
+			total.pc_samples[i] += c->pc_samples[i];
+	}
+}
+
+
+// Input: file_name - text file to write
+//        top_pcs - number of most executed addresses to list
+// Return Value: Return 0 on success;
+//               return -1 on failure
+// Function: Write the opcodes sorted by the clock cycles they took, followed
+//           by the addresses executed most often
+int Profiler::write_report(const char* file_name, const int top_pcs)
+{
+	FILE* file = fopen(file_name, "w");
+
+	if (!file)
+		return -1;
+
+	ProfileCounters* total = new ProfileCounters;
+	merge(*total);
+
+	uint64_t instructions = 0;
+	uint64_t cycles = 0;
+	std::vector<int> opcodes;
+
+	for (int i = 0; i < PROFILE_OPCODES; i++) {
+		instructions += total->count[i];
+		cycles += total->cycles[i];
+		if (total->count[i])
+			opcodes.push_back(i);
+	}
+
+	std::sort(opcodes.begin(), opcodes.end(), [total](int a, int b) {
+		return total->cycles[a] > total->cycles[b];
+	});
+
+	fprintf(file, "%llu instructions, %llu cycles\n\n",
+	        (unsigned long long)instructions, (unsigned long long)cycles);
+	fprintf(file, "opcode        count          cycles  cycles%%  cycles/op\n");
+
+	for (size_t i = 0; i < opcodes.size(); i++) {
+		const int op = opcodes[i];
+		char name[16];
+
+		if (op >= 0x100)
+			snprintf(name, sizeof(name), "CB %02X", op - 0x100);
+		else
+			snprintf(name, sizeof(name), "%02X", op);
+
+		fprintf(file, "%-6s %12llu %15llu %7.2f%% %10.2f\n", name,
+		        (unsigned long long)total->count[op], (unsigned long long)total->cycles[op],
+		        cycles ? 100.0 * total->cycles[op] / cycles : 0.0,
+		        (double)total->cycles[op] / total->count[op]);
+	}
+
+	std::vector<int> pcs;
+
+	for (int i = 0; i < PROFILE_PCS; i++)
+		if (total->pc_samples[i])
+			pcs.push_back(i);
+
+	const size_t shown = std::min(pcs.size(), (size_t)(top_pcs > 0 ? top_pcs : 0));
+
+	std::partial_sort(pcs.begin(), pcs.begin() + shown, pcs.end(), [total](int a, int b) {
+		return total->pc_samples[a] > total->pc_samples[b];
+	});
+
+	fprintf(file, "\npc            count  count%%\n");
+
+	for (size_t i = 0; i < shown; i++)
+		fprintf(file, "0x%04X %12llu %6.2f%%\n", pcs[i],
+		        (unsigned long long)total->pc_samples[pcs[i]],
+		        instructions ? 100.0 * total->pc_samples[pcs[i]] / instructions : 0.0);
+
+	delete total;
+
+	return fclose(file) == 0 ? 0 : -1;
+}
+
+
+// Input: file_name - binary file to write
+// Return Value: Return 0 on success;
+//               return -1 on failure
+// Function: Dump the summed counters for offline analysis. Layout, in host
+//           byte order: 8-byte magic "GBPROF\1\0", u32 PROFILE_OPCODES,
+//           u32 PROFILE_PCS, u64 count[], u64 cycles[], u64 pc_samples[].
+int Profiler::write_raw(const char* file_name)
+{
+	FILE* file = fopen(file_name, "wb");
+
+	if (!file)
+		return -1;
+
+	ProfileCounters* total = new ProfileCounters;
+	merge(*total);
+
+	const uint32_t sizes[2] = { PROFILE_OPCODES, PROFILE_PCS };
+	bool ok = fwrite(raw_magic, sizeof(raw_magic), 1, file) == 1 &&
+	          fwrite(sizes, sizeof(sizes), 1, file) == 1 &&
+	          fwrite(total, sizeof(*total), 1, file) == 1;
+
+	delete total;
+
+	if (fclose(file) != 0)
+		ok = false;
+
+	return ok ? 0 : -1;
+}
+
+
+// Function: Give the calling thread zeroed counters and register them
+ProfileCounters* Profiler::attach_thread()
+{
+	ProfileCounters* c = new ProfileCounters;
+
+	memset(c, 0, sizeof(*c));
+
+	std::lock_guard<std::mutex> lock(registry_lock);
+
+	registry.push_back(c);
+	thread_counters.counters = c;
+	counters = c;
+
+	return c;
+}
@@ -0,0 +1,66 @@
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <stdint.h>
+#include <atomic>
+
+#define PROFILE_OPCODES 512  // 256 opcodes, then the 256 CB-prefixed ones
+#define PROFILE_PCS     0x10000
+
+
+struct ProfileCounters {
+	uint64_t count[PROFILE_OPCODES];
+	uint64_t cycles[PROFILE_OPCODES];
+	uint64_t pc_samples[PROFILE_PCS];
+};
+
+
+// Counts executions and clock cycles per opcode, and executions per PC.
+//
+// Each thread that executes instructions gets its own counters, so several
+// emulators can run on separate threads without sharing cache lines; the
+// counters of all threads are summed when a report is written. Reports should
+// be written while no emulation thread is running. Recording costs one branch
+// per instruction while the profiler is disabled.
+class Profiler {
+public:
+	static void set_enabled(const bool enabled);
+	static bool is_enabled();
+	static void reset();
+
+	static void record(const uint16_t pc, const int opcode, const int cycles);
+	static void merge(ProfileCounters& total);
+
+	static int write_report(const char* file_name, const int top_pcs = 32);
+	static int write_raw(const char* file_name);
+private:
+	static std::atomic<bool> enabled;  // set from any thread
+	static thread_local ProfileCounters* counters;
+
+	static ProfileCounters* attach_thread();
+};
+
+
+inline bool Profiler::is_enabled()
+{
+	return enabled.load(std::memory_order_relaxed);
+}
+
+
+// Input: pc - address of the instruction
+//        opcode - opcode, or 0x100 + the second byte for CB-prefixed opcodes
+//        cycles - clock cycles the instruction took
+// Return: None
+inline void Profiler::record(const uint16_t pc, const int opcode, const int cycles)
+{
+	ProfileCounters* c = counters;
+
+	if (!c)
+		c = attach_thread();
+
+	c->count[opcode]++;
+	c->cycles[opcode] += cycles;
+	c->pc_samples[pc]++;
+}
+
+#endif  // PROFILER_H_
@@ -0,0 +1,210 @@
+#include "render_worker.h"
+#include "mmu.h"
+#include <string.h>
+#include <chrono>
+
+#define LOG_RESERVE 16384  // entries; a frame with a full VRAM and OAM rewrite fits
+#define IDLE_SPINS  256    // yields before the worker sleeps on an empty queue
+
+
+RenderWorker::RenderWorker()
+	: queue(RENDER_QUEUE_FRAMES, BACKPRESSURE), output(RENDER_OUTPUT_FRAMES, DROP_OLDEST),
+	  running(false), drawn_count(0), log(NULL), stale(true), stall_count(0)
+{
+}
+
+
+RenderWorker::~RenderWorker()
+{
+	stop();
+}
+
+
+// Input: None
+// Return: None
+// Function: Start the worker thread. Attach the worker to a GameBoy after
+//           this, so the first line logged carries all of video memory.
+void RenderWorker::start()
+{
+	if (log)
+		return;
+
+	stale = true;
+	stall_count = 0;
+	drawn_count.store(0, std::memory_order_relaxed);
+	running.store(true, std::memory_order_release);
+	worker = std::thread(&RenderWorker::worker_loop, this);
+	next_log();
+}
+
+
+// Input: None
+// Return: None
+// Function: Draw the frames already handed over, drop the one being
+//           logged, and stop the worker thread. Detach the worker from its
+//           GameBoy first.
+void RenderWorker::stop()
+{
+	if (!log)
+		return;
+
+	log = NULL;
+	running.store(false, std::memory_order_release);
+	worker.join();
+}
+
+
+// Input: clock - cpu clock when the line was drawn
+//        ly - line, 0 - 143
+//        window_line - window rows drawn before it in the frame
+// Return: None
+void RenderWorker::log_line(const uint64_t clock, const int ly, const int window_line)
+{
+	if (log) {
+		const VideoLogEntry entry = { (uint32_t)clock, (uint16_t)ly, (uint8_t)window_line,
+		                              VIDEO_LOG_LINE };
+		log->entries.push_back(entry);
+	}
+}
+
+
+// Input: clock - cpu clock when the screen was cleared
+// Return: None
+void RenderWorker::log_blank(const uint64_t clock)
+{
+	if (log) {
+		const VideoLogEntry entry = { (uint32_t)clock, 0, 0, VIDEO_LOG_BLANK };
+		log->entries.push_back(entry);
+	}
+}
+
+
+// Input: mmu - memory to copy VRAM, OAM and the LCD registers from
+//        clock - cpu clock now
+// Return: None
+// Function: Log a snapshot of video memory for the worker to restore, when
+//           is_stale() says its copy may be out of date
+void RenderWorker::sync(const MMU& mmu, const uint64_t clock)
+{
+	if (!log)
+		return;
+
+	const VideoLogEntry entry = { (uint32_t)clock, (uint16_t)log->snapshots.size(), 0,
+	                              VIDEO_LOG_SYNC };
+
+	log->snapshots.resize(log->snapshots.size() + 1);
+	VideoMemory& snapshot = log->snapshots.back();
+
+	for (int i = 0; i < 0x2000; i++)
+		snapshot.vram[i] = mmu.read(0x8000 + i);
+	for (int i = 0; i < 0xA0; i++)
+		snapshot.oam[i] = mmu.read(0xFE00 + i);
+	for (int i = 0; i < 0x0C; i++)
+		snapshot.registers[i] = mmu.read(0xFF40 + i);
+
+	log->entries.push_back(entry);
+	stale = false;
+}
+
+
+// Input: frame_number - frames finished before this one since reset
+//        clock_cycles - cpu cycle the frame was finished on
+// Return: None
+// Function: Hand the frame's log to the worker and start the next one
+void RenderWorker::end_frame(const uint64_t frame_number, const uint64_t clock_cycles)
+{
+	if (!log)
+		return;
+
+	log->frame_number = frame_number;
+	log->clock_cycles = clock_cycles;
+	queue.end_write();
+	next_log();
+}
+
+
+// Function: Take a free log from the queue, waiting only if the worker has
+//           fallen a whole queue behind
+void RenderWorker::next_log()
+{
+	VideoLog* next;
+
+	while (!(next = queue.begin_write())) {
+		stall_count++;
+		std::this_thread::yield();
+	}
+
+	next->entries.clear();
+	next->entries.reserve(LOG_RESERVE);
+	next->snapshots.clear();
+	log = next;
+}
+
+
+// Function: Draw logged frames until stopped
+void RenderWorker::worker_loop()
+{
+	VideoMemory* memory = new VideoMemory();
+	VideoFrame* frame = new VideoFrame();
+	int idle = 0;
+
+	for (;;) {
+		const VideoLog* next = queue.begin_read();
+
+		if (!next) {
+			if (running.load(std::memory_order_acquire)) {
+				if (++idle < IDLE_SPINS)
+					std::this_thread::yield();
+				else
+					std::this_thread::sleep_for(std::chrono::microseconds(100));
+				continue;
+			}
+			// stopping; anything handed over before stop() is visible now
+			next = queue.begin_read();
+			if (!next)
+				break;
+		}
+
+		idle = 0;
+		replay(*next, *memory, *frame);
+		queue.end_read();
+
+		output.push(*frame);
+		drawn_count.store(drawn_count.load(std::memory_order_relaxed) + 1,
+		                  std::memory_order_relaxed);
+	}
+
+	delete frame;
+	delete memory;
+}
+
+
+// Input: log - frame to draw
+//        memory - the worker's copy of video memory, as of the end of the
+//                 previous frame
+//        frame - receives the frame; lines not drawn keep their contents
+// Return: None
+void RenderWorker::replay(const VideoLog& log, VideoMemory& memory, VideoFrame& frame)
+{
+	for (size_t i = 0; i < log.entries.size(); i++) {
+		const VideoLogEntry& entry = log.entries[i];
+
+		switch(entry.type) {
+		case VIDEO_LOG_WRITE:
+			memory.write(entry.addr, entry.value);
+			break;
+		case VIDEO_LOG_LINE:
+			draw_line(memory, entry.addr, entry.value, &frame.pixels[entry.addr * SCREEN_WIDTH]);
+			break;
+		case VIDEO_LOG_BLANK:
+			memset(frame.pixels, 0, sizeof(frame.pixels));
+			break;
+		case VIDEO_LOG_SYNC:
+			memory = log.snapshots[entry.addr];
+			break;
+		}
+	}
+
+	frame.frame_number = log.frame_number;
+	frame.clock_cycles = log.clock_cycles;
+}
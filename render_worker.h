@@ -0,0 +1,143 @@
+#ifndef RENDER_WORKER_H_
+#define RENDER_WORKER_H_
+
+#include "ppu.h"
+#include "ring_buffer.h"
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define RENDER_QUEUE_FRAMES  2  // logged frames waiting to be drawn
+#define RENDER_OUTPUT_FRAMES 4  // drawn frames waiting to be read, oldest dropped
+
+// VideoLogEntry types
+#define VIDEO_LOG_WRITE 0  // a byte of VRAM, OAM or an LCD register was written
+#define VIDEO_LOG_LINE  1  // the LCD drew a line
+#define VIDEO_LOG_BLANK 2  // the LCD cleared the screen
+#define VIDEO_LOG_SYNC  3  // video memory changed wholesale; restore a snapshot
+
+class MMU;
+
+
+struct VideoLogEntry {
+	uint32_t clock;  // low bits of the cpu clock
+	uint16_t addr;   // address written; LY for a line; snapshot number for a sync
+	uint8_t value;   // value written; window line for a line
+	uint8_t type;    // VIDEO_LOG_*
+};
+
+
+// Everything the LCD reads during one frame, in the order it happened
+struct VideoLog {
+	uint64_t frame_number;
+	uint64_t clock_cycles;
+	std::vector<VideoLogEntry> entries;
+	std::vector<VideoMemory> snapshots;
+};
+
+
+// Draws frames on a worker thread, in parallel with emulation.
+//
+// Once attached to a GameBoy, the MMU logs every write to VRAM, OAM and the
+// LCD registers, and the PPU logs each line where it would otherwise draw
+// it. A finished frame's log is handed to the worker, which replays it into
+// its own copy of video memory and draws each line at its place in the
+// stream, so mid-frame scroll, palette and sprite changes come out exactly
+// as drawn serially. Writes that bypass the log, such as loading a state or
+// writing through MMU::get_page(), make the next line carry a snapshot of
+// all of video memory instead.
+//
+// Frames come out one frame behind the emulation. The emulation thread
+// only waits if the worker falls RENDER_QUEUE_FRAMES behind.
+class RenderWorker {
+public:
+	RenderWorker();
+	~RenderWorker();
+
+	void start();
+	void stop();
+
+	// emulation thread
+	void log_write(const uint64_t clock, const uint16_t addr, const uint8_t value);
+	void log_line(const uint64_t clock, const int ly, const int window_line);
+	void log_blank(const uint64_t clock);
+	void end_frame(const uint64_t frame_number, const uint64_t clock_cycles);
+	void invalidate();
+	bool is_stale() const;
+	void sync(const MMU& mmu, const uint64_t clock);
+	uint64_t stalls() const;
+
+	// any one other thread
+	FrameRing& frames();
+	uint64_t frames_drawn() const;
+private:
+	RingBuffer<VideoLog> queue;
+	FrameRing output;
+	std::thread worker;
+	std::atomic<bool> running;
+	std::atomic<uint64_t> drawn_count;
+
+	VideoLog* log;  // being filled, NULL while stopped
+	bool stale;     // the worker's copy of video memory can't be trusted
+	uint64_t stall_count;
+
+	RenderWorker(const RenderWorker&) = delete;
+	RenderWorker& operator=(const RenderWorker&) = delete;
+
+	void next_log();
+	void worker_loop();
+	void replay(const VideoLog& log, VideoMemory& memory, VideoFrame& frame);
+};
+
+
+// Input: clock - cpu clock at the write
+//        addr - address in VRAM, OAM or 0xFF40 - 0xFF4B
+//        value - byte written
+// Return: None
+inline void RenderWorker::log_write(const uint64_t clock, const uint16_t addr,
+                                    const uint8_t value)
+{
+	if (log) {
+		const VideoLogEntry entry = { (uint32_t)clock, addr, value, VIDEO_LOG_WRITE };
+		log->entries.push_back(entry);
+	}
+}
+
+
+// Input: None
+// Return: None
+// Function: Note that video memory changed without being logged
+inline void RenderWorker::invalidate()
+{
+	stale = true;
+}
+
+
+inline bool RenderWorker::is_stale() const
+{
+	return stale;
+}
+
+
+// Return: Number of frames the emulation thread waited for the worker
+inline uint64_t RenderWorker::stalls() const
+{
+	return stall_count;
+}
+
+
+// Return: Drawn frames, to read with begin_read() and end_read() or pop()
+inline FrameRing& RenderWorker::frames()
+{
+	return output;
+}
+
+
+// Return: Number of frames the worker has drawn
+inline uint64_t RenderWorker::frames_drawn() const
+{
+	return drawn_count.load(std::memory_order_relaxed);
+}
+
+#endif  // RENDER_WORKER_H_
@@ -0,0 +1,236 @@
+#ifndef RING_BUFFER_H_
+#define RING_BUFFER_H_
+
+#include "frame.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+
+enum OverflowPolicy {
+	DROP_OLDEST,   // a full ring discards its oldest item to make room
+	BACKPRESSURE   // a full ring refuses new items until the consumer catches up
+};
+
+
+// Lock-free single-producer/single-consumer ring of preallocated slots.
+// Items are never copied in or out: the producer is lent a free slot to fill
+// in place and the consumer is lent the oldest filled slot to read in place.
+// Neither side ever blocks; a full or empty ring is reported by returning NULL
+// and counted in overruns()/underruns().
+//
+// Under DROP_OLDEST the producer may advance the read position itself, so the
+// consumer claims an item by compare-and-swap and publishes the slot it holds.
+// One slot more than the capacity is allocated so that the held slot is never
+// reused while the consumer is still reading it.
+template <typename T>
+class RingBuffer {
+public:
+	RingBuffer(const int capacity, const OverflowPolicy policy);
+	~RingBuffer();
+
+	// producer side
+	T* begin_write();
+	void end_write();
+	bool push(const T& item);
+
+	// consumer side
+	const T* begin_read();
+	void end_read();
+	bool pop(T& item);
+
+	int size() const;
+	int capacity() const;
+	OverflowPolicy policy() const;
+	uint64_t overruns() const;
+	uint64_t underruns() const;
+private:
+	static const uint64_t no_slot = ~(uint64_t)0;
+
+	RingBuffer(const RingBuffer&) = delete;
+	RingBuffer& operator=(const RingBuffer&) = delete;
+
+	T* slots;
+	const uint64_t slot_count;
+	const uint64_t max_items;
+	const OverflowPolicy overflow_policy;
+
+	// Indices increase monotonically; slot = index % slot_count. Each index
+	// lives on its own cache line so the two threads don't share one.
+	alignas(64) std::atomic<uint64_t> head;  // next item to be written
+	alignas(64) std::atomic<uint64_t> tail;  // next item to be read
+	std::atomic<uint64_t> held;              // item lent to the consumer, or no_slot
+	alignas(64) std::atomic<uint64_t> overrun_count;
+	alignas(64) std::atomic<uint64_t> underrun_count;
+};
+
+typedef RingBuffer<VideoFrame> FrameRing;
+typedef RingBuffer<AudioBlock> AudioRing;
+
+
+template <typename T>
+RingBuffer<T>::RingBuffer(const int capacity, const OverflowPolicy policy)
+	: slot_count(capacity + 1), max_items(capacity), overflow_policy(policy),
+	  head(0), tail(0), held(no_slot), overrun_count(0), underrun_count(0)
+{
+	slots = new T[slot_count];
+}
+
+
+template <typename T>
+RingBuffer<T>::~RingBuffer()
+{
+	delete[] slots;
+}
+
+
+// Input: None
+// Return: Free slot to fill in place, or NULL if the ring is full and the
+//         policy (or a slot still lent to the consumer) keeps it full
+// Function: Lend the producer the next slot. Publish it with end_write().
+template <typename T>
+T* RingBuffer<T>::begin_write()
+{
+	const uint64_t write = head.load(std::memory_order_relaxed);
+	bool counted = false;
+
+	for (;;) {
+		uint64_t read = tail.load(std::memory_order_seq_cst);
+		const uint64_t lent = held.load(std::memory_order_seq_cst);
+		const bool full = (write - read) >= max_items;
+		const bool lent_slot = (lent != no_slot) && ((write - lent) >= slot_count);
+
+		if (!full && !lent_slot)
+			return &slots[write % slot_count];
+
+		if (!counted) {
+			overrun_count.store(overrun_count.load(std::memory_order_relaxed) + 1,
+			                    std::memory_order_relaxed);
+			counted = true;
+		}
+
+		// the consumer is still reading the only slot we could take
+		if (overflow_policy == BACKPRESSURE || !full)
+			return NULL;
+
+		// drop the oldest item; on failure the consumer just took it
+		tail.compare_exchange_strong(read, read + 1, std::memory_order_seq_cst);
+	}
+}
+
+
+// Function: Publish the slot returned by the last successful begin_write()
+template <typename T>
+void RingBuffer<T>::end_write()
+{
+	head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+
+// Input: item - value to copy into the ring
+// Return: true if the item was queued
+template <typename T>
+bool RingBuffer<T>::push(const T& item)
+{
+	T* slot = begin_write();
+
+	if (!slot)
+		return false;
+
+	*slot = item;
+	end_write();
+	return true;
+}
+
+
+// Input: None
+// Return: Oldest item to read in place, or NULL if the ring is empty
+// Function: Lend the consumer the oldest item. Release it with end_read().
+template <typename T>
+const T* RingBuffer<T>::begin_read()
+{
+	for (;;) {
+		uint64_t read = tail.load(std::memory_order_acquire);
+
+		if (read == head.load(std::memory_order_acquire)) {
+			underrun_count.store(underrun_count.load(std::memory_order_relaxed) + 1,
+			                     std::memory_order_relaxed);
+			return NULL;
+		}
+
+		// announce the slot before taking it so the producer never reuses it
+		held.store(read, std::memory_order_seq_cst);
+		if (tail.compare_exchange_strong(read, read + 1, std::memory_order_seq_cst))
+			return &slots[read % slot_count];
+
+		// the producer dropped it first; try the next one
+		held.store(no_slot, std::memory_order_seq_cst);
+	}
+}
+
+
+// Function: Return the slot lent by the last successful begin_read()
+template <typename T>
+void RingBuffer<T>::end_read()
+{
+	held.store(no_slot, std::memory_order_release);
+}
+
+
+// Input: item - destination for the oldest item
+// Return: true if an item was read
+template <typename T>
+bool RingBuffer<T>::pop(T& item)
+{
+	const T* slot = begin_read();
+
+	if (!slot)
+		return false;
+
+	item = *slot;
+	end_read();
+	return true;
+}
+
+
+// Return: Number of items waiting to be read
+template <typename T>
+int RingBuffer<T>::size() const
+{
+	const uint64_t read = tail.load(std::memory_order_acquire);
+	const uint64_t write = head.load(std::memory_order_acquire);
+
+	return (write > read) ? (int)(write - read) : 0;
+}
+
+
+template <typename T>
+int RingBuffer<T>::capacity() const
+{
+	return (int)max_items;
+}
+
+
+template <typename T>
+OverflowPolicy RingBuffer<T>::policy() const
+{
+	return overflow_policy;
+}
+
+
+// Return: Number of writes that found the ring full
+template <typename T>
+uint64_t RingBuffer<T>::overruns() const
+{
+	return overrun_count.load(std::memory_order_relaxed);
+}
+
+
+// Return: Number of reads that found the ring empty
+template <typename T>
+uint64_t RingBuffer<T>::underruns() const
+{
+	return underrun_count.load(std::memory_order_relaxed);
+}
+
+#endif  // RING_BUFFER_H_
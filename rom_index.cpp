@@ -0,0 +1,305 @@
+#include "rom_index.h"
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+static const char index_magic[8] = { 'G', 'B', 'R', 'O', 'M', 'I', 'D', 'X' };
+
+
+// Return: Whether name ends in .gb or .gbc, in any case
+static bool is_rom_name(const char* name)
+{
+	const char* dot = strrchr(name, '.');
+
+	return dot && (strcasecmp(dot, ".gb") == 0 || strcasecmp(dot, ".gbc") == 0);
+}
+
+
+// Input: dir - directory to search, recursively
+//        paths - receives the path of every ROM file found
+// Return: None
+// Function: Unreadable directories are skipped
+static void find_roms(const std::string& dir, std::vector<std::string>& paths)
+{
+	DIR* handle = opendir(dir.c_str());
+
+	if (!handle)
+		return;
+
+	while (const struct dirent* item = readdir(handle)) {
+		if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+			continue;
+
+		const std::string path = dir + "/" + item->d_name;
+		bool is_dir = item->d_type == DT_DIR;
+		bool is_file = item->d_type == DT_REG;
+
+		// some file systems don't report the type
+		if (item->d_type == DT_UNKNOWN || item->d_type == DT_LNK) {
+			struct stat info;
+			if (stat(path.c_str(), &info) != 0)
+				continue;
+			is_dir = S_ISDIR(info.st_mode) && item->d_type != DT_LNK;
+			is_file = S_ISREG(info.st_mode);
+		}
+
+		if (is_dir)
+			find_roms(path, paths);
+		else if (is_file && is_rom_name(item->d_name))
+			paths.push_back(path);
+	}
+
+	closedir(handle);
+}
+
+
+// Input: path - ROM file
+//        entry - receives its size, time and header fields
+// Return: None
+// Function: Read only the header; the flags record what went wrong
+static void index_rom(const std::string& path, RomIndexEntry& entry)
+{
+	uint8_t header[ROM_HEADER_END];
+	struct stat info;
+	const int fd = ::open(path.c_str(), O_RDONLY);
+
+	memset(&entry, 0, sizeof(entry));
+	entry.flags = ROM_READ_FAILED;
+
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &info) == 0) {
+		entry.file_size = info.st_size;
+		entry.mtime = info.st_mtime;
+
+		if (pread(fd, header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+		    parse_rom_header(header, sizeof(header), entry) == 0 &&
+		    entry.rom_size_code <= 8 && entry.file_size >= (uint64_t)0x8000 << entry.rom_size_code)
+			entry.flags |= ROM_SIZE_VALID;
+	}
+
+	::close(fd);
+}
+
+
+// Input: header - the first bytes of a ROM image
+//        size - bytes in header, at least ROM_HEADER_END
+//        entry - receives the header fields; its file size, time and path
+//                are left alone
+// Return Value: Return 0 on success;
+//               return -1 if size is too small to hold the header
+int parse_rom_header(const uint8_t* header, const size_t size, RomIndexEntry& entry)
+{
+	if (size < ROM_HEADER_END)
+		return -1;
+
+	uint8_t checksum = 0;
+	for (int addr = 0x0134; addr <= 0x014C; addr++)
+		checksum = checksum - header[addr] - 1;
+
+	entry.cgb_flag = header[0x0143];
+	entry.cartridge_type = header[0x0147];
+	entry.rom_size_code = header[0x0148];
+	entry.ram_size_code = header[0x0149];
+	entry.header_checksum = header[0x014D];
+	entry.global_checksum = (header[0x014E] << 8) | header[0x014F];
+	entry.flags = (checksum == header[0x014D]) ? ROM_HEADER_VALID : 0;
+
+	// CGB titles give up their last byte to the CGB flag
+	const int title_length = (entry.cgb_flag & 0x80) ? ROM_TITLE_LENGTH - 1 : ROM_TITLE_LENGTH;
+	memset(entry.title, 0, sizeof(entry.title));
+	for (int i = 0; i < title_length && header[0x0134 + i]; i++)
+		entry.title[i] = header[0x0134 + i];
+
+	return 0;
+}
+
+
+// Input: dirs - directories to search for .gb and .gbc files, recursively
+//        file_name - index file to create or update
+//        threads - threads to read headers on, at least 1
+// Return: Number of ROMs indexed, or -1 if the index can't be written
+// Function: Stat every ROM and read the headers of those whose size or time
+//           differs from the previous index at file_name, on a pool of
+//           threads. The new index is written to a temporary file and
+//           renamed into place, so readers see either index whole.
+int build_rom_index(const std::vector<std::string>& dirs, const char* file_name,
+                    const int threads)
+{
+	std::vector<std::string> paths;
+	RomIndex previous;
+
+	for (size_t i = 0; i < dirs.size(); i++)
+		find_roms(dirs[i], paths);
+	std::sort(paths.begin(), paths.end());
+	paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+	previous.open(file_name);  // a missing or stale index means reading every header
+
+	std::vector<RomIndexEntry> entries(paths.size());
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+
+	auto work = [&]() {
+		for (size_t i = next++; i < paths.size(); i = next++) {
+			const int old = previous.find(paths[i].c_str());
+			struct stat info;
+
+			if (old >= 0 && stat(paths[i].c_str(), &info) == 0 &&
+			    previous.entry(old).file_size == (uint64_t)info.st_size &&
+			    previous.entry(old).mtime == info.st_mtime &&
+			    !(previous.entry(old).flags & ROM_READ_FAILED))
+				entries[i] = previous.entry(old);
+			else
+				index_rom(paths[i], entries[i]);
+		}
+	};
+
+	for (int i = 1; i < threads; i++)
+		workers.push_back(std::thread(work));
+	work();
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	previous.close();
+
+	std::string path_data;
+	for (size_t i = 0; i < paths.size(); i++) {
+		entries[i].path_offset = path_data.size();
+		path_data.append(paths[i].c_str(), paths[i].size() + 1);
+	}
+
+	RomIndexHeader header;
+	memcpy(header.magic, index_magic, sizeof(index_magic));
+	header.version = ROM_INDEX_VERSION;
+	header.count = entries.size();
+	header.paths_offset = sizeof(header) + entries.size() * sizeof(RomIndexEntry);
+	header.paths_size = path_data.size();
+
+	const std::string temp_name = std::string(file_name) + "." + std::to_string(getpid());
+	FILE* file = fopen(temp_name.c_str(), "wb");
+
+	if (!file)
+		return -1;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+	          (entries.empty() ||
+	           fwrite(&entries[0], sizeof(RomIndexEntry), entries.size(), file) == entries.size()) &&
+	          (path_data.empty() || fwrite(path_data.data(), path_data.size(), 1, file) == 1);
+
+	if (fclose(file) != 0)
+		ok = false;
+
+	if (!ok || rename(temp_name.c_str(), file_name) != 0) {
+		remove(temp_name.c_str());
+		return -1;
+	}
+
+	return entries.size();
+}
+
+
+RomIndex::RomIndex() : data(NULL), data_size(0), header(NULL), entries(NULL), paths(NULL)
+{
+}
+
+
+RomIndex::~RomIndex()
+{
+	close();
+}
+
+
+// Input: file_name - index written by build_rom_index()
+// Return Value: Return 0 on success;
+//               return -1 if the file can't be mapped or isn't a valid index
+int RomIndex::open(const char* file_name)
+{
+	struct stat info;
+	const int fd = ::open(file_name, O_RDONLY);
+
+	close();
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(RomIndexHeader)) {
+		::close(fd);
+		return -1;
+	}
+
+	void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED)
+		return -1;
+
+	const RomIndexHeader* h = (const RomIndexHeader*)mapped;
+	const uint64_t size = info.st_size;
+	const uint64_t entries_end = sizeof(RomIndexHeader) + (uint64_t)h->count * sizeof(RomIndexEntry);
+	bool ok = memcmp(h->magic, index_magic, sizeof(index_magic)) == 0 &&
+	          h->version == ROM_INDEX_VERSION && h->paths_offset == entries_end &&
+	          h->paths_size <= size && h->paths_offset <= size - h->paths_size &&
+	          (h->count == 0 || (h->paths_size > 0 &&
+	                             ((const char*)mapped)[h->paths_offset + h->paths_size - 1] == 0));
+
+	const RomIndexEntry* e = (const RomIndexEntry*)((const uint8_t*)mapped + sizeof(RomIndexHeader));
+	for (uint32_t i = 0; ok && i < h->count; i++)
+		ok = e[i].path_offset < h->paths_size;
+
+	if (!ok) {
+		munmap(mapped, info.st_size);
+		return -1;
+	}
+
+	data = (const uint8_t*)mapped;
+	data_size = info.st_size;
+	header = h;
+	entries = e;
+	paths = (const char*)data + h->paths_offset;
+	return 0;
+}
+
+
+// Inputs: None
+// Function: Unmap the index; entries and paths returned so far are invalid
+void RomIndex::close()
+{
+	if (data)
+		munmap((void*)data, data_size);
+
+	data = NULL;
+	data_size = 0;
+	header = NULL;
+	entries = NULL;
+	paths = NULL;
+}
+
+
+// Input: path - ROM path as it was indexed
+// Return: Number of its entry, or -1 if it isn't in the index
+int RomIndex::find(const char* path) const
+{
+	int low = 0;
+	int high = (int)size() - 1;
+
+	while (low <= high) {
+		const int middle = low + (high - low) / 2;
+		const int order = strcmp(this->path(middle), path);
+
+		if (order == 0)
+			return middle;
+		if (order < 0)
+			low = middle + 1;
+		else
+			high = middle - 1;
+	}
+
+	return -1;
+}
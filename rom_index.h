@@ -0,0 +1,98 @@
+#ifndef ROM_INDEX_H_
+#define ROM_INDEX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#define ROM_INDEX_VERSION 1
+#define ROM_HEADER_END    0x150  // bytes read from each ROM file
+#define ROM_TITLE_LENGTH  16
+
+// RomIndexEntry flags
+#define ROM_HEADER_VALID 0x01  // the header checksum at 0x014D matches
+#define ROM_SIZE_VALID   0x02  // the file is as large as the header says
+#define ROM_READ_FAILED  0x04  // the file couldn't be read or is too short
+
+// On-disk index layout, in host byte order: a RomIndexHeader, count
+// entries, then the paths, each NUL-terminated. Every field is naturally
+// aligned so the file can be used in place once mapped.
+struct RomIndexHeader {
+	char magic[8];          // "GBROMIDX"
+	uint32_t version;       // ROM_INDEX_VERSION
+	uint32_t count;         // entries
+	uint64_t paths_offset;  // from the start of the file
+	uint64_t paths_size;
+};
+
+struct RomIndexEntry {
+	uint64_t file_size;
+	int64_t mtime;               // seconds; with file_size, decides whether to reread
+	uint32_t path_offset;        // into the paths
+	uint16_t global_checksum;    // as stored at 0x014E, big-endian there
+	uint8_t cartridge_type;      // 0x0147, the MBC and extras
+	uint8_t rom_size_code;       // 0x0148, 32 KiB << code
+	uint8_t ram_size_code;       // 0x0149
+	uint8_t cgb_flag;            // 0x0143
+	uint8_t header_checksum;     // as stored at 0x014D
+	uint8_t flags;               // ROM_* flags
+	char title[ROM_TITLE_LENGTH];  // NUL-padded, not terminated when 16 long
+	uint8_t reserved[12];
+};
+
+
+// Read-only view of an index file written by build_rom_index(). The file is
+// mapped, not read, so opening even a large library costs one page fault
+// per page touched.
+class RomIndex {
+public:
+	RomIndex();
+	~RomIndex();
+
+	int open(const char* file_name);
+	void close();
+
+	uint32_t size() const;
+	const RomIndexEntry& entry(const uint32_t i) const;
+	const char* path(const uint32_t i) const;
+	int find(const char* path) const;
+private:
+	const uint8_t* data;  // mapped file, NULL while closed
+	size_t data_size;
+	const RomIndexHeader* header;
+	const RomIndexEntry* entries;
+	const char* paths;
+
+	RomIndex(const RomIndex&) = delete;
+	RomIndex& operator=(const RomIndex&) = delete;
+};
+
+
+int build_rom_index(const std::vector<std::string>& dirs, const char* file_name,
+                    const int threads);
+int parse_rom_header(const uint8_t* header, const size_t size, RomIndexEntry& entry);
+
+
+inline uint32_t RomIndex::size() const
+{
+	return header ? header->count : 0;
+}
+
+
+// Input: i - entry number, below size()
+// Return: Entry i; entries are sorted by path
+inline const RomIndexEntry& RomIndex::entry(const uint32_t i) const
+{
+	return entries[i];
+}
+
+
+// Input: i - entry number, below size()
+// Return: Path of the ROM file as it was found under the indexed directory
+inline const char* RomIndex::path(const uint32_t i) const
+{
+	return paths + entries[i].path_offset;
+}
+
+#endif  // ROM_INDEX_H_
@@ -0,0 +1,52 @@
+#include "run_ahead.h"
+#include <string.h>
+
+
+// Input: gb - instance to run ahead of; it must outlive this object
+RunAhead::RunAhead(GameBoy& gb) : gb(gb), frames(0)
+{
+	memcpy(&frame, &gb.get_ppu().get_frame(), sizeof(frame));
+}
+
+
+// Input: frames - frames to show ahead of the instance, 0 to turn run-ahead
+//                 off; clamped to MAX_RUN_AHEAD_FRAMES. Set it to the number
+//                 of frames a game takes to react to input.
+// Return: None
+void RunAhead::set_frames(const int frames)
+{
+	this->frames = frames < 0 ? 0 : (frames > MAX_RUN_AHEAD_FRAMES ? MAX_RUN_AHEAD_FRAMES : frames);
+}
+
+
+// Input: None
+// Return Value: Return 0 on success;
+//               return -1 if there was no memory to run ahead, in which case
+//               the instance's own frame is shown
+// Function: Run the instance one frame with the buttons set through
+//           GameBoy::set_joypad(), then run ahead from it
+int RunAhead::run_frame()
+{
+	gb.run_frame();
+
+	if (frames == 0)
+		return 0;
+
+	GameBoy* ahead = gb.fork();
+
+	if (!ahead) {
+		memcpy(&frame, &gb.get_ppu().get_frame(), sizeof(frame));
+		return -1;
+	}
+
+	ahead->get_ppu().set_rendering(false);
+	for (int i = 1; i < frames; i++)
+		ahead->run_frame();
+
+	ahead->get_ppu().set_rendering(true);
+	ahead->run_frame();
+
+	memcpy(&frame, &ahead->get_ppu().get_frame(), sizeof(frame));
+	delete ahead;
+	return 0;
+}
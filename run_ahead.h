@@ -0,0 +1,50 @@
+#ifndef RUN_AHEAD_H_
+#define RUN_AHEAD_H_
+
+#include "gameboy.h"
+#include "frame.h"
+
+#define MAX_RUN_AHEAD_FRAMES 8
+
+
+// Hides a game's built-in input lag by showing, each frame, the screen as
+// it will be some frames later if the current input stays held.
+//
+// The instance itself advances one frame at a time as usual. After each
+// frame it is forked, which costs a few microseconds because memory pages
+// are shared until written, and the fork runs ahead headless: the LCD only
+// draws the last frame, and the fork has no sound or link cable. Its final
+// frame is kept for display and the fork is discarded, so the instance's
+// state, sound, saves and hashes never see the frames run ahead.
+class RunAhead {
+public:
+	RunAhead(GameBoy& gb);
+
+	void set_frames(const int frames);
+	int get_frames() const;
+
+	int run_frame();
+	const VideoFrame& get_frame() const;
+private:
+	GameBoy& gb;
+	int frames;
+	VideoFrame frame;  // shown for the last run_frame() while frames > 0
+
+	RunAhead(const RunAhead&) = delete;
+	RunAhead& operator=(const RunAhead&) = delete;
+};
+
+
+inline int RunAhead::get_frames() const
+{
+	return frames;
+}
+
+
+// Return: Frame to show for the last run_frame()
+inline const VideoFrame& RunAhead::get_frame() const
+{
+	return frames ? frame : gb.get_ppu().get_frame();
+}
+
+#endif  // RUN_AHEAD_H_
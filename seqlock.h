@@ -0,0 +1,80 @@
+#ifndef SEQLOCK_H_
+#define SEQLOCK_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+
+
+// Single-writer sequence lock around a small trivially copyable value.
+// The writer never waits; readers retry until they copy a version that no
+// write overlapped. The value is held in atomic words so concurrent copies
+// are well defined.
+template <typename T>
+class SeqLock {
+	static_assert(std::is_trivially_copyable<T>::value, "SeqLock needs a plain struct");
+public:
+	SeqLock();
+
+	void write(const T& value);
+	void read(T& value) const;
+private:
+	static const int word_count = (sizeof(T) + 7) / 8;
+
+	std::atomic<uint32_t> sequence;  // odd while a write is in progress
+	std::atomic<uint64_t> words[word_count];
+};
+
+
+template <typename T>
+SeqLock<T>::SeqLock() : sequence(0)
+{
+	for (int i = 0; i < word_count; i++)
+		words[i].store(0, std::memory_order_relaxed);
+}
+
+
+// Input: value - new value to publish
+// Return: None
+template <typename T>
+void SeqLock<T>::write(const T& value)
+{
+	uint64_t buffer[word_count] = {};
+	const uint32_t seq = sequence.load(std::memory_order_relaxed);
+
+	memcpy(buffer, &value, sizeof(T));
+
+	sequence.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (int i = 0; i < word_count; i++)
+		words[i].store(buffer[i], std::memory_order_relaxed);
+
+	sequence.store(seq + 2, std::memory_order_release);
+}
+
+
+// Input: value - receives the last published value
+// Return: None
+template <typename T>
+void SeqLock<T>::read(T& value) const
+{
+	uint64_t buffer[word_count];
+	uint32_t before;
+	uint32_t after;
+
+	do {
+		before = sequence.load(std::memory_order_acquire);
+
+		for (int i = 0; i < word_count; i++)
+			buffer[i] = words[i].load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		after = sequence.load(std::memory_order_relaxed);
+	} while ((before & 1) || before != after);
+
+	memcpy(&value, buffer, sizeof(T));
+}
+
+#endif  // SEQLOCK_H_
@@ -0,0 +1,279 @@
+#include "serial.h"
+#include "mmu.h"
+#include <thread>
+
+
+Serial::Serial(MMU& mmu) : gb_mmu(mmu), port(NULL), published(0)
+{
+	reset();
+}
+
+
+// Input: mmu - the forked instance's memory
+//        parent - serial port to copy
+// Function: Continue a transfer the parent clocks, unplugged: it completes
+//           on time and receives 0xFF
+Serial::Serial(MMU& mmu, const Serial& parent)
+	: gb_mmu(mmu), port(NULL), transfer_end(parent.transfer_end),
+	  reply_received(false), reply(0xFF), start_received(false), published(0)
+{
+}
+
+
+Serial::~Serial()
+{
+	if (port)
+		port->close();
+}
+
+
+// Inputs: None
+// Function: Abandon any transfer in progress; the cable stays plugged in
+void Serial::reset()
+{
+	transfer_end = 0;
+	reply_received = false;
+	reply = 0xFF;
+	start_received = false;
+}
+
+
+// Input: port - end of a LinkCable no other instance uses, or NULL to unplug
+//        clock - current cpu clock
+// Return: None
+// Function: Plug in a cable. The two instances are kept within LINK_WINDOW
+//           cycles of each other by their cpu clocks, so a port should be
+//           attached before either instance runs.
+void Serial::attach_link(LinkPort* port, const uint64_t clock)
+{
+	if (this->port)
+		this->port->close();
+
+	this->port = port;
+	reply_received = false;
+	start_received = false;
+
+	if (port)
+		publish(clock);
+}
+
+
+// Input: clock - cpu clock of the write
+//        addr - 0xFF01 or 0xFF02
+//        value - 8-bit value written, already stored in memory
+// Return: None
+// Function: Start a transfer when SC asks for one on the internal clock
+void Serial::write_register(const uint64_t clock, const uint16_t addr, const uint8_t value)
+{
+	if (addr != 0xFF02 || (value & 0x81) != 0x81 || transfer_end != 0)
+		return;
+
+	transfer_end = clock + SERIAL_TRANSFER_CYCLES;
+	reply_received = false;
+
+	if (port) {
+		const LinkMessage message = { transfer_end, LINK_START, gb_mmu.read(0xFF01) };
+		port->send(message);
+	}
+}
+
+
+// Input: clock - cpu clock before the next instruction
+// Return: None
+// Function: Wait while the peer is more than LINK_WINDOW cycles behind
+void Serial::wait_for_peer(const uint64_t clock)
+{
+	uint64_t peer = port->peer_clock();
+
+	if (peer == LINK_NO_PEER || clock <= peer + LINK_WINDOW)
+		return;
+
+	// the peer may itself be waiting on the clock we last told it
+	publish(clock);
+
+	do {
+		std::this_thread::yield();
+		peer = port->peer_clock();
+	} while (peer != LINK_NO_PEER && clock > peer + LINK_WINDOW);
+}
+
+
+// Input: clock - cpu clock after the last instruction
+// Return: None
+// Function: Answer transfers the peer clocks and complete our own once
+//           clock reaches their last cycle
+void Serial::update(const uint64_t clock)
+{
+	if (!port) {
+		if (transfer_end != 0 && clock >= transfer_end) {
+			complete(0xFF);
+			transfer_end = 0;
+		}
+		return;
+	}
+
+	receive();
+
+	if (start_received && clock >= start.time)
+		exchange();
+
+	if (transfer_end != 0 && clock >= transfer_end)
+		finish_transfer(clock);
+
+	if (clock - published >= LINK_PUBLISH_INTERVAL)
+		publish(clock);
+}
+
+
+// Input: clock - current cpu clock
+// Return: Cycles until the serial port needs tick() to be called, or until
+//         the peer's last published clock plus LINK_WINDOW, whichever is
+//         first; INT32_MAX when nothing is pending
+int Serial::cycles_until_event(const uint64_t clock) const
+{
+	uint64_t until = INT32_MAX;
+
+	if (transfer_end != 0)
+		until = transfer_end > clock ? transfer_end - clock : 0;
+
+	if (port) {
+		if (start_received) {
+			const uint64_t start_in = start.time > clock ? start.time - clock : 0;
+			if (start_in < until)
+				until = start_in;
+		}
+
+		const uint64_t peer = port->peer_clock();
+		if (peer != LINK_NO_PEER) {
+			const uint64_t limit = peer + LINK_WINDOW;
+			if (limit <= clock)
+				until = 0;
+			else if (limit - clock < until)
+				until = limit - clock;
+		}
+	}
+
+	return (int)until;
+}
+
+
+// Input: state - receives the transfer in progress
+// Return: None
+void Serial::get_state(SerialState& state) const
+{
+	state.transfer_end = transfer_end;
+}
+
+
+// Input: state - state saved by get_state()
+// Return: None
+// Function: Restore a transfer in progress. A transfer the peer clocks isn't
+//           part of the state, so states shouldn't be loaded while linked.
+void Serial::set_state(const SerialState& state)
+{
+	transfer_end = state.transfer_end;
+	reply_received = false;
+	start_received = false;
+}
+
+
+// Input: state - state from a file or another process, not yet loaded
+//        clock - cpu clock the state was saved at
+// Return: Whether set_state() can take it: a transfer in progress ends at
+//         most SERIAL_TRANSFER_CYCLES after clock
+bool Serial::is_valid_state(const SerialState& state, const uint64_t clock)
+{
+	return state.transfer_end == 0 || state.transfer_end <= clock + SERIAL_TRANSFER_CYCLES;
+}
+
+
+// Inputs: None
+// Function: Take every message the peer has queued. The peer clocks at
+//           most one transfer at a time, since it waits for our reply
+//           before it can start another.
+void Serial::receive()
+{
+	const LinkMessage* message;
+
+	while ((message = port->peek()) != NULL) {
+		if (message->type == LINK_START) {
+			start = *message;
+			start_received = true;
+		} else {
+			reply = message->data;
+			reply_received = true;
+		}
+		port->pop();
+	}
+}
+
+
+// Inputs: None
+// Function: Swap bytes for the transfer the peer clocks, if SC is waiting
+//           for one on the external clock; otherwise the peer receives 0xFF
+void Serial::exchange()
+{
+	LinkMessage message = { start.time, LINK_REPLY, 0xFF };
+
+	if ((gb_mmu.read(0xFF02) & 0x81) == 0x80) {
+		message.data = gb_mmu.read(0xFF01);
+		complete(start.data);
+	}
+
+	port->send(message);
+	start_received = false;
+}
+
+
+// Input: clock - cpu clock, at or past transfer_end
+// Return: None
+// Function: Wait for the peer to reach the end of our transfer and reply
+void Serial::finish_transfer(const uint64_t clock)
+{
+	publish(clock);
+
+	while (!reply_received) {
+		const bool closed = port->peer_clock() == LINK_NO_PEER;
+
+		receive();
+
+		// both ends may clock a transfer at once; answer the peer's first
+		if (start_received && clock >= start.time)
+			exchange();
+
+		if (reply_received)
+			break;
+
+		if (closed) {
+			reply = 0xFF;
+			break;
+		}
+
+		std::this_thread::yield();
+	}
+
+	complete(reply);
+	transfer_end = 0;
+	reply_received = false;
+}
+
+
+// Input: clock - cpu clock to tell the peer
+// Return: None
+void Serial::publish(const uint64_t clock)
+{
+	port->publish_clock(clock);
+	published = clock;
+}
+
+
+// Input: received - byte shifted in from the other end
+// Return: None
+// Function: End a transfer: store the byte, clear the transfer flag in
+//           SC and request the serial interrupt
+void Serial::complete(const uint8_t received)
+{
+	gb_mmu.set_io_register(0xFF01, received);
+	gb_mmu.set_io_register(0xFF02, gb_mmu.read(0xFF02) & 0x7F);
+	gb_mmu.request_interrupt(INT_SERIAL);
+}
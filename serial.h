@@ -0,0 +1,83 @@
+#ifndef SERIAL_H_
+#define SERIAL_H_
+
+#include "link_cable.h"
+#include <stdint.h>
+
+class MMU;
+
+struct SerialState {
+	uint64_t transfer_end;  // clock the transfer we clock ends on, or 0
+};
+
+
+// Serial port, SB (0xFF01) and SC (0xFF02). Writing SC with bits 7 and 0
+// set shifts SB out on the internal 8192 Hz clock; the byte from the other
+// end replaces it SERIAL_TRANSFER_CYCLES later and INT_SERIAL is requested.
+// With bit 0 clear the port waits for the other end to clock a transfer.
+//
+// Without a link the other end reads as disconnected: transfers we clock
+// receive 0xFF and transfers we wait for never come.
+class Serial {
+public:
+	Serial(MMU& mmu);
+	Serial(MMU& mmu, const Serial& parent);
+	~Serial();
+	void reset();
+	void attach_link(LinkPort* port, const uint64_t clock);
+
+	void write_register(const uint64_t clock, const uint16_t addr, const uint8_t value);
+	void sync(const uint64_t clock);
+	void tick(const uint64_t clock);
+	int cycles_until_event(const uint64_t clock) const;
+
+	void get_state(SerialState& state) const;
+	void set_state(const SerialState& state);
+	static bool is_valid_state(const SerialState& state, const uint64_t clock);
+private:
+	MMU& gb_mmu;
+	LinkPort* port;  // NULL when no cable is plugged in
+
+	uint64_t transfer_end;
+	bool reply_received;
+	uint8_t reply;
+
+	bool start_received;  // the peer clocks a transfer ending on start.time
+	LinkMessage start;
+
+	uint64_t published;   // clock last published to the peer
+
+	Serial(const Serial&) = delete;
+	Serial& operator=(const Serial&) = delete;
+
+	void wait_for_peer(const uint64_t clock);
+	void update(const uint64_t clock);
+	void receive();
+	void exchange();
+	void finish_transfer(const uint64_t clock);
+	void publish(const uint64_t clock);
+	void complete(const uint8_t received);
+};
+
+
+
+// Input: clock - cpu clock before the next instruction
+// Return: None
+// Function: Keep within LINK_WINDOW cycles of the peer
+inline void Serial::sync(const uint64_t clock)
+{
+	if (port)
+		wait_for_peer(clock);
+}
+
+
+// Input: clock - cpu clock after the last instruction
+// Return: None
+// Function: Exchange bytes for transfers that have reached their end
+inline void Serial::tick(const uint64_t clock)
+{
+	if (port || transfer_end != 0)
+		update(clock);
+}
+
+#endif  // SERIAL_H_
@@ -0,0 +1,99 @@
+#ifndef SERVER_PROTOCOL_H_
+#define SERVER_PROTOCOL_H_
+
+#include <stdint.h>
+
+// Wire format of the control server (tools/gb_server) for orchestrators in
+// other processes. Plain C so any language with fixed-layout structs can
+// speak it. Everything is in host byte order; the socket is local.
+//
+// On connecting, the client receives a ServerHello. It then sends batches:
+// a ServerBatch, then count commands, each a ServerCommand followed by
+// data_size bytes of data. The server runs the batch and answers with a
+// ServerBatch carrying the same sequence number, followed by one
+// ServerResult per command, in order.
+//
+// Commands for one instance run in the order given. Different instances
+// run in parallel, so a batch of STEP commands for every instance uses all
+// the server's threads.
+//
+// No pixels or memory go over the socket. After each command that changes
+// an instance, its slot in the shared memory region is updated with the
+// frame, the watched RAM bytes, the frame count and the cpu fault. A slot
+// also holds a save state area that SAVE_STATE writes and LOAD_STATE reads.
+// Slots are only written while a batch runs. With one client connected they
+// are stable once the reply has arrived; with several, another client's
+// batch can rewrite any slot its commands touch, so clients either own
+// disjoint instances or agree among themselves when to read.
+
+#define SERVER_MAGIC            0x47425356  // "GBSV"
+#define SERVER_PROTOCOL_VERSION 1
+
+#define SERVER_MAX_BATCH     (64 << 20)  // bytes after a ServerBatch header
+#define SERVER_MAX_WATCH     256         // watched RAM addresses per instance
+#define SERVER_ALL_INSTANCES 0xFFFF      // ServerCommand instance for every instance
+
+#define SERVER_SCREEN_WIDTH  160
+#define SERVER_SCREEN_HEIGHT 144
+
+// ServerCommand ops
+#define SERVER_LOAD_ROM   1  // data: ROM image; loads and powers on
+#define SERVER_RESET      2
+#define SERVER_SET_INPUT  3  // arg: buttons held, as GB_BUTTON_* in gb_api.h
+#define SERVER_STEP       4  // arg: frames to run
+#define SERVER_SAVE_STATE 5  // to the slot's state area
+#define SERVER_LOAD_STATE 6  // from the slot's state area
+#define SERVER_WATCH_RAM  7  // data: uint16_t addresses to publish, up to SERVER_MAX_WATCH
+
+
+struct ServerHello {
+	uint32_t magic;           // SERVER_MAGIC
+	uint32_t version;         // SERVER_PROTOCOL_VERSION
+	uint32_t instance_count;
+	uint32_t shared_size;     // bytes in the shared memory region
+};
+
+struct ServerBatch {
+	uint32_t magic;     // SERVER_MAGIC
+	uint32_t size;      // bytes that follow, commands and their data
+	uint32_t count;     // commands, or results in a reply
+	uint32_t sequence;  // chosen by the client, echoed in the reply
+};
+
+struct ServerCommand {
+	uint8_t op;           // SERVER_*
+	uint8_t reserved;
+	uint16_t instance;    // or SERVER_ALL_INSTANCES
+	uint32_t arg;
+	uint32_t data_size;   // bytes of data that follow
+};
+
+struct ServerResult {
+	int32_t status;     // 0 on success, -1 on failure (for every instance, or any)
+	uint32_t reserved;
+};
+
+
+// The shared memory region: a SharedHeader, then instance_count slots of
+// slot_size bytes starting at slot_offset.
+struct SharedHeader {
+	char magic[8];            // "GBSHARED"
+	uint32_t version;         // SERVER_PROTOCOL_VERSION
+	uint32_t instance_count;
+	uint32_t slot_offset;
+	uint32_t slot_size;
+	uint32_t state_offset;    // of the save state area, from the start of a slot
+	uint32_t state_size;
+};
+
+struct SharedSlot {
+	uint64_t frame_number;   // frames finished since the last reset
+	uint64_t clock_cycles;   // since the last reset
+	uint32_t fault;          // nonzero once the cpu has locked up
+	uint32_t watch_count;
+	uint16_t watch_addresses[SERVER_MAX_WATCH];
+	uint8_t ram[SERVER_MAX_WATCH];  // values at watch_addresses
+	uint8_t pixels[SERVER_SCREEN_WIDTH * SERVER_SCREEN_HEIGHT];  // shades 0 (white) - 3
+};
+
+#endif  // SERVER_PROTOCOL_H_
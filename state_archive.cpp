@@ -0,0 +1,396 @@
+#include "state_archive.h"
+#include "compress.h"
+#include "state_hash.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PAGES_PER_STATE ((sizeof(GameBoyState) + ARCHIVE_PAGE_SIZE - 1) / ARCHIVE_PAGE_SIZE)
+
+static const char archive_magic[8] = { 'G', 'B', 'S', 'T', 'A', 'R', 'C', 'H' };
+
+
+// Input: page - ARCHIVE_PAGE_SIZE bytes
+//        hash - receives two independent 64-bit hashes of them
+// Return: None
+static void hash_page(const uint8_t* page, uint64_t* hash)
+{
+	uint64_t a = 0;
+	uint64_t b = ARCHIVE_PAGE_SIZE;
+
+	for (int i = 0; i < ARCHIVE_PAGE_SIZE; i += 8) {
+		uint64_t word;
+
+		memcpy(&word, page + i, sizeof(word));
+		a = (a ^ word) * HASH_MULTIPLIER_1;
+		a ^= a >> 29;
+		b = (b + word) * HASH_MULTIPLIER_2;
+		b = (b << 31) | (b >> 33);
+	}
+
+	hash[0] = hash_mix(a);
+	hash[1] = hash_mix(b ^ hash[0]);
+}
+
+
+// Return: size rounded up to a multiple of 8
+static uint64_t padded(const uint64_t size)
+{
+	return (size + 7) & ~(uint64_t)7;
+}
+
+
+StateArchive::StateArchive()
+	: fd(-1), failed(false), file_size(0), map(NULL), map_size(0)
+{
+}
+
+
+StateArchive::~StateArchive()
+{
+	close();
+}
+
+
+// Input: file_name - archive to open, created if it doesn't exist
+// Return Value: Return 0 on success;
+//               return -1 if the file can't be opened or is not an archive
+//               of states of this version
+// Function: Read the page and state records back. A torn record at the end
+//           and anything after it is cut off.
+int StateArchive::open(const char* file_name)
+{
+	struct stat info;
+	ArchiveHeader header;
+
+	close();
+
+	fd = ::open(file_name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &info) != 0) {
+		close();
+		return -1;
+	}
+
+	if (info.st_size == 0) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, archive_magic, sizeof(archive_magic));
+		header.version = ARCHIVE_VERSION;
+		header.page_size = ARCHIVE_PAGE_SIZE;
+		header.state_size = sizeof(GameBoyState);
+
+		if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+			close();
+			return -1;
+		}
+		file_size = sizeof(header);
+		return 0;
+	}
+
+	if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+	    memcmp(header.magic, archive_magic, sizeof(archive_magic)) != 0 ||
+	    header.version != ARCHIVE_VERSION || header.page_size != ARCHIVE_PAGE_SIZE ||
+	    header.state_size != sizeof(GameBoyState)) {
+		close();
+		return -1;
+	}
+
+	file_size = info.st_size;
+	if (scan() != 0) {
+		close();
+		return -1;
+	}
+
+	return 0;
+}
+
+
+// Input: None
+// Return Value: Return 0 on success;
+//               return -1 if records couldn't be written, now or earlier
+// Function: Write what is pending and close the file
+int StateArchive::close()
+{
+	if (fd < 0)
+		return 0;
+
+	const int result = flush();
+
+	if (map)
+		munmap((void*)map, map_size);
+	::close(fd);
+
+	fd = -1;
+	failed = false;
+	file_size = 0;
+	pending.clear();
+	map = NULL;
+	map_size = 0;
+	pages.clear();
+	states.clear();
+	return result;
+}
+
+
+// Input: None
+// Return Value: Return 0 on success;
+//               return -1 if records couldn't be written, now or earlier
+// Function: Write the records appended since the last flush
+int StateArchive::flush()
+{
+	size_t done = 0;
+
+	if (fd < 0 || failed)
+		return -1;
+
+	while (done < pending.size()) {
+		const ssize_t written = pwrite(fd, &pending[done], pending.size() - done,
+		                               file_size + done);
+		if (written <= 0) {
+			failed = true;
+			return -1;
+		}
+		done += written;
+	}
+
+	file_size += pending.size();
+	pending.clear();
+	return 0;
+}
+
+
+// Input: state - state to add
+// Return: Number of the state, or -1 if the archive isn't open or can't be
+//         written
+// Function: Store the pages of the state not already in the archive, then
+//           the list of its pages
+int64_t StateArchive::put(const GameBoyState& state)
+{
+	const uint8_t* data = (const uint8_t*)&state;
+	uint64_t offsets[PAGES_PER_STATE];
+	uint8_t page[ARCHIVE_PAGE_SIZE];
+	ArchiveState head;
+
+	if (fd < 0 || failed)
+		return -1;
+
+	for (size_t i = 0; i < PAGES_PER_STATE; i++) {
+		const size_t start = i * ARCHIVE_PAGE_SIZE;
+		const size_t length = (sizeof(state) - start < ARCHIVE_PAGE_SIZE) ? sizeof(state) - start
+		                                                                  : ARCHIVE_PAGE_SIZE;
+
+		memcpy(page, data + start, length);
+		memset(page + length, 0, ARCHIVE_PAGE_SIZE - length);
+		offsets[i] = store_page(page);
+	}
+
+	head.page_count = PAGES_PER_STATE;
+	head.reserved = 0;
+	states.push_back(append(ARCHIVE_RECORD_STATE, &head, sizeof(head), offsets, sizeof(offsets)));
+
+	if (pending.size() >= ARCHIVE_FLUSH_SIZE && flush() != 0)
+		return -1;
+
+	return states.size() - 1;
+}
+
+
+// Input: id - number returned by put(), below state_count()
+//        state - receives the state
+// Return Value: Return 0 on success;
+//               return -1 for an unknown id, or if the file is damaged
+int StateArchive::get(const uint64_t id, GameBoyState& state)
+{
+	uint8_t* data = (uint8_t*)&state;
+	uint8_t page[ARCHIVE_PAGE_SIZE];
+
+	if (id >= states.size())
+		return -1;
+
+	// a state's pages are always written before it
+	if (states[id] >= file_size && flush() != 0)
+		return -1;
+	if (map_file() != 0)
+		return -1;
+
+	const ArchiveState* head = (const ArchiveState*)(map + states[id] + sizeof(ArchiveRecord));
+	const uint64_t* offsets = (const uint64_t*)(head + 1);
+
+	for (size_t i = 0; i < PAGES_PER_STATE; i++) {
+		const size_t start = i * ARCHIVE_PAGE_SIZE;
+		const size_t length = (sizeof(state) - start < ARCHIVE_PAGE_SIZE) ? sizeof(state) - start
+		                                                                  : ARCHIVE_PAGE_SIZE;
+
+		if (load_page(offsets[i], page) != 0)
+			return -1;
+		memcpy(data + start, page, length);
+	}
+
+	return 0;
+}
+
+
+// Input: None
+// Return Value: Return 0 on success;
+//               return -1 if the file can't be mapped
+// Function: Index every complete record after the header. The file is cut
+//           back to the end of the last one.
+int StateArchive::scan()
+{
+	uint64_t offset = sizeof(ArchiveHeader);
+
+	if (map_file() != 0)
+		return -1;
+
+	while (offset + sizeof(ArchiveRecord) <= file_size) {
+		const ArchiveRecord* record = (const ArchiveRecord*)(map + offset);
+		const uint64_t end = offset + sizeof(ArchiveRecord) + record->size;
+		bool ok = record->size % 8 == 0 && end <= file_size;
+
+		if (ok && record->type == ARCHIVE_RECORD_PAGE) {
+			const ArchivePage* head = (const ArchivePage*)(record + 1);
+			PageKey key;
+
+			ok = record->size >= sizeof(ArchivePage) &&
+			     record->size == padded(sizeof(ArchivePage) + head->stored_size) &&
+			     head->stored_size <= ARCHIVE_PAGE_SIZE;
+			if (ok) {
+				memcpy(key.hash, head->hash, sizeof(key.hash));
+				pages.insert(std::make_pair(key, offset));
+			}
+		} else if (ok && record->type == ARCHIVE_RECORD_STATE) {
+			const ArchiveState* head = (const ArchiveState*)(record + 1);
+
+			ok = record->size == sizeof(ArchiveState) + PAGES_PER_STATE * sizeof(uint64_t) &&
+			     head->page_count == PAGES_PER_STATE;
+			if (ok)
+				states.push_back(offset);
+		} else {
+			ok = false;
+		}
+
+		if (!ok)
+			break;
+		offset = end;
+	}
+
+	if (offset < file_size) {
+		if (ftruncate(fd, offset) != 0)
+			return -1;
+		file_size = offset;
+	}
+
+	return 0;
+}
+
+
+// Input: None
+// Return Value: Return 0 on success;
+//               return -1 if the file can't be mapped
+// Function: Make sure the mapping covers the written file. It is made
+//           ARCHIVE_MAP_CHUNK larger at a time, so it is seldom redone.
+int StateArchive::map_file()
+{
+	if (map && map_size >= file_size)
+		return 0;
+
+	if (map)
+		munmap((void*)map, map_size);
+
+	map_size = (file_size / ARCHIVE_MAP_CHUNK + 1) * (size_t)ARCHIVE_MAP_CHUNK;
+	void* mapped = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (mapped == MAP_FAILED) {
+		map = NULL;
+		map_size = 0;
+		return -1;
+	}
+
+	map = (const uint8_t*)mapped;
+	return 0;
+}
+
+
+// Input: type - ARCHIVE_RECORD_*
+//        head, head_size - fixed part of the record
+//        data, data_size - rest of the record
+// Return: File offset of the record
+// Function: Queue the record to be written at the end of the file
+uint64_t StateArchive::append(const uint32_t type, const void* head, const size_t head_size,
+                              const void* data, const size_t data_size)
+{
+	const uint64_t offset = file_size + pending.size();
+	ArchiveRecord record;
+
+	record.type = type;
+	record.size = padded(head_size + data_size);
+
+	const size_t start = pending.size();
+	pending.resize(start + sizeof(record) + record.size, 0);
+	memcpy(&pending[start], &record, sizeof(record));
+	memcpy(&pending[start + sizeof(record)], head, head_size);
+	memcpy(&pending[start + sizeof(record) + head_size], data, data_size);
+
+	return offset;
+}
+
+
+// Input: page - ARCHIVE_PAGE_SIZE bytes
+// Return: File offset of the record holding a page with the same contents,
+//         appended now if there was none
+uint64_t StateArchive::store_page(const uint8_t* page)
+{
+	PageKey key;
+
+	hash_page(page, key.hash);
+
+	const auto found = pages.find(key);
+	if (found != pages.end())
+		return found->second;
+
+	uint8_t compressed[ARCHIVE_PAGE_SIZE];
+	ArchivePage head;
+	const int size = lz_compress(page, ARCHIVE_PAGE_SIZE, compressed, ARCHIVE_PAGE_SIZE - 1);
+
+	memcpy(head.hash, key.hash, sizeof(head.hash));
+	head.stored_size = (size < 0) ? ARCHIVE_PAGE_SIZE : size;
+	head.flags = (size < 0) ? ARCHIVE_PAGE_RAW : 0;
+
+	const uint64_t offset = append(ARCHIVE_RECORD_PAGE, &head, sizeof(head),
+	                               (size < 0) ? page : compressed, head.stored_size);
+	pages.insert(std::make_pair(key, offset));
+	return offset;
+}
+
+
+// Input: offset - file offset of a page record, within the mapping
+//        page - receives ARCHIVE_PAGE_SIZE bytes
+// Return Value: Return 0 on success;
+//               return -1 if there is no intact page record at offset
+int StateArchive::load_page(const uint64_t offset, uint8_t* page) const
+{
+	if (offset % 8 != 0 || offset + sizeof(ArchiveRecord) + sizeof(ArchivePage) > file_size)
+		return -1;
+
+	const ArchiveRecord* record = (const ArchiveRecord*)(map + offset);
+	const ArchivePage* head = (const ArchivePage*)(record + 1);
+	const uint8_t* stored = (const uint8_t*)(head + 1);
+
+	if (record->type != ARCHIVE_RECORD_PAGE || head->stored_size > ARCHIVE_PAGE_SIZE ||
+	    offset + sizeof(ArchiveRecord) + sizeof(ArchivePage) + head->stored_size > file_size)
+		return -1;
+
+	if (head->flags & ARCHIVE_PAGE_RAW) {
+		if (head->stored_size != ARCHIVE_PAGE_SIZE)
+			return -1;
+		memcpy(page, stored, ARCHIVE_PAGE_SIZE);
+		return 0;
+	}
+
+	return lz_decompress(stored, head->stored_size, page, ARCHIVE_PAGE_SIZE) == ARCHIVE_PAGE_SIZE
+	       ? 0 : -1;
+}
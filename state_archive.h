@@ -0,0 +1,147 @@
+#ifndef STATE_ARCHIVE_H_
+#define STATE_ARCHIVE_H_
+
+#include "gameboy.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <unordered_map>
+#include <vector>
+
+#define ARCHIVE_VERSION    1
+#define ARCHIVE_PAGE_SIZE  1024  // bytes of a state per deduplicated page
+#define ARCHIVE_FLUSH_SIZE (1 << 20)   // appended bytes buffered before a write
+#define ARCHIVE_MAP_CHUNK  (1 << 28)   // the read mapping grows this much at a time
+
+// ArchiveRecord types
+#define ARCHIVE_RECORD_PAGE  1
+#define ARCHIVE_RECORD_STATE 2
+
+// ArchivePage flags
+#define ARCHIVE_PAGE_RAW 0x01  // stored uncompressed; the codec didn't shrink it
+
+
+// On-disk layout, in host byte order: an ArchiveHeader, then records
+// appended one after another, each an ArchiveRecord and size bytes. Every
+// record starts 8-byte aligned so it can be used in place once mapped.
+struct ArchiveHeader {
+	char magic[8];        // "GBSTARCH"
+	uint32_t version;     // ARCHIVE_VERSION
+	uint32_t page_size;   // ARCHIVE_PAGE_SIZE
+	uint32_t state_size;  // sizeof(GameBoyState)
+	uint32_t reserved;
+};
+
+struct ArchiveRecord {
+	uint32_t type;  // ARCHIVE_RECORD_*
+	uint32_t size;  // bytes that follow, a multiple of 8
+};
+
+// followed by stored_size bytes, compressed unless ARCHIVE_PAGE_RAW
+struct ArchivePage {
+	uint64_t hash[2];  // of the uncompressed page
+	uint32_t stored_size;
+	uint32_t flags;    // ARCHIVE_PAGE_*
+};
+
+// followed by page_count file offsets of ArchiveRecords of pages
+struct ArchiveState {
+	uint32_t page_count;
+	uint32_t reserved;
+};
+
+
+// Append-only store for large numbers of save states.
+//
+// Each state is cut into ARCHIVE_PAGE_SIZE pages. A page is stored once,
+// compressed, however many states contain it; a state is stored as the
+// file offsets of its pages. States from one run share most of their memory,
+// so the file grows with the content that is new in each state rather than
+// with the number of states. Pages are matched by a 128-bit hash of their
+// contents, without comparing the bytes.
+//
+// States are numbered in the order they were added, across every session
+// that appended to the file. Reads go through a read-only mapping of the
+// file. A record cut short by a crash is dropped when the file is opened
+// again. An archive is used by one thread at a time.
+class StateArchive {
+public:
+	StateArchive();
+	~StateArchive();
+
+	int open(const char* file_name);
+	int close();
+	int flush();
+
+	int64_t put(const GameBoyState& state);
+	int get(const uint64_t id, GameBoyState& state);
+
+	uint64_t state_count() const;
+	uint64_t page_count() const;
+	uint64_t size() const;
+private:
+	struct PageKey {
+		uint64_t hash[2];
+
+		bool operator==(const PageKey& other) const;
+	};
+
+	struct PageKeyHash {
+		size_t operator()(const PageKey& key) const;
+	};
+
+	int fd;  // -1 while closed
+	bool failed;  // a write failed; nothing more is appended
+	uint64_t file_size;  // bytes written to the file
+	std::vector<uint8_t> pending;  // appended records not yet written
+
+	const uint8_t* map;  // read-only mapping of the file, NULL until needed
+	size_t map_size;
+
+	std::unordered_map<PageKey, uint64_t, PageKeyHash> pages;  // record offsets
+	std::vector<uint64_t> states;  // record offsets, by id
+
+	StateArchive(const StateArchive&) = delete;
+	StateArchive& operator=(const StateArchive&) = delete;
+
+	int scan();
+	int map_file();
+	uint64_t append(const uint32_t type, const void* head, const size_t head_size,
+	                const void* data, const size_t data_size);
+	uint64_t store_page(const uint8_t* page);
+	int load_page(const uint64_t offset, uint8_t* page) const;
+};
+
+
+// Return: Number of states stored
+inline uint64_t StateArchive::state_count() const
+{
+	return states.size();
+}
+
+
+// Return: Number of different pages stored
+inline uint64_t StateArchive::page_count() const
+{
+	return pages.size();
+}
+
+
+// Return: Bytes in the file, counting records not yet written
+inline uint64_t StateArchive::size() const
+{
+	return file_size + pending.size();
+}
+
+
+inline bool StateArchive::PageKey::operator==(const PageKey& other) const
+{
+	return hash[0] == other.hash[0] && hash[1] == other.hash[1];
+}
+
+
+inline size_t StateArchive::PageKeyHash::operator()(const PageKey& key) const
+{
+	return key.hash[0];
+}
+
+#endif  // STATE_ARCHIVE_H_
@@ -0,0 +1,115 @@
+#include "state_hash.h"
+
+
+static uint64_t load_word(const uint8_t* p)
+{
+	uint64_t word;
+
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+
+StateHasher::StateHasher() : memory_hash(0), valid(false)
+{
+	memset(relevant, 0xFF, sizeof(relevant));
+	memset(block_hash, 0, sizeof(block_hash));
+}
+
+
+// Input: mask - MEMORY_SIZE bytes ANDed with memory before hashing, or NULL
+//               to hash every byte; it is copied
+// Return: None
+void StateHasher::set_mask(const uint8_t* mask)
+{
+	if (!mask) {
+		this->mask.reset();
+		memset(relevant, 0xFF, sizeof(relevant));
+	} else {
+		uint8_t* copy = new uint8_t[MEMORY_SIZE];
+
+		memcpy(copy, mask, MEMORY_SIZE);
+		this->mask.reset(copy, std::default_delete<uint8_t[]>());
+
+		memset(relevant, 0, sizeof(relevant));
+		for (int addr = 0; addr < MEMORY_SIZE; addr++)
+			if (copy[addr])
+				relevant[addr >> (DIRTY_BLOCK_SHIFT + 6)] |=
+					(uint64_t)1 << ((addr >> DIRTY_BLOCK_SHIFT) & 63);
+	}
+
+	invalidate();
+}
+
+
+// Inputs: None
+// Function: Rehash every block on the next call, e.g. after memory was
+//           changed behind the MMU's back
+void StateHasher::invalidate()
+{
+	valid = false;
+}
+
+
+// Input: mmu - memory to fingerprint; its written-block flags are consumed,
+//              so an MMU should have a single hasher
+//        cpu - cpu state to include
+// Return: 64-bit fingerprint of the state
+uint64_t StateHasher::hash(MMU& mmu, const CPUState& cpu)
+{
+	uint64_t dirty[DIRTY_WORDS];
+
+	mmu.take_dirty_blocks(dirty);
+
+	if (!valid) {
+		memset(dirty, 0xFF, sizeof(dirty));
+		memset(block_hash, 0, sizeof(block_hash));
+		memory_hash = 0;
+		valid = true;
+	}
+
+	for (int w = 0; w < DIRTY_WORDS; w++) {
+		uint64_t bits = dirty[w] & relevant[w];
+
+		while (bits) {
+			const int block = w * 64 + __builtin_ctzll(bits);
+			const uint64_t h = hash_block(block, mmu.get_block(block << DIRTY_BLOCK_SHIFT));
+
+			memory_hash += h - block_hash[block];
+			block_hash[block] = h;
+			bits &= bits - 1;
+		}
+	}
+
+	const CPURegisters& r = cpu.regs;
+	const uint64_t registers = (uint64_t)r.AF | ((uint64_t)r.BC << 16) |
+	                           ((uint64_t)r.DE << 32) | ((uint64_t)r.HL << 48);
+	const uint64_t control = (uint64_t)r.SP | ((uint64_t)r.PC << 16) |
+	                         ((uint64_t)cpu.IME << 32) | ((uint64_t)cpu.ime_scheduled << 33) |
+	                         ((uint64_t)cpu.halted << 34) | ((uint64_t)cpu.stopped << 35);
+
+	return hash_mix(memory_hash ^ hash_mix(registers + hash_mix(control)));
+}
+
+
+// Input: block - block index, so equal contents at different addresses
+//                hash differently
+//        data - DIRTY_BLOCK_SIZE bytes of memory
+// Return: Hash of the masked block
+uint64_t StateHasher::hash_block(const int block, const uint8_t* data) const
+{
+	const uint8_t* m = mask ? mask.get() + block * DIRTY_BLOCK_SIZE : NULL;
+	uint64_t h = hash_mix(block + 1);
+
+	for (int i = 0; i < DIRTY_BLOCK_SIZE; i += 8) {
+		uint64_t word = load_word(data + i);
+
+		if (m)
+			word &= load_word(m + i);
+
+		h = (h ^ (word * HASH_MULTIPLIER_1)) * HASH_MULTIPLIER_2;
+		h ^= h >> 32;
+	}
+
+	return hash_mix(h);
+}
@@ -0,0 +1,55 @@
+#ifndef STATE_HASH_H_
+#define STATE_HASH_H_
+
+#include "mmu.h"
+#include "cpu.h"
+#include <stdint.h>
+#include <memory>
+
+// Multipliers for combining 64-bit words into a hash; shared with the state
+// archive's page hashes
+#define HASH_MULTIPLIER_1 0x9E3779B97F4A7C15ull
+#define HASH_MULTIPLIER_2 0xC2B2AE3D27D4EB4Full
+
+
+// Fingerprint of the emulator state for transposition tables and duplicate
+// detection. Memory is hashed in DIRTY_BLOCK_SIZE blocks; each call only
+// rehashes the blocks the MMU reports as written since the previous call,
+// so a fingerprint costs O(dirty blocks) rather than O(64 KiB). The block
+// hashes are summed, so replacing one is a subtract and an add.
+//
+// An optional relevance mask of MEMORY_SIZE bytes is ANDed with memory
+// before hashing; bytes masked to 0 are ignored and blocks with no mask
+// bits set are never read. The cpu registers, IME and the halt/stop state
+// are always included; the clock is not, nor is the timer's or the LCD's
+// position except as it shows in their registers.
+class StateHasher {
+public:
+	StateHasher();
+
+	void set_mask(const uint8_t* mask);
+	void invalidate();
+	uint64_t hash(MMU& mmu, const CPUState& cpu);
+private:
+	std::shared_ptr<const uint8_t> mask;  // NULL when every byte counts
+	uint64_t relevant[DIRTY_WORDS];       // blocks with any mask bit set
+	uint64_t block_hash[DIRTY_BLOCKS];
+	uint64_t memory_hash;                 // sum of block_hash
+	bool valid;                           // block_hash matches memory
+
+	uint64_t hash_block(const int block, const uint8_t* data) const;
+};
+
+
+// Return: x with every bit mixed into every other (the splitmix64 finalizer)
+inline uint64_t hash_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ull;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBull;
+	x ^= x >> 31;
+	return x;
+}
+
+#endif  // STATE_HASH_H_
@@ -0,0 +1,166 @@
+#include "timer.h"
+#include "mmu.h"
+
+// cpu cycles per TIMA increment for each TAC clock select
+static const int tima_period[4] = { 1024, 16, 64, 256 };
+
+
+Timer::Timer(MMU& mmu) : gb_mmu(mmu)
+{
+	reset();
+}
+
+
+// Input: mmu - fork of the parent's MMU
+//        parent - timer to copy the state of
+Timer::Timer(MMU& mmu, const Timer& parent)
+	: gb_mmu(mmu), divider(parent.divider), tima(parent.tima), tma(parent.tma), tac(parent.tac)
+{
+}
+
+
+// Inputs: None
+// Function: Set the timer registers to their state after the boot ROM
+void Timer::reset()
+{
+	divider = 0xABCC;
+	tima = 0x00;
+	tma = 0x00;
+	tac = 0x00;
+
+	update_registers();
+}
+
+
+// Input: state - receives the counter and registers
+// Return: None
+void Timer::get_state(TimerState& state) const
+{
+	state.divider = divider;
+	state.tima = tima;
+	state.tma = tma;
+	state.tac = tac;
+}
+
+
+// Input: state - state saved by get_state()
+// Return: None
+// Function: Restore the counter and registers. The register copies in
+//           memory are restored along with the rest of the MMU.
+void Timer::set_state(const TimerState& state)
+{
+	divider = state.divider;
+	tima = state.tima;
+	tma = state.tma;
+	tac = state.tac;
+}
+
+
+// Input: state - state from a file or another process, not yet loaded
+// Return: Whether set_state() can take it; TAC holds only its 3 bits
+bool Timer::is_valid_state(const TimerState& state)
+{
+	return state.tac <= 0x07;
+}
+
+
+// Input: cycles - cpu clock cycles that have passed
+// Return: None
+// Function: Advance DIV and TIMA, requesting the timer interrupt on overflow
+void Timer::tick(const int cycles)
+{
+	if (tac & 0x04) {
+		const int period = tima_period[tac & 0x03];
+		const uint32_t start = divider;
+		const uint32_t end = start + cycles;
+
+		// one increment for every multiple of period the counter passes
+		count((int)(end / period - start / period));
+	}
+
+	divider += cycles;
+	update_registers();
+}
+
+
+// Input: addr - timer register address (0xFF04 - 0xFF07)
+//        value - 8-bit value written
+// Return: None
+void Timer::write_register(const uint16_t addr, const uint8_t value)
+{
+	switch(addr) {
+	case 0xFF04:  // DIV: any write clears the whole counter
+		// clearing it while the selected bit is set is a falling edge
+		if ((tac & 0x04) && (divider & (tima_period[tac & 0x03] >> 1)))
+			count(1);
+		divider = 0;
+		break;
+	case 0xFF05:  // TIMA
+		tima = value;
+		break;
+	case 0xFF06:  // TMA
+		tma = value;
+		break;
+	case 0xFF07:  // TAC
+		tac = value & 0x07;
+		break;
+	}
+
+	update_registers();
+}
+
+
+// Input: None
+// Return: Cycles until TIMA next overflows, or -1 if the timer is stopped
+int Timer::cycles_until_interrupt() const
+{
+	if (!(tac & 0x04))
+		return -1;
+
+	const int period = tima_period[tac & 0x03];
+
+	return period * (0x100 - tima) - (divider % period);
+}
+
+
+// Input: addr - 0xFF04 (DIV) or 0xFF05 (TIMA)
+// Return: Cycles until the register's value next changes on its own, or -1
+//         if it won't
+int Timer::cycles_until_change(const uint16_t addr) const
+{
+	if (addr == 0xFF04)
+		return 0x100 - (divider & 0xFF);
+
+	if (addr != 0xFF05 || !(tac & 0x04))
+		return -1;
+
+	const int period = tima_period[tac & 0x03];
+
+	return period - (divider % period);
+}
+
+
+// Input: increments - number of TIMA increments
+// Return: None
+// Function: Add to TIMA, reloading it from TMA on every overflow
+void Timer::count(int increments)
+{
+	if (increments < 0x100 - tima) {
+		tima += increments;
+		return;
+	}
+
+	// first overflow, then one more for every (0x100 - TMA) increments
+	increments -= 0x100 - tima;
+	tima = tma + increments % (0x100 - tma);
+	gb_mmu.request_interrupt(INT_TIMER);
+}
+
+
+void Timer::update_registers()
+{
+	gb_mmu.set_io_register(0xFF04, divider >> 8);
+	gb_mmu.set_io_register(0xFF05, tima);
+	gb_mmu.set_io_register(0xFF06, tma);
+	gb_mmu.set_io_register(0xFF07, tac | 0xF8);
+}
@@ -0,0 +1,46 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdint.h>
+
+class MMU;
+
+struct TimerState {
+	uint16_t divider;
+	uint8_t tima;
+	uint8_t tma;
+	uint8_t tac;
+};
+
+
+// DIV/TIMA/TMA/TAC. DIV is the high byte of a 16-bit counter that runs at the
+// cpu clock; TIMA counts falling edges of the counter bit selected by TAC.
+// The timer is caught up in whole instructions, so any number of cycles can
+// be passed to tick() at once.
+class Timer {
+public:
+	Timer(MMU& mmu);
+	Timer(MMU& mmu, const Timer& parent);
+	void reset();
+
+	void tick(const int cycles);
+	void write_register(const uint16_t addr, const uint8_t value);
+	int cycles_until_interrupt() const;
+	int cycles_until_change(const uint16_t addr) const;
+
+	void get_state(TimerState& state) const;
+	void set_state(const TimerState& state);
+	static bool is_valid_state(const TimerState& state);
+private:
+	MMU& gb_mmu;
+
+	uint16_t divider;
+	uint8_t tima;
+	uint8_t tma;
+	uint8_t tac;
+
+	void count(int increments);
+	void update_registers();
+};
+
+#endif  // TIMER_H_
@@ -0,0 +1,170 @@
+#include "../code_map.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <vector>
+
+// Runs the static code analyzer on small hand-written ROMs and checks the
+// flags it sets, then on random ROMs for the invariants any map keeps:
+//
+//   flow    - fall-through, JR/JP/CALL targets, RST vectors, returns and
+//             undefined opcodes end or start blocks where they should
+//   bounds  - instructions that aren't branches, branches into RAM and ROMs
+//             shorter than the map touch nothing outside it
+//   random  - random ROMs never mark bytes past their end, and build()
+//             gives the same map as analyze()
+//
+// Build it with -fsanitize=address as well: the analyzer writes into a
+// fixed-size array, and a write just outside it lands in the shared_ptr
+// control block that build() allocates in front of it.
+//
+// usage: code_map_check [--seed S] [--roms N]
+
+#define ROM_SIZE CODE_MAP_SIZE
+
+static int checks = 0;
+static int failing = 0;
+
+
+static void check(const bool ok, const char* what)
+{
+	checks++;
+	if (!ok) {
+		failing++;
+		printf("FAIL: %s\n", what);
+	}
+}
+
+
+// Return: ROM of size bytes holding code at 0x0100; the rest, including the
+//         interrupt vectors, is an undefined opcode that maps to nothing
+static std::vector<uint8_t> make_rom(const std::vector<uint8_t>& code, const size_t size)
+{
+	std::vector<uint8_t> rom(size, 0xD3);
+
+	memcpy(&rom[0x0100], &code[0], code.size());
+	return rom;
+}
+
+
+static bool has(const CodeMap& map, const uint16_t addr, const uint8_t flags)
+{
+	return (map.get_flags(addr) & flags) == flags;
+}
+
+
+static void check_flow()
+{
+	CodeMap map;
+
+	// NOP; LD A, n; JR -4 back to the LD
+	std::vector<uint8_t> rom = make_rom({ 0x00, 0x3E, 0x12, 0x18, 0xFC }, ROM_SIZE);
+	map.analyze(&rom[0], rom.size());
+	check(has(map, 0x0100, CODE_OPCODE | CODE_BLOCK_START | CODE_CALL_TARGET), "flow: entry point");
+	check(has(map, 0x0101, CODE_OPCODE | CODE_BLOCK_START) && has(map, 0x0102, CODE_OPERAND),
+	      "flow: JR target and operand");
+	check(has(map, 0x0103, CODE_OPCODE) && has(map, 0x0104, CODE_OPERAND),
+	      "flow: JR itself");
+	check(map.get_flags(0x0105) == 0, "flow: nothing after an unconditional JR");
+	check(map.count(0, CODE_OPCODE) == 3, "flow: three instructions in bank 0");
+
+	// CALL 0x0200; HALT, with RET at 0x0200
+	rom = make_rom({ 0xCD, 0x00, 0x02, 0x76 }, ROM_SIZE);
+	rom[0x0200] = 0xC9;
+	map.analyze(&rom[0], rom.size());
+	check(has(map, 0x0200, CODE_OPCODE | CODE_BLOCK_START | CODE_CALL_TARGET), "flow: call target");
+	check(has(map, 0x0103, CODE_OPCODE | CODE_BLOCK_START), "flow: return point after a call");
+	check(map.get_flags(0x0201) == 0, "flow: nothing after RET");
+
+	// RST 0x38, with RET there
+	rom = make_rom({ 0xFF }, ROM_SIZE);
+	rom[0x0038] = 0xC9;
+	map.analyze(&rom[0], rom.size());
+	check(has(map, 0x0038, CODE_OPCODE | CODE_CALL_TARGET), "flow: RST vector");
+
+	// JR Z, +1 past a NOP to another, then an undefined opcode
+	rom = make_rom({ 0x28, 0x01, 0x00, 0x00, 0xD3 }, ROM_SIZE);
+	map.analyze(&rom[0], rom.size());
+	check(has(map, 0x0102, CODE_OPCODE | CODE_BLOCK_START), "flow: JR cc fall-through");
+	check(has(map, 0x0103, CODE_OPCODE | CODE_BLOCK_START), "flow: JR cc target");
+	check(!(map.get_flags(0x0104) & CODE_OPCODE), "flow: undefined opcode isn't code");
+}
+
+
+static void check_bounds()
+{
+	CodeMap map;
+
+	// JP 0xC000 and CALL 0xFF80 leave the ROM; nothing is marked for them
+	std::vector<uint8_t> rom = make_rom({ 0xCD, 0x80, 0xFF, 0xC3, 0x00, 0xC0 }, ROM_SIZE);
+	map.analyze(&rom[0], rom.size());
+	check(has(map, 0x0103, CODE_OPCODE), "bounds: JP into RAM decoded");
+	check(map.get_flags(0xC000) == 0 && map.get_flags(0xFF80) == 0,
+	      "bounds: RAM targets have no flags");
+
+	// a ROM that ends in the middle of the map, mid-instruction
+	rom = make_rom({ 0x00, 0x00, 0x3E }, 0x0103);
+	map.analyze(&rom[0], rom.size());
+	check(has(map, 0x0101, CODE_OPCODE) && !(map.get_flags(0x0102) & CODE_OPCODE),
+	      "bounds: instruction past the end of the ROM isn't decoded");
+	check(map.count(0, CODE_OPCODE) == 2 && map.count(1, CODE_OPCODE | CODE_OPERAND) == 0,
+	      "bounds: short ROM marks nothing past its end");
+	check(map.count(CODE_MAP_BANKS, CODE_OPCODE) == -1, "bounds: bank outside the map");
+}
+
+
+static void check_random(std::mt19937& rng, const int roms)
+{
+	int past_end = 0;
+	int differing = 0;
+
+	for (int r = 0; r < roms; r++) {
+		const size_t size = 0x0100 + rng() % (ROM_SIZE - 0x0100 + 1);
+		std::vector<uint8_t> rom(size);
+		CodeMap map;
+
+		for (size_t i = 0; i < size; i++)
+			rom[i] = rng();
+		map.analyze(&rom[0], size);
+
+		for (uint32_t addr = size; addr < CODE_MAP_SIZE; addr++)
+			if (map.get_flags(addr) & (CODE_OPCODE | CODE_OPERAND))
+				past_end++;
+
+		const std::shared_ptr<const CodeMap> built = CodeMap::build(&rom[0], size);
+		for (uint32_t addr = 0; addr < CODE_MAP_SIZE; addr++)
+			if (built->get_flags(addr) != map.get_flags(addr))
+				differing++;
+	}
+
+	check(past_end == 0, "random: no code past the end of the ROM");
+	check(differing == 0, "random: build() matches analyze()");
+}
+
+
+int main(int argc, char* argv[])
+{
+	unsigned int seed = 1;
+	int roms = 200;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--roms") && i + 1 < argc)
+			roms = atoi(argv[++i]);
+		else {
+			fprintf(stderr, "usage: %s [--seed S] [--roms N]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	std::mt19937 rng(seed);
+
+	check_flow();
+	check_bounds();
+	check_random(rng, roms);
+
+	printf("%d checks, %d failing\n", checks, failing);
+	return failing ? 1 : 0;
+}
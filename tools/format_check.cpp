@@ -0,0 +1,477 @@
+#include "../state_archive.h"
+#include "../rom_index.h"
+#include "../capture.h"
+#include "../trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <random>
+#include <string>
+#include <vector>
+
+// Writes each on-disk format through its writer and reads it back through its
+// reader, then damages or outdates the files the way crashes and edits do and
+// checks that the readers recover as documented:
+//
+//   state archive - states read back byte for byte, unchanged pages stored
+//                   once, a torn last record and trailing junk dropped on
+//                   reopen, appends after a reopen
+//   ROM index     - header fields and flags, reuse of entries whose size and
+//                   time are unchanged, rereads of changed files, removed
+//                   files dropped, damaged index files rejected
+//   capture       - frames read back in order and by seeking across
+//                   keyframes, index rebuilt for a capture never closed
+//   trace         - entries and clocks read back across chunks, diffs
+//
+// Files are written to a temporary directory, which is removed afterwards
+// unless --keep is given, or to D, which is left in place.
+//
+// usage: format_check [--dir D] [--seed S] [--keep]
+
+#define ARCHIVE_STATES   200
+#define CAPTURE_FRAMES   50
+#define CAPTURE_INTERVAL 8
+#define TRACE_ENTRIES    (2 * TRACE_CHUNK_ENTRIES + 1000)
+
+static int checks = 0;
+static int failing = 0;
+
+
+static void check(const bool ok, const char* what)
+{
+	checks++;
+	if (!ok) {
+		failing++;
+		printf("FAIL: %s\n", what);
+	}
+}
+
+
+static off_t file_size(const std::string& name)
+{
+	struct stat info;
+
+	return stat(name.c_str(), &info) == 0 ? info.st_size : -1;
+}
+
+
+static bool write_file(const std::string& name, const void* data, const size_t size)
+{
+	FILE* file = fopen(name.c_str(), "wb");
+	bool ok = file && fwrite(data, 1, size, file) == size;
+
+	if (file && fclose(file) != 0)
+		ok = false;
+	return ok;
+}
+
+
+static bool read_file(const std::string& name, std::vector<uint8_t>& data)
+{
+	FILE* file = fopen(name.c_str(), "rb");
+
+	if (!file)
+		return false;
+
+	data.clear();
+	uint8_t buffer[65536];
+	size_t got;
+	while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		data.insert(data.end(), buffer, buffer + got);
+	fclose(file);
+	return true;
+}
+
+
+static int remove_entry(const char* path, const struct stat*, int, struct FTW*)
+{
+	return remove(path);
+}
+
+
+static void check_state_archive(const std::string& dir, std::mt19937& rng)
+{
+	const std::string name = dir + "/states.gbsa";
+	const int pages_per_state = (sizeof(GameBoyState) + ARCHIVE_PAGE_SIZE - 1) / ARCHIVE_PAGE_SIZE;
+	std::vector<GameBoyState> states(ARCHIVE_STATES);
+	GameBoyState* read = new GameBoyState;
+	StateArchive archive;
+	bool ok;
+
+	// a run: each state changes a few WRAM bytes and the registers of the last
+	memset(&states[0], 0, sizeof(GameBoyState));
+	for (size_t i = 0; i < sizeof(states[0].mmu.memory); i++)
+		states[0].mmu.memory[i] = rng() % 4 ? 0 : rng();
+	for (int i = 1; i < ARCHIVE_STATES; i++) {
+		states[i] = states[i - 1];
+		for (int n = 0; n < 4; n++)
+			states[i].mmu.memory[0xC000 + rng() % 0x2000] = rng();
+		states[i].cpu.regs.PC = rng();
+	}
+
+	check(archive.open(name.c_str()) == 0, "archive: create");
+	ok = true;
+	for (int i = 0; i < ARCHIVE_STATES; i++)
+		ok = ok && archive.put(states[i]) == i;
+	check(ok, "archive: ids count up from 0");
+	check(archive.state_count() == ARCHIVE_STATES, "archive: state count");
+	check(archive.page_count() < (uint64_t)pages_per_state * ARCHIVE_STATES / 8,
+	      "archive: unchanged pages are stored once");
+
+	ok = true;
+	for (int i = 0; i < ARCHIVE_STATES; i++)
+		ok = ok && archive.get(i, *read) == 0 && memcmp(read, &states[i], sizeof(*read)) == 0;
+	check(ok, "archive: states read back before a flush");
+
+	const uint64_t pages = archive.page_count();
+	check(archive.put(states[0]) == ARCHIVE_STATES && archive.page_count() == pages,
+	      "archive: a repeated state adds no pages");
+	check(archive.get(ARCHIVE_STATES + 1, *read) != 0, "archive: unknown id rejected");
+	check(archive.close() == 0, "archive: close");
+
+	// reopen, read through the mapping, append
+	check(archive.open(name.c_str()) == 0 && archive.state_count() == ARCHIVE_STATES + 1 &&
+	      archive.page_count() == pages, "archive: reopen finds every record");
+	ok = true;
+	for (int i = 0; i < ARCHIVE_STATES; i++)
+		ok = ok && archive.get(i, *read) == 0 && memcmp(read, &states[i], sizeof(*read)) == 0;
+	check(ok, "archive: states read back after a reopen");
+	check(archive.put(states[ARCHIVE_STATES - 1]) == ARCHIVE_STATES + 1,
+	      "archive: append after a reopen");
+	check(archive.close() == 0, "archive: close after appending");
+
+	// a crash partway through the last record
+	const off_t whole = file_size(name);
+	check(truncate(name.c_str(), whole - 5) == 0, "archive: tear the last record");
+	check(archive.open(name.c_str()) == 0 && archive.state_count() == ARCHIVE_STATES + 1,
+	      "archive: torn last record dropped");
+	check(file_size(name) % 8 == 0 && file_size(name) < whole - 5,
+	      "archive: file cut back to the last whole record");
+	check(archive.put(states[7]) == ARCHIVE_STATES + 1, "archive: append after a torn record");
+	check(archive.close() == 0, "archive: close after repair");
+
+	// junk after the last record
+	std::vector<uint8_t> data;
+	const off_t good = file_size(name);
+	check(read_file(name, data), "archive: read file");
+	data.insert(data.end(), 13, 0xA5);
+	check(write_file(name, &data[0], data.size()), "archive: append junk");
+	check(archive.open(name.c_str()) == 0 && archive.state_count() == ARCHIVE_STATES + 2 &&
+	      file_size(name) == good, "archive: trailing junk dropped");
+	check(archive.get(ARCHIVE_STATES + 1, *read) == 0 && memcmp(read, &states[7], sizeof(*read)) == 0,
+	      "archive: state appended after the repair survives");
+	archive.close();
+
+	// another format
+	data[0] ^= 0xFF;
+	check(write_file(name, &data[0], data.size()), "archive: damage header");
+	check(archive.open(name.c_str()) != 0, "archive: bad magic rejected");
+
+	delete read;
+}
+
+
+// Input: title - stored at 0x0134
+//        cgb - CGB flag for 0x0143
+//        size_code - ROM size code for 0x0148
+//        good_checksum - store the right header checksum
+// Return: Header of a ROM, ROM_HEADER_END bytes, padded out to size
+static std::vector<uint8_t> make_rom(const char* title, const uint8_t cgb, const uint8_t size_code,
+                                     const bool good_checksum, const size_t size)
+{
+	std::vector<uint8_t> rom(size, 0);
+	uint8_t checksum = 0;
+
+	memcpy(&rom[0x0134], title, strlen(title));
+	rom[0x0143] = cgb;
+	rom[0x0147] = 0x01;
+	rom[0x0148] = size_code;
+	for (int addr = 0x0134; addr <= 0x014C; addr++)
+		checksum = checksum - rom[addr] - 1;
+	rom[0x014D] = good_checksum ? checksum : checksum + 1;
+	rom[0x014E] = 0x12;
+	rom[0x014F] = 0x34;
+	return rom;
+}
+
+
+// Input: name - file to give time seconds since the epoch
+static bool set_mtime(const std::string& name, const time_t time)
+{
+	struct timeval times[2] = { { time, 0 }, { time, 0 } };
+
+	return utimes(name.c_str(), times) == 0;
+}
+
+
+static const RomIndexEntry* find_entry(RomIndex& index, const std::string& path)
+{
+	const int i = index.find(path.c_str());
+
+	return i >= 0 ? &index.entry(i) : NULL;
+}
+
+
+static void check_rom_index(const std::string& dir)
+{
+	const std::string roms = dir + "/roms";
+	const std::string name = dir + "/roms.idx";
+	const std::string a = roms + "/a.gb", b = roms + "/sub/b.gbc", c = roms + "/c.GB";
+	const std::string d = roms + "/d.gb";
+	std::vector<std::string> dirs(1, roms);
+	std::vector<uint8_t> rom;
+	RomIndex index;
+	const RomIndexEntry* e;
+
+	mkdir(roms.c_str(), 0755);
+	mkdir((roms + "/sub").c_str(), 0755);
+
+	rom = make_rom("ALPHA", 0x00, 0, true, 0x8000);
+	check(write_file(a, &rom[0], rom.size()), "index: write a.gb");
+	rom = make_rom("BETA", 0x80, 1, true, 0x8000);  // says 64 KiB
+	check(write_file(b, &rom[0], rom.size()), "index: write b.gbc");
+	rom = make_rom("GAMMA", 0x00, 0, false, 0x8000);
+	check(write_file(c, &rom[0], rom.size()), "index: write c.GB");
+	check(write_file(d, &rom[0], 100), "index: write d.gb");
+	check(write_file(roms + "/notes.txt", "x", 1), "index: write notes.txt");
+	set_mtime(a, 1000000000);
+
+	check(build_rom_index(dirs, name.c_str(), 2) == 4, "index: every ROM file found");
+	check(index.open(name.c_str()) == 0 && index.size() == 4, "index: open");
+	for (uint32_t i = 0; i < index.size(); i++)
+		check(index.find(index.path(i)) == (int)i, "index: find each path");
+	check(index.find((roms + "/notes.txt").c_str()) < 0, "index: other files skipped");
+
+	e = find_entry(index, a);
+	check(e && !strcmp(e->title, "ALPHA") && e->flags == (ROM_HEADER_VALID | ROM_SIZE_VALID) &&
+	      e->cartridge_type == 0x01 && e->global_checksum == 0x1234 && e->file_size == 0x8000,
+	      "index: header fields of a valid ROM");
+	e = find_entry(index, b);
+	check(e && !strncmp(e->title, "BETA", ROM_TITLE_LENGTH) && e->cgb_flag == 0x80 &&
+	      e->flags == ROM_HEADER_VALID, "index: CGB title and short file");
+	e = find_entry(index, c);
+	check(e && !(e->flags & ROM_HEADER_VALID), "index: bad header checksum flagged");
+	e = find_entry(index, d);
+	check(e && (e->flags & ROM_READ_FAILED), "index: file too short to read flagged");
+	index.close();
+
+	// same size and time: the old entry is kept without reading the file
+	rom = make_rom("DELTA", 0x00, 0, true, 0x8000);
+	check(write_file(a, &rom[0], rom.size()) && set_mtime(a, 1000000000), "index: rewrite a.gb");
+	check(build_rom_index(dirs, name.c_str(), 2) == 4 && index.open(name.c_str()) == 0,
+	      "index: rebuild");
+	e = find_entry(index, a);
+	check(e && !strcmp(e->title, "ALPHA"), "index: unchanged size and time reuse the entry");
+	index.close();
+
+	// a new time: read again; a removed file: dropped
+	check(set_mtime(a, 1000000100), "index: touch a.gb");
+	check(remove(c.c_str()) == 0, "index: remove c.GB");
+	check(build_rom_index(dirs, name.c_str(), 1) == 3 && index.open(name.c_str()) == 0,
+	      "index: rebuild after changes");
+	e = find_entry(index, a);
+	check(e && !strcmp(e->title, "DELTA"), "index: changed time rereads the header");
+	check(!find_entry(index, c), "index: removed file dropped");
+	index.close();
+
+	// a damaged index is rejected, and the next build reads every header
+	check(truncate(name.c_str(), file_size(name) - 3) == 0, "index: damage index");
+	check(index.open(name.c_str()) != 0, "index: truncated index rejected");
+	check(build_rom_index(dirs, name.c_str(), 2) == 3 && index.open(name.c_str()) == 0 &&
+	      index.size() == 3, "index: rebuilt from a damaged index");
+	index.close();
+}
+
+
+static bool same_frame(const VideoFrame& a, const VideoFrame& b)
+{
+	return a.frame_number == b.frame_number && a.clock_cycles == b.clock_cycles &&
+	       memcmp(a.pixels, b.pixels, sizeof(a.pixels)) == 0;
+}
+
+
+static void check_capture(const std::string& dir, std::mt19937& rng)
+{
+	const std::string name = dir + "/run.gbcap";
+	const std::string unclosed = dir + "/unclosed.gbcap";
+	std::vector<VideoFrame> frames(CAPTURE_FRAMES);
+	FrameCapture capture;
+	CaptureReader reader;
+	VideoFrame frame;
+	bool ok;
+
+	// a scrolling pattern with a few random pixels changed per frame
+	for (int f = 0; f < CAPTURE_FRAMES; f++) {
+		frames[f].frame_number = f + 1;
+		frames[f].clock_cycles = (uint64_t)(f + 1) * 70224;
+		for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+			frames[f].pixels[i] = ((i % SCREEN_WIDTH + f) / 8 + i / SCREEN_WIDTH / 8) & 3;
+		for (int n = 0; n < 50; n++)
+			frames[f].pixels[rng() % (SCREEN_WIDTH * SCREEN_HEIGHT)] = rng() & 3;
+	}
+
+	check(capture.open(name.c_str(), CAPTURE_INTERVAL) == 0, "capture: create");
+	for (int f = 0; f < CAPTURE_FRAMES; f++)
+		capture.submit(frames[f]);
+	check(capture.close() == 0 && capture.frames_written() == CAPTURE_FRAMES, "capture: close");
+
+	check(reader.open(name.c_str()) == 0 && reader.frame_count() == CAPTURE_FRAMES,
+	      "capture: open with index");
+	ok = true;
+	for (int f = 0; f < CAPTURE_FRAMES; f++)
+		ok = ok && reader.read_frame(f, frame) == 0 && same_frame(frame, frames[f]);
+	check(ok, "capture: frames read back in order");
+	ok = true;
+	for (int f = CAPTURE_FRAMES - 1; f >= 0; f--)
+		ok = ok && reader.read_frame(f, frame) == 0 && same_frame(frame, frames[f]);
+	check(ok, "capture: frames read back in reverse");
+	ok = true;
+	for (int n = 0; n < 100; n++) {
+		const int f = rng() % CAPTURE_FRAMES;
+		ok = ok && reader.read_frame(f, frame) == 0 && same_frame(frame, frames[f]);
+	}
+	check(ok, "capture: frames read back by seeking");
+	check(reader.read_frame(CAPTURE_FRAMES, frame) != 0, "capture: frame past the end rejected");
+	reader.close();
+
+	// never closed: no index, and the last record partly written
+	std::vector<uint8_t> data;
+	check(read_file(name, data) && data.size() > 24, "capture: read file");
+	uint64_t index_offset = 0;
+	for (int i = 7; i >= 0; i--)
+		index_offset = (index_offset << 8) | data[data.size() - 24 + i];
+	check(index_offset < data.size(), "capture: footer points at the index");
+
+	check(write_file(unclosed, &data[0], index_offset), "capture: write unclosed");
+	check(reader.open(unclosed.c_str()) == 0 && reader.frame_count() == CAPTURE_FRAMES,
+	      "capture: index rebuilt for a capture never closed");
+	check(reader.read_frame(CAPTURE_FRAMES - 1, frame) == 0 &&
+	      same_frame(frame, frames[CAPTURE_FRAMES - 1]), "capture: last frame of a rebuilt index");
+	reader.close();
+
+	check(write_file(unclosed, &data[0], index_offset - 7), "capture: write torn");
+	check(reader.open(unclosed.c_str()) == 0 && reader.frame_count() == CAPTURE_FRAMES - 1,
+	      "capture: torn last record dropped");
+	ok = true;
+	for (int f = CAPTURE_FRAMES - 2; f >= 0; f -= 3)
+		ok = ok && reader.read_frame(f, frame) == 0 && same_frame(frame, frames[f]);
+	check(ok, "capture: frames before a torn record");
+	reader.close();
+
+	data[0] ^= 0xFF;
+	check(write_file(unclosed, &data[0], data.size()), "capture: damage header");
+	check(reader.open(unclosed.c_str()) != 0, "capture: bad magic rejected");
+}
+
+
+static bool same_entry(const TraceEntry& a, const TraceEntry& b, const bool clock)
+{
+	return (!clock || a.clock == b.clock) && a.PC == b.PC && a.AF == b.AF && a.BC == b.BC &&
+	       a.DE == b.DE && a.HL == b.HL && a.SP == b.SP && a.opcode == b.opcode &&
+	       a.operand == b.operand;
+}
+
+
+static void check_trace(const std::string& dir, std::mt19937& rng)
+{
+	const std::string name_a = dir + "/a.trace", name_b = dir + "/b.trace";
+	std::vector<TraceEntry> entries(TRACE_ENTRIES);
+	TraceRecorder recorder;
+	TraceReader reader;
+	TraceEntry entry;
+	uint64_t clock = 0;
+	bool ok = true;
+
+	for (int i = 0; i < TRACE_ENTRIES; i++) {
+		TraceEntry& e = entries[i];
+
+		clock += (rng() % 100 == 0) ? rng() % 70224 : 4 * (1 + rng() % 6);
+		e.clock = clock;
+		e.PC = rng();
+		e.AF = rng() & 0xFFF0;
+		e.BC = rng();
+		e.DE = rng();
+		e.HL = rng();
+		e.SP = rng();
+		e.opcode = rng();
+		e.operand = rng();
+	}
+
+	check(recorder.open(name_a.c_str()) == 0, "trace: create");
+	for (int i = 0; i < TRACE_ENTRIES; i++)
+		recorder.record(entries[i]);
+	check(recorder.close() == 0 && recorder.entries_written() == TRACE_ENTRIES, "trace: close");
+
+	check(reader.open(name_a.c_str()) == 0 && reader.has_clock(), "trace: open");
+	for (int i = 0; i < TRACE_ENTRIES; i++)
+		ok = ok && reader.next(entry) && same_entry(entry, entries[i], true);
+	check(ok, "trace: entries and clocks read back across chunks");
+	check(!reader.next(entry), "trace: ends after the last entry");
+	reader.close();
+
+	// the same run but one register differs late in the second chunk
+	entries[TRACE_CHUNK_ENTRIES + 500].HL ^= 0x0100;
+	check(recorder.open(name_b.c_str()) == 0, "trace: create second");
+	for (int i = 0; i < TRACE_ENTRIES; i++)
+		recorder.record(entries[i]);
+	check(recorder.close() == 0, "trace: close second");
+
+	FILE* out = fopen("/dev/null", "w");
+	check(diff_traces(name_a.c_str(), name_a.c_str(), out) == 0, "trace: a trace matches itself");
+	check(diff_traces(name_a.c_str(), name_b.c_str(), out) == 1, "trace: changed register found");
+	if (out)
+		fclose(out);
+}
+
+
+int main(int argc, char* argv[])
+{
+	std::string dir;
+	unsigned int seed = 1;
+	bool keep = false;
+	bool temporary = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--dir") && i + 1 < argc)
+			dir = argv[++i];
+		else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--keep"))
+			keep = true;
+		else {
+			fprintf(stderr, "usage: %s [--dir D] [--seed S] [--keep]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (dir.empty()) {
+		char temp[] = "/tmp/format_check.XXXXXX";
+
+		if (!mkdtemp(temp)) {
+			fprintf(stderr, "can't create a temporary directory\n");
+			return 2;
+		}
+		dir = temp;
+		temporary = true;
+	} else {
+		mkdir(dir.c_str(), 0755);
+	}
+
+	std::mt19937 rng(seed);
+
+	check_state_archive(dir, rng);
+	check_rom_index(dir);
+	check_capture(dir, rng);
+	check_trace(dir, rng);
+
+	printf("%d checks, %d failing\n", checks, failing);
+
+	if (temporary && !keep && nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0)
+		fprintf(stderr, "can't remove %s\n", dir.c_str());
+
+	return failing ? 1 : 0;
+}
@@ -0,0 +1,71 @@
+#include "../control_server.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+// Hosts emulator instances for an orchestrator in another process, such as
+// a training loop, over the protocol in server_protocol.h. Runs until
+// interrupted.
+//
+// usage: gb_server [-n instances] [-j threads] socket_path shared_name
+
+static ControlServer* server;
+
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "usage: %s [-n instances] [-j threads] socket_path shared_name\n", name);
+}
+
+
+static void handle_signal(int)
+{
+	if (server)
+		server->stop();
+}
+
+
+int main(int argc, char* argv[])
+{
+	int threads = std::thread::hardware_concurrency();
+	int count = 1;
+	int arg = 1;
+
+	while (argc > arg + 1 && argv[arg][0] == '-') {
+		if (strcmp(argv[arg], "-n") == 0)
+			count = atoi(argv[arg + 1]);
+		else if (strcmp(argv[arg], "-j") == 0)
+			threads = atoi(argv[arg + 1]);
+		else
+			break;
+		arg += 2;
+	}
+
+	if (argc - arg != 2 || count < 1 || count > SERVER_ALL_INSTANCES - 1 || threads < 1) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	ControlServer control(count, threads);
+
+	if (control.open(argv[arg], argv[arg + 1]) != 0) {
+		fprintf(stderr, "can't listen on %s with shared memory %s\n", argv[arg], argv[arg + 1]);
+		return 2;
+	}
+
+	server = &control;
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	printf("serving %d instances on %s\n", count, argv[arg]);
+	fflush(stdout);
+	const int status = control.serve();
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	server = NULL;
+	control.close();
+	return status == 0 ? 0 : 2;
+}
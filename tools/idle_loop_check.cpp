@@ -0,0 +1,224 @@
+#include "../gameboy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Runs small ROMs whose main loop waits for something a device or an
+// interrupt handler changes, once with idle loops executed, once skipped
+// and once verified, and checks that skipping changes nothing:
+//
+//   vblank - waits on a RAM flag the VBlank handler sets, so a skip has to
+//            stop at every VBlank and must not run past one already raised;
+//            run with wait loops of several lengths
+//   ly_hl  - waits for a line through (HL) with L pointed at LY only inside
+//            the loop body, so the read must not be judged by HL at the head
+//   ly     - waits for a line with LDH; LY can change after the read in the
+//            iteration before a skip, and the skip must still see it
+//
+// The runs must end with the same count, clock and state hash, and
+// IDLE_SKIP_VERIFY must not report a mismatch.
+//
+// usage: idle_loop_check [--frames N]
+
+#define ROM_SIZE        0x8000
+#define VBLANK_PADDINGS 8
+#define LY_LINES        11  // lines 0, 13, ... 130 waited for
+
+struct Program {
+	const char* name;
+	std::vector<uint8_t> main;     // placed at 0x0100
+	std::vector<uint8_t> handler;  // placed at the VBlank vector, 0x0040
+	uint16_t counter;              // address counted up once a frame
+};
+
+static int checks = 0;
+static int failing = 0;
+
+
+static void check(const bool ok, const char* name, const char* what)
+{
+	checks++;
+	if (!ok) {
+		failing++;
+		printf("FAIL: %s: %s\n", name, what);
+	}
+}
+
+
+// Input: pad - NOPs in the wait loop; each length leaves a skip a different
+//              distance short of VBlank
+// Return: Program waiting on a flag the VBlank handler sets
+static Program vblank_program(const int pad)
+{
+	static char names[VBLANK_PADDINGS][16];
+	Program program;
+
+	snprintf(names[pad], sizeof(names[pad]), "vblank+%d", pad);
+	program.name = names[pad];
+	program.main = {
+		0xF3,              // DI
+		0x3E, 0x01,        // LD A, IE_VBLANK
+		0xE0, 0xFF,        // LDH (IE), A
+		0xAF,              // XOR A
+		0xE0, 0x0F,        // LDH (IF), A
+		0xEA, 0x00, 0xC0,  // LD (flag), A
+		0xFB               // EI
+	};
+	program.main.insert(program.main.end(), pad, 0x00);  // wait: NOP ...
+	program.main.insert(program.main.end(), {
+		0xFA, 0x00, 0xC0,                // LD A, (flag)
+		0xB7,                            // OR A
+		0x28, (uint8_t)(0xFA - pad),     // JR Z, wait
+		0xAF,                            // XOR A
+		0xEA, 0x00, 0xC0,                // LD (flag), A
+		0x21, 0x01, 0xC0,                // LD HL, frames seen
+		0x34,                            // INC (HL)
+		0x18, (uint8_t)(0xF0 - pad)      // JR wait
+	});
+	program.handler = {
+		0xF5,              // PUSH AF
+		0x3E, 0x01,        // LD A, 1
+		0xEA, 0x00, 0xC0,  // LD (flag), A
+		0xFA, 0x03, 0xC0,  // LD A, (count)
+		0x3C,              // INC A
+		0xEA, 0x03, 0xC0,  // LD (count), A
+		0xF1,              // POP AF
+		0xD9               // RETI
+	};
+	program.counter = 0xC003;
+	return program;
+}
+
+
+// Input: line - LY value to wait for, then the line after it
+// Return: Program counting the frames in which LY reaches line
+static Program ly_program(const uint8_t line)
+{
+	static char names[LINES_PER_FRAME][16];
+	Program program;
+
+	snprintf(names[line], sizeof(names[line]), "ly=%d", line);
+	program.name = names[line];
+	program.main = {
+		0xF3,                         // DI
+		0xF0, 0x44,                   // wait: LDH A, (LY)
+		0xFE, line,                   // CP line
+		0x20, 0xFA,                   // JR NZ, wait
+		0xFA, 0x03, 0xC0,             // LD A, (count)
+		0x3C,                         // INC A
+		0xEA, 0x03, 0xC0,             // LD (count), A
+		0xF0, 0x44,                   // leave: LDH A, (LY)
+		0xFE, (uint8_t)(line + 1),    // CP line + 1
+		0x20, 0xFA,                   // JR NZ, leave
+		0x18, 0xEA                    // JR wait
+	};
+	program.counter = 0xC003;
+	return program;
+}
+
+
+// Return: Program counting the frames in which LY reaches 0x90, reading LY
+//         as (HL) with L set to 0x44 just before the read and to 0x80, HRAM,
+//         just after it
+static Program ly_hl_program()
+{
+	Program program;
+
+	program.name = "ly_hl";
+	program.main = {
+		0xF3,              // DI
+		0x21, 0x80, 0xFF,  // LD HL, 0xFF80
+		0x2E, 0x44,        // wait: LD L, LY
+		0x7E,              // LD A, (HL)
+		0x2E, 0x80,        // LD L, 0x80
+		0xFE, 0x90,        // CP 0x90
+		0x20, 0xF7,        // JR NZ, wait
+		0xFA, 0x03, 0xC0,  // LD A, (count)
+		0x3C,              // INC A
+		0xEA, 0x03, 0xC0,  // LD (count), A
+		0x2E, 0x44,        // leave: LD L, LY
+		0x7E,              // LD A, (HL)
+		0x2E, 0x80,        // LD L, 0x80
+		0xFE, 0x91,        // CP 0x91
+		0x20, 0xF7,        // JR NZ, leave
+		0x18, 0xE5         // JR wait
+	};
+	program.counter = 0xC003;
+	return program;
+}
+
+
+struct Result {
+	uint8_t count;
+	uint64_t clock;
+	uint64_t hash;
+	uint64_t mismatches;
+};
+
+
+static Result run(const Program& program, const IdleSkipMode mode, const int frames)
+{
+	std::vector<uint8_t> rom(ROM_SIZE, 0);
+	GameBoy gameboy;
+	Result result;
+
+	memcpy(&rom[0x0100], &program.main[0], program.main.size());
+	if (!program.handler.empty())
+		memcpy(&rom[0x0040], &program.handler[0], program.handler.size());
+	gameboy.get_mmu().load_ROM_data(&rom[0], rom.size());
+	gameboy.reset();
+	gameboy.set_idle_skip(mode);
+
+	for (int i = 0; i < frames; i++)
+		gameboy.run_frame();
+
+	result.count = gameboy.get_mmu().read(program.counter);
+	result.clock = gameboy.get_cpu().get_clock_cycles();
+	result.hash = gameboy.state_hash();
+	result.mismatches = gameboy.get_idle_loop().get_mismatches();
+	return result;
+}
+
+
+static void check_program(const Program& program, const int frames)
+{
+	const Result off = run(program, IDLE_SKIP_OFF, frames);
+	const Result on = run(program, IDLE_SKIP_ON, frames);
+	const Result verify = run(program, IDLE_SKIP_VERIFY, frames);
+
+	printf("%s: counted %d times off, %d on, %d verified\n", program.name,
+	       off.count, on.count, verify.count);
+	check(off.count >= frames - 1, program.name, "counts every frame without skipping");
+	check(on.count == off.count && verify.count == off.count, program.name,
+	      "same count in every mode");
+	check(on.clock == off.clock && verify.clock == off.clock, program.name,
+	      "same clock in every mode");
+	check(on.hash == off.hash && verify.hash == off.hash, program.name,
+	      "same state in every mode");
+	check(verify.mismatches == 0, program.name, "no mismatches when verifying");
+}
+
+
+int main(int argc, char* argv[])
+{
+	int frames = 60;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+			frames = atoi(argv[++i]);
+		else {
+			fprintf(stderr, "usage: %s [--frames N]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	for (int pad = 0; pad < VBLANK_PADDINGS; pad++)
+		check_program(vblank_program(pad), frames);
+	check_program(ly_hl_program(), frames);
+	for (int line = 0; line < LY_LINES; line++)
+		check_program(ly_program(line * 13), frames);
+
+	printf("%d checks, %d failing\n", checks, failing);
+	return failing ? 1 : 0;
+}
@@ -0,0 +1,904 @@
+#include "../cpu.h"
+#include "../mmu.h"
+#include "../timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <string>
+
+// Runs every opcode in isolation against a table-driven reference model of
+// the instruction set, over randomly generated registers, flags, operands and
+// memory, and checks registers, flags, memory, interrupt state and clock
+// cycles. With --bench it also times each implemented handler. With
+// --accurate it runs the AccurateTiming cpu with a timer attached and also
+// checks that the timer was clocked through exactly the instruction's cycles.
+//
+// usage: opcode_suite [--cases N] [--seed S] [--bench] [--verbose] [--accurate]
+
+#define FLAG_Z 0x80
+#define FLAG_N 0x40
+#define FLAG_H 0x20
+#define FLAG_C 0x10
+
+#define BENCH_ITERATIONS 200000
+
+// Writes outside these are rejected so MMU side effects (OAM DMA) stay out
+#define SAFE_WRITE(addr) (((addr) >= 0xC000 && (addr) < 0xE000) || \
+                          ((addr) >= 0xFF80 && (addr) < 0xFFFF))
+
+static const char* r_names[8] = { "B", "C", "D", "E", "H", "L", "(HL)", "A" };
+static const char* rp_names[4] = { "BC", "DE", "HL", "SP" };
+static const char* rp2_names[4] = { "BC", "DE", "HL", "AF" };
+static const char* cc_names[4] = { "NZ", "Z", "NC", "C" };
+static const char* alu_names[8] = { "ADD A,", "ADC A,", "SUB", "SBC A,", "AND", "XOR", "OR", "CP" };
+static const char* rot_names[8] = { "RLC", "RRC", "RL", "RR", "SLA", "SRA", "SWAP", "SRL" };
+static const char* x0z7_names[8] = { "RLCA", "RRCA", "RLA", "RRA", "DAA", "CPL", "SCF", "CCF" };
+
+// Cycles per opcode from the hardware reference; conditionals not taken
+static const int base_cycles[256] = {
+	 4, 12,  8,  8,  4,  4,  8,  4, 20,  8,  8,  8,  4,  4,  8,  4,
+	 4, 12,  8,  8,  4,  4,  8,  4, 12,  8,  8,  8,  4,  4,  8,  4,
+	 8, 12,  8,  8,  4,  4,  8,  4,  8,  8,  8,  8,  4,  4,  8,  4,
+	 8, 12,  8,  8, 12, 12, 12,  4,  8,  8,  8,  8,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 8,  8,  8,  8,  8,  8,  4,  8,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 8, 12, 12, 16, 12, 16,  8, 16,  8, 16, 12,  4, 12, 24,  8, 16,
+	 8, 12, 12,  4, 12, 16,  8, 16,  8, 16, 12,  4, 12,  4,  8, 16,
+	12, 12,  8,  4,  4, 16,  8, 16, 16,  4, 16,  4,  4,  4,  8, 16,
+	12, 12,  8,  4,  4, 16,  8, 16, 12,  8, 16,  4,  4,  4,  8, 16
+};
+
+
+// Reference cpu. Decodes opcodes from their bit fields (x = bits 7-6,
+// y = bits 5-3, z = bits 2-0) instead of one case per opcode, so it shares
+// no code or structure with the emulator.
+struct RefCPU {
+	uint8_t r[8];  // B C D E H L - A, indexed like the opcode register field
+	uint8_t f;
+	uint16_t sp;
+	uint16_t pc;
+	bool ime;
+	bool halted;
+	bool stopped;
+	bool illegal;
+	bool unsafe;   // wrote somewhere the harness doesn't allow
+	int cycles;
+	uint8_t mem[0x10000];
+
+	uint16_t pair(const int p) const
+	{
+		return (r[2 * p] << 8) | r[2 * p + 1];
+	}
+
+	void set_pair(const int p, const uint16_t v)
+	{
+		r[2 * p] = v >> 8;
+		r[2 * p + 1] = v & 0xFF;
+	}
+
+	uint16_t rp(const int p) const
+	{
+		return (p == 3) ? sp : pair(p);
+	}
+
+	void set_rp(const int p, const uint16_t v)
+	{
+		if (p == 3)
+			sp = v;
+		else
+			set_pair(p, v);
+	}
+
+	uint16_t rp2(const int p) const
+	{
+		return (p == 3) ? ((r[7] << 8) | f) : pair(p);
+	}
+
+	void set_rp2(const int p, const uint16_t v)
+	{
+		if (p == 3) {
+			r[7] = v >> 8;
+			f = v & 0xF0;
+		} else {
+			set_pair(p, v);
+		}
+	}
+
+	void write(const uint16_t addr, const uint8_t v)
+	{
+		if (!SAFE_WRITE(addr))
+			unsafe = true;
+		mem[addr] = v;
+	}
+
+	uint8_t get_r(const int i) const
+	{
+		return (i == 6) ? mem[pair(2)] : r[i];
+	}
+
+	void set_r(const int i, const uint8_t v)
+	{
+		if (i == 6)
+			write(pair(2), v);
+		else
+			r[i] = v;
+	}
+
+	void push(const uint16_t v)
+	{
+		sp -= 2;
+		write(sp + 1, v >> 8);
+		write(sp, v & 0xFF);
+	}
+
+	uint16_t pop()
+	{
+		const uint16_t v = mem[sp] | (mem[(uint16_t)(sp + 1)] << 8);
+		sp += 2;
+		return v;
+	}
+
+	bool condition(const int c) const
+	{
+		switch(c) {
+		case 0: return !(f & FLAG_Z);
+		case 1: return (f & FLAG_Z) != 0;
+		case 2: return !(f & FLAG_C);
+		default: return (f & FLAG_C) != 0;
+		}
+	}
+
+	void alu(const int op, const uint8_t v)
+	{
+		const int a = r[7];
+		const int carry = (f & FLAG_C) ? 1 : 0;
+		int result;
+
+		switch(op) {
+		case 0:  // ADD
+		case 1:  // ADC
+		{
+			const int c = (op == 1) ? carry : 0;
+			result = a + v + c;
+			f = (((a & 0xF) + (v & 0xF) + c) > 0xF ? FLAG_H : 0) | (result > 0xFF ? FLAG_C : 0);
+			break;
+		}
+		case 2:  // SUB
+		case 3:  // SBC
+		case 7:  // CP
+		{
+			const int c = (op == 3) ? carry : 0;
+			result = a - v - c;
+			f = FLAG_N | (((a & 0xF) - (v & 0xF) - c) < 0 ? FLAG_H : 0) | (result < 0 ? FLAG_C : 0);
+			break;
+		}
+		case 4:
+			result = a & v;
+			f = FLAG_H;
+			break;
+		case 5:
+			result = a ^ v;
+			f = 0;
+			break;
+		default:
+			result = a | v;
+			f = 0;
+			break;
+		}
+
+		if ((result & 0xFF) == 0)
+			f |= FLAG_Z;
+		if (op != 7)
+			r[7] = result;
+	}
+
+	uint8_t rotate(const int op, const uint8_t v)
+	{
+		const int carry = (f & FLAG_C) ? 1 : 0;
+		int out = 0;
+		uint8_t result;
+
+		switch(op) {
+		case 0: out = v >> 7; result = (v << 1) | out; break;             // RLC
+		case 1: out = v & 1; result = (v >> 1) | (out << 7); break;       // RRC
+		case 2: out = v >> 7; result = (v << 1) | carry; break;           // RL
+		case 3: out = v & 1; result = (v >> 1) | (carry << 7); break;     // RR
+		case 4: out = v >> 7; result = v << 1; break;                     // SLA
+		case 5: out = v & 1; result = (v >> 1) | (v & 0x80); break;       // SRA
+		case 6: result = (v << 4) | (v >> 4); break;                      // SWAP
+		default: out = v & 1; result = v >> 1; break;                     // SRL
+		}
+
+		f = (result ? 0 : FLAG_Z) | (out ? FLAG_C : 0);
+		return result;
+	}
+
+	uint16_t add_sp(const uint8_t d)
+	{
+		f = (((sp & 0xF) + (d & 0xF)) > 0xF ? FLAG_H : 0) |
+		    (((sp & 0xFF) + d) > 0xFF ? FLAG_C : 0);
+		return sp + (int8_t)d;
+	}
+
+	void step();
+	void step_cb(const uint8_t op);
+};
+
+
+// Execute the instruction at pc
+void RefCPU::step()
+{
+	const uint8_t op = mem[pc];
+	const uint8_t n = mem[(uint16_t)(pc + 1)];
+	const uint16_t nn = n | (mem[(uint16_t)(pc + 2)] << 8);
+	const int x = op >> 6;
+	const int y = (op >> 3) & 7;
+	const int z = op & 7;
+	const int p = y >> 1;
+	const int q = y & 1;
+
+	cycles = base_cycles[op];
+
+	if (x == 1) {
+		if (op == 0x76) {
+			halted = true;
+		} else {
+			set_r(y, get_r(z));
+		}
+		pc += 1;
+		return;
+	}
+
+	if (x == 2) {
+		alu(y, get_r(z));
+		pc += 1;
+		return;
+	}
+
+	if (x == 0) {
+		switch(z) {
+		case 0:
+			if (y == 0) {
+				pc += 1;
+			} else if (y == 1) {  // LD (nn), SP
+				write(nn, sp & 0xFF);
+				write(nn + 1, sp >> 8);
+				pc += 3;
+			} else if (y == 2) {  // STOP
+				stopped = true;
+				mem[0xFF04] = 0;  // DIV is reset
+				pc += 2;
+			} else {  // JR, JR cc
+				pc += 2;
+				if (y == 3 || condition(y - 4)) {
+					if (y != 3)
+						cycles += 4;
+					pc += (int8_t)n;
+				}
+			}
+			return;
+		case 1:
+			if (q == 0) {
+				set_rp(p, nn);
+				pc += 3;
+			} else {  // ADD HL, rr
+				const int hl = pair(2);
+				const int v = rp(p);
+				f = (f & FLAG_Z) | (((hl & 0xFFF) + (v & 0xFFF)) > 0xFFF ? FLAG_H : 0) |
+				    ((hl + v) > 0xFFFF ? FLAG_C : 0);
+				set_pair(2, hl + v);
+				pc += 1;
+			}
+			return;
+		case 2:
+		{
+			const uint16_t addr = (p == 0) ? pair(0) : (p == 1) ? pair(1) : pair(2);
+			if (q == 0)
+				write(addr, r[7]);
+			else
+				r[7] = mem[addr];
+			if (p == 2)
+				set_pair(2, pair(2) + 1);
+			else if (p == 3)
+				set_pair(2, pair(2) - 1);
+			pc += 1;
+			return;
+		}
+		case 3:
+			set_rp(p, rp(p) + (q ? -1 : 1));
+			pc += 1;
+			return;
+		case 4:
+		case 5:
+		{
+			const uint8_t v = get_r(y);
+			const uint8_t result = v + ((z == 4) ? 1 : -1);
+			const bool half = (z == 4) ? ((result & 0xF) == 0) : ((v & 0xF) == 0);
+			f = (f & FLAG_C) | (result ? 0 : FLAG_Z) | ((z == 5) ? FLAG_N : 0) | (half ? FLAG_H : 0);
+			set_r(y, result);
+			pc += 1;
+			return;
+		}
+		case 6:
+			set_r(y, n);
+			pc += 2;
+			return;
+		default:
+		{
+			const int a = r[7];
+			const int carry = (f & FLAG_C) ? 1 : 0;
+
+			switch(y) {
+			case 0: r[7] = (a << 1) | (a >> 7); f = (a & 0x80) ? FLAG_C : 0; break;
+			case 1: r[7] = (a >> 1) | (a << 7); f = (a & 0x01) ? FLAG_C : 0; break;
+			case 2: r[7] = (a << 1) | carry; f = (a & 0x80) ? FLAG_C : 0; break;
+			case 3: r[7] = (a >> 1) | (carry << 7); f = (a & 0x01) ? FLAG_C : 0; break;
+			case 4:  // DAA
+			{
+				int v = a;
+				int c = carry;
+				if (f & FLAG_N) {
+					if (f & FLAG_H)
+						v -= 0x06;
+					if (c)
+						v -= 0x60;
+				} else {
+					if ((f & FLAG_H) || (v & 0x0F) > 0x09)
+						v += 0x06;
+					if (c || a > 0x99) {
+						v += 0x60;
+						c = 1;
+					}
+				}
+				r[7] = v;
+				f = (f & FLAG_N) | (r[7] ? 0 : FLAG_Z) | (c ? FLAG_C : 0);
+				break;
+			}
+			case 5: r[7] = ~a; f |= FLAG_N | FLAG_H; break;
+			case 6: f = (f & FLAG_Z) | FLAG_C; break;
+			default: f = (f & (FLAG_Z | FLAG_C)) ^ FLAG_C; break;
+			}
+			pc += 1;
+			return;
+		}
+		}
+	}
+
+	// x == 3
+	switch(z) {
+	case 0:
+		if (y < 4) {  // RET cc
+			pc += 1;
+			if (condition(y)) {
+				cycles += 12;
+				pc = pop();
+			}
+		} else if (y == 4) {
+			write(0xFF00 + n, r[7]);
+			pc += 2;
+		} else if (y == 5) {
+			sp = add_sp(n);
+			pc += 2;
+		} else if (y == 6) {
+			r[7] = mem[0xFF00 + n];
+			pc += 2;
+		} else {
+			set_pair(2, add_sp(n));
+			pc += 2;
+		}
+		return;
+	case 1:
+		if (q == 0) {
+			set_rp2(p, pop());
+			pc += 1;
+		} else if (p == 0 || p == 1) {  // RET, RETI
+			pc = pop();
+			if (p == 1)
+				ime = true;
+		} else if (p == 2) {
+			pc = pair(2);
+		} else {
+			sp = pair(2);
+			pc += 1;
+		}
+		return;
+	case 2:
+		if (y < 4) {
+			pc += 3;
+			if (condition(y)) {
+				cycles += 4;
+				pc = nn;
+			}
+		} else if (y == 4) {
+			write(0xFF00 + r[1], r[7]);
+			pc += 1;
+		} else if (y == 5) {
+			write(nn, r[7]);
+			pc += 3;
+		} else if (y == 6) {
+			r[7] = mem[0xFF00 + r[1]];
+			pc += 1;
+		} else {
+			r[7] = mem[nn];
+			pc += 3;
+		}
+		return;
+	case 3:
+		if (y == 0) {
+			pc = nn;
+		} else if (y == 1) {
+			step_cb(n);
+		} else if (y == 6) {
+			ime = false;
+			pc += 1;
+		} else if (y == 7) {
+			pc += 1;  // EI only takes effect after the next instruction
+		} else {
+			illegal = true;
+		}
+		return;
+	case 4:
+		if (y >= 4) {
+			illegal = true;
+			return;
+		}
+		pc += 3;
+		if (condition(y)) {
+			cycles += 12;
+			push(pc);
+			pc = nn;
+		}
+		return;
+	case 5:
+		if (q == 0) {
+			push(rp2(p));
+			pc += 1;
+		} else if (p == 0) {
+			push(pc + 3);
+			pc = nn;
+		} else {
+			illegal = true;
+		}
+		return;
+	case 6:
+		alu(y, n);
+		pc += 2;
+		return;
+	default:
+		push(pc + 1);
+		pc = y * 8;
+		return;
+	}
+}
+
+
+void RefCPU::step_cb(const uint8_t op)
+{
+	const int x = op >> 6;
+	const int y = (op >> 3) & 7;
+	const int z = op & 7;
+	const uint8_t v = get_r(z);
+
+	cycles = (z == 6) ? ((x == 1) ? 12 : 16) : 8;
+	pc += 2;
+
+	switch(x) {
+	case 0:
+		set_r(z, rotate(y, v));
+		break;
+	case 1:
+		f = (f & FLAG_C) | FLAG_H | ((v & (1 << y)) ? 0 : FLAG_Z);
+		break;
+	case 2:
+		set_r(z, v & ~(1 << y));
+		break;
+	default:
+		set_r(z, v | (1 << y));
+		break;
+	}
+}
+
+
+// Return: Assembly name of opcode, or of the CB opcode if prefix is set
+static std::string mnemonic(const uint8_t op, const bool prefix)
+{
+	const int x = op >> 6;
+	const int y = (op >> 3) & 7;
+	const int z = op & 7;
+	const int p = y >> 1;
+	const int q = y & 1;
+	char name[32];
+
+	if (prefix) {
+		static const char* cb_ops[4] = { NULL, "BIT", "RES", "SET" };
+		if (x == 0)
+			snprintf(name, sizeof(name), "%s %s", rot_names[y], r_names[z]);
+		else
+			snprintf(name, sizeof(name), "%s %d, %s", cb_ops[x], y, r_names[z]);
+		return name;
+	}
+
+	if (x == 1) {
+		if (op == 0x76)
+			return "HALT";
+		snprintf(name, sizeof(name), "LD %s, %s", r_names[y], r_names[z]);
+		return name;
+	}
+	if (x == 2) {
+		snprintf(name, sizeof(name), "%s %s", alu_names[y], r_names[z]);
+		return name;
+	}
+	if (x == 0) {
+		switch(z) {
+		case 0:
+		{
+			static const char* names[4] = { "NOP", "LD (nn), SP", "STOP", "JR d" };
+			if (y < 4)
+				return names[y];
+			snprintf(name, sizeof(name), "JR %s, d", cc_names[y - 4]);
+			return name;
+		}
+		case 1:
+			snprintf(name, sizeof(name), q ? "ADD HL, %s" : "LD %s, nn", rp_names[p]);
+			return name;
+		case 2:
+		{
+			static const char* addr[4] = { "(BC)", "(DE)", "(HL+)", "(HL-)" };
+			snprintf(name, sizeof(name), q ? "LD A, %s" : "LD %s, A", addr[p]);
+			return name;
+		}
+		case 3:
+			snprintf(name, sizeof(name), "%s %s", q ? "DEC" : "INC", rp_names[p]);
+			return name;
+		case 4:
+		case 5:
+			snprintf(name, sizeof(name), "%s %s", (z == 4) ? "INC" : "DEC", r_names[y]);
+			return name;
+		case 6:
+			snprintf(name, sizeof(name), "LD %s, n", r_names[y]);
+			return name;
+		default:
+			return x0z7_names[y];
+		}
+	}
+
+	switch(z) {
+	case 0:
+	{
+		static const char* names[4] = { "LDH (n), A", "ADD SP, d", "LDH A, (n)", "LD HL, SP+d" };
+		if (y >= 4)
+			return names[y - 4];
+		snprintf(name, sizeof(name), "RET %s", cc_names[y]);
+		return name;
+	}
+	case 1:
+	{
+		static const char* names[4] = { "RET", "RETI", "JP HL", "LD SP, HL" };
+		if (q)
+			return names[p];
+		snprintf(name, sizeof(name), "POP %s", rp2_names[p]);
+		return name;
+	}
+	case 2:
+	{
+		static const char* names[4] = { "LD (C), A", "LD (nn), A", "LD A, (C)", "LD A, (nn)" };
+		if (y >= 4)
+			return names[y - 4];
+		snprintf(name, sizeof(name), "JP %s, nn", cc_names[y]);
+		return name;
+	}
+	case 3:
+	{
+		static const char* names[8] = { "JP nn", "CB", "-", "-", "-", "-", "DI", "EI" };
+		return names[y];
+	}
+	case 4:
+		if (y >= 4)
+			return "-";
+		snprintf(name, sizeof(name), "CALL %s, nn", cc_names[y]);
+		return name;
+	case 5:
+		if (q == 0) {
+			snprintf(name, sizeof(name), "PUSH %s", rp2_names[p]);
+			return name;
+		}
+		return (p == 0) ? "CALL nn" : "-";
+	case 6:
+		snprintf(name, sizeof(name), "%s n", alu_names[y]);
+		return name;
+	default:
+		snprintf(name, sizeof(name), "RST %02XH", y * 8);
+		return name;
+	}
+}
+
+
+struct Result {
+	int cases;
+	int failures;
+	bool missing;   // the emulator faults on it
+	double ns_per_op;
+};
+
+
+static void print_state(const char* label, const CPURegisters& r, const int cycles,
+                        const bool ime, const bool halted)
+{
+	printf("    %s AF:%04X BC:%04X DE:%04X HL:%04X SP:%04X PC:%04X cycles:%d IME:%d halt:%d\n",
+	       label, r.AF, r.BC, r.DE, r.HL, r.SP, r.PC, cycles, ime, halted);
+}
+
+
+// Input: op - opcode, or the CB opcode when prefix is set
+//        timer - timer clocked by cpu, or NULL
+// Return: Pass/fail counts over cases generated inputs
+template <class CPUType>
+static Result check_opcode(MMU& mmu, CPUType& cpu, Timer* timer, RefCPU& ref, std::mt19937& rng,
+                           const uint8_t op, const bool prefix, const int cases,
+                           const bool verbose)
+{
+	Result result = { 0, 0, false, 0.0 };
+
+	for (int i = 0; i < cases; i++) {
+		CPURegisters in;
+		int tries = 0;
+
+		// Generate inputs until the reference only writes to WRAM/HRAM.
+		// After a few attempts point the memory registers there directly.
+		do {
+			cpu.initialize();
+			if (timer)
+				timer->reset();  // DIV can't tick over within one instruction
+			for (int a = 0xC000; a < 0xE000; a++)
+				mmu.write_byte(a, rng());
+			for (int a = 0xFF80; a < 0xFFFF; a++)
+				mmu.write_byte(a, rng());
+
+			const bool constrain = tries++ >= 4;
+
+			in.PC = 0xC000 + rng() % 0x1FF0;
+			in.AF = rng() & 0xFFF0;
+			in.BC = constrain ? 0xC000 + rng() % 0x1FFF : rng();
+			in.DE = constrain ? 0xC000 + rng() % 0x1FFF : rng();
+			in.HL = constrain ? 0xC000 + rng() % 0x1FFF : rng();
+			in.SP = constrain ? 0xC002 + rng() % 0x1FFC : rng();
+			if (constrain)
+				in.BC = (in.BC & 0xFF00) | (0x80 + rng() % 0x7F);  // (C) in HRAM
+
+			if (prefix) {
+				mmu.write_byte(in.PC, 0xCB);
+				mmu.write_byte(in.PC + 1, op);
+			} else {
+				mmu.write_byte(in.PC, op);
+			}
+			if (constrain) {
+				// (n) and (nn) operands into HRAM and WRAM
+				if (!prefix)
+					mmu.write_byte(in.PC + 1, 0x80 + rng() % 0x7F);
+				if (!prefix && (op == 0xEA || op == 0x08))
+					mmu.write_word(in.PC + 1, 0xC000 + rng() % 0x1FF0);
+			}
+
+			for (int a = 0; a < 0x10000; a++)
+				ref.mem[a] = mmu.read(a);
+			ref.r[0] = in.BC >> 8;
+			ref.r[1] = in.BC & 0xFF;
+			ref.r[2] = in.DE >> 8;
+			ref.r[3] = in.DE & 0xFF;
+			ref.r[4] = in.HL >> 8;
+			ref.r[5] = in.HL & 0xFF;
+			ref.r[7] = in.AF >> 8;
+			ref.f = in.AF & 0xF0;
+			ref.sp = in.SP;
+			ref.pc = in.PC;
+			ref.ime = false;
+			ref.halted = false;
+			ref.stopped = false;
+			ref.illegal = false;
+			ref.unsafe = false;
+			ref.step();
+		} while (ref.unsafe && tries < 16);
+
+		if (ref.unsafe)
+			continue;
+
+		TimerState before, after;
+
+		if (timer)
+			timer->get_state(before);
+
+		cpu.set_registers(in);
+		const int cycles = cpu.execute_next_opcode();
+		const CPUState out = cpu.get_state();
+
+		if (timer)
+			timer->get_state(after);
+
+		result.cases++;
+
+		if (out.fault == FAULT_UNKNOWN_OPCODE && !ref.illegal) {
+			result.missing = true;
+			return result;
+		}
+
+		CPURegisters expect;
+		expect.AF = (ref.r[7] << 8) | ref.f;
+		expect.BC = ref.pair(0);
+		expect.DE = ref.pair(1);
+		expect.HL = ref.pair(2);
+		expect.SP = ref.sp;
+		expect.PC = ref.pc;
+
+		bool ok;
+		if (ref.illegal) {
+			ok = (out.fault == FAULT_UNKNOWN_OPCODE) && out.regs.PC == in.PC;
+		} else {
+			ok = out.fault == FAULT_NONE && memcmp(&out.regs, &expect, sizeof(expect)) == 0 &&
+			     cycles == ref.cycles && out.IME == ref.ime && out.halted == ref.halted &&
+			     out.stopped == ref.stopped;
+			for (int a = 0; ok && a < 0x10000; a++)
+				ok = mmu.read(a) == ref.mem[a];
+			if (timer && !ref.stopped)  // STOP clears DIV
+				ok = ok && (uint16_t)(after.divider - before.divider) == cycles;
+		}
+
+		if (!ok) {
+			if (result.failures == 0 && verbose) {
+				printf("  %s%02X %s\n", prefix ? "CB " : "", op, mnemonic(op, prefix).c_str());
+				print_state("in:    ", in, 0, false, false);
+				print_state("expect:", expect, ref.cycles, ref.ime, ref.halted);
+				print_state("got:   ", out.regs, cycles, out.IME, out.halted);
+				for (int a = 0; a < 0x10000; a++)
+					if (mmu.read(a) != ref.mem[a])
+						printf("    memory %04X: expect %02X got %02X\n", a, ref.mem[a], mmu.read(a));
+			}
+			result.failures++;
+		}
+	}
+
+	return result;
+}
+
+
+// Return: Average nanoseconds per execution of the opcode, including
+//         resetting the registers before each one
+template <class CPUType>
+static double bench_opcode(MMU& mmu, CPUType& cpu, const uint8_t op, const bool prefix)
+{
+	CPURegisters regs;
+
+	cpu.initialize();
+	regs.PC = 0xC000;
+	regs.AF = 0x1230;
+	regs.BC = 0xD180;
+	regs.DE = 0xD200;
+	regs.HL = 0xD300;
+	regs.SP = 0xDFF0;
+
+	if (prefix) {
+		mmu.write_byte(0xC000, 0xCB);
+		mmu.write_byte(0xC001, op);
+	} else {
+		mmu.write_byte(0xC000, op);
+		mmu.write_byte(0xC001, 0x90);
+		mmu.write_byte(0xC002, 0xD4);
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < BENCH_ITERATIONS; i++) {
+		cpu.set_registers(regs);
+		cpu.execute_next_opcode();
+	}
+
+	const auto end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(end - start).count() / BENCH_ITERATIONS;
+}
+
+
+// Input: accurate - attach a timer for the cpu to clock
+// Return: Number of failing opcodes
+template <class CPUType>
+static int run_suite(const int cases, const unsigned int seed, const bool bench,
+                     const bool verbose, const bool accurate)
+{
+	MMU* mmu = new MMU();
+	CPUType* cpu = new CPUType(*mmu);
+	Timer* timer = accurate ? new Timer(*mmu) : NULL;
+	RefCPU* ref = new RefCPU();
+	std::mt19937 rng(seed);
+	int implemented = 0;
+	int failing = 0;
+	int missing = 0;
+
+	mmu->attach_timer(timer);
+	cpu->attach_devices(timer, NULL);
+
+	printf("opcode  mnemonic        cases  fail%s\n", bench ? "    ns/op" : "");
+
+	for (int n = 0; n < 512; n++) {
+		const bool prefix = n >= 256;
+		const uint8_t op = n & 0xFF;
+
+		if (!prefix && op == 0xCB)
+			continue;
+
+		Result result = check_opcode(*mmu, *cpu, timer, *ref, rng, op, prefix, cases, verbose);
+
+		if (result.missing) {
+			missing++;
+			if (verbose)
+				printf("%s%02X %-15s missing\n", prefix ? "CB " : "   ", op,
+				       mnemonic(op, prefix).c_str());
+			continue;
+		}
+
+		implemented++;
+		if (result.failures)
+			failing++;
+
+		if (bench && !result.failures)
+			result.ns_per_op = bench_opcode(*mmu, *cpu, op, prefix);
+
+		printf("%s%02X %-15s %6d %5d", prefix ? "CB " : "   ", op, mnemonic(op, prefix).c_str(),
+		       result.cases, result.failures);
+		if (bench && !result.failures)
+			printf(" %8.1f", result.ns_per_op);
+		printf("\n");
+	}
+
+	printf("\n%d opcodes checked, %d failing, %d not implemented\n", implemented, failing, missing);
+
+	delete ref;
+	delete timer;
+	delete cpu;
+	delete mmu;
+
+	return failing;
+}
+
+
+int main(int argc, char* argv[])
+{
+	int cases = 64;
+	unsigned int seed = 1;
+	bool bench = false;
+	bool verbose = false;
+	bool accurate = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--cases") && i + 1 < argc)
+			cases = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--bench"))
+			bench = true;
+		else if (!strcmp(argv[i], "--verbose"))
+			verbose = true;
+		else if (!strcmp(argv[i], "--accurate"))
+			accurate = true;
+		else {
+			fprintf(stderr, "usage: %s [--cases N] [--seed S] [--bench] [--verbose] [--accurate]\n",
+			        argv[0]);
+			return 2;
+		}
+	}
+
+	int failing;
+
+	if (accurate)
+		failing = run_suite<BasicCPU<AccurateTiming> >(cases, seed, bench, verbose, true);
+	else
+		failing = run_suite<BasicCPU<FastTiming> >(cases, seed, bench, verbose, false);
+
+	return failing ? 1 : 0;
+}
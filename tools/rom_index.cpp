@@ -0,0 +1,76 @@
+#include "../rom_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "usage: %s [-j threads] index_file dir...   build or update an index\n"
+	                "       %s -l index_file                  list an index\n", name, name);
+}
+
+
+// Print one line per ROM: header and size checks, cartridge type, ROM and
+// RAM size codes, title and path
+static int list_index(const char* file_name)
+{
+	RomIndex index;
+
+	if (index.open(file_name) != 0) {
+		fprintf(stderr, "can't read index %s\n", file_name);
+		return 2;
+	}
+
+	for (uint32_t i = 0; i < index.size(); i++) {
+		const RomIndexEntry& e = index.entry(i);
+		char title[ROM_TITLE_LENGTH + 1];
+
+		memcpy(title, e.title, ROM_TITLE_LENGTH);
+		title[ROM_TITLE_LENGTH] = 0;
+
+		if (e.flags & ROM_READ_FAILED)
+			printf("unreadable                               %s\n", index.path(i));
+		else
+			printf("%s %s %02X %02X %02X %-16s %s\n", (e.flags & ROM_HEADER_VALID) ? "hdr-ok " : "hdr-bad",
+			       (e.flags & ROM_SIZE_VALID) ? "size-ok " : "size-bad", e.cartridge_type,
+			       e.rom_size_code, e.ram_size_code, title, index.path(i));
+	}
+
+	return 0;
+}
+
+
+// Index the headers of every .gb and .gbc file under the given directories,
+// or list an existing index.
+int main(int argc, char* argv[])
+{
+	int threads = std::thread::hardware_concurrency();
+	int arg = 1;
+
+	if (argc == 3 && strcmp(argv[1], "-l") == 0)
+		return list_index(argv[2]);
+
+	if (argc > arg + 1 && strcmp(argv[arg], "-j") == 0) {
+		threads = atoi(argv[arg + 1]);
+		arg += 2;
+	}
+
+	if (argc - arg < 2 || threads < 1) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	const char* index_file = argv[arg];
+	std::vector<std::string> dirs(argv + arg + 1, argv + argc);
+	const int count = build_rom_index(dirs, index_file, threads);
+
+	if (count < 0) {
+		fprintf(stderr, "can't write %s\n", index_file);
+		return 2;
+	}
+
+	printf("%d ROMs indexed\n", count);
+	return 0;
+}
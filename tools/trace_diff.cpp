@@ -0,0 +1,20 @@
+#include "../trace.h"
+#include <stdio.h>
+
+
+// Compare two execution traces, or a trace and a reference emulator's text
+// log, and print the first instruction where they differ.
+int main(int argc, char* argv[])
+{
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s trace_a trace_b\n", argv[0]);
+		return 2;
+	}
+
+	const int result = diff_traces(argv[1], argv[2], stdout);
+
+	if (result < 0)
+		fprintf(stderr, "can't read %s or %s\n", argv[1], argv[2]);
+
+	return result < 0 ? 2 : result;
+}
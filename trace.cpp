@@ -0,0 +1,454 @@
+#include "trace.h"
+#include "compress.h"
+#include <string.h>
+#include <chrono>
+
+#define FILE_HEADER_SIZE  16
+#define CHUNK_HEADER_SIZE 16
+#define PACKED_ENTRY_SIZE 18
+#define PACKED_CHUNK_SIZE (TRACE_CHUNK_ENTRIES * PACKED_ENTRY_SIZE)
+
+#define DIFF_CONTEXT 8  // instructions shown before a divergence
+
+static const char file_magic[8] = { 'G', 'B', 'T', 'R', 'C', 0x01, 0, 0 };
+
+
+// Trace files are little-endian regardless of the host.
+static void put_u16(uint8_t* p, const uint16_t value)
+{
+	p[0] = value & 0xFF;
+	p[1] = value >> 8;
+}
+
+
+static void put_u32(uint8_t* p, const uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = (value >> (8 * i)) & 0xFF;
+}
+
+
+static void put_u64(uint8_t* p, const uint64_t value)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = (value >> (8 * i)) & 0xFF;
+}
+
+
+static uint16_t get_u16(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+
+static uint32_t get_u32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static uint64_t get_u64(const uint8_t* p)
+{
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+
+TraceRecorder::TraceRecorder()
+	: queue(NULL), running(false), written_count(0), stall_count(0), chunk(NULL),
+	  file(NULL), failed(false)
+{
+}
+
+
+TraceRecorder::~TraceRecorder()
+{
+	close();
+}
+
+
+// Input: file_name - trace file to create
+// Return: Return 0 on success;
+//         return -1 on failure
+// Function: Create the trace file and start the writer thread
+int TraceRecorder::open(const char* file_name)
+{
+	uint8_t header[FILE_HEADER_SIZE];
+
+	close();
+
+	file = fopen(file_name, "wb");
+	if (!file)
+		return -1;
+
+	memcpy(header, file_magic, sizeof(file_magic));
+	put_u32(header + 8, PACKED_ENTRY_SIZE);
+	put_u32(header + 12, 0);
+
+	if (fwrite(header, sizeof(header), 1, file) != 1) {
+		fclose(file);
+		file = NULL;
+		return -1;
+	}
+
+	failed = false;
+	written_count.store(0, std::memory_order_relaxed);
+	stall_count = 0;
+
+	queue = new RingBuffer<TraceChunk>(TRACE_QUEUE_CHUNKS, BACKPRESSURE);
+	chunk = queue->begin_write();
+	chunk->count = 0;
+
+	running.store(true, std::memory_order_release);
+	worker = std::thread(&TraceRecorder::worker_loop, this);
+
+	return 0;
+}
+
+
+// Input: None
+// Return: Return 0 on success;
+//         return -1 if any chunk could not be written
+// Function: Flush the partly filled chunk and wait for the writer to finish
+int TraceRecorder::close()
+{
+	if (!file)
+		return 0;
+
+	if (chunk->count > 0)
+		queue->end_write();
+	chunk = NULL;
+
+	running.store(false, std::memory_order_release);
+	worker.join();
+
+	if (fclose(file) != 0)
+		failed = true;
+	file = NULL;
+
+	delete queue;
+	queue = NULL;
+
+	return failed ? -1 : 0;
+}
+
+
+// Return: Number of instructions the writer has finished
+uint64_t TraceRecorder::entries_written() const
+{
+	return written_count.load(std::memory_order_relaxed);
+}
+
+
+// Return: Number of times the cpu waited for a free chunk
+uint64_t TraceRecorder::stalls() const
+{
+	return stall_count;
+}
+
+
+// Function: Hand the full chunk to the writer and start the next one
+void TraceRecorder::next_chunk()
+{
+	queue->end_write();
+
+	while (!(chunk = queue->begin_write())) {
+		stall_count++;
+		std::this_thread::yield();
+	}
+
+	chunk->count = 0;
+}
+
+
+// Function: Pack, compress and write queued chunks until the trace is closed
+void TraceRecorder::worker_loop()
+{
+	std::vector<uint8_t> packed(PACKED_CHUNK_SIZE);
+	std::vector<uint8_t> compressed(lz_compress_bound(PACKED_CHUNK_SIZE));
+
+	for (;;) {
+		const TraceChunk* full = queue->begin_read();
+
+		if (!full) {
+			if (running.load(std::memory_order_acquire)) {
+				std::this_thread::sleep_for(std::chrono::microseconds(500));
+				continue;
+			}
+			// closing; the last chunk is visible now
+			full = queue->begin_read();
+			if (!full)
+				break;
+		}
+
+		const int count = full->count;
+
+		write_chunk(*full, &packed[0], &compressed[0]);
+		queue->end_read();
+		written_count.store(written_count.load(std::memory_order_relaxed) + count,
+		                    std::memory_order_relaxed);
+	}
+}
+
+
+// Input: chunk - entries to write
+//        packed, compressed - scratch buffers
+// Return: None
+// Function: Append the entries as one or more file chunks. Each file chunk
+//           stores the clock of its first entry, and every entry the cycles
+//           since the one before; a gap too long for 32 bits starts a new
+//           file chunk.
+void TraceRecorder::write_chunk(const TraceChunk& chunk, uint8_t* packed, uint8_t* compressed)
+{
+	int first = 0;
+
+	while (!failed && first < chunk.count) {
+		uint64_t clock = chunk.entries[first].clock;
+		int count = 0;
+
+		for (int i = first; i < chunk.count; i++) {
+			const TraceEntry& e = chunk.entries[i];
+			uint8_t* p = &packed[count * PACKED_ENTRY_SIZE];
+
+			if (e.clock - clock > 0xFFFFFFFF)
+				break;
+
+			put_u16(p, e.PC);
+			p[2] = e.opcode;
+			p[3] = e.operand;
+			put_u16(p + 4, e.AF);
+			put_u16(p + 6, e.BC);
+			put_u16(p + 8, e.DE);
+			put_u16(p + 10, e.HL);
+			put_u16(p + 12, e.SP);
+			put_u32(p + 14, (uint32_t)(e.clock - clock));
+			clock = e.clock;
+			count++;
+		}
+
+		const int size = lz_compress(packed, count * PACKED_ENTRY_SIZE, compressed,
+		                             lz_compress_bound(PACKED_CHUNK_SIZE));
+		uint8_t header[CHUNK_HEADER_SIZE];
+
+		put_u32(header, count);
+		put_u32(header + 4, size);
+		put_u64(header + 8, chunk.entries[first].clock);
+
+		if (size < 0 || fwrite(header, sizeof(header), 1, file) != 1 ||
+		    fwrite(compressed, size, 1, file) != 1)
+			failed = true;
+
+		first += count;
+	}
+}
+
+
+TraceReader::TraceReader() : file(NULL), binary(false), position(0), clock(0)
+{
+}
+
+
+TraceReader::~TraceReader()
+{
+	close();
+}
+
+
+// Input: file_name - trace file or text log to read
+// Return: Return 0 on success;
+//         return -1 on failure
+int TraceReader::open(const char* file_name)
+{
+	uint8_t header[FILE_HEADER_SIZE];
+
+	close();
+
+	file = fopen(file_name, "rb");
+	if (!file)
+		return -1;
+
+	binary = fread(header, sizeof(header), 1, file) == 1 &&
+	         memcmp(header, file_magic, sizeof(file_magic)) == 0;
+
+	if (binary && get_u32(header + 8) != PACKED_ENTRY_SIZE) {
+		close();
+		return -1;
+	}
+	if (!binary)
+		rewind(file);
+
+	chunk.clear();
+	position = 0;
+	clock = 0;
+
+	return 0;
+}
+
+
+void TraceReader::close()
+{
+	if (file)
+		fclose(file);
+	file = NULL;
+}
+
+
+// Return: true if entries carry the cpu clock
+bool TraceReader::has_clock() const
+{
+	return binary;
+}
+
+
+// Input: entry - receives the next instruction
+// Return: false at the end of the trace or on a damaged chunk
+bool TraceReader::next(TraceEntry& entry)
+{
+	if (!file)
+		return false;
+
+	if (!binary)
+		return read_line(entry);
+
+	if (position == chunk.size() && !read_chunk())
+		return false;
+
+	const uint8_t* p = &chunk[position];
+
+	entry.PC = get_u16(p);
+	entry.opcode = p[2];
+	entry.operand = p[3];
+	entry.AF = get_u16(p + 4);
+	entry.BC = get_u16(p + 6);
+	entry.DE = get_u16(p + 8);
+	entry.HL = get_u16(p + 10);
+	entry.SP = get_u16(p + 12);
+	clock += get_u32(p + 14);
+	entry.clock = clock;
+
+	position += PACKED_ENTRY_SIZE;
+	return true;
+}
+
+
+bool TraceReader::read_chunk()
+{
+	uint8_t header[CHUNK_HEADER_SIZE];
+
+	if (fread(header, sizeof(header), 1, file) != 1)
+		return false;
+
+	const uint32_t count = get_u32(header);
+	const uint32_t size = get_u32(header + 4);
+
+	if (count == 0 || count > TRACE_CHUNK_ENTRIES ||
+	    size > (uint32_t)lz_compress_bound(PACKED_CHUNK_SIZE))
+		return false;
+
+	std::vector<uint8_t> compressed(size);
+
+	if (fread(&compressed[0], size, 1, file) != 1)
+		return false;
+
+	chunk.resize(count * PACKED_ENTRY_SIZE);
+	if (lz_decompress(&compressed[0], size, &chunk[0], chunk.size()) != (int)chunk.size())
+		return false;
+
+	position = 0;
+	clock = get_u64(header + 8);
+	return true;
+}
+
+
+bool TraceReader::read_line(TraceEntry& entry)
+{
+	char line[256];
+
+	while (fgets(line, sizeof(line), file)) {
+		unsigned int a, f, b, c, d, e, h, l, sp, pc, op, operand;
+
+		if (sscanf(line, "A:%x F:%x B:%x C:%x D:%x E:%x H:%x L:%x SP:%x PC:%x PCMEM:%x,%x",
+		           &a, &f, &b, &c, &d, &e, &h, &l, &sp, &pc, &op, &operand) != 12)
+			continue;
+
+		entry.clock = 0;
+		entry.PC = pc;
+		entry.AF = (a << 8) | f;
+		entry.BC = (b << 8) | c;
+		entry.DE = (d << 8) | e;
+		entry.HL = (h << 8) | l;
+		entry.SP = sp;
+		entry.opcode = op;
+		entry.operand = operand;
+		return true;
+	}
+
+	return false;
+}
+
+
+static void print_entry(FILE* out, const char* label, const TraceEntry& e, const bool clock)
+{
+	if (clock)
+		fprintf(out, "%s %12llu ", label, (unsigned long long)e.clock);
+	else
+		fprintf(out, "%s %12s ", label, "-");
+
+	fprintf(out, "PC:%04X op:%02X %02X AF:%04X BC:%04X DE:%04X HL:%04X SP:%04X\n",
+	        e.PC, e.opcode, e.operand, e.AF, e.BC, e.DE, e.HL, e.SP);
+}
+
+
+// Input: file_a, file_b - traces or text logs to compare
+//        out - where to describe the first divergence
+// Return: Return 0 if the traces match;
+//         return 1 if they diverge;
+//         return -1 if either can't be read
+// Function: Walk both traces in step and report the first instruction whose
+//           address, opcode or registers differ, along with the instructions
+//           leading up to it. Clocks are compared when both traces have them.
+int diff_traces(const char* file_a, const char* file_b, FILE* out)
+{
+	TraceReader a;
+	TraceReader b;
+
+	if (a.open(file_a) != 0 || b.open(file_b) != 0)
+		return -1;
+
+	const bool clock = a.has_clock() && b.has_clock();
+	TraceEntry context[DIFF_CONTEXT];
+	TraceEntry ea;
+	TraceEntry eb;
+	uint64_t n = 0;
+
+	for (;; n++) {
+		const bool more_a = a.next(ea);
+		const bool more_b = b.next(eb);
+
+		if (!more_a || !more_b) {
+			if (more_a == more_b) {
+				fprintf(out, "traces match (%llu instructions)\n", (unsigned long long)n);
+				return 0;
+			}
+			fprintf(out, "%s ends after %llu instructions\n", more_a ? file_b : file_a,
+			        (unsigned long long)n);
+			return 1;
+		}
+
+		if (ea.PC != eb.PC || ea.opcode != eb.opcode || ea.operand != eb.operand ||
+		    ea.AF != eb.AF || ea.BC != eb.BC || ea.DE != eb.DE || ea.HL != eb.HL ||
+		    ea.SP != eb.SP || (clock && ea.clock != eb.clock))
+			break;
+
+		context[n % DIFF_CONTEXT] = ea;
+	}
+
+	fprintf(out, "traces diverge at instruction %llu\n", (unsigned long long)n);
+
+	for (uint64_t i = (n > DIFF_CONTEXT) ? n - DIFF_CONTEXT : 0; i < n; i++)
+		print_entry(out, " ", context[i % DIFF_CONTEXT], clock);
+
+	print_entry(out, "a", ea, clock);
+	print_entry(out, "b", eb, clock);
+
+	return 1;
+}
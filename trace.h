@@ -0,0 +1,111 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "ring_buffer.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define TRACE_CHUNK_ENTRIES 65536  // instructions buffered before a hand-off
+#define TRACE_QUEUE_CHUNKS  8
+
+
+// cpu state just before an instruction executes
+struct TraceEntry {
+	uint64_t clock;   // cpu clock cycles
+	uint16_t PC;
+	uint16_t AF;
+	uint16_t BC;
+	uint16_t DE;
+	uint16_t HL;
+	uint16_t SP;
+	uint8_t opcode;
+	uint8_t operand;  // byte after the opcode, the CB opcode for CB-prefixed ones
+};
+
+struct TraceChunk {
+	int count;
+	TraceEntry entries[TRACE_CHUNK_ENTRIES];
+};
+
+
+// Records every executed instruction into a compact binary trace.
+//
+// The cpu appends entries to a chunk lent from a preallocated queue; only
+// when a chunk fills is it handed to a worker thread, which delta-encodes
+// the clock, packs each entry into 18 bytes, compresses the chunk and
+// appends it to the file.
+class TraceRecorder {
+public:
+	TraceRecorder();
+	~TraceRecorder();
+
+	int open(const char* file_name);
+	int close();
+
+	void record(const TraceEntry& entry);
+
+	uint64_t entries_written() const;
+	uint64_t stalls() const;
+private:
+	RingBuffer<TraceChunk>* queue;  // allocated while a trace is open
+	std::thread worker;
+	std::atomic<bool> running;
+	std::atomic<uint64_t> written_count;
+	uint64_t stall_count;
+
+	TraceChunk* chunk;  // being filled, owned by the cpu thread
+	FILE* file;
+	bool failed;        // a write failed; set by the worker, read after it exits
+
+	void next_chunk();
+	void worker_loop();
+	void write_chunk(const TraceChunk& chunk, uint8_t* packed, uint8_t* compressed);
+};
+
+
+// Reads a trace written by TraceRecorder, or a text log with one line per
+// instruction in the common "A:01 F:B0 B:00 C:13 D:00 E:D8 H:01 L:4D SP:FFFE
+// PC:0100 PCMEM:00,C3,13,02" form that other emulators can produce. Text logs
+// carry no clock.
+class TraceReader {
+public:
+	TraceReader();
+	~TraceReader();
+
+	int open(const char* file_name);
+	void close();
+
+	bool next(TraceEntry& entry);
+	bool has_clock() const;
+private:
+	FILE* file;
+	bool binary;
+
+	std::vector<uint8_t> chunk;  // decompressed entries of the current chunk
+	size_t position;
+	uint64_t clock;
+
+	bool read_chunk();
+	bool read_line(TraceEntry& entry);
+};
+
+
+int diff_traces(const char* file_a, const char* file_b, FILE* out);
+
+
+// Input: entry - cpu state before the instruction
+// Return: None
+inline void TraceRecorder::record(const TraceEntry& entry)
+{
+	if (!chunk)
+		return;
+
+	chunk->entries[chunk->count++] = entry;
+	if (chunk->count == TRACE_CHUNK_ENTRIES)
+		next_chunk();
+}
+
+#endif  // TRACE_H_
@@ -0,0 +1,251 @@
+#include "vec_env.h"
+
+
+// Input: count - number of emulator instances, at least 1
+//        threads - threads to step them on, including the calling thread
+VecEnv::VecEnv(const int count, const int threads)
+	: reset_instance(new GameBoy()), episode_frames(0), observation_type(VEC_OBS_FRAMEBUFFER),
+	  generation(0), pending(0), stopping(false), batch_actions(NULL), batch_frames(0),
+	  batch_observations(NULL), batch_done(NULL)
+{
+	const int n = count < 1 ? 1 : count;
+
+	for (int i = 0; i < n; i++)
+		envs.push_back(new GameBoy());
+	episode_frame.assign(n, 0);
+
+	slice_count = threads < 1 ? 1 : (threads > n ? n : threads);
+
+	for (int i = 1; i < slice_count; i++)
+		workers.push_back(std::thread(&VecEnv::worker_loop, this, i));
+}
+
+
+VecEnv::~VecEnv()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	start.notify_all();
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	for (size_t i = 0; i < envs.size(); i++)
+		delete envs[i];
+	delete reset_instance;
+}
+
+
+// Input: data, size - ROM image
+//        warmup_frames - frames to run after power-on before taking the
+//                        reset state, e.g. to get past the boot logo
+// Return Value: Return 0 on success;
+//               return -1 if the ROM can't be loaded
+// Function: Load the ROM once for every instance and reset them all to the
+//           state after warmup_frames
+int VecEnv::load_ROM(const uint8_t* data, const size_t size, const int warmup_frames)
+{
+	if (reset_instance->get_mmu().load_ROM_data(data, size) != 0)
+		return -1;
+	reset_instance->reset();
+
+	for (int i = 0; i < warmup_frames; i++)
+		reset_instance->run_frame();
+
+	reset(NULL);
+	return 0;
+}
+
+
+// Input: state - state episodes start from, saved with the same ROM loaded
+// Return Value: Return 0 on success;
+//               return -1 if state was saved by another version or is
+//               invalid
+// Function: Use state for every later reset. Instances keep running until
+//           their episode ends.
+int VecEnv::set_reset_state(const GameBoyState& state)
+{
+	return reset_instance->load_state(state);
+}
+
+
+// Input: frames - episode length in frames, or 0 to only end episodes when
+//                 the cpu locks up
+// Return: None
+void VecEnv::set_episode_frames(const int frames)
+{
+	episode_frames = frames > 0 ? frames : 0;
+}
+
+
+// Input: None
+// Return: None
+// Function: Observe the finished frame of each instance
+void VecEnv::set_observation_framebuffer()
+{
+	observation_type = VEC_OBS_FRAMEBUFFER;
+	observation_addresses.clear();
+}
+
+
+// Input: addresses - bytes of the address space to observe, in order
+//        count - number of addresses
+// Return Value: Return 0 on success;
+//               return -1 if count is not positive
+int VecEnv::set_observation_ram(const uint16_t* addresses, const int count)
+{
+	if (count <= 0)
+		return -1;
+
+	observation_type = VEC_OBS_RAM;
+	observation_addresses.assign(addresses, addresses + count);
+	return 0;
+}
+
+
+// Return: Bytes written per instance into the observation buffer
+int VecEnv::observation_size() const
+{
+	if (observation_type == VEC_OBS_RAM)
+		return (int)observation_addresses.size();
+	return SCREEN_WIDTH * SCREEN_HEIGHT;
+}
+
+
+// Input: observations - receives size() * observation_size() bytes, or NULL
+// Return: None
+// Function: Put every instance back to the reset state
+void VecEnv::reset(uint8_t* observations)
+{
+	batch_actions = NULL;
+	batch_frames = 0;
+	batch_observations = observations;
+	batch_done = NULL;
+	run_batch();
+}
+
+
+// Input: actions - JOYPAD_* buttons for each instance, held for all frames
+//        frames - frames to run each instance
+//        observations - receives size() * observation_size() bytes, or NULL
+//        done - receives 1 for each instance whose episode ended and was
+//               reset, 0 otherwise; may be NULL
+// Return: None
+void VecEnv::step(const uint8_t* actions, const int frames, uint8_t* observations,
+                  uint8_t* done)
+{
+	batch_actions = actions;
+	batch_frames = frames;
+	batch_observations = observations;
+	batch_done = done;
+	run_batch();
+}
+
+
+// Function: Hand the batch to the workers, run slice 0 and wait for the rest
+void VecEnv::run_batch()
+{
+	if (slice_count > 1) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			pending = slice_count - 1;
+			generation++;
+		}
+		start.notify_all();
+	}
+
+	run_slice(0);
+
+	if (slice_count > 1) {
+		std::unique_lock<std::mutex> guard(lock);
+		finished.wait(guard, [this] { return pending == 0; });
+	}
+}
+
+
+void VecEnv::worker_loop(const int slice)
+{
+	uint64_t seen = 0;
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			start.wait(guard, [this, seen] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+
+		run_slice(slice);
+
+		bool last;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			last = --pending == 0;
+		}
+		if (last)
+			finished.notify_one();
+	}
+}
+
+
+// Input: slice - which contiguous share of the instances to run
+// Return: None
+void VecEnv::run_slice(const int slice)
+{
+	const int count = size();
+	const int first = (int)((int64_t)count * slice / slice_count);
+	const int last = (int)((int64_t)count * (slice + 1) / slice_count);
+	const int stride = observation_size();
+
+	for (int i = first; i < last; i++) {
+		GameBoy& gameboy = *envs[i];
+		bool end = !batch_actions;
+
+		if (batch_actions) {
+			gameboy.set_joypad(batch_actions[i]);
+
+			for (int f = 0; f < batch_frames; f++) {
+				if (gameboy.get_cpu().get_fault() != FAULT_NONE)
+					break;
+				gameboy.run_frame();
+				episode_frame[i]++;
+			}
+
+			end = gameboy.get_cpu().get_fault() != FAULT_NONE ||
+			      (episode_frames && episode_frame[i] >= episode_frames);
+
+			if (batch_done)
+				batch_done[i] = end ? 1 : 0;
+		}
+
+		if (end) {
+			gameboy.restore(*reset_instance);
+			episode_frame[i] = 0;
+		}
+
+		if (batch_observations)
+			observe(i, batch_observations + (size_t)i * stride);
+	}
+}
+
+
+// Input: index - instance to observe
+//        out - receives observation_size() bytes
+// Return: None
+void VecEnv::observe(const int index, uint8_t* out)
+{
+	GameBoy& gameboy = *envs[index];
+
+	if (observation_type == VEC_OBS_FRAMEBUFFER) {
+		memcpy(out, gameboy.get_ppu().get_frame().pixels, SCREEN_WIDTH * SCREEN_HEIGHT);
+		return;
+	}
+
+	const MMU& mmu = gameboy.get_mmu();
+
+	for (size_t i = 0; i < observation_addresses.size(); i++)
+		out[i] = mmu.read(observation_addresses[i]);
+}
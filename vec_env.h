@@ -0,0 +1,93 @@
+#ifndef VEC_ENV_H_
+#define VEC_ENV_H_
+
+#include "gameboy.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define VEC_OBS_FRAMEBUFFER 0  // SCREEN_WIDTH * SCREEN_HEIGHT shades per instance
+#define VEC_OBS_RAM         1  // selected bytes of the address space per instance
+
+
+// Batch of emulator instances stepped in lock step for agents that act on
+// many environments at once. step() takes one action (JOYPAD_* buttons) per
+// instance, runs every instance the same number of frames on a fixed pool of
+// threads, and writes the observations into one caller-provided
+// [count][observation_size()] buffer. An instance whose episode ends (frame
+// limit reached or cpu locked up) is put back to a cached reset instance, and
+// its observation is taken after the reset.
+//
+// The ROM is loaded once and every instance shares it. A reset shares the
+// reset instance's memory pages instead of copying them, so instances only
+// own the pages they have written since. Everything else is allocated up
+// front; step() only takes pages from the page pool.
+class VecEnv {
+public:
+	VecEnv(const int count, const int threads);
+	~VecEnv();
+
+	int load_ROM(const uint8_t* data, const size_t size, const int warmup_frames);
+	int set_reset_state(const GameBoyState& state);
+	void set_episode_frames(const int frames);
+
+	void set_observation_framebuffer();
+	int set_observation_ram(const uint16_t* addresses, const int count);
+	int observation_size() const;
+
+	void reset(uint8_t* observations);
+	void step(const uint8_t* actions, const int frames, uint8_t* observations, uint8_t* done);
+
+	int size() const;
+	GameBoy& get_env(const int index);
+private:
+	VecEnv(const VecEnv&) = delete;
+	VecEnv& operator=(const VecEnv&) = delete;
+
+	std::vector<GameBoy*> envs;
+	std::vector<int> episode_frame;  // frames since each instance's last reset
+	GameBoy* reset_instance;         // not stepped; instances restart from it
+	int episode_frames;              // 0 for no limit
+
+	int observation_type;
+	std::vector<uint16_t> observation_addresses;
+
+	// The calling thread works on slice 0; workers wait for a new generation
+	// and each run their own slice of the instances.
+	std::vector<std::thread> workers;
+	int slice_count;
+	std::mutex lock;
+	std::condition_variable start;
+	std::condition_variable finished;
+	uint64_t generation;
+	int pending;
+	bool stopping;
+
+	// arguments of the batch in progress
+	const uint8_t* batch_actions;
+	int batch_frames;
+	uint8_t* batch_observations;
+	uint8_t* batch_done;
+
+	void worker_loop(const int slice);
+	void run_batch();
+	void run_slice(const int slice);
+	void observe(const int index, uint8_t* out);
+};
+
+
+inline int VecEnv::size() const
+{
+	return (int)envs.size();
+}
+
+
+inline GameBoy& VecEnv::get_env(const int index)
+{
+	return *envs[index];
+}
+
+#endif  // VEC_ENV_H_